@@ -15,5 +15,6 @@ int main(int argc, char **argv)
     printf("          TOTAL           USED           FREE\n");
     printf("%14xB%14xB%14xB\n", ms.ms_total, ms.ms_used, ms.ms_free);
     printf("%14dM%14dM%14dM\n", ms.ms_total / MB, ms.ms_used / MB, ms.ms_free / MB);
+    printf("FRAGMENTATION: %d%%\n", ms.ms_frag);
     return 0;
 }
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/swap.h>
+
+/**
+ * swapon /dev/sdb
+ * swapon /dev/loop0
+ * swapon -d /dev/sdb
+ *
+ * 交换文件需要先通过losetup绑定到loop设备，文件必须在磁盘上的FAT文件系统中
+ */
+static void print_usage()
+{
+    printf("Usage: swapon [-d] [device]\n");
+    printf("Options:\n");
+    printf("  -d        swap off the device\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        print_usage();
+        return -1;
+    }
+    int result;
+    char *arg_device = NULL;
+    int is_swap_off = 0;
+
+    opterr = 0;  //使getopt不行stderr输出错误信息
+
+    while( (result = getopt(argc, argv, "hd")) != -1 ) {
+        switch(result) {
+        case 'h':
+            print_usage();
+            return 0;
+        case 'd':
+            is_swap_off = 1;
+            break;
+        case '?':
+            fprintf(stderr, "swapon: unknown option '%c'!\n", optopt);
+            return -1;
+        default:
+            fprintf(stderr, "swapon: option error!\n");
+            return -1;
+        }
+    }
+    if (argv[optind]) { /* device */
+        arg_device = argv[optind];
+    }
+    if (arg_device == NULL) {
+        fprintf(stderr, "swapon: no device!\n");
+        return -1;
+    }
+    if (!is_swap_off) {
+        if (swapon(arg_device, 0) < 0) {
+            fprintf(stderr, "swapon: swap on device %s failed!\n", arg_device);
+            return -1;
+        }
+        printf("swapon: swap on device %s success.\n", arg_device);
+    } else {
+        if (swapoff(arg_device) < 0) {
+            fprintf(stderr, "swapon: swap off device %s failed, pages may still be on it!\n", arg_device);
+            return -1;
+        }
+        printf("swapon: swap off device %s success.\n", arg_device);
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "test.h"
+#include <fcntl.h>
+
+/* 程序段按需映射，这些缓冲区在系统调用之前都没有访问过，页表中还没有映射 */
+#define LAZY_BUF_SIZE   (64 * 1024)
+
+static const char lazy_path[] __attribute__((aligned(4096))) = "/bin/tests";
+static const char lazy_tmp_path[] __attribute__((aligned(4096))) = "lazy.tmp";
+static char lazy_bss[LAZY_BUF_SIZE] __attribute__((aligned(4096)));
+static char lazy_data[LAZY_BUF_SIZE] __attribute__((aligned(4096))) = {'x', 'b', 'o', 'o', 'k'};
+static char lazy_check[LAZY_BUF_SIZE] __attribute__((aligned(4096)));
+static char lazy_data_dst[LAZY_BUF_SIZE] __attribute__((aligned(4096))) = {1};
+
+/* 路径在没有访问过的只读数据中，读取到没有访问过的bss中 */
+static int lazy_read_test()
+{
+    int fd = open(lazy_path, O_RDONLY);
+    if (fd < 0) {
+        printf("lazy: open %s with untouched path failed\n", lazy_path);
+        return -1;
+    }
+    int len = read(fd, lazy_bss, LAZY_BUF_SIZE);
+    close(fd);
+    if (len <= 0) {
+        printf("lazy: read into untouched bss failed, ret %d\n", len);
+        return -1;
+    }
+    /* 可执行文件以ELF魔数开头 */
+    if (memcmp(lazy_bss, "\177ELF", 4)) {
+        printf("lazy: read data error\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* 
+ * 读取到没有访问过的数据段中，这些页来自文件映射，
+ * 文件系统复制数据时缺页会读取同一个卷上的程序文件
+ */
+static int lazy_read_data_test()
+{
+    int fd = open(lazy_path, O_RDONLY);
+    if (fd < 0) {
+        printf("lazy: open %s failed\n", lazy_path);
+        return -1;
+    }
+    int len = read(fd, lazy_data_dst, LAZY_BUF_SIZE);
+    close(fd);
+    if (len <= 0) {
+        printf("lazy: read into untouched data failed, ret %d\n", len);
+        return -1;
+    }
+    if (memcmp(lazy_data_dst, "\177ELF", 4)) {
+        printf("lazy: read data error\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* 从没有访问过的数据段写入，读回到没有访问过的bss中比较 */
+static int lazy_write_test()
+{
+    int fd = open(lazy_tmp_path, O_CREAT | O_RDWR);
+    if (fd < 0) {
+        printf("lazy: open %s failed\n", lazy_tmp_path);
+        return -1;
+    }
+    int len = write(fd, lazy_data, LAZY_BUF_SIZE);
+    if (len != LAZY_BUF_SIZE) {
+        printf("lazy: write from untouched data failed, ret %d\n", len);
+        close(fd);
+        return -1;
+    }
+    lseek(fd, 0, SEEK_SET);
+    len = read(fd, lazy_check, LAZY_BUF_SIZE);
+    close(fd);
+    unlink(lazy_tmp_path);
+    if (len != LAZY_BUF_SIZE || memcmp(lazy_check, lazy_data, LAZY_BUF_SIZE)) {
+        printf("lazy: read back error, ret %d\n", len);
+        return -1;
+    }
+    return 0;
+}
+
+int lazy_test(int argc, char *argv[])
+{
+    if (lazy_read_test() < 0)
+        return -1;
+    if (lazy_read_data_test() < 0)
+        return -1;
+    if (lazy_write_test() < 0)
+        return -1;
+    printf("lazy: all test passed\n");
+    return 0;
+}
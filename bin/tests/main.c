@@ -47,6 +47,9 @@ testfunc_t test_table[] = {
     {"sound", sound_test},
     {"file5", file_test5},
     {"file6", file_test6},
+    {"string", string_test},
+    {"spawn", spawn_test},
+    {"lazy", lazy_test},
 };
 
 int main(int argc, char *argv[])
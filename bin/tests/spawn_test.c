@@ -0,0 +1,98 @@
+#include "test.h"
+#include <sys/wait.h>
+
+/* 一共创建的进程数，每批同时存在的进程数 */
+#define SPAWN_TOTAL     512
+#define SPAWN_BATCH     64
+
+static pid_t spawn_pids[SPAWN_BATCH];
+
+static pid_t spawn_child(int code)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(code);
+    return pid;
+}
+
+/* 按照创建的相反顺序等待指定的子进程，再等待任意子进程 */
+static int spawn_batch(int base)
+{
+    int i, status;
+    for (i = 0; i < SPAWN_BATCH; i++) {
+        spawn_pids[i] = spawn_child((base + i) & 0x7f);
+        if (spawn_pids[i] < 0) {
+            printf("spawn: fork %d failed\n", base + i);
+            return -1;
+        }
+    }
+    for (i = SPAWN_BATCH - 1; i >= SPAWN_BATCH / 2; i--) {
+        status = -1;
+        if (waitpid(spawn_pids[i], &status, 0) != spawn_pids[i]) {
+            printf("spawn: wait pid %d failed\n", spawn_pids[i]);
+            return -1;
+        }
+        if (status != ((base + i) & 0x7f)) {
+            printf("spawn: pid %d exit status %d, should be %d\n",
+                spawn_pids[i], status, (base + i) & 0x7f);
+            return -1;
+        }
+    }
+    for (i = 0; i < SPAWN_BATCH / 2; i++) {
+        pid_t pid = waitpid(-1, &status, 0);
+        int j;
+        for (j = 0; j < SPAWN_BATCH / 2; j++)
+            if (spawn_pids[j] == pid)
+                break;
+        if (j >= SPAWN_BATCH / 2) {
+            printf("spawn: wait any returned unknown pid %d\n", pid);
+            return -1;
+        }
+        spawn_pids[j] = -1;
+    }
+    return 0;
+}
+
+/* 子进程先于孙进程退出，孙进程过继给INIT，不能再被原来的进程等待 */
+static int spawn_orphan_check()
+{
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        if (fork() == 0) {
+            sleep(1);
+            _exit(0);
+        }
+        _exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid) {
+        printf("spawn: wait orphan parent failed\n");
+        return -1;
+    }
+    if (waitpid(-1, &status, WNOHANG) != -1) {
+        printf("spawn: grandchild still belongs to us\n");
+        return -1;
+    }
+    return 0;
+}
+
+int spawn_test(int argc, char *argv[])
+{
+    clock_t start = clock();
+    int base;
+    for (base = 0; base < SPAWN_TOTAL; base += SPAWN_BATCH) {
+        if (spawn_batch(base) < 0)
+            return -1;
+    }
+    if (waitpid(-1, NULL, WNOHANG) != -1) {
+        printf("spawn: children left after all waited\n");
+        return -1;
+    }
+    printf("spawn %d processes in %d ticks.\n", SPAWN_TOTAL, clock() - start);
+    if (spawn_orphan_check() < 0)
+        return -1;
+    printf("spawn test passed.\n");
+    return 0;
+}
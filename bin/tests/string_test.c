@@ -0,0 +1,121 @@
+#include "test.h"
+
+#define STR_TEST_BUF_SIZE   1024
+#define STR_TEST_ALIGN_MAX  8
+#define STR_TEST_LEN_MAX    300
+#define STR_TEST_GUARD      0xa5
+
+static unsigned char str_src[STR_TEST_BUF_SIZE];
+static unsigned char str_dst[STR_TEST_BUF_SIZE];
+static unsigned char str_ref[STR_TEST_BUF_SIZE];
+
+static void str_fill_pattern(unsigned char *buf, int len, int seed)
+{
+    int i;
+    for (i = 0; i < len; i++)
+        buf[i] = (unsigned char)(i * 7 + seed);
+}
+
+/* 逐字节的参考实现，用来比对结果 */
+static void str_ref_move(unsigned char *dst, unsigned char *src, int len)
+{
+    unsigned char tmp[STR_TEST_BUF_SIZE];
+    int i;
+    for (i = 0; i < len; i++)
+        tmp[i] = src[i];
+    for (i = 0; i < len; i++)
+        dst[i] = tmp[i];
+}
+
+static int str_check(const char *name, int doff, int soff, int len)
+{
+    int i;
+    for (i = 0; i < STR_TEST_BUF_SIZE; i++) {
+        if (str_dst[i] != str_ref[i]) {
+            printf("%s: dst align %d src align %d len %d: byte %d is %x, should be %x\n",
+                name, doff, soff, len, i, str_dst[i], str_ref[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int memcpy_check()
+{
+    int doff, soff, len;
+    str_fill_pattern(str_src, STR_TEST_BUF_SIZE, 3);
+    for (doff = 0; doff < STR_TEST_ALIGN_MAX; doff++) {
+        for (soff = 0; soff < STR_TEST_ALIGN_MAX; soff++) {
+            for (len = 0; len <= STR_TEST_LEN_MAX; len++) {
+                int i;
+                for (i = 0; i < STR_TEST_BUF_SIZE; i++)
+                    str_dst[i] = str_ref[i] = STR_TEST_GUARD;
+                str_ref_move(str_ref + 64 + doff, str_src + 64 + soff, len);
+                if (memcpy(str_dst + 64 + doff, str_src + 64 + soff, len) != str_dst + 64 + doff) {
+                    printf("memcpy: bad return value\n");
+                    return -1;
+                }
+                if (str_check("memcpy", doff, soff, len) < 0)
+                    return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int memset_check()
+{
+    int doff, len;
+    for (doff = 0; doff < STR_TEST_ALIGN_MAX; doff++) {
+        for (len = 0; len <= STR_TEST_LEN_MAX; len++) {
+            int i;
+            for (i = 0; i < STR_TEST_BUF_SIZE; i++)
+                str_dst[i] = str_ref[i] = STR_TEST_GUARD;
+            for (i = 0; i < len; i++)
+                str_ref[64 + doff + i] = (unsigned char)(len + 1);
+            if (memset(str_dst + 64 + doff, len + 1, len) != str_dst + 64 + doff) {
+                printf("memset: bad return value\n");
+                return -1;
+            }
+            if (str_check("memset", doff, 0, len) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* 源和目的在同一个缓冲区中，覆盖向前和向后重叠的情况 */
+static int memmove_check()
+{
+    int doff, soff, len;
+    for (doff = 0; doff < STR_TEST_ALIGN_MAX * 2; doff++) {
+        for (soff = 0; soff < STR_TEST_ALIGN_MAX * 2; soff++) {
+            for (len = 0; len <= STR_TEST_LEN_MAX; len++) {
+                str_fill_pattern(str_dst, STR_TEST_BUF_SIZE, 5);
+                str_fill_pattern(str_ref, STR_TEST_BUF_SIZE, 5);
+                str_ref_move(str_ref + 64 + doff, str_ref + 64 + soff, len);
+                if (memmove(str_dst + 64 + doff, str_dst + 64 + soff, len) != str_dst + 64 + doff) {
+                    printf("memmove: bad return value\n");
+                    return -1;
+                }
+                if (str_check("memmove", doff, soff, len) < 0)
+                    return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int string_test(int argc, char *argv[])
+{
+    if (memcpy_check() < 0)
+        return -1;
+    printf("memcpy test passed.\n");
+    if (memset_check() < 0)
+        return -1;
+    printf("memset test passed.\n");
+    if (memmove_check() < 0)
+        return -1;
+    printf("memmove test passed.\n");
+    return 0;
+}
@@ -75,5 +75,8 @@ int sound_test(int argc, char *argv[]);
 
 int file_test5(int argc,char *argv[]);
 int file_test6(int argc, char *argv[]);
+int string_test(int argc, char *argv[]);
+int spawn_test(int argc, char *argv[]);
+int lazy_test(int argc, char *argv[]);
 
 #endif // _TEST_H
@@ -36,6 +36,7 @@ extern "C" {
 #define DISKIO_SETUP        DEVCTL_CODE('d', 5)
 #define DISKIO_SETDOWN      DEVCTL_CODE('d', 6)
 #define DISKIO_GETSECSIZE   DEVCTL_CODE('d', 7)
+#define DISKIO_SYNC         DEVCTL_CODE('d', 8)
 
 /* tty */
 #define TTYIO_CLEAR         CONIO_CLEAR
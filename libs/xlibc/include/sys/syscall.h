@@ -118,6 +118,9 @@ enum syscall_num {
     SYS_REBOOT,
     SYS_SHUTDOWN,
     SYS_SELECT,
+    SYS_SYNC,
+    SYS_SWAPON,
+    SYS_SWAPOFF,
     SYSCALL_NR,
 };
 
@@ -0,0 +1,20 @@
+#ifndef _SYS_TIMEPAGE_H
+#define _SYS_TIMEPAGE_H
+
+/*
+ * 时间页：内核把它只读映射到每个进程的用户空间最高的一页，
+ * 每个tick更新一次，用户态读取时间时不需要进入内核。
+ */
+#define TIME_PAGE_ADDR      0x7ffff000
+
+typedef struct {
+    volatile unsigned long seq;         /* 序号，为奇数时内核正在更新，读取前后不同时需要重新读取 */
+    unsigned long hz;                   /* 每秒的ticks数 */
+    unsigned long ticks;                /* 系统启动后的ticks */
+    unsigned long timestamp;            /* 墙上时间的时间戳（秒） */
+    unsigned long tsc_low;              /* 更新ticks时的TSC */
+    unsigned long tsc_high;
+    unsigned long tsc_per_tick;         /* 每个tick的TSC数，为0表示不能使用TSC */
+} time_page_t;
+
+#endif   /* _SYS_TIMEPAGE_H */
@@ -13,6 +13,7 @@ typedef struct {
     unsigned long ms_total;    /* 物理内存总大小 */
     unsigned long ms_free;     /* 物理内存空闲大小 */
     unsigned long ms_used;     /* 物理内存已使用大小 */
+    unsigned long ms_frag;     /* 空闲内存碎片率（百分比） */
 } mstate_t;
 
 int mstate(mstate_t *ms);
@@ -43,6 +43,7 @@ int access(const char *filenpath, int mode);
 int unlink(const char *path);
 int ftruncate(int fd, off_t offset);
 int fsync(int fd);
+int sync(void);
 int ioctl(int fd, int cmd, void *arg);
 
 int dup(int fd);
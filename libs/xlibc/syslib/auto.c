@@ -8,6 +8,31 @@ char **_environ;
 /* 退出之前需要执行的回调函数 */
 extern void __atexit_callback();
 
+/* 系统调用是否使用sysenter，在syscall.asm中 */
+extern int __syscall_sysenter;
+
+/* cpuid(1).edx中的SEP位 */
+#define CPUID_FEATURE_SEP   (1 << 11)
+
+/**
+ * 检测cpu是否支持sysenter，和内核中的检测保持一致，
+ * 内核在同样的条件下才会设置sysenter的入口。
+ */
+static void __syscall_select()
+{
+    unsigned int eax, ebx, ecx, edx;
+    __asm__ __volatile__ ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "0"(0), "2"(0));
+    if (eax < 1)
+        return;
+    __asm__ __volatile__ ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "0"(1), "2"(0));
+    if (!(edx & CPUID_FEATURE_SEP))
+        return;
+    /* 早期的Pentium Pro虽然报告了SEP，但是并不支持 */
+    if (((eax >> 8) & 0xf) == 6 && ((eax >> 4) & 0xf) < 3 && (eax & 0xf) < 3)
+        return;
+    __syscall_sysenter = 1;
+}
+
 /**
  * _enter_preload - 进入预先加载
  * 
@@ -17,6 +42,8 @@ extern void __atexit_callback();
  */
 void _enter_preload(int argc, char *const argv[], char *const envp[])
 {
+    /* 选择系统调用的方式 */
+    __syscall_select();
     /* 设置environ全局变量 */
     _environ = (char **)envp;
     /* 设置C语言的环境变量 */
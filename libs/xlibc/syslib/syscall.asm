@@ -3,11 +3,40 @@
 
 SYSCALL_INT	EQU 0x40
 
+global __syscall_sysenter
+
+[section .data]
+; 为1时使用sysenter快速系统调用，进程启动时根据cpu特性设置
+__syscall_sysenter: dd 0
+
+[section .text]
+
+; 进入内核，eax是系统调用号，ebx、ecx、edx、esi、edi是参数
+; sysenter会占用ecx和edx，并且不会保存返回地址和栈，
+; 所以把返回地址、ebp、edx、ecx压栈，用ebp指向它们，由内核读取
+__syscall_trap:
+	cmp dword [__syscall_sysenter], 0
+	je .int_trap
+	push ecx
+	push edx
+	push ebp
+	push .sysenter_ret
+	mov ebp, esp
+	sysenter
+.sysenter_ret:
+	pop ebp
+	pop edx
+	pop ecx
+	ret
+.int_trap:
+	int SYSCALL_INT
+	ret
+
 ; 0个参数
 global __syscall0
 __syscall0:
 	mov eax, [esp + 4]	; eax = syscall num
-	int SYSCALL_INT
+	call __syscall_trap
 	ret
 
 ; 1个参数
@@ -16,7 +45,7 @@ __syscall1:
 	push ebx
 	mov eax, [esp + 4 + 4]	; eax = syscall num
 	mov ebx, [esp + 4 + 8]	; ebx = arg0
-	int SYSCALL_INT
+	call __syscall_trap
 	pop ebx
 	ret
 
@@ -28,7 +57,7 @@ __syscall2:
 	mov eax, [esp + 8 + 4]	; eax = syscall num
 	mov ebx, [esp + 8 + 8]	; ebx = arg0
 	mov ecx, [esp + 8 + 12]	; ecx = arg1
-	int SYSCALL_INT
+	call __syscall_trap
 	pop ebx
 	pop ecx
 	ret
@@ -43,7 +72,7 @@ __syscall3:
 	mov ebx, [esp + 12 + 8]	; ebx = arg0
 	mov ecx, [esp + 12 + 12]	; ecx = arg1
 	mov edx, [esp + 12 + 16]	; edx = arg2
-	int SYSCALL_INT
+	call __syscall_trap
 	pop ebx
 	pop ecx
 	pop edx
@@ -60,7 +89,7 @@ __syscall4:
 	mov ecx, [esp + 16 + 12]	; ecx = arg1
 	mov edx, [esp + 16 + 16]	; edx = arg2
 	mov esi, [esp + 16 + 20]	; esi = arg3
-	int SYSCALL_INT
+	call __syscall_trap
 	pop ebx
 	pop ecx
 	pop edx
@@ -80,7 +109,7 @@ __syscall5:
 	mov edx, [esp + 20 + 16]	; edx = arg2
 	mov esi, [esp + 20 + 20]	; esi = arg3
 	mov edi, [esp + 20 + 24]	; edi = arg4
-	int SYSCALL_INT
+	call __syscall_trap
 	pop ebx
 	pop ecx
 	pop edx
@@ -1,8 +1,46 @@
 #include <sys/time.h>
 #include <sys/syscall.h>
 #include <sys/proc.h>
+#include <sys/timepage.h>
 #include <time.h>
 #include <errno.h>
+
+/* 内核只读映射的时间页 */
+#define __time_page ((const time_page_t *) TIME_PAGE_ADDR)
+
+/**
+ * 读取时间页中的ticks、时间戳以及当前tick内经过的纳秒数，
+ * 内核正在更新时（序号为奇数或者前后不同）重新读取
+ */
+static void __time_page_read(unsigned long *ticks, unsigned long *timestamp,
+    unsigned long *nsec)
+{
+    const time_page_t *tp = __time_page;
+    unsigned long seq, tick_nsec, hz;
+    unsigned long long tsc, now;
+    unsigned long tsc_per_tick;
+    do {
+        seq = tp->seq;
+        __asm__ __volatile__ ("" ::: "memory");
+        *ticks = tp->ticks;
+        *timestamp = tp->timestamp;
+        hz = tp->hz;
+        tsc = ((unsigned long long)tp->tsc_high << 32) | tp->tsc_low;
+        tsc_per_tick = tp->tsc_per_tick;
+        __asm__ __volatile__ ("" ::: "memory");
+    } while ((seq & 1) || seq != tp->seq);
+    *nsec = 0;
+    if (!tsc_per_tick)
+        return;
+    __asm__ __volatile__ ("rdtsc" : "=A"(now));
+    /* 计算当前tick内经过的时间，不超过1个tick */
+    tick_nsec = 1000000000UL / hz;
+    now -= tsc;
+    if (now >= tsc_per_tick)
+        *nsec = tick_nsec - 1;
+    else
+        *nsec = (unsigned long)(now * tick_nsec / tsc_per_tick);
+}
 /**
  * alarm - 设置一个闹钟
  * @second: 闹钟产生的时间
@@ -25,7 +63,8 @@ unsigned long walltime(walltime_t *wt)
  */
 clock_t getticks()
 {
-    return syscall0(clock_t, SYS_GETTICKS);
+    const time_page_t *tp = __time_page;
+    return tp->ticks;
 }
 
 /**
@@ -37,7 +76,18 @@ clock_t getticks()
  */
 int gettimeofday(struct timeval *tv, struct timezone *tz)
 {
-    return syscall2(int, SYS_GETTIMEOFDAY, tv, tz);
+    unsigned long ticks, timestamp, nsec;
+    if (tv) {
+        __time_page_read(&ticks, &timestamp, &nsec);
+        unsigned long hz = __time_page->hz;
+        tv->tv_sec = timestamp;
+        tv->tv_usec = (ticks % hz) * (1000000UL / hz) + nsec / 1000;
+    }
+    if (tz) {
+        tz->tz_dsttime = 0;
+        tz->tz_minuteswest = 0;
+    }
+    return 0;
 }
 /**
  * clock_gettime - 获取时机
@@ -48,7 +98,25 @@ int gettimeofday(struct timeval *tv, struct timezone *tz)
  */
 int clock_gettime(clockid_t clockid, struct timespec *ts)
 {
-    return syscall2(int, SYS_CLOCK_GETTIME, clockid, ts);
+    unsigned long ticks, timestamp, nsec, hz;
+    if (!ts)
+        return -1;
+    switch (clockid) {
+    case CLOCK_REALTIME:
+        __time_page_read(&ticks, &timestamp, &nsec);
+        hz = __time_page->hz;
+        ts->tv_sec = timestamp;
+        ts->tv_nsec = (ticks % hz) * (1000000000UL / hz) + nsec;
+        return 0;
+    case CLOCK_MONOTONIC:
+        __time_page_read(&ticks, &timestamp, &nsec);
+        hz = __time_page->hz;
+        ts->tv_sec = ticks / hz;
+        ts->tv_nsec = (ticks % hz) * (1000000000UL / hz) + nsec;
+        return 0;
+    default:    /* 进程和线程的运行时间只有内核知道 */
+        return syscall2(int, SYS_CLOCK_GETTIME, clockid, ts);
+    }
 }
 
 int walltime_switch(walltime_t *wt, struct tm *tm)
@@ -125,6 +125,11 @@ int fsync(int fd)
     return syscall1(int, SYS_FSYNC, fd);
 }
 
+int sync(void)
+{
+    return syscall0(int, SYS_SYNC);
+}
+
 int fchmod(int fd, mode_t mode)
 {
     if (fd < 0)
@@ -0,0 +1,17 @@
+#include <sys/swap.h>
+#include <sys/syscall.h>
+#include <stddef.h>
+
+int swapon(const char *path, int flags)
+{
+    if (path == NULL)
+        return -1;
+    return syscall2(int, SYS_SWAPON, path, flags);
+}
+
+int swapoff(const char *path)
+{
+    if (path == NULL)
+        return -1;
+    return syscall1(int, SYS_SWAPOFF, path);
+}
@@ -1,6 +1,8 @@
 #ifndef _X86_ACPI_H
 #define _X86_ACPI_H
 
+#include <arch/cpu.h>
+
 typedef unsigned char byte;
 typedef unsigned short word;
 typedef unsigned int dword;
@@ -40,10 +42,33 @@ struct FACP {
     byte PM1_CNT_LEN;
 };
 
+/* MADT中的中断控制器结构类型 */
+#define ACPI_MADT_LAPIC         0
+#define ACPI_MADT_IOAPIC        1
+#define ACPI_MADT_OVERRIDE      2
+
+#define ACPI_MADT_LAPIC_ENABLED 0x01
+
+#define ACPI_ISA_IRQ_NR         16
+
+/* 从MADT中得到的处理器和中断控制器信息 */
+typedef struct {
+    dword lapic_addr;                       /* local apic的物理地址 */
+    int cpu_count;
+    byte lapic_ids[CPU_NR_MAX];             /* 每个处理器的local apic id，第一个是启动处理器 */
+    dword ioapic_addr;                      /* io apic的物理地址，为0表示没有io apic */
+    dword ioapic_gsi_base;
+    dword isa_gsi[ACPI_ISA_IRQ_NR];         /* isa中断号对应的全局中断号 */
+    word isa_flags[ACPI_ISA_IRQ_NR];        /* 中断的极性和触发方式 */
+} acpi_madt_info_t;
+
+extern acpi_madt_info_t acpi_madt_info;
+
 unsigned int *acpi_check_RSDPtr(unsigned int *ptr);
 unsigned int *acpi_get_RSDPtr(void);
 int acpi_checkHeader(unsigned int *ptr, char *sig);
 int acpi_enable(void);
 int acpi_init(void);
+int acpi_madt_parse(unsigned int *rsdt);
 
 #endif /* _X86_ACPI_H */
@@ -0,0 +1,65 @@
+#ifndef _X86_APIC_H
+#define _X86_APIC_H
+
+#include <types.h>
+
+/* local apic寄存器偏移 */
+#define LAPIC_ID            0x020
+#define LAPIC_VERSION       0x030
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0b0
+#define LAPIC_SVR           0x0f0
+#define LAPIC_ESR           0x280
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_LVT_ERROR     0x370
+#define LAPIC_TIMER_INITCNT 0x380
+#define LAPIC_TIMER_CURCNT  0x390
+#define LAPIC_TIMER_DIV     0x3e0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_LVT_NMI       0x400
+#define LAPIC_LVT_PERIODIC  0x20000
+#define LAPIC_TIMER_DIV16   0x03
+
+/* 处理器间中断命令 */
+#define LAPIC_ICR_INIT      0x500
+#define LAPIC_ICR_STARTUP   0x600
+#define LAPIC_ICR_PENDING   0x1000
+#define LAPIC_ICR_ASSERT    0x4000
+#define LAPIC_ICR_LEVEL     0x8000
+
+/* 处理器间中断和local apic时钟的向量，在isa中断之后，伪中断之前 */
+#define IPI_TLB_VECTOR          0xf0
+#define IPI_RESCHED_VECTOR      0xf1
+#define LAPIC_TIMER_VECTOR      0xf2
+
+/* 伪中断向量，低4位必须全为1 */
+#define LAPIC_SPURIOUS_VECTOR   0xff
+
+/* io apic寄存器 */
+#define IOAPIC_REGSEL       0x00
+#define IOAPIC_WINDOW       0x10
+#define IOAPIC_REG_ID       0x00
+#define IOAPIC_REG_VERSION  0x01
+#define IOAPIC_REG_REDTBL   0x10
+
+#define IOAPIC_REDTBL_MASKED    0x10000
+#define IOAPIC_REDTBL_LEVEL     0x8000
+#define IOAPIC_REDTBL_LOW       0x2000
+
+extern int apic_enabled;
+
+int apic_init();
+void lapic_init();
+int lapic_get_id();
+void lapic_eoi();
+int lapic_send_ipi(int apicid, unsigned int command);
+unsigned int lapic_timer_calibrate();
+void lapic_timer_start(unsigned int count);
+
+#endif  /* _X86_APIC_H */
@@ -2,12 +2,22 @@
 #define _X86_CPU_H
 
 #include <types.h>
+#include <xbook/config.h>
 
+#ifdef CONFIG_SMP
+#define CPU_NR_MAX  8
+#else
 #define CPU_NR_MAX  1
+#endif
 
 cpuid_t cpu_get_my_id();
+int cpu_get_my_index();
 void cpu_get_attached_list(cpuid_t *cpu_list, unsigned int *count);
 void cpu_init();
+#ifdef CONFIG_SMP
+int cpu_attach(int apicid);
+void cpu_detach(int index);
+#endif
 
 void cpu_do_sleep();
 void cpu_do_nohing(void);
@@ -16,6 +26,11 @@ static inline void cpu_do_pause(void)
 {
 	__asm__ __volatile__ ("pause");
 }
+/* 开中断后立即停机，sti后的一条指令执行完才响应中断，不会错过唤醒的中断 */
+static inline void cpu_do_safe_halt(void)
+{
+	__asm__ __volatile__ ("sti; hlt" ::: "memory");
+}
 static inline void cpu_do_cpuid(unsigned int mop,unsigned int sop,unsigned int *a,
         unsigned int *b,unsigned int *c,unsigned int *d)
 {
@@ -26,9 +41,66 @@ static inline void cpu_do_cpuid(unsigned int mop,unsigned int sop,unsigned int *
     );
 }
 
+static inline void cpu_do_rdmsr(unsigned int msr, unsigned int *low, unsigned int *high)
+{
+	__asm__ __volatile__ ("rdmsr" : "=a"(*low), "=d"(*high) : "c"(msr));
+}
+static inline void cpu_do_wrmsr(unsigned int msr, unsigned int low, unsigned int high)
+{
+	__asm__ __volatile__ ("wrmsr" : : "c"(msr), "a"(low), "d"(high));
+}
+
+static inline unsigned long long cpu_do_rdtsc(void)
+{
+	unsigned long long tsc;
+	__asm__ __volatile__ ("rdtsc" : "=A"(tsc));
+	return tsc;
+}
+
+/* cpuid(1).edx中的TSC位 */
+#define CPUID_FEATURE_TSC       (1 << 4)
+
+static inline int cpu_do_has_tsc(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	cpu_do_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+	if (eax < 1)
+		return 0;
+	cpu_do_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	return (edx & CPUID_FEATURE_TSC) ? 1 : 0;
+}
+
+/* cpuid(1).edx中的大页和全局页位 */
+#define CPUID_FEATURE_PSE       (1 << 3)
+#define CPUID_FEATURE_PGE       (1 << 13)
+
+/* 检测cpuid(1).edx中的特性位 */
+static inline int cpu_do_has_feature(unsigned int feature)
+{
+	unsigned int eax, ebx, ecx, edx;
+	cpu_do_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+	if (eax < 1)
+		return 0;
+	cpu_do_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	return (edx & feature) ? 1 : 0;
+}
+
+/* sysenter/sysexit使用的MSR */
+#define MSR_IA32_SYSENTER_CS    0x174
+#define MSR_IA32_SYSENTER_ESP   0x175
+#define MSR_IA32_SYSENTER_EIP   0x176
+
+/* cpuid(1).edx中的SEP位，表示支持sysenter/sysexit */
+#define CPUID_FEATURE_SEP       (1 << 11)
+
+int sysenter_init();
+
 #define cpu_sleep       cpu_do_sleep
 #define cpu_idle        cpu_do_nohing
 #define cpu_pause       cpu_do_pause
+#define cpu_safe_halt   cpu_do_safe_halt
+#define cpu_rdtsc       cpu_do_rdtsc
+#define cpu_has_tsc     cpu_do_has_tsc
 #define udelay          cpu_do_udelay
 
 #endif  /* _X86_CPU_H */
@@ -16,17 +16,15 @@ typedef struct  {
     long status; /* software status information */
 } fpu_storage_t;
 
+/* 任务使用过fpu，storage中保存了有效的状态。没有置位的任务复制和销毁时不需要保存或丢弃寄存器中的状态 */
+#define FPU_USED    0x01
+
 typedef struct  {
     fpu_storage_t storage;
+    unsigned long flags;
+    unsigned long loads;    /* 因为使用fpu而恢复状态的次数 */
 } fpu_t;
 
-static inline void fpu_init(fpu_t *fpu, int reg)
-{
-    if (reg)    /* 需要初始化寄存器才调用 */
-        __asm__ __volatile__ ("fninit");
-    memset(&fpu->storage, 0, sizeof(fpu_storage_t));
-}
-
 static inline void fpu_save(fpu_t *fpu)
 {
     __asm__ __volatile__ ( "fnsave %0 ; fwait" : "=m" (fpu->storage));
@@ -36,4 +34,18 @@ static inline void fpu_restore(fpu_t *fpu)
 {
     __asm__ __volatile__ ("frstor %0	\n\t": :"m" (fpu->storage));
 }
+
+static inline void fpu_clts()
+{
+    __asm__ __volatile__ ("clts");
+}
+
+void fpu_init(fpu_t *fpu, int reg);
+void fpu_switch_to(fpu_t *next);
+void fpu_flush(fpu_t *fpu);
+void fpu_release(fpu_t *fpu);
+int fpu_live_elsewhere(fpu_t *fpu);
+void fpu_cpu_init();
+void fpu_lazy_init();
+
 #endif  /* _X86_FPU_H */
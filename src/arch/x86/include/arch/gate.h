@@ -78,6 +78,11 @@ extern void irq_entry0x2d();
 extern void irq_entry0x2e();
 extern void irq_entry0x2f();
 
+extern void ipi_entry0xf0();
+extern void ipi_entry0xf1();
+extern void ipi_entry0xf2();
+
 extern void syscall_handler();
+extern void apic_spurious_handler();
 
 #endif	/* _X86_GATE_H */
\ No newline at end of file
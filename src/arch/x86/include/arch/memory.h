@@ -1,11 +1,13 @@
 #ifndef _X86_MEMORY_H
 #define _X86_MEMORY_H
 
+#include <xbook/config.h>
 
-#define	tlb_flush_one(addr)	\
+#define	tlb_flush_one_local(addr)	\
 	__asm__ __volatile__	("invlpg	(%0)	\n\t"::"r"(addr):"memory")
 
-#define tlb_flush()						\
+/* 重新加载cr3，开启全局页后不会刷新内核的全局页 */
+#define tlb_flush_local()				\
 do								\
 {								\
 	unsigned long	tmpreg;					\
@@ -18,6 +20,24 @@ do								\
 				);				\
 }while(0)
 
+#ifdef CONFIG_SMP
+void smp_tlb_shootdown(unsigned long addr, unsigned long pages);
+/* 其它处理器也可能缓存了这一页，需要通知它们刷新 */
+#define tlb_flush_one(addr)						\
+do {								\
+	tlb_flush_one_local(addr);				\
+	smp_tlb_shootdown((unsigned long) (addr), 1);		\
+} while (0)
+#define tlb_flush()						\
+do {								\
+	tlb_flush_local();					\
+	smp_tlb_shootdown(0, 0);				\
+} while (0)
+#else
+#define tlb_flush_one   tlb_flush_one_local
+#define tlb_flush       tlb_flush_local
+#endif
+
 char mem_xchg8(char *ptr, char value);
 short mem_xchg16(short *ptr, short value);
 int mem_xchg32(int *ptr, int value);
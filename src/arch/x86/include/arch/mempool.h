@@ -20,6 +20,12 @@ enum {
 #define MEM_SECTION_MAX_NR      12
 #define MEM_SECTION_MAX_SIZE    2048    // (2 ^ 11) : 8 MB
 
+/* 计算碎片率时检测的分配阶：16个页（64KB），和DMA缓冲区大小相当 */
+#define MEM_FRAG_CHECK_ORDER    4
+
+/* 节点标志 */
+#define MEM_NODE_FLAG_FREE      0x01    /* 块在空闲链表中 */
+
 typedef struct {
     list_t free_list_head;
     size_t node_count;
@@ -63,6 +69,13 @@ typedef struct {
 #define MEM_NODE_GET_CACHE(node) node->cache
 #define MEM_NODE_GET_SECTION(node) node->section
 
+#define MEM_NODE_SET_FREE(node) \
+        (node)->flags |= MEM_NODE_FLAG_FREE
+#define MEM_NODE_CLEAR_FREE(node) \
+        (node)->flags &= ~MEM_NODE_FLAG_FREE
+#define MEM_NODE_IS_FREE(node) \
+        ((node)->flags & MEM_NODE_FLAG_FREE)
+
 #define MEM_SECTION_DES_COUNT(section) \
         section->node_count--
 
@@ -76,9 +89,16 @@ mem_node_t *phy_addr_to_mem_node(unsigned int page);
 unsigned int mem_node_to_phy_addr(mem_node_t *node);
 
 unsigned long mem_node_alloc_pages(unsigned long count, unsigned long flags);
+unsigned long mem_node_alloc_pages_batch(unsigned long *pages, unsigned long count, unsigned long flags);
 int mem_node_free_pages(unsigned long page);
+int mem_node_ref_pages(unsigned long page);
+int mem_node_get_reference(unsigned long page);
 
 void mem_range_init(unsigned int idx, unsigned int start, size_t len);
+int mem_range_has_phy_addr(unsigned int idx, unsigned long addr);
+unsigned long mem_range_get_page_nr(unsigned int idx);
+unsigned long mem_range_get_free_page_nr(unsigned int idx);
+unsigned long mem_get_fragmentation(int order);
 
 void mem_pool_test();
 
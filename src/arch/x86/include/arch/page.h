@@ -30,8 +30,16 @@ typedef unsigned int pte_t; /* page table entry */
 #define	PAGE_ATTR_WRITE  	    2	// 0010 R/W read/write/execute
 #define	PAGE_ATTR_SYSTEM  	    0	// 0000 U/S system level, cpl0,1,2
 #define	PAGE_ATTR_USER  	    4   // 0100 U/S user level, cpl3
+#define	PAGE_ATTR_ACCESSED  	0x20    // bit 5(A) set by cpu when page accessed
+#define	PAGE_ATTR_DIRTY  	    0x40    // bit 6(D) set by cpu when page written
+#define	PAGE_ATTR_LARGE  	    0x80    // bit 7(PS) in pde, map a 4MB page directly
+#define	PAGE_ATTR_GLOBAL  	    0x100   // bit 8(G) not flushed when cr3 reloaded
+#define	PAGE_ATTR_COW  	        0x200   // bit 9(AVL) copy on write, page shared read-only after fork
+#define	PAGE_ATTR_SWAP  	    0x400   // bit 10(AVL) page swapped out, pte not present
 
 #define KERN_PAGE_ATTR  (PAGE_ATTR_PRESENT | PAGE_ATTR_WRITE | PAGE_ATTR_SYSTEM)
+/* 所有页目录中都相同的内核映射，设置成全局页 */
+#define KERN_PAGE_ATTR_GLOBAL   (KERN_PAGE_ATTR | PAGE_ATTR_GLOBAL)
 
 
 #define PAGE_SHIFT  12
@@ -41,6 +49,8 @@ typedef unsigned int pte_t; /* page table entry */
 #define PAGE_ALIGN(value) ((value + PAGE_LIMIT) & PAGE_MASK)
 
 #define PAGE_TABLE_ENTRY_NR 1024  
+#define PAGE_LARGE_SIZE     (PAGE_TABLE_ENTRY_NR * PAGE_SIZE)   /* 一个页目录项映射的大小，4MB */
+#define PAGE_LARGE_MASK     (~(PAGE_LARGE_SIZE - 1))
 
 #if CONFIG_KERN_LOWMEM == 1
 #define KERN_PAGE_DIR_ENTRY_OFF 0
@@ -48,6 +58,12 @@ typedef unsigned int pte_t; /* page table entry */
 #define KERN_PAGE_DIR_ENTRY_OFF 512  
 #endif
 
+/* 换出的页表项：不存在位为0，高20位是交换槽号，保留原来的读写属性，换入时恢复 */
+#define PAGE_SWAP_ATTR_MASK         (PAGE_ATTR_WRITE | PAGE_ATTR_USER | PAGE_ATTR_COW)
+#define PAGE_SWAP_ENTRY(slot, attr) (((slot) << PAGE_SHIFT) | ((attr) & PAGE_SWAP_ATTR_MASK) | PAGE_ATTR_SWAP)
+#define PAGE_SWAP_SLOT(pte)         ((pte) >> PAGE_SHIFT)
+#define PAGE_IS_SWAP_ENTRY(pte)     (((pte) & (PAGE_ATTR_SWAP | PAGE_ATTR_PRESENT)) == PAGE_ATTR_SWAP)
+
 #define PAGE_DIR_ENTRY_IDX(addr)    ((addr & 0xffc00000) >> 22)
 #define PAGE_TABLE_ENTRY_IDX(addr)  ((addr & 0x003ff000) >> 12)
 
@@ -80,6 +96,7 @@ void page_unlink_addr(unsigned long vaddr);
 
 int page_map_addr(unsigned long start, unsigned long len, unsigned long prot);
 int page_unmap_addr(unsigned long vaddr, unsigned long len);
+int page_unmap_addr_lazy(unsigned long vaddr, unsigned long len);
 
 int page_map_addr_safe(unsigned long start, unsigned long len, unsigned long prot);
 int page_unmap_addr_safe(unsigned long start, unsigned long len, char fixed);
@@ -87,6 +104,9 @@ int page_unmap_addr_safe(unsigned long start, unsigned long len, char fixed);
 int page_map_addr_fixed(unsigned long start, unsigned long addr, 
     unsigned long len, unsigned long prot);
 
+unsigned long page_swap_pick(unsigned long *vaddr, unsigned long end, void *buf, unsigned long *scan);
+int page_swap_out(unsigned long vaddr, unsigned long pte, unsigned long slot);
+
 #define kern_vir_addr2phy_addr(x) ((unsigned long)(x) - KERN_BASE_VIR_ADDR)
 #define kern_phy_addr2vir_addr(x) ((void *)((unsigned long)(x) + KERN_BASE_VIR_ADDR)) 
 
@@ -108,8 +128,14 @@ int page_do_fault(trap_frame_t *frame);
 
 #define page_alloc_normal(count)            mem_node_alloc_pages(count, MEM_NODE_TYPE_NORMAL)
 #define page_alloc_user(count)              mem_node_alloc_pages(count, MEM_NODE_TYPE_USER)
+#define page_alloc_user_batch(pages, count) mem_node_alloc_pages_batch(pages, count, MEM_NODE_TYPE_USER)
 #define page_alloc_dma(count)               mem_node_alloc_pages(count, MEM_NODE_TYPE_DMA)
 #define page_free(addr)                     mem_node_free_pages(addr)
+#define page_ref(addr)                      mem_node_ref_pages(addr)
+#define page_ref_count(addr)                mem_node_get_reference(addr)
+#define page_is_user(addr)                  mem_range_has_phy_addr(MEM_RANGE_USER, addr)
+#define page_user_free_nr()                 mem_range_get_free_page_nr(MEM_RANGE_USER)
+#define page_user_total_nr()                mem_range_get_page_nr(MEM_RANGE_USER)
 
 #define kern_page_copy_storge               kern_page_dir_copy_to
 
@@ -36,6 +36,9 @@
 #define BOOT_MEM_ADDR                NORMAL_MEM_ADDR
 #define BOOT_MEM_SIZE                (32 * MB)  // 4G内存需要占用32M引导内存
 
+/* 物理内存的下限，低端的固定区域和黑洞一共占用20MB，qemu -m 32报告的内存比32MB略少 */
+#define PHY_MEM_MIN_SIZE             (30 * MB)
+
 #define KERN_LIMIT_MEM_ADDR                (KERN_SPACE_TOP_ADDR - KERN_BLACKHOLE_MEM_SIZE + 1)
 
 #define DYNAMIC_MAP_MEM_SIZE               (256 * MB)
@@ -12,12 +12,24 @@ void eflags_restore_from(unsigned int eflags);
 
 /* cr0的最高位是分页模式位，1则启动，0则关闭 */
 #define REG_CR0_PG  (1 << 31)
+/* cr0的写保护位，置1后内核写只读的用户页也会产生页故障（写时复制需要） */
+#define REG_CR0_WP  (1 << 16)
+/* cr0的fpu控制位，TS置位后使用fpu会产生#NM，用来延迟切换fpu状态 */
+#define REG_CR0_MP  (1 << 1)
+#define REG_CR0_EM  (1 << 2)
+#define REG_CR0_TS  (1 << 3)
+
+/* cr4的PSE位允许页目录项直接映射4MB大页，PGE位允许全局页，切换cr3时不刷新全局页 */
+#define REG_CR4_PSE (1 << 4)
+#define REG_CR4_PGE (1 << 7)
 
 unsigned int cpu_cr0_read(void );
 unsigned int cpu_cr2_read(void );
 unsigned int cpu_cr3_read(void );
+unsigned int cpu_cr4_read(void );
 
 void cpu_cr0_write(unsigned int address);
 void cpu_cr3_write(unsigned int address);
+void cpu_cr4_write(unsigned int value);
 
 #endif  /* _X86_REGISTERS_H */
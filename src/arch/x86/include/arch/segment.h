@@ -37,12 +37,13 @@
 #define	SA_TIL		4
 
 //index of descriptor
+/* sysexit要求用户代码段和数据段紧跟在内核代码段和数据段之后 */
 #define	INDEX_DUMMY 0
 #define	INDEX_KERNEL_CODE 1
 #define	INDEX_KERNEL_DATA 2
-#define	INDEX_TSS 3
-#define	INDEX_USER_CODE 4
-#define	INDEX_USER_DATA 5
+#define	INDEX_USER_CODE 3
+#define	INDEX_USER_DATA 4
+#define	INDEX_TSS 5     /* 之后依次是每个应用处理器的tss */
 
 #define KERNEL_CODE_SEL ((INDEX_KERNEL_CODE << 3) + (SA_TIG << 2) + SA_RPL0)
 #define KERNEL_DATA_SEL ((INDEX_KERNEL_DATA << 3) + (SA_TIG << 2) + SA_RPL0)
@@ -53,6 +54,7 @@
 #define USER_STACK_SEL USER_DATA_SEL 
 
 #define KERNEL_TSS_SEL ((INDEX_TSS << 3) + (SA_TIG << 2) + SA_RPL0)
+#define KERNEL_TSS_SEL_CPU(index) (((INDEX_TSS + (index)) << 3) + (SA_TIG << 2) + SA_RPL0)
 
 /* GDT 的虚拟地址 */
 #define GDT_VADDR			(KERN_BASE_VIR_ADDR + 0x003F0000)
@@ -76,5 +78,6 @@ struct segment_descriptor {
 };
 
 void segment_descriptor_init();
+void segment_tss_descriptor_set(int index, void *tss);
 
 #endif	/*_X86_SEGMENT_H*/
\ No newline at end of file
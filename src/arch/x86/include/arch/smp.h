@@ -0,0 +1,37 @@
+#ifndef _X86_SMP_H
+#define _X86_SMP_H
+
+#include <xbook/config.h>
+#include <arch/cpu.h>
+
+/* 启动应用处理器的实模式代码所在的物理地址，必须在1MB以下并且4KB对齐 */
+#define SMP_TRAMPOLINE_ADDR     0x7000
+
+#ifdef CONFIG_SMP
+int smp_init();
+void smp_start();
+int smp_get_online_count();
+
+/* 大内核锁 */
+void smp_lock_kernel();
+void smp_unlock_kernel();
+void smp_relax_kernel();
+void smp_idle_halt();
+
+void smp_set_active_pgdir(unsigned long pgdir);
+void smp_tlb_shootdown(unsigned long addr, unsigned long pages);
+void smp_send_reschedule(cpuid_t cpuid);
+#else
+static inline int smp_get_online_count()
+{
+    return 1;
+}
+static inline void smp_relax_kernel() {}
+static inline void smp_idle_halt()
+{
+    cpu_safe_halt();
+}
+static inline void smp_set_active_pgdir(unsigned long pgdir) {}
+#endif  /* CONFIG_SMP */
+
+#endif  /* _X86_SMP_H */
@@ -7,8 +7,14 @@
 #define HZ                (100 * 10)
 
 void pit_clock_init();
+void pit_clock_periodic();
+clock_t pit_clock_oneshot(clock_t ticks);
+clock_t pit_clock_elapsed();
 
-#define clock_hardware_init pit_clock_init
+#define clock_hardware_init     pit_clock_init
+#define clock_hardware_periodic pit_clock_periodic
+#define clock_hardware_oneshot  pit_clock_oneshot
+#define clock_hardware_elapsed  pit_clock_elapsed
 
 #define time_get_hour       cmos_get_hour_hex
 #define time_get_minute     cmos_get_min_hex
@@ -34,7 +34,9 @@ typedef struct {
 } tss_t;
 
 void tss_init();
+void tss_init_ap(int index, unsigned long stack_top);
 tss_t *tss_get_from_cpu0();
+tss_t *tss_get_current();
 void tss_update_info(unsigned long task_addr);
 
 #endif	/*_X86_CPU_H*/
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <arch/pic.h>
 #include <arch/pci.h>
 #include <arch/cpu.h>
+#include <arch/fpu.h>
 #include <xbook/debug.h>
 
 int arch_init()
@@ -16,6 +17,8 @@ int arch_init()
     gate_descriptor_init();
     tss_init();
     cpu_init();
+    sysenter_init();
+    fpu_lazy_init();
     physic_memory_init();
     pic_init();
     pci_init();
@@ -1,17 +1,80 @@
 #include <arch/cpu.h>
+#include <xbook/config.h>
 
+#ifdef CONFIG_SMP
+#include <arch/apic.h>
+#include <arch/segment.h>
+#endif
+
+/* 下标0是启动处理器，开启apic后记录的是每个处理器的local apic id */
 cpuid_t cpu_attached_list[CPU_NR_MAX];
+static unsigned int cpu_attached_count;
+
+#ifdef CONFIG_SMP
+/**
+ * cpu_attach - 登记一个处理器
+ * @apicid: 处理器的local apic id
+ * 
+ * 启动处理器在初始化apic时最先登记，下标为0，
+ * 应用处理器在启动前由启动处理器登记。
+ * 返回处理器的下标，处理器已满返回-1
+ */
+int cpu_attach(int apicid)
+{
+    int index;
+    if (!apic_enabled) {
+        index = 0;  /* 启动处理器替换掉cpu_init中的默认值 */
+    } else {
+        if (cpu_attached_count >= CPU_NR_MAX)
+            return -1;
+        index = cpu_attached_count++;
+    }
+    cpu_attached_list[index] = apicid;
+    return index;
+}
+
+/* 应用处理器启动失败时取消登记，只能撤销最后一次登记 */
+void cpu_detach(int index)
+{
+    if (index > 0 && index == cpu_attached_count - 1) {
+        cpu_attached_list[index] = 0;
+        cpu_attached_count--;
+    }
+}
+
+static inline unsigned short cpu_tr_read()
+{
+    unsigned short sel;
+    __asm__ __volatile__ ("str %0" : "=r" (sel));
+    return sel;
+}
+#endif
+
+/**
+ * 获取当前CPU在cpu_attached_list中的下标，用来访问每个CPU的数据。
+ * 每个处理器在gdt中有自己的tss描述符，从任务寄存器中就能算出下标，
+ * 比读取local apic id快，task_current每次都会用到它
+ */
+int cpu_get_my_index()
+{
+#ifdef CONFIG_SMP
+    if (apic_enabled)
+        return (cpu_tr_read() >> 3) - INDEX_TSS;
+#endif
+    return 0;
+}
 
 cpuid_t cpu_get_my_id()
 {
-    // TODO: calc cpuid 
-    return cpu_attached_list[0];
+    return cpu_attached_list[cpu_get_my_index()];
 }
 
 void cpu_get_attached_list(cpuid_t *cpu_list, unsigned int *count)
 {
-    cpu_list[0] = cpu_get_my_id();
-    *count = 1;
+    int i;
+    for (i = 0; i < cpu_attached_count; i++)
+        cpu_list[i] = cpu_attached_list[i];
+    *count = cpu_attached_count;
 }
 
 void cpu_init()
@@ -21,4 +84,5 @@ void cpu_init()
         cpu_attached_list[i] = 0;
     }
     cpu_attached_list[0] = 0x80386;
+    cpu_attached_count = 1;
 }
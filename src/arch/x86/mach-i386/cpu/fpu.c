@@ -0,0 +1,140 @@
+#include <arch/fpu.h>
+#include <arch/registers.h>
+#include <arch/interrupt.h>
+#include <arch/cpu.h>
+#include <xbook/schedule.h>
+#include <xbook/debug.h>
+
+/* 
+ * 延迟切换fpu：切换任务时不保存和恢复fpu，只设置cr0.TS，
+ * 任务第一次使用fpu时产生#NM异常，这时才把上一个使用者的状态保存起来，
+ * 并恢复当前任务的状态。大多数内核线程和很多用户任务从不使用fpu，
+ * 任务切换时就不需要执行fnsave/frstor了。
+ * 每个处理器有自己的fpu寄存器，状态还在某个处理器上的任务不能迁移到其它处理器。
+ */
+
+/* 每个处理器的fpu寄存器中的状态属于哪个任务，NULL表示没有任务的状态 */
+static fpu_t *fpu_owner[CPU_NR_MAX];
+
+#define fpu_my_owner    fpu_owner[cpu_get_my_index()]
+
+static inline void fpu_stts()
+{
+    cpu_cr0_write(cpu_cr0_read() | REG_CR0_TS);
+}
+
+/**
+ * fpu_init - 初始化任务的fpu状态
+ * @fpu: fpu
+ * @reg: 当前任务重新初始化fpu（执行新程序），寄存器中旧的状态不能再使用
+ * 
+ * 不会立即初始化寄存器，第一次使用fpu时才执行fninit
+ */
+void fpu_init(fpu_t *fpu, int reg)
+{
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (reg && (fpu->flags & FPU_USED) && fpu_my_owner == fpu) {
+        fpu_my_owner = NULL;
+        fpu_stts();
+    }
+    memset(&fpu->storage, 0, sizeof(fpu_storage_t));
+    /* 和fninit之后的状态一致，没有使用过fpu的任务恢复这个状态也是正确的 */
+    fpu->storage.cwd = 0x37f;
+    fpu->storage.twd = 0xffff;
+    fpu->flags = 0;
+    interrupt_restore_state(flags);
+}
+
+/* 调度时调用，只有下一个任务的状态还在寄存器中时才允许直接使用fpu */
+void fpu_switch_to(fpu_t *next)
+{
+    if (fpu_my_owner == next)
+        fpu_clts();
+    else
+        fpu_stts();
+}
+
+/* 把寄存器中的状态写回到内存中，复制任务或者保存任务的fpu状态前调用 */
+void fpu_flush(fpu_t *fpu)
+{
+    /* 从没使用过fpu的任务，寄存器中不会有它的状态，storage还是初始状态，直接复制即可 */
+    if (!(fpu->flags & FPU_USED))
+        return;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (fpu_my_owner == fpu) {
+        fpu_clts();
+        fpu_save(fpu);  /* fnsave后寄存器被重新初始化，已经不属于任何任务了 */
+        fpu_my_owner = NULL;
+        fpu_stts();
+    }
+    interrupt_restore_state(flags);
+}
+
+/**
+ * 丢弃寄存器中的状态，下次使用fpu时从内存中恢复。
+ * 任务销毁前也需要调用，避免之后把状态保存到已经释放的内存中。
+ * 任务可能在其它处理器上销毁，那个处理器上的记录也要清除，
+ * 它的cr0.TS已经置位，下次使用fpu时不会保存状态
+ */
+void fpu_release(fpu_t *fpu)
+{
+    if (!(fpu->flags & FPU_USED))
+        return;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    int i;
+    for (i = 0; i < CPU_NR_MAX; i++) {
+        if (fpu_owner[i] == fpu) {
+            fpu_owner[i] = NULL;
+            if (i == cpu_get_my_index())
+                fpu_stts();
+        }
+    }
+    interrupt_restore_state(flags);
+}
+
+/* 任务的fpu状态是否还在其它处理器的寄存器中，需要关中断调用 */
+int fpu_live_elsewhere(fpu_t *fpu)
+{
+    int me = cpu_get_my_index();
+    int i;
+    for (i = 0; i < CPU_NR_MAX; i++) {
+        if (i != me && fpu_owner[i] == fpu)
+            return 1;
+    }
+    return 0;
+}
+
+/* #NM异常：当前任务使用了fpu，保存上一个使用者的状态，恢复当前任务的状态 */
+static void fpu_device_not_available(unsigned int esp)
+{
+    fpu_t *fpu = &task_current->fpu;
+    fpu_clts();
+    if (fpu_my_owner == fpu)
+        return;
+    if (fpu_my_owner)
+        fpu_save(fpu_my_owner);
+    fpu_restore(fpu);
+    fpu->flags |= FPU_USED;
+    fpu->loads++;
+    fpu_my_owner = fpu;
+}
+
+/* 设置当前处理器的cr0，应用处理器启动时也要调用 */
+void fpu_cpu_init()
+{
+    /* MP=1使得TS置位时wait指令也会产生#NM，EM=0表示存在fpu */
+    unsigned int cr0 = cpu_cr0_read();
+    cr0 &= ~REG_CR0_EM;
+    cr0 |= REG_CR0_MP | REG_CR0_TS;
+    cpu_cr0_write(cr0);
+}
+
+void fpu_lazy_init()
+{
+    fpu_cpu_init();
+    interrupt_register_handler(EP_DEVICE_NOT_AVAILABLE, fpu_device_not_available);
+    keprint(PRINT_INFO "[fpu]: lazy context switch enabled\n");
+}
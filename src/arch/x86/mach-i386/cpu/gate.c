@@ -3,6 +3,7 @@
 #include <arch/interrupt.h>
 #include <arch/pic.h>
 #include <arch/registers.h>
+#include <arch/apic.h>
 #include <xbook/kernel.h>
 
 /* 
@@ -87,6 +88,14 @@ static void interrupt_descriptor_init()
 	/* 系统调用处理中断 */
 	gate_descriptor_set(IDT_OFF2PTR(idt0, KERN_SYSCALL_NR), syscall_handler, KERNEL_CODE_SEL, DA_386IGate, DA_GATE_DPL3);
 
+	/* 处理器间中断和local apic时钟 */
+	gate_descriptor_set(IDT_OFF2PTR(idt0, IPI_TLB_VECTOR), ipi_entry0xf0, KERNEL_CODE_SEL, DA_386IGate, DA_GATE_DPL0);
+	gate_descriptor_set(IDT_OFF2PTR(idt0, IPI_RESCHED_VECTOR), ipi_entry0xf1, KERNEL_CODE_SEL, DA_386IGate, DA_GATE_DPL0);
+	gate_descriptor_set(IDT_OFF2PTR(idt0, LAPIC_TIMER_VECTOR), ipi_entry0xf2, KERNEL_CODE_SEL, DA_386IGate, DA_GATE_DPL0);
+
+	/* local apic的伪中断 */
+	gate_descriptor_set(IDT_OFF2PTR(idt0, 0xff), apic_spurious_handler, KERNEL_CODE_SEL, DA_386IGate, DA_GATE_DPL0);
+
 	idt_register_set(IDT_LIMIT, IDT_VADDR);
 }
 
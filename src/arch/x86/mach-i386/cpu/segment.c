@@ -18,6 +18,12 @@ static void segment_descriptor_set(struct segment_descriptor *descriptor, unsign
 	descriptor->base_high    = (base >> 24) & 0xff;
 }
 
+/* 设置第index个处理器的tss描述符 */
+void segment_tss_descriptor_set(int index, void *tss)
+{
+	segment_descriptor_set(GDT_OFF2PTR(gdt0, INDEX_TSS + index), sizeof(tss_t) - 1, (uint32_t )tss, GDT_TSS_ATTR);
+}
+
 void segment_descriptor_init()
 {
 	gdt0 = (struct segment_descriptor *) GDT_VADDR;
@@ -28,8 +34,7 @@ void segment_descriptor_init()
 	segment_descriptor_set(GDT_OFF2PTR(gdt0, INDEX_KERNEL_CODE), GDT_BOUND_TOP, GDT_BOUND_BOTTOM, GDT_KERNEL_CODE_ATTR);
 	segment_descriptor_set(GDT_OFF2PTR(gdt0, INDEX_KERNEL_DATA), GDT_BOUND_TOP,   GDT_BOUND_BOTTOM, GDT_KERNEL_DATA_ATTR);
 	
-    tss_t *tss = tss_get_from_cpu0();
-	segment_descriptor_set(GDT_OFF2PTR(gdt0, INDEX_TSS), sizeof(tss_t) - 1, (uint32_t )tss, GDT_TSS_ATTR);
+	segment_tss_descriptor_set(0, tss_get_from_cpu0());
 
 	segment_descriptor_set(GDT_OFF2PTR(gdt0, INDEX_USER_CODE), GDT_BOUND_TOP, GDT_BOUND_BOTTOM, DA_CR | DA_DPL3 | DA_32 | DA_G);
 	segment_descriptor_set(GDT_OFF2PTR(gdt0, INDEX_USER_DATA), GDT_BOUND_TOP, GDT_BOUND_BOTTOM, DA_DRW | DA_DPL3 | DA_32 | DA_G);
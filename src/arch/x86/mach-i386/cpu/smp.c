@@ -0,0 +1,407 @@
+#include <xbook/config.h>
+#include <arch/interrupt.h>
+
+#ifdef CONFIG_SMP
+#include <arch/smp.h>
+#include <arch/apic.h>
+#include <arch/acpi.h>
+#include <arch/cpu.h>
+#include <arch/page.h>
+#include <arch/gate.h>
+#include <arch/segment.h>
+#include <arch/registers.h>
+#include <arch/atomic.h>
+#include <arch/memory.h>
+#include <arch/tss.h>
+#include <arch/fpu.h>
+#include <xbook/memcache.h>
+#include <xbook/schedule.h>
+#include <xbook/task.h>
+#include <xbook/vmm.h>
+#include <xbook/fd.h>
+#include <xbook/debug.h>
+#include <string.h>
+
+/* 
+ * 多处理器启动和调度。
+ * 内核中的互斥都是通过关中断实现的，只在单处理器上成立，
+ * 因此用一把大内核锁保证同一时间只有一个处理器在内核中执行：
+ * 从用户态进入内核时获取，返回用户态或者空闲停机时释放，
+ * 内核里的关中断互斥就和单处理器上一样有效。
+ * 每个处理器有自己的调度单元和local apic时钟，空闲时从最忙的处理器上拿任务。
+ * 外部中断仍然只投递到启动处理器。
+ */
+
+extern char smp_trampoline_start[];
+extern char smp_trampoline_end[];
+extern char smp_trampoline_cr3[];
+extern char smp_trampoline_cr4[];
+extern char smp_trampoline_stack[];
+extern char smp_trampoline_entry[];
+
+extern cpuid_t cpu_attached_list[];
+
+static atomic_t smp_online_count;
+static volatile int smp_ap_started;
+static volatile int smp_ap_index;       /* 正在启动的处理器的下标 */
+static volatile int smp_ap_go;          /* 调度器准备好后，应用处理器才开始调度 */
+/* 应用处理器的栈，同时也是它的idle任务，和启动处理器的idle0一样 */
+static task_t *smp_ap_idle[CPU_NR_MAX];
+static unsigned int smp_lapic_timer_count;
+
+/* 大内核锁，启动处理器从一开始就持有 */
+static atomic_t smp_kernel_flag = ATOMIC_INIT(1);
+static volatile int smp_kernel_owner = 0;
+static atomic_t smp_kernel_waiters = ATOMIC_INIT(0);
+
+/* 开始调度的处理器，只有它们需要刷新tlb */
+static volatile unsigned long smp_cpu_active = 1;
+static volatile unsigned long smp_active_pgdir[CPU_NR_MAX];
+
+/* 
+ * tlb刷新请求，持有大内核锁的处理器才能发出，
+ * 等到所有目标处理器都完成后才返回，因此同一时间只有一个请求
+ */
+static volatile unsigned long smp_tlb_addr;
+static volatile unsigned long smp_tlb_pages;
+static volatile int smp_tlb_pending[CPU_NR_MAX];
+
+/* 刷新的页数超过这个值时直接重新加载cr3 */
+#define SMP_TLB_FLUSH_ALL_PAGES 32
+
+static inline int smp_kernel_flag_get()
+{
+    return *(volatile int *) &smp_kernel_flag.value;
+}
+
+int smp_get_online_count()
+{
+    return atomic_get(&smp_online_count);
+}
+
+/* 完成发给当前处理器的tlb刷新请求，关中断调用 */
+static void smp_tlb_do_flush(int me)
+{
+    if (!smp_tlb_pending[me])
+        return;
+    unsigned long pages = smp_tlb_pages;
+    if (!pages) {
+        tlb_flush_local();
+    } else {
+        unsigned long addr = smp_tlb_addr;
+        while (pages-- > 0) {
+            tlb_flush_one_local(addr);
+            addr += PAGE_SIZE;
+        }
+    }
+    smp_tlb_pending[me] = 0;
+}
+
+/**
+ * smp_lock_kernel - 获取大内核锁
+ * 
+ * 所有中断和系统调用入口都会调用，已经持有时直接返回。
+ * 等待时处理tlb刷新请求，持有锁的处理器可能正在等我们完成刷新
+ */
+void smp_lock_kernel()
+{
+    int me = cpu_get_my_index();
+    if (smp_kernel_owner == me)
+        return;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    atomic_inc(&smp_kernel_waiters);
+    while (atomic_xchg(&smp_kernel_flag, 1)) {
+        while (smp_kernel_flag_get()) {
+            smp_tlb_do_flush(me);
+            cpu_pause();
+        }
+    }
+    atomic_dec(&smp_kernel_waiters);
+    smp_kernel_owner = me;
+    interrupt_restore_state(flags);
+}
+
+void smp_unlock_kernel()
+{
+    smp_kernel_owner = -1;
+    atomic_xchg(&smp_kernel_flag, 0);
+}
+
+/* 返回用户态前调用，返回内核态时还在内核中，不能释放 */
+void smp_unlock_kernel_on_exit(trap_frame_t *frame)
+{
+    if ((frame->cs & 0x03) == 0x03 && smp_kernel_owner == cpu_get_my_index())
+        smp_unlock_kernel();
+}
+
+/**
+ * smp_relax_kernel - 有其它处理器等待时让出大内核锁
+ * 
+ * 调度之后和忙等待systicks时调用，避免一个处理器在内核中长时间执行，
+ * 或者在等待只有启动处理器才能推进的systicks时占着锁
+ */
+void smp_relax_kernel()
+{
+    if (!atomic_get(&smp_kernel_waiters))
+        return;
+    if (smp_kernel_owner != cpu_get_my_index())
+        return;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    smp_unlock_kernel();
+    /* 等到锁被其它处理器拿走，否则自己马上又会拿到 */
+    while (atomic_get(&smp_kernel_waiters) && !smp_kernel_flag_get())
+        cpu_pause();
+    smp_lock_kernel();
+    interrupt_restore_state(flags);
+}
+
+/* 释放大内核锁后停机，被中断唤醒后重新获取，需要关中断调用 */
+void smp_idle_halt()
+{
+    smp_unlock_kernel();
+    cpu_safe_halt();
+    interrupt_disable();
+    smp_lock_kernel();
+}
+
+/* 切换页目录时记录，用户空间的tlb只需要通知使用同一个页目录的处理器 */
+void smp_set_active_pgdir(unsigned long pgdir)
+{
+    smp_active_pgdir[cpu_get_my_index()] = pgdir;
+}
+
+/**
+ * smp_tlb_shootdown - 通知其它处理器刷新tlb
+ * @addr: 起始地址
+ * @pages: 页数，为0时刷新整个tlb
+ * 
+ * 当前处理器的tlb已经刷新过了，需要持有大内核锁调用
+ */
+void smp_tlb_shootdown(unsigned long addr, unsigned long pages)
+{
+    int me = cpu_get_my_index();
+    if (!(smp_cpu_active & ~(1UL << me)))
+        return;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (pages > SMP_TLB_FLUSH_ALL_PAGES)
+        pages = 0;
+    smp_tlb_addr = addr & PAGE_MASK;
+    smp_tlb_pages = pages;
+    /* 内核空间所有处理器都共享，用户空间只有同一个页目录的处理器才会缓存 */
+    int user = pages && addr < USER_VMM_TOP_ADDR;
+    int i;
+    for (i = 0; i < CPU_NR_MAX; i++) {
+        if (i == me || !(smp_cpu_active & (1UL << i)))
+            continue;
+        if (user && smp_active_pgdir[i] != smp_active_pgdir[me])
+            continue;
+        smp_tlb_pending[i] = 1;
+        lapic_send_ipi(cpu_attached_list[i], LAPIC_ICR_ASSERT | IPI_TLB_VECTOR);
+    }
+    for (i = 0; i < CPU_NR_MAX; i++) {
+        while (smp_tlb_pending[i])
+            cpu_pause();
+    }
+    interrupt_restore_state(flags);
+}
+
+/* tlb刷新的处理器间中断，不获取大内核锁，发出请求的处理器持有锁并在等待 */
+void smp_tlb_ipi_handler()
+{
+    smp_tlb_do_flush(cpu_get_my_index());
+    lapic_eoi();
+}
+
+/* 通知其它处理器它的调度单元中有了更优先的任务 */
+void smp_send_reschedule(cpuid_t cpuid)
+{
+    lapic_send_ipi(cpuid, LAPIC_ICR_ASSERT | IPI_RESCHED_VECTOR);
+}
+
+void smp_resched_ipi_handler(trap_frame_t *frame)
+{
+    lapic_eoi();
+    sched_unit_t *su = sched_get_cur_unit();
+    if (su->flags & SCHED_NEED_RESCHED)
+        schedule();
+}
+
+/* 应用处理器的local apic时钟，和启动处理器的调度软中断一样处理时间片 */
+void smp_timer_handler(trap_frame_t *frame)
+{
+    lapic_eoi();
+    task_t *current = task_current;
+    assert(current->stack_magic == TASK_STACK_MAGIC);
+    current->elapsed_ticks++;
+    sched_tick(sched_get_cur_unit(), current);
+}
+
+/* 应用处理器进入内核后执行的第一个函数，栈顶就是idle任务的内核栈顶 */
+static void smp_ap_main()
+{
+    int index = smp_ap_index;
+    gdt_register_set(GDT_LIMIT, GDT_VADDR);
+    idt_register_set(IDT_LIMIT, IDT_VADDR);
+    /* 加载tss之后cpu_get_my_index才能使用 */
+    tss_init_ap(index, (unsigned long) smp_ap_idle[index] + TASK_KERN_STACK_SIZE);
+    lapic_init();
+    atomic_inc(&smp_online_count);
+    smp_ap_started = 1;
+    while (!smp_ap_go)
+        cpu_pause();
+
+    smp_lock_kernel();
+    sysenter_init();
+    fpu_cpu_init();
+    smp_set_active_pgdir(KERN_PAGE_DIR_PHY_ADDR);
+    smp_cpu_active |= 1UL << index;
+    /* 启动前的tlb刷新请求都没有通知这个处理器 */
+    tlb_flush_local();
+    lapic_timer_start(smp_lapic_timer_count);
+    interrupt_enable();
+    kern_do_idle(NULL);
+}
+
+/* 修改复制到低端内存中的启动代码里的变量 */
+static void smp_trampoline_set(char *var, unsigned long value)
+{
+    unsigned long off = (unsigned long) var - (unsigned long) smp_trampoline_start;
+    *(unsigned long *) kern_phy_addr2vir_addr(SMP_TRAMPOLINE_ADDR + off) = value;
+}
+
+/**
+ * smp_boot_ap - 通过INIT-SIPI-SIPI启动一个应用处理器
+ * @apicid: 处理器的local apic id
+ * 
+ * 成功返回0，处理器没有响应返回-1
+ */
+static int smp_boot_ap(int apicid)
+{
+    void *stack = mem_alloc(TASK_KERN_STACK_SIZE);
+    if (stack == NULL)
+        return -1;
+    /* 先登记下标，处理器进入内核后就能找到自己的每CPU数据 */
+    int index = cpu_attach(apicid);
+    if (index < 0) {
+        mem_free(stack);
+        return -1;
+    }
+    smp_ap_idle[index] = stack;
+    smp_ap_index = index;
+    smp_trampoline_set(smp_trampoline_stack, (unsigned long) stack + TASK_KERN_STACK_SIZE);
+    smp_ap_started = 0;
+
+    lapic_send_ipi(apicid, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+    cpu_do_udelay(200);
+    lapic_send_ipi(apicid, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL);
+    cpu_do_udelay(10000);
+    int i;
+    for (i = 0; i < 2 && !smp_ap_started; i++) {
+        lapic_send_ipi(apicid, LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE_ADDR >> 12));
+        cpu_do_udelay(200);
+    }
+    int timeout = 1000;
+    while (!smp_ap_started && --timeout > 0)
+        cpu_do_udelay(100);
+    if (!smp_ap_started) {
+        smp_ap_idle[index] = NULL;
+        cpu_detach(index);
+        mem_free(stack);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * smp_init - 初始化apic并启动其它处理器
+ * 
+ * 需要在内存管理初始化之后，注册中断之前调用，
+ * 应用处理器启动后等待smp_start才开始调度。
+ * 返回在线的处理器数量
+ */
+int smp_init()
+{
+    atomic_set(&smp_online_count, 1);
+    smp_active_pgdir[0] = KERN_PAGE_DIR_PHY_ADDR;
+    if (apic_init() < 0)
+        return 1;
+    memcpy(kern_phy_addr2vir_addr(SMP_TRAMPOLINE_ADDR), smp_trampoline_start,
+        smp_trampoline_end - smp_trampoline_start);
+    smp_trampoline_set(smp_trampoline_cr3, KERN_PAGE_DIR_PHY_ADDR);
+    /* 应用处理器要和启动处理器一样识别大页和全局页 */
+    smp_trampoline_set(smp_trampoline_cr4, cpu_cr4_read() & (REG_CR4_PSE | REG_CR4_PGE));
+    smp_trampoline_set(smp_trampoline_entry, (unsigned long) smp_ap_main);
+    int bsp = lapic_get_id();
+    int i;
+    for (i = 0; i < acpi_madt_info.cpu_count; i++) {
+        int apicid = acpi_madt_info.lapic_ids[i];
+        if (apicid == bsp)
+            continue;
+        if (smp_boot_ap(apicid) < 0)
+            keprint(PRINT_WARING "[smp]: cpu %d not respond!\n", apicid);
+    }
+    keprint(PRINT_INFO "[smp]: %d of %d cpus online\n", smp_get_online_count(),
+        acpi_madt_info.cpu_count);
+    return smp_get_online_count();
+}
+
+/**
+ * smp_start - 让应用处理器开始调度
+ * 
+ * 在调度器和文件系统初始化之后，启动用户进程之前调用，需要开中断。
+ * 把每个应用处理器的栈初始化成它的idle任务，然后放行
+ */
+void smp_start()
+{
+    if (smp_get_online_count() <= 1)
+        return;
+    smp_lapic_timer_count = lapic_timer_calibrate();
+    char name[] = "idle0";
+    int i;
+    for (i = 1; i < scheduler.cpunr; i++) {
+        task_t *idle = smp_ap_idle[i];
+        if (idle == NULL)
+            continue;
+        name[4] = '0' + i;
+        task_init(idle, name, TASK_PRIO_LEVEL_LOW);
+        idle->static_priority = idle->priority = TASK_PRIORITY_IDLE;
+        idle->state = TASK_RUNNING;
+        if (fs_fd_init(idle) < 0)
+            panic("[smp]: init %s fs fd failed!\n", name);
+        sched_unit_t *su = &scheduler.sched_unit_table[i];
+        unsigned long flags;
+        interrupt_save_and_disable(flags);
+        idle->cpuid = su->cpuid;
+        task_add_to_global_list(idle);
+        su->idle = idle;
+        su->cur = idle;
+        interrupt_restore_state(flags);
+    }
+    smp_ap_go = 1;
+    keprint(PRINT_INFO "[smp]: lapic timer %d counts per tick\n", smp_lapic_timer_count);
+}
+#else
+/* 单处理器时入口代码仍然会调用这些函数 */
+void smp_lock_kernel()
+{
+}
+
+void smp_unlock_kernel_on_exit(trap_frame_t *frame)
+{
+}
+
+void smp_tlb_ipi_handler()
+{
+}
+
+void smp_resched_ipi_handler(trap_frame_t *frame)
+{
+}
+
+void smp_timer_handler(trap_frame_t *frame)
+{
+}
+#endif  /* CONFIG_SMP */
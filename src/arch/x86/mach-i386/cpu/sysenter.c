@@ -0,0 +1,85 @@
+#include <arch/cpu.h>
+#include <arch/tss.h>
+#include <arch/segment.h>
+#include <arch/interrupt.h>
+#include <xbook/safety.h>
+#include <xbook/exception.h>
+#include <xbook/debug.h>
+
+extern void sysenter_handler();
+
+/* 用户态在sysenter前压入栈中的内容，ebp指向它 */
+typedef struct {
+    unsigned int eip;   /* sysexit返回的地址 */
+    unsigned int ebp;
+    unsigned int edx;
+    unsigned int ecx;
+} sysenter_user_frame_t;
+
+/**
+ * sysenter_frame_fixup - 补全sysenter进入时的中断栈
+ * @frame: 中断栈
+ * 
+ * sysenter不会保存用户的返回地址和栈，用户态把它们和被占用的ecx、edx
+ * 压入用户栈中，并让ebp指向它，这里读取出来填写到中断栈，
+ * 之后就和int 0x40进入的系统调用没有区别了（fork、异常处理都依赖中断栈）。
+ * 成功返回0，用户栈无效返回-1
+ */
+int sysenter_frame_fixup(trap_frame_t *frame)
+{
+    sysenter_user_frame_t uframe;
+    frame->cs = USER_CODE_SEL;
+    frame->ss = USER_STACK_SEL;
+    frame->eflags |= EFLAGS_IF_1;
+    if (mem_copy_from_user(&uframe, (void *)frame->ebp, sizeof(sysenter_user_frame_t)) < 0) {
+        keprint(PRINT_ERR "sysenter: bad user frame %x!\n", frame->ebp);
+        frame->eip = frame->esp = 0;
+        exception_force_self(EXP_CODE_SEGV);
+        return -1;
+    }
+    frame->eip = uframe.eip;
+    frame->esp = frame->ebp + 4;    /* 返回后用户栈顶是保存的ebp */
+    frame->ebp = uframe.ebp;
+    frame->edx = uframe.edx;
+    frame->ecx = uframe.ecx;
+    return 0;
+}
+
+/* 早期的Pentium Pro虽然报告了SEP，但是并不支持 */
+static int sysenter_supported()
+{
+    unsigned int eax, ebx, ecx, edx;
+    cpu_do_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1)
+        return 0;
+    cpu_do_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_FEATURE_SEP))
+        return 0;
+    unsigned int family = (eax >> 8) & 0xf;
+    unsigned int model = (eax >> 4) & 0xf;
+    unsigned int stepping = eax & 0xf;
+    if (family == 6 && model < 3 && stepping < 3)
+        return 0;
+    return 1;
+}
+
+/**
+ * sysenter_init - 设置sysenter的MSR
+ * 
+ * sysenter进入内核时的栈指向tss.esp0所在的位置，入口处再从中取出
+ * 当前任务的内核栈，这样任务切换时不需要重新设置MSR。
+ * MSR是每个处理器自己的，应用处理器加载tss后也要调用。
+ * 不支持时用户态继续使用int 0x40。
+ */
+int sysenter_init()
+{
+    if (!sysenter_supported()) {
+        keprint(PRINT_INFO "[sysenter] not supported, use int 0x40.\n");
+        return -1;
+    }
+    tss_t *tss = tss_get_current();
+    cpu_do_wrmsr(MSR_IA32_SYSENTER_CS, KERNEL_CODE_SEL, 0);
+    cpu_do_wrmsr(MSR_IA32_SYSENTER_ESP, (unsigned int)&tss->esp0, 0);
+    cpu_do_wrmsr(MSR_IA32_SYSENTER_EIP, (unsigned int)sysenter_handler, 0);
+    return 0;
+}
@@ -0,0 +1,66 @@
+; 应用处理器的启动代码，被复制到SMP_TRAMPOLINE_ADDR后执行。
+; 处理器收到SIPI后从实模式开始运行，这里进入保护模式，
+; 使用内核页目录开启分页（低端内存是对等映射的），然后跳转到内核中。
+; 内核直接映射区使用了4MB大页和全局页，开启分页前要先设置和启动处理器相同的cr4。
+
+SMP_TRAMPOLINE_ADDR EQU 0x7000
+
+%define TRAMPOLINE_ADDR(x)  ((x) - smp_trampoline_start + SMP_TRAMPOLINE_ADDR)
+
+global smp_trampoline_start
+global smp_trampoline_end
+global smp_trampoline_cr3
+global smp_trampoline_cr4
+global smp_trampoline_stack
+global smp_trampoline_entry
+
+[section .text]
+[bits 16]
+smp_trampoline_start:
+    cli
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    lgdt [TRAMPOLINE_ADDR(trampoline_gdtr)]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword 0x08:TRAMPOLINE_ADDR(trampoline_protect)
+
+[bits 32]
+trampoline_protect:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov eax, [TRAMPOLINE_ADDR(smp_trampoline_cr4)]
+    mov cr4, eax            ; PSE | PGE
+    mov eax, [TRAMPOLINE_ADDR(smp_trampoline_cr3)]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80010000      ; PG | WP
+    mov cr0, eax
+
+    mov esp, [TRAMPOLINE_ADDR(smp_trampoline_stack)]
+    xor ebp, ebp
+    jmp [TRAMPOLINE_ADDR(smp_trampoline_entry)]
+
+align 8
+trampoline_gdt:
+    dq 0
+    dq 0x00cf9a000000ffff   ; 内核代码段
+    dq 0x00cf92000000ffff   ; 内核数据段
+trampoline_gdtr:
+    dw 8 * 3 - 1
+    dd TRAMPOLINE_ADDR(trampoline_gdt)
+
+; 由启动处理器在发送SIPI前填写
+smp_trampoline_cr3:     dd 0
+smp_trampoline_cr4:     dd 0
+smp_trampoline_stack:   dd 0
+smp_trampoline_entry:   dd 0
+smp_trampoline_end:
@@ -90,6 +90,17 @@ cpu_cr3_write:
 	mov cr3,eax
 	ret
 
+global cpu_cr4_read
+cpu_cr4_read:
+	mov eax,cr4
+	ret
+
+global cpu_cr4_write
+cpu_cr4_write:
+	mov eax,[esp+4]
+	mov cr4,eax
+	ret
+
 global cpu_cr0_read
 cpu_cr0_read:
 	mov eax,cr0
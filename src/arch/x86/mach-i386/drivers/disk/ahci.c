@@ -19,6 +19,9 @@
 #include <xbook/dma.h>
 #include <xbook/task.h>
 #include <xbook/virmem.h>
+#include <xbook/mdl.h>
+#include <xbook/semaphore.h>
+#include <xbook/schedule.h>
 #include <assert.h>
 #include <sys/ioctl.h>
 #include <stdio.h>
@@ -351,6 +354,19 @@ struct ata_identify {
 #define HBA_PxCMD_FR  (1 << 14)
 #define HBA_PxCMD_FRE (1 << 4)
 
+#define HBA_CAP_SNCQ (1 << 30)
+#define HBA_CAP_NCS(cap) ((((cap) >> 8) & 0x1f) + 1)
+
+#define HBA_PxIS_DHRS (1 << 0)
+#define HBA_PxIS_PSS  (1 << 1)
+#define HBA_PxIS_DSS  (1 << 2)
+#define HBA_PxIS_SDBS (1 << 3)
+#define HBA_PxIS_IFS  (1 << 27)
+#define HBA_PxIS_HBDS (1 << 28)
+#define HBA_PxIS_HBFS (1 << 29)
+#define HBA_PxIS_TFES (1 << 30)
+#define HBA_PxIS_ERROR (HBA_PxIS_TFES | HBA_PxIS_HBFS | HBA_PxIS_HBDS | HBA_PxIS_IFS)
+
 #define HBA_GHC_AHCI_ENABLE (1 << 31)
 #define HBA_GHC_INTERRUPT_ENABLE (1 << 1)
 #define HBA_GHC_RESET (1 << 0)
@@ -363,17 +379,37 @@ struct ata_identify {
 
 #define ATA_CMD_READ_DMA_EX 0x25
 #define ATA_CMD_WRITE_DMA_EX 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+
+/* IDENTIFY数据中的字 */
+#define ATA_IDENT_QUEUE_DEPTH   75
+#define ATA_IDENT_SATA_CAP      76
+#define ATA_SATA_CAP_NCQ        (1 << 8)
 
 #define PRDT_MAX_COUNT 0x1000
 
-#define PRDT_MAX_ENTRIES 65535
+/* 一个PRDT项最多描述4MB */
+#define PRDT_MAX_BYTES (4 * 1024 * 1024)
+
+/* 命令表占一个页，去掉前面0x80字节的命令FIS后剩下的都用来放PRDT */
+#define PRDT_MAX_ENTRIES ((0x1000 - 0x80) / sizeof(struct hba_prdt_entry))
 
 #define ATA_TFD_TIMEOUT  1000000
 #define AHCI_CMD_TIMEOUT 1000000
 
+/* 等待命令完成的超时时间（ticks） */
+#define AHCI_CMD_TIMEOUT_TICKS (5 * HZ)
+/* 清除PxCMD.ST后等待PxCMD.CR清零的最长时间，规范规定为500ms，单位为10us */
+#define AHCI_PORT_STOP_TIMEOUT  50000
+
 #define ATA_SECTOR_SIZE 512
 
-#define AHCI_DEFAULT_INT 0
+/* 最坏情况下每个页一个PRDT项，缓冲区不是页对齐时首尾各多占一项 */
+#define AHCI_MAX_SECTORS_PER_CMD (((PRDT_MAX_ENTRIES - 1) * PAGE_SIZE) / ATA_SECTOR_SIZE)
+
+#define AHCI_DEFAULT_INT (HBA_PxIS_DHRS | HBA_PxIS_PSS | HBA_PxIS_DSS | \
+        HBA_PxIS_SDBS | HBA_PxIS_ERROR)
 
 #define	SATA_SIG_ATA	0x00000101	// SATA drive
 #define	SATA_SIG_ATAPI	0xEB140101	// SATAPI drive
@@ -390,6 +426,18 @@ struct ata_identify {
 #define HBA_PORT_IPM_ACTIVE 1
 #define HBA_PORT_DET_PRESENT 3
  
+/* 命令槽状态 */
+enum {
+    AHCI_SLOT_IDLE = 0,
+    AHCI_SLOT_ISSUED,       /* 已经发出命令，等待完成 */
+    AHCI_SLOT_DONE,
+    AHCI_SLOT_ERROR,
+};
+
+typedef struct {
+    task_t *waiter;         /* 等待命令完成的任务 */
+    volatile int status;
+} ahci_slot_t;
 
 typedef struct _device_extension {
     device_object_t *device_object; /* 设备对象 */
@@ -407,7 +455,13 @@ typedef struct _device_extension {
 	void *ch[HBA_COMMAND_HEADER_NUM];
 	struct dma_region ch_dmas[HBA_COMMAND_HEADER_NUM];
 	struct ata_identify identify;
-	uint32_t slots;
+	uint32_t slots;         /* 已经分配的命令槽 */
+	volatile uint32_t issued;   /* 已经发出还没有完成的命令槽 */
+	int nr_slots;           /* 可以使用的命令槽数量 */
+	int ncq;                /* 是否使用原生命令队列 */
+	volatile int need_reset;    /* 命令出错，需要复位端口 */
+	semaphore_t slot_sem;   /* 空闲命令槽计数 */
+	ahci_slot_t slot_info[HBA_COMMAND_HEADER_NUM];
 	int created;
 } device_extension_t;
 
@@ -534,36 +588,39 @@ void ahci_send_command(struct hba_port *port, int slot)
 	ahci_flush_commands(port);
 }
 
+/**
+ * 根据缓冲区的每个物理页填写PRDT，物理地址连续的页合并到同一项中。
+ * 缓冲区必须按2字节对齐，并且已经映射到当前地址空间。
+ * 返回PRDT项数，项数不够时返回-1
+ */
 int ahci_write_prdt(struct hba_memory *abar, struct hba_port *port, device_extension_t *dev, int slot, int offset, int length, addr_t virt_buffer)
 {
-	int num_entries = ((length-1) / PRDT_MAX_COUNT) + 1;
 	struct hba_command_table *tbl = (struct hba_command_table *)(dev->ch[slot]);
-	int i;
-	struct hba_prdt_entry *prd;
-	for(i=0;i<num_entries-1;i++)
-	{
-		/* TODO: do we need to do this? */
-		addr_t phys_buffer;
-        phys_buffer = addr_vir2phy(virt_buffer);
-		//mm_virtual_getmap(virt_buffer, &phys_buffer, 0);
-		prd = &tbl->prdt_entries[i+offset];
-		prd->byte_count = PRDT_MAX_COUNT-1;
-		prd->data_base_l = low32(phys_buffer);
-		prd->data_base_h = 0;
-		prd->interrupt_on_complete=0;
-		
-		length -= PRDT_MAX_COUNT;
-		virt_buffer += PRDT_MAX_COUNT;
+	struct hba_prdt_entry *prd = NULL;
+	addr_t next_phys = 0;
+	int num_entries = 0;
+	while (length > 0) {
+		addr_t phys_buffer = addr_vir2phy(virt_buffer);
+		int chunk = PAGE_SIZE - (virt_buffer & (PAGE_SIZE - 1));
+		if (chunk > length)
+			chunk = length;
+		if (prd && phys_buffer == next_phys && prd->byte_count + 1 + chunk <= PRDT_MAX_BYTES) {
+			prd->byte_count += chunk;
+		} else {
+			if (offset + num_entries >= PRDT_MAX_ENTRIES)
+				return -1;
+			prd = &tbl->prdt_entries[offset + num_entries];
+			prd->data_base_l = low32(phys_buffer);
+			prd->data_base_h = 0;
+			prd->reserved0 = 0;
+			prd->byte_count = chunk - 1;
+			prd->interrupt_on_complete = 0;
+			num_entries++;
+		}
+		next_phys = phys_buffer + chunk;
+		virt_buffer += chunk;
+		length -= chunk;
 	}
-	addr_t phys_buffer;
-    phys_buffer = addr_vir2phy(virt_buffer);
-	//mm_virtual_getmap(virt_buffer, &phys_buffer, 0);
-	prd = &tbl->prdt_entries[i+offset];
-	prd->byte_count = length-1;
-	prd->data_base_l = low32(phys_buffer);
-	prd->data_base_h = 0;
-	prd->interrupt_on_complete=0;
-	
 	return num_entries;
 }
 
@@ -592,24 +649,123 @@ void ahci_reset_device(struct hba_memory *abar, struct hba_port *port, device_ex
 	port->interrupt_status = ~0; /* clear pending interrupts */
 	port->interrupt_enable = AHCI_DEFAULT_INT; /* we want some interrupts */
 	ahci_start_port_command_engine(port);
-	dev->slots=0;
+	dev->issued = 0;
 	port->sata_error = ~0;
 }
 
+/* 等待端口的命令引擎停止，PxCI和PxSACT清零。可以在中断中调用，超时返回-1 */
+static int ahci_port_wait_stopped(struct hba_port *port)
+{
+	int timeout = AHCI_PORT_STOP_TIMEOUT;
+	while ((port->command & HBA_PxCMD_CR) || port->command_issue || port->sata_active) {
+		if (!--timeout)
+			return -1;
+		udelay(10);
+	}
+	return 0;
+}
+
+/**
+ * 停止端口的命令引擎，之后硬件不会再访问已经发出的命令的缓冲区。
+ * 清除PxCMD.ST后硬件会清除PxCI和PxSACT，引擎停不下来时发送COMRESET。
+ * FRE保持不变，端口由ahci_port_recover重新启动。
+ */
+static void ahci_port_stop(device_extension_t *dev, struct hba_port *port)
+{
+	port->command &= ~HBA_PxCMD_ST;
+	ahci_flush_commands(port);
+	if (!ahci_port_wait_stopped(port))
+		return;
+	keprint(PRINT_ERR "[ahci]: device %d: port stop timeout, sending COMRESET\n", dev->idx);
+	port->sata_control = (port->sata_control & ~0xf) | 1;
+	udelay(1000);
+	port->sata_control &= ~0xf;
+	if (ahci_port_wait_stopped(port))
+		keprint(PRINT_ERR "[ahci]: device %d: port still busy after COMRESET cmd=%x ci=%x sact=%x\n",
+			dev->idx, port->command, port->command_issue, port->sata_active);
+}
+
+/* 停止端口，让所有已经发出的命令失败，并且标记端口需要复位。需要关中断调用 */
+static void ahci_port_fail_all(device_extension_t *dev, struct hba_port *port)
+{
+	/* 先停止端口再唤醒等待者，否则硬件可能还在往已经释放的缓冲区里传输 */
+	ahci_port_stop(dev, port);
+	uint32_t issued = dev->issued;
+	while (issued) {
+		int slot = __builtin_ctz(issued);
+		issued &= issued - 1;
+		dev->slot_info[slot].status = AHCI_SLOT_ERROR;
+		if (dev->slot_info[slot].waiter)
+			task_wakeup(dev->slot_info[slot].waiter);
+	}
+	dev->issued = 0;
+	dev->need_reset = 1;
+}
+
+/**
+ * 根据PxSACT和PxCI检查已经完成的命令，唤醒等待的任务。
+ * 在中断处理中调用，等待超时的时候也会调用。需要关中断调用
+ */
+static void ahci_port_complete(device_extension_t *dev, struct hba_port *port, uint32_t pis)
+{
+	if (pis & HBA_PxIS_ERROR) {
+		keprint(PRINT_ERR "[ahci]: device %d: error interrupt %x tfd=%x serr=%x\n",
+			dev->idx, pis, port->task_file_data, port->sata_error);
+		ahci_port_fail_all(dev, port);
+		return;
+	}
+	uint32_t done = dev->issued & ~(port->sata_active | port->command_issue);
+	dev->issued &= ~done;
+	while (done) {
+		int slot = __builtin_ctz(done);
+		done &= done - 1;
+		dev->slot_info[slot].status = AHCI_SLOT_DONE;
+		if (dev->slot_info[slot].waiter)
+			task_wakeup(dev->slot_info[slot].waiter);
+	}
+}
+
+/* 出错后复位端口，所有出错的命令都已经完成，不会有新命令在复位时发出 */
+static void ahci_port_recover(struct hba_memory *abar, struct hba_port *port, device_extension_t *dev)
+{
+	mutex_lock(&dev->lock);
+	if (dev->need_reset && !dev->issued) {
+		ahci_reset_device(abar, port, dev);
+		port->interrupt_enable = AHCI_DEFAULT_INT;
+		dev->need_reset = 0;
+	}
+	mutex_unlock(&dev->lock);
+}
+
 int ahci_port_dma_data_transfer(struct hba_memory *abar, struct hba_port *port, device_extension_t *dev, int slot, int write, addr_t virt_buffer, int sectors, uint64_t lba)
 {
 	int timeout;
 	int fis_len = sizeof(struct fis_reg_host_to_device) / 4;
 	int ne = ahci_write_prdt(abar, port, dev,
 			slot, 0, ATA_SECTOR_SIZE * sectors, virt_buffer);
+	if (ne < 0) {
+		keprint(PRINT_ERR "[ahci]: device %d: too many prdt entries\n", dev->idx);
+		return 0;
+	}
 	ahci_initialize_command_header(abar,
 			port, dev, slot, write, 0, ne, fis_len);
-	struct fis_reg_host_to_device *fis = ahci_initialize_fis_host_to_device(abar,
+	struct fis_reg_host_to_device *fis;
+	if (dev->ncq) {
+		/* 原生命令队列：扇区数放在feature中，count中是命令标签 */
+		fis = ahci_initialize_fis_host_to_device(abar,
+			port, dev, slot, 1, write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED);
+		fis->feature_l = sectors & 0xFF;
+		fis->feature_h = (sectors >> 8) & 0xFF;
+		fis->count_l = slot << 3;
+		fis->count_h = 0;
+	} else {
+		fis = ahci_initialize_fis_host_to_device(abar,
 			port, dev, slot, 1, write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX);
+		/* WARNING: assumes little-endian */
+		fis->count_l = sectors & 0xFF;
+		fis->count_h = (sectors >> 8) & 0xFF;
+	}
 	fis->device = 1<<6;
-	/* WARNING: assumes little-endian */
-	fis->count_l = sectors & 0xFF;
-	fis->count_h = (sectors >> 8) & 0xFF;
 	
 	fis->lba0 = (unsigned char)( lba        & 0xFF);
 	fis->lba1 = (unsigned char)((lba >> 8)  & 0xFF);
@@ -617,53 +773,61 @@ int ahci_port_dma_data_transfer(struct hba_memory *abar, struct hba_port *port,
 	fis->lba3 = (unsigned char)((lba >> 24) & 0xFF);
 	fis->lba4 = (unsigned char)((lba >> 32) & 0xFF);
 	fis->lba5 = (unsigned char)((lba >> 40) & 0xFF);
-	port->sata_error = ~0;
-	timeout = ATA_TFD_TIMEOUT;
-	while ((port->task_file_data & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && --timeout)
-	{
-		//tm_schedule();
-        // cpu yield
-        cpu_pause();
-        //task_yield();
-	}
-	if(!timeout) goto port_hung;
-	
-	port->sata_error = ~0;
-	ahci_send_command(port, slot);
-	timeout = ATA_TFD_TIMEOUT;
-	while ((port->task_file_data & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && --timeout)
-	{
-		cpu_pause();
-        //task_yield();
-	}
-	if(!timeout) goto port_hung;
-	
-	timeout = AHCI_CMD_TIMEOUT;
-	while(--timeout)
-	{
-		if(!((port->sata_active | port->command_issue) & (1 << slot)))
-			break;
-		cpu_pause();
-        //task_yield();
-	}
-	if(!timeout) goto port_hung;
-	if(port->sata_error)
-	{
-		keprint(PRINT_ERR "[ahci]: device %d: ahci error\n", dev->idx);
-		goto error;
+
+	/* 端口复位期间不能发出命令 */
+	while (dev->need_reset)
+		task_sleep_by_ticks(1);
+	if (!dev->ncq) {
+		/* 非队列命令每次只有一个，发出前等待设备空闲 */
+		timeout = ATA_TFD_TIMEOUT;
+		while ((port->task_file_data & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && --timeout)
+			cpu_pause();
+		if(!timeout) goto port_hung;
 	}
-	if(port->task_file_data & ATA_DEV_ERR)
-	{
-		keprint(PRINT_ERR "[ahci]: device %d: task file data error\n", dev->idx);
-		goto error;
+
+	ahci_slot_t *info = &dev->slot_info[slot];
+	unsigned long flags;
+	interrupt_save_and_disable(flags);
+	if (!dev->issued)
+		port->sata_error = ~0;
+	info->status = AHCI_SLOT_ISSUED;
+	info->waiter = task_current;
+	dev->issued |= (1 << slot);
+	if (dev->ncq)
+		port->sata_active = (1 << slot);
+	port->command_issue = (1 << slot);
+	ahci_flush_commands(port);
+	/* 由中断处理函数唤醒，超时后直接检查寄存器，防止中断丢失 */
+	clock_t left = AHCI_CMD_TIMEOUT_TICKS;
+	while (info->status == AHCI_SLOT_ISSUED && left > 0)
+		left = task_sleep_by_ticks(left);
+	if (info->status == AHCI_SLOT_ISSUED) {
+		ahci_port_complete(dev, port, port->interrupt_status);
+		if (info->status == AHCI_SLOT_ISSUED) {
+			keprint(PRINT_ERR "[ahci]: device %d: slot %d timeout\n", dev->idx, slot);
+			ahci_port_fail_all(dev, port);
+		}
 	}
-	return 1;
+	info->waiter = NULL;
+	int status = info->status;
+	info->status = AHCI_SLOT_IDLE;
+	interrupt_restore_state(flags);
+
+	if (status == AHCI_SLOT_DONE)
+		return 1;
+	keprint(PRINT_ERR "[ahci]: device %d: tfd=%x, serr=%x\n",
+			dev->idx, port->task_file_data, port->sata_error);
+	ahci_port_recover(abar, port, dev);
+	return 0;
 	port_hung:
 	keprint(PRINT_ERR "[ahci]: device %d: port hung\n", dev->idx);
-	error:
 	keprint(PRINT_ERR "[ahci]: device %d: tfd=%x, serr=%x\n",
 			dev->idx, port->task_file_data, port->sata_error);
-	ahci_reset_device(abar, port, dev);
+	mutex_lock(&dev->lock);
+	if (!dev->issued)
+		ahci_reset_device(abar, port, dev);
+	port->interrupt_enable = AHCI_DEFAULT_INT;
+	mutex_unlock(&dev->lock);
 	return 0;
 }
 
@@ -725,6 +889,18 @@ int ahci_device_identify_ahci(struct hba_memory *abar,
 
     if (!dev->identify.lba48_addressable_sectors)
         return 0;
+    /* 控制器和磁盘都支持时使用原生命令队列，命令槽数量取两者的较小值 */
+    uint16_t *ident = (uint16_t *)&dev->identify;
+    dev->ncq = 0;
+    dev->nr_slots = 1;
+    if ((abar->capability & HBA_CAP_SNCQ) && (ident[ATA_IDENT_SATA_CAP] & ATA_SATA_CAP_NCQ)) {
+        dev->ncq = 1;
+        dev->nr_slots = MIN(HBA_CAP_NCS(abar->capability), (ident[ATA_IDENT_QUEUE_DEPTH] & 0x1f) + 1);
+    }
+    semaphore_init(&dev->slot_sem, dev->nr_slots);
+    #ifdef DEBUG_AHCI
+    keprint(PRINT_INFO "[ahci]: device %d: ncq %d slots %d\n", dev->idx, dev->ncq, dev->nr_slots);
+	#endif
     return 1;
 }
 
@@ -827,6 +1003,9 @@ int ahci_initialize_device(struct hba_memory *abar, device_extension_t *dev)
 	clb_phys = dev->dma_clb.p.address;
 	fis_phys = dev->dma_fis.p.address;
 	dev->slots=0;
+	dev->issued = 0;
+	dev->need_reset = 0;
+	memset(dev->slot_info, 0, sizeof(dev->slot_info));
 	struct hba_command_header *h = (struct hba_command_header *)dev->clb_virt;
 	int i;
 	for(i=0;i<HBA_COMMAND_HEADER_NUM;i++) {
@@ -868,8 +1047,8 @@ iostatus_t ahci_create_device(driver_object_t *driver, device_extension_t *dev)
         keprint(PRINT_ERR "[ahci]: create device on port %d failed!\n", dev->idx);
         return status;
     }
-    /* buffered io mode */
-    devobj->flags = DO_BUFFERED_IO;
+    /* direct io mode */
+    devobj->flags = DO_DIRECT_IO;
     devobj->device_extension = dev;
     dev->device_object = devobj;
 	dev->created = 1;
@@ -895,6 +1074,7 @@ int ahci_probe_ports(driver_object_t *driver, struct hba_memory *abar)
                 #endif
                 /* 创建设备扩展 */
 				ports[i] = mem_alloc(sizeof(device_extension_t));
+                memset(ports[i], 0, sizeof(device_extension_t));
 				ports[i]->type = type;
 				ports[i]->idx = i;
                 mutexlock_init(&(ports[i]->lock));
@@ -928,43 +1108,38 @@ int ahci_probe_ports(driver_object_t *driver, struct hba_memory *abar)
     return counts;
 }
 
+/* 没有空闲的命令槽时睡眠等待，而不是忙等 */
 int ahci_port_acquire_slot(device_extension_t *dev)
 {
-	while(1) {
-		int i;
-		mutex_lock(&dev->lock);
-		for(i=0;i<32;i++)
-		{
-			if(!(dev->slots & (1 << i))) {
-				dev->slots |= (1 << i);
-				mutex_unlock(&dev->lock);
-				return i;
-			}
+	semaphore_down(&dev->slot_sem);
+	unsigned long flags;
+	interrupt_save_and_disable(flags);
+	int i;
+	for (i = 0; i < dev->nr_slots; i++) {
+		if (!(dev->slots & (1 << i))) {
+			dev->slots |= (1 << i);
+			break;
 		}
-		mutex_unlock(&dev->lock);
-		// yield
-        cpu_pause();
-        //task_yield();
 	}
+	interrupt_restore_state(flags);
+	assert(i < dev->nr_slots);
+	return i;
 }
 
 void ahci_port_release_slot(device_extension_t *dev, int slot)
 {
-	mutex_lock(&dev->lock);
+	unsigned long flags;
+	interrupt_save_and_disable(flags);
 	dev->slots &= ~(1 << slot);
-	mutex_unlock(&dev->lock);
+	interrupt_restore_state(flags);
+	semaphore_up(&dev->slot_sem);
 }
 
-/* since a DMA transfer must write to contiguous physical RAM, we need to allocate
- * buffers that allow us to create PRDT entries that do not cross a page boundary.
- * That means that each PRDT entry can transfer a maximum of PAGE_SIZE bytes (for
- * 0x1000 page size, that's 8 sectors). Thus, we allocate a buffer that is page aligned, 
- * in a multiple of PAGE_SIZE, so that the PRDT will write to contiguous physical ram
- * (the key here is that the buffer need not be contiguous across multiple PRDT entries).
+/* PRDT直接使用调用者缓冲区的物理页，只有缓冲区没有按2字节对齐时才使用DMA缓冲区中转。
+ * 多个任务可以同时占用不同的命令槽，使用原生命令队列时磁盘可以重新排序执行。
  */
 int ahci_rw_multiple_do(int rw, int min, uint64_t blk, unsigned char *out_buffer, int count)
 {
-	uint32_t length = count * ATA_SECTOR_SIZE;
 	int d = min;
 	device_extension_t *dev = ports[d];
 	uint64_t end_blk = dev->identify.lba48_addressable_sectors;
@@ -977,33 +1152,39 @@ int ahci_rw_multiple_do(int rw, int min, uint64_t blk, unsigned char *out_buffer
 		count = end_blk - blk;
 	if(!count)
 		return 0;
-    int num_pages = ((ATA_SECTOR_SIZE * (count-1)) / PAGE_SIZE) + 1;
-	assert(length <= (unsigned)num_pages * 0x1000);
+	uint32_t length = count * ATA_SECTOR_SIZE;
 	struct dma_region dma;
-	dma.p.size = 0x1000 * num_pages;
-	dma.p.alignment = 0x1000;
-	dma.flags = DMA_REGION_SPECIAL;
-	dma_alloc_buffer(&dma);
+	addr_t buffer = (addr_t)out_buffer;
+	int bounce = ((addr_t)out_buffer & 1);
+	if (bounce) {
+		int num_pages = ((ATA_SECTOR_SIZE * (count-1)) / PAGE_SIZE) + 1;
+		dma.p.size = 0x1000 * num_pages;
+		dma.p.alignment = 0x1000;
+		dma.flags = DMA_REGION_SPECIAL;
+		if (dma_alloc_buffer(&dma) < 0)
+			return 0;
+		buffer = (addr_t)dma.v;
+		if(rw == 1)
+			memcpy((void *)dma.v, out_buffer, length);
+	}
 	int num_read_blocks = count;
 	struct hba_port *port = (struct hba_port *)&hba_mem->ports[dev->idx];
-	if(rw == 1)
-		memcpy((void *)dma.v, out_buffer, length);
 	
 	int slot=ahci_port_acquire_slot(dev);
-	if(!ahci_port_dma_data_transfer(hba_mem, port, dev, slot, rw == 1 ? 1 : 0, (addr_t)dma.v, count, blk))
+	if(!ahci_port_dma_data_transfer(hba_mem, port, dev, slot, rw == 1 ? 1 : 0, buffer, count, blk))
 		num_read_blocks = 0;
 	
 	ahci_port_release_slot(dev, slot);
 	
-	if(rw == 0 && num_read_blocks) {
-		memcpy(out_buffer, (void *)dma.v, length);
+	if (bounce) {
+		if(rw == 0 && num_read_blocks)
+			memcpy(out_buffer, (void *)dma.v, length);
+		dma_free_buffer(&dma);
 	}
-		
-	dma_free_buffer(&dma);
 	return num_read_blocks * ATA_SECTOR_SIZE;
 }
 
-/* and then since there is a maximum transfer amount because of the page size
+/* and then since there is a maximum transfer amount because of the prdt entry
  * limit, wrap the transfer function to allow for bigger transfers than that even.
  */
 int ahci_rw_multiple(int rw, int min, uint64_t blk, unsigned char *out_buffer, int count)
@@ -1011,12 +1192,15 @@ int ahci_rw_multiple(int rw, int min, uint64_t blk, unsigned char *out_buffer, i
 	int i=0;
 	int ret=0;
 	int c = count;
-	for(i=0;i<count;i+=(PRDT_MAX_ENTRIES * PRDT_MAX_COUNT) / ATA_SECTOR_SIZE)
+	for(i=0;i<count;i+=AHCI_MAX_SECTORS_PER_CMD)
 	{
-		int n = (PRDT_MAX_ENTRIES * PRDT_MAX_COUNT) / ATA_SECTOR_SIZE;
+		int n = AHCI_MAX_SECTORS_PER_CMD;
 		if(n > c)
 			n=c;
-		ret += ahci_rw_multiple_do(rw, min, blk+i, out_buffer + ret, n);
+		int done = ahci_rw_multiple_do(rw, min, blk+i, out_buffer + ret, n);
+		if (done <= 0)
+			break;
+		ret += done;
 		c -= n;
 	}
 	return ret;
@@ -1092,8 +1276,9 @@ iostatus_t ahci_read(device_object_t *device, io_request_t *ioreq)
     } else {
         off = ioreq->parame.read.offset;
     }
+    void *buffer = ioreq->mdl_address ? MDL_GET_MAPPED_VADDR(ioreq->mdl_address) : ioreq->system_buffer;
     len = ahci_read_sector(device->device_extension, off,
-        ioreq->system_buffer, sectors);
+        buffer, sectors);
     if (!len) { /* 执行失败 */
         status = IO_FAILED;
         len = 0;
@@ -1124,8 +1309,9 @@ iostatus_t ahci_write(device_object_t *device, io_request_t *ioreq)
     } else {
         off = ioreq->parame.write.offset;
     }
+    void *buffer = ioreq->mdl_address ? MDL_GET_MAPPED_VADDR(ioreq->mdl_address) : ioreq->system_buffer;
     len = ahci_write_sector(device->device_extension, off,
-        ioreq->system_buffer, sectors);
+        buffer, sectors);
     
     if (!len) { /* 执行失败 */
         status = IO_FAILED;
@@ -1147,18 +1333,21 @@ iostatus_t ahci_write(device_object_t *device, io_request_t *ioreq)
  */
 static int ahci_handler(irqno_t irq, void *data)
 {
-    int intrhandled = IRQ_NEXTONE;
-    int i;
-	for(i=0;i<32;i++) {
-		if(hba_mem->interrupt_status & (1 << i)) {
-            dbgprint("ahci: interrupt %d occur!\n", i);
-			hba_mem->ports[i].interrupt_status = ~0;
-			hba_mem->interrupt_status = (1 << i);
-			ahci_flush_commands((struct hba_port *)&hba_mem->ports[i]);
-            intrhandled = IRQ_HANDLED;
-		}
+	uint32_t pending = hba_mem->interrupt_status;
+	if (!pending)
+		return IRQ_NEXTONE;
+	/* 只处理有中断的端口，先清除端口的中断状态再清除全局的 */
+	while (pending) {
+		int i = __builtin_ctz(pending);
+		pending &= pending - 1;
+		struct hba_port *port = (struct hba_port *)&hba_mem->ports[i];
+		uint32_t pis = port->interrupt_status;
+		port->interrupt_status = pis;
+		if (ports[i])
+			ahci_port_complete(ports[i], port, pis);
+		hba_mem->interrupt_status = (1 << i);
 	}
-    return intrhandled;
+    return IRQ_HANDLED;
 }
 
 static iostatus_t ahci_enter(driver_object_t *driver)
@@ -5,12 +5,20 @@
 #include <xbook/softirq.h>
 
 #include <xbook/driver.h>
+#include <xbook/mdl.h>
 #include <string.h>
 #include <xbook/clock.h>
 #include <arch/io.h>
 #include <xbook/hardirq.h>
 #include <arch/cpu.h>
 #include <xbook/memalloc.h>
+#include <xbook/mutexlock.h>
+#include <xbook/dma.h>
+#include <xbook/task.h>
+#include <xbook/schedule.h>
+#include <xbook/bitops.h>
+#include <arch/pci.h>
+#include <arch/page.h>
 #include <sys/ioctl.h>
 #include <stdio.h>
 
@@ -104,6 +112,43 @@
 #define ATA_REG_ALT_STATUS(channel) 	(channel->base + 0x206)
 #define ATA_REG_CTL(channel) 			ATA_REG_ALT_STATUS(channel)
 
+/* 总线主控DMA（BMIDE）寄存器，主通道在BAR4基址，从通道在基址+8 */
+#define BMIDE_REG_CMD(channel)          (channel->bmide + 0)
+#define BMIDE_REG_STATUS(channel)       (channel->bmide + 2)
+#define BMIDE_REG_PRDT(channel)         (channel->bmide + 4)
+
+#define BMIDE_CMD_START     0x01
+#define BMIDE_CMD_READ      0x08    /* 从磁盘读取到内存 */
+
+#define BMIDE_STATUS_ACTIVE 0x01
+#define BMIDE_STATUS_ERR    0x02
+#define BMIDE_STATUS_IRQ    0x04
+
+/* PRD项描述的内存不能跨越64KB边界，字节数为0表示64KB */
+#define BMIDE_PRD_BOUNDARY  0x10000
+#define BMIDE_PRD_EOT       0x8000
+
+/* PRD表占一个页 */
+#define BMIDE_PRD_MAX       (PAGE_SIZE / sizeof(struct ide_prd))
+
+/* 等待DMA完成的超时时间（ticks） */
+#define IDE_DMA_TIMEOUT     (5 * HZ)
+
+/* DMA传输的状态 */
+enum {
+	IDE_DMA_IDLE = 0,
+	IDE_DMA_BUSY,
+	IDE_DMA_DONE,
+	IDE_DMA_ERROR,
+};
+
+/* 物理区域描述符 */
+struct ide_prd {
+	unsigned int addr;
+	unsigned short count;
+	unsigned short flags;
+} __attribute__((packed));
+
 /* 设备寄存器的位 */
 #define BIT_DEV_MBS		0xA0	//bit 7 and 5 are 1
 
@@ -117,11 +162,19 @@
 struct ide_channel {
    	unsigned short base;    // I/O Base.
 	char irqno;		 	// 本通道所用的中断号
-   	struct _device_extension *ext;	// 通道上面的设备
+   	struct _device_extension *ext[2];	// 通道上面的设备
 	char who;		    /* 通道上主磁盘在活动还是从磁盘在活动 */
 	char what;		    /* 执行的是什么操作 */
+	unsigned short bmide;	/* 总线主控DMA寄存器基址，为0表示不支持DMA */
+	struct dma_region prdt;	/* PRD表 */
+	task_t *waiter;			/* 等待DMA完成的任务 */
+	volatile int dma_status;
+	mutexlock_t lock;		/* 主从磁盘共用一个通道，每次只能有一个操作 */
 } channels[2];
 
+/* IDE控制器的总线主控寄存器基址，没有找到时为0 */
+static unsigned short ide_bmide_base = 0;
+
 typedef struct _device_extension {
     string_t device_name;           /* 设备名字 */
     device_object_t *device_object; /* 设备对象 */
@@ -135,6 +188,7 @@ typedef struct _device_extension {
 	unsigned int capabilities;// Features.
 	unsigned int command_sets; // Command Sets Supported.
 	unsigned int size;		// Size in Sectors.
+	unsigned char dma;		// 是否使用DMA传输
 
     unsigned long rwoffset; // 读写偏移位置
 	/* 状态信息 */
@@ -756,8 +810,8 @@ static void select_sector(device_extension_t *ext,
 	if (mode == 2) {
 		out8(ATA_REG_FEATURE(channel), 0); // PIO mode.
 
-		/* 写入要读写的扇区数*/
-		out8(ATA_REG_SECTOR_CNT(channel), 0);
+		/* 写入要读写的扇区数高8位 */
+		out8(ATA_REG_SECTOR_CNT(channel), (count >> 8) & 0xff);
 
 		/* 写入lba地址24~47位(即扇区号) */
 		out8(ATA_REG_SECTOR_LOW(channel), lbaIO[3]);
@@ -904,10 +958,7 @@ static int pio_data_transfer(device_extension_t *ext,
 			buf += SECTOR_SIZE;
             //keprint("write success! ");
 		}
-		/* 刷新写缓冲区 */
-		out8(ATA_REG_CMD(ext->channel), mode > 1 ?
-			ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
-		ide_polling(ext->channel, 0);
+		/* 写缓存由DISKIO_SYNC统一刷新，不再每次写入后刷新 */
 	}
 #ifdef DEBUG_DRV
         keprint("PIO read done\n");
@@ -915,6 +966,82 @@ static int pio_data_transfer(device_extension_t *ext,
 	return 0;
 }
 
+/**
+ * ide_dma_setup - 根据缓冲区填写PRD表
+ * @channel: 通道
+ * @buf: 缓冲区
+ * @size: 字节数
+ * 
+ * 每个页单独转换物理地址，物理地址连续并且不跨越64KB边界的页合并成一项。
+ * 成功返回0，缓冲区不能用于DMA时返回-1，调用者改用PIO传输
+ */
+static int ide_dma_setup(struct ide_channel *channel, void *buf, unsigned int size)
+{
+	struct ide_prd *prd = (struct ide_prd *)channel->prdt.v;
+	struct ide_prd *last = NULL;
+	addr_t vaddr = (addr_t)buf;
+	unsigned int start = 0, next = 0;
+	int n = 0;
+	/* 控制器每次传输一个字 */
+	if ((vaddr & 1) || (size & 1))
+		return -1;
+	while (size > 0) {
+		addr_t paddr = addr_vir2phy(vaddr);
+		unsigned int chunk = PAGE_SIZE - (vaddr & (PAGE_SIZE - 1));
+		if (chunk > size)
+			chunk = size;
+		if (last && paddr == next &&
+			(start & ~(BMIDE_PRD_BOUNDARY - 1)) == ((paddr + chunk - 1) & ~(BMIDE_PRD_BOUNDARY - 1))) {
+			last->count += chunk;
+		} else {
+			if (n >= BMIDE_PRD_MAX)
+				return -1;
+			last = &prd[n++];
+			last->addr = low32(paddr);
+			last->count = chunk;
+			last->flags = 0;
+			start = paddr;
+		}
+		next = paddr + chunk;
+		vaddr += chunk;
+		size -= chunk;
+	}
+	last->flags = BMIDE_PRD_EOT;
+	out32(BMIDE_REG_PRDT(channel), channel->prdt.p.address);
+	return 0;
+}
+
+/**
+ * ide_dma_wait - 启动DMA并等待完成
+ * @channel: 通道
+ * @rw: 传输方向（读，写）
+ * 
+ * 命令已经发送给磁盘，启动总线主控后睡眠，由中断处理函数唤醒。
+ * 成功返回0，失败返回非0
+ */
+static int ide_dma_wait(struct ide_channel *channel, unsigned char rw)
+{
+	unsigned char cmd = (rw == IDE_READ) ? BMIDE_CMD_READ : 0;
+	unsigned long flags;
+	interrupt_save_and_disable(flags);
+	channel->dma_status = IDE_DMA_BUSY;
+	channel->waiter = task_current;
+	out8(BMIDE_REG_CMD(channel), cmd | BMIDE_CMD_START);
+	clock_t left = IDE_DMA_TIMEOUT;
+	while (channel->dma_status == IDE_DMA_BUSY && left > 0)
+		left = task_sleep_by_ticks(left);
+	int status = channel->dma_status;
+	channel->dma_status = IDE_DMA_IDLE;
+	channel->waiter = NULL;
+	interrupt_restore_state(flags);
+	if (status == IDE_DMA_DONE)
+		return 0;
+	/* 停止总线主控，清除状态 */
+	out8(BMIDE_REG_CMD(channel), 0);
+	out8(BMIDE_REG_STATUS(channel), BMIDE_STATUS_ERR | BMIDE_STATUS_IRQ);
+	return status == IDE_DMA_BUSY ? 5 : 2;
+}
+
 /**
  * ata_type_transfer - ATA类型数据传输
  * @dev: 设备
@@ -940,15 +1067,14 @@ static int ata_type_transfer(device_extension_t *ext,
 
 	struct ide_channel *channel = ext->channel;
 
-   	unsigned char head, err;
+   	unsigned char head, err = 0;
 
 	/* 要去操作的扇区数 */
 	unsigned int todo;
 	/* 已经完成的扇区数 */
 	unsigned int done = 0;
 	
-    /* 同步锁加锁 */
-	//SyncLock(&channel->lock);
+	mutex_lock(&channel->lock);
 
 	/* 保存读写操作 */
 	channel->what = rw;
@@ -963,8 +1089,10 @@ static int ata_type_transfer(device_extension_t *ext,
 			todo = count - done;
 		}
 
-		/* 选择传输模式（PIO或DMA） */
-		dma = 0; // We don't support DMA
+		/* 选择传输模式（PIO或DMA），缓冲区不能用于DMA时使用PIO */
+		dma = 0;
+		if (ext->dma && !ide_dma_setup(channel, _buf, todo * SECTOR_SIZE))
+			dma = 1;
 
 		/* 选择寻址模式 */
 		// (I) Select one from LBA28, LBA48 or CHS;
@@ -977,7 +1105,7 @@ static int ata_type_transfer(device_extension_t *ext,
 		select_disk(ext, mode, head);
 
 		/* 填写参数，扇区和扇区数 */
-		select_sector(ext, mode, lbaIO, count);
+		select_sector(ext, mode, lbaIO, todo);
 
 		/* 等待磁盘控制器处于准备状态 */
 		while (!(in8(ATA_REG_STATUS(channel)) & ATA_STATUS_READY)) cpu_idle();
@@ -999,23 +1127,44 @@ static int ata_type_transfer(device_extension_t *ext,
 
 		/* 根据不同的模式传输数据 */
 		if (dma) {	/* DMA模式 */
-			if (rw == IDE_READ) {
-				// DMA Read.
-			} else {
-				// DMA Write.
+			err = ide_dma_wait(channel, rw);
+			if (err) {
+				rest_driver(ext);
+				break;
 			}
 		} else {
 			/* PIO模式数据传输 */
-			if ((err = pio_data_transfer(ext, rw, mode, _buf, todo))) {
-				return err;
-			}
-			_buf += todo * SECTOR_SIZE;
-			done += todo;
+			if ((err = pio_data_transfer(ext, rw, mode, _buf, todo)))
+				break;
 		}
+		if (rw == IDE_READ)
+			ext->read_sectors += todo;
+		else
+			ext->write_sectors += todo;
+		_buf += todo * SECTOR_SIZE;
+		done += todo;
 	}
 
-	//SyncUnlock(&channel->lock);
-	return 0;
+	mutex_unlock(&channel->lock);
+	return err;
+}
+
+/**
+ * ide_flush_cache - 把磁盘写缓存中的数据写入盘片
+ * @ext: 设备
+ */
+static int ide_flush_cache(device_extension_t *ext)
+{
+	struct ide_channel *channel = ext->channel;
+	mutex_lock(&channel->lock);
+	channel->what = 0;
+	while (in8(ATA_REG_STATUS(channel)) & ATA_STATUS_BUSY) cpu_idle();
+	select_disk(ext, 1, 0);
+	send_cmd(channel, (ext->command_sets & (1 << 26)) ?
+		ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+	int err = ide_polling(channel, 0);
+	mutex_unlock(&channel->lock);
+	return err;
 }
 
 /**
@@ -1038,15 +1187,11 @@ static int ide_read_sector(device_extension_t *ext,
         errprint(PRINT_ERR "ide_read_sector: out of range!\n");
 		return -1;
 	} else {
-		unsigned char *_buf = (unsigned char *)buf;
-		int i;
-		for (i = 0; i < count; i++) {
-			error = ata_type_transfer(ext, IDE_READ, lba + i, 1, _buf + i * SECTOR_SIZE);
-			/* 打印驱动错误信息 */
-			if(ide_print_error(ext, error)) {
-				keprint(PRINT_ERR "ide_read_sector: ide read error!\n");
-				return -1;
-			}
+		error = ata_type_transfer(ext, IDE_READ, lba, count, buf);
+		/* 打印驱动错误信息 */
+		if(ide_print_error(ext, error)) {
+			keprint(PRINT_ERR "ide_read_sector: ide read error!\n");
+			return -1;
 		}
 	}
 	return 0;
@@ -1072,15 +1217,11 @@ static int ide_write_sector(
 		errprint(PRINT_ERR "ide_write_sector: out of range!\n");
 		return -1;
 	} else {
-		unsigned char *_buf = (unsigned char *)buf;
-		int i;
-		for (i = 0; i < count; i++) {
-			error = ata_type_transfer(ext, IDE_WRITE, lba + i, 1, _buf + i * SECTOR_SIZE);
-			/* 打印驱动错误信息 */
-			if(ide_print_error(ext, error)) {
-				keprint(PRINT_ERR "ide_write_sector: ide write error!\n");
-				return -1;
-			}
+		error = ata_type_transfer(ext, IDE_WRITE, lba, count, buf);
+		/* 打印驱动错误信息 */
+		if(ide_print_error(ext, error)) {
+			keprint(PRINT_ERR "ide_write_sector: ide write error!\n");
+			return -1;
 		}
 	}
 	return 0;
@@ -1149,6 +1290,12 @@ iostatus_t ide_devctl(device_object_t *device, io_request_t *ioreq)
     case DISKIO_GETOFF:
         *((unsigned long *) arg) = ext->rwoffset;
         break;
+    case DISKIO_SYNC:
+        if (ide_flush_cache(ext)) {
+            infomation = -1;
+            status = IO_FAILED;
+        }
+        break;
     default:
         infomation = -1;
         status = IO_FAILED;
@@ -1177,8 +1324,9 @@ iostatus_t ide_read(device_object_t *device, io_request_t *ioreq)
     } else {
         off = ioreq->parame.read.offset;
     }
+    void *buffer = ioreq->mdl_address ? MDL_GET_MAPPED_VADDR(ioreq->mdl_address) : ioreq->system_buffer;
     len = ide_read_sector(device->device_extension, off,
-        ioreq->system_buffer, sectors);
+        buffer, sectors);
     if (!len) { /* 执行成功 */
         len = sectors * SECTOR_SIZE;
     } else {
@@ -1210,8 +1358,9 @@ iostatus_t ide_write(device_object_t *device, io_request_t *ioreq)
     } else {
         off = ioreq->parame.write.offset;
     }
+    void *buffer = ioreq->mdl_address ? MDL_GET_MAPPED_VADDR(ioreq->mdl_address) : ioreq->system_buffer;
     len = ide_write_sector(device->device_extension, off,
-        ioreq->system_buffer, sectors);
+        buffer, sectors);
     if (!len) { /* 执行成功 */
         len = sectors * SECTOR_SIZE;
     } else {
@@ -1228,22 +1377,73 @@ iostatus_t ide_write(device_object_t *device, io_request_t *ioreq)
 static int ide_handler(irqno_t irq, void *data)
 {
     struct ide_channel *channel = (struct ide_channel *)data;
-	device_extension_t *ext = channel->ext + channel->who;
-
+	device_extension_t *ext = channel->ext[(int)channel->who];
+
+	if (channel->dma_status == IDE_DMA_BUSY) {
+		unsigned char bm_status = in8(BMIDE_REG_STATUS(channel));
+		if (!(bm_status & BMIDE_STATUS_IRQ))
+			return 0;
+		/* 停止总线主控，读取状态寄存器清除磁盘的中断 */
+		out8(BMIDE_REG_CMD(channel), 0);
+		unsigned char state = in8(ATA_REG_STATUS(channel));
+		out8(BMIDE_REG_STATUS(channel), BMIDE_STATUS_ERR | BMIDE_STATUS_IRQ);
+		if ((bm_status & BMIDE_STATUS_ERR) || (state & (ATA_STATUS_ERR | ATA_STATUS_DF)))
+			channel->dma_status = IDE_DMA_ERROR;
+		else
+			channel->dma_status = IDE_DMA_DONE;
+		if (channel->waiter)
+			task_wakeup(channel->waiter);
+		return 0;
+	}
     
 	/* 获取状态，做出错判断 */
 	if (in8(ATA_REG_STATUS(channel)) & ATA_STATUS_ERR) {
 		/* 尝试重置驱动 */
-		rest_driver(ext);
+		if (ext)
+			rest_driver(ext);
 	}
+    return 0;
+}
 
-	/* 可以在这里面做一些统计信息 */
-	if (channel->what == IDE_READ) {
-		ext->read_sectors++;
-	} else if (channel->what == IDE_WRITE) {
-		ext->write_sectors++;
+/**
+ * ide_dma_probe - 查找PCI IDE控制器的总线主控寄存器
+ */
+static void ide_dma_probe()
+{
+	pci_device_t *pci = pci_locate_class(0x1, 0x1);
+	if (!pci)
+		return;
+	/* 编程接口的第7位表示支持总线主控 */
+	if (!(pci->class_code & 0x80) || pci->bar[4].type != PCI_BAR_TYPE_IO)
+		return;
+	pci_enable_bus_mastering(pci);
+	ide_bmide_base = pci->bar[4].base_addr & ~3;
+	keprint(PRINT_INFO "[ide]: bus master dma at %x\n", ide_bmide_base);
+}
+
+/**
+ * ide_channel_init - 初始化通道的DMA
+ * @channel: 通道
+ * @channelno: 通道号
+ */
+static void ide_channel_init(struct ide_channel *channel, int channelno)
+{
+	channel->bmide = 0;
+	channel->waiter = NULL;
+	channel->dma_status = IDE_DMA_IDLE;
+	mutexlock_init(&channel->lock);
+	if (!ide_bmide_base || channel->prdt.v)
+		return;
+	channel->prdt.p.size = PAGE_SIZE;
+	channel->prdt.p.alignment = PAGE_SIZE;
+	channel->prdt.flags = DMA_REGION_SPECIAL;
+	if (dma_alloc_buffer(&channel->prdt) < 0) {
+		channel->prdt.v = 0;
+		return;
 	}
-    return 0;
+	channel->bmide = ide_bmide_base + channelno * 8;
+	out8(BMIDE_REG_CMD(channel), 0);
+	out8(BMIDE_REG_STATUS(channel), BMIDE_STATUS_ERR | BMIDE_STATUS_IRQ);
 }
 
 static int ide_probe(device_extension_t *ext, int id)
@@ -1270,6 +1470,7 @@ static int ide_probe(device_extension_t *ext, int id)
     channel->what = 0;
 
     if (diskno == 0) {  /* 通道上第一个磁盘的时候才注册中断 */
+        ide_channel_init(channel, channelno);
         /* 注册中断 */
         char irqname[32] = {0};
         sprintf(irqname, "hd channel%d", channelno);
@@ -1280,7 +1481,7 @@ static int ide_probe(device_extension_t *ext, int id)
     dump_ide_channel(channel);
 #endif
 
-    channel->ext = ext;
+    channel->ext[diskno] = ext;
 
     /* 填写设备信息 */
     ext->channel = channel;
@@ -1340,6 +1541,9 @@ static int ide_probe(device_extension_t *ext, int id)
 
     ext->capabilities = ext->info->Capabilities0;
     ext->signature = ext->info->General_Config;
+    /* 控制器支持总线主控并且磁盘支持DMA时使用DMA传输 */
+    ext->dma = (channel->bmide && (ext->capabilities & (1 << 8))) ? 1 : 0;
+    ext->read_sectors = ext->write_sectors = 0;
     ext->reserved = 1;	/* 设备存在 */
     ext->rwoffset = 0;
 #ifdef DEBUG_DRV
@@ -1366,6 +1570,7 @@ static iostatus_t ide_enter(driver_object_t *driver)
 	 */
 	unsigned char disk_foud = *((unsigned char *)IDE_DISK_NR_ADDR);
 	keprint(PRINT_INFO "ide_enter: found %d hard disks.\n", disk_foud);
+	ide_dma_probe();
 
 	/* 有磁盘才初始化磁盘 */
 	if (disk_foud > 0) {    
@@ -1378,8 +1583,8 @@ static iostatus_t ide_enter(driver_object_t *driver)
                 keprint(PRINT_ERR "ide_enter: create device failed!\n");
                 return status;
             }
-            /* buffered io mode */
-            devobj->flags = DO_BUFFERED_IO;
+            /* direct io mode */
+            devobj->flags = DO_DIRECT_IO;
 
             devext = (device_extension_t *)devobj->device_extension;
             string_new(&devext->device_name, devname, DEVICE_NAME_LEN);
@@ -1416,6 +1621,8 @@ static iostatus_t ide_exit(driver_object_t *driver)
         if (ext->drive == 0) {  /* 通道上第一个磁盘的时候才注销中断 */
             /* 注销中断 */
     		irq_unregister(ext->channel->irqno, ext->channel);
+            if (ext->channel->prdt.v)
+                dma_free_buffer(&ext->channel->prdt);
         }
         
         io_delete_device(devobj);   /* 删除每一个设备 */
@@ -120,10 +120,62 @@ enum CtrlModeBits {
 #define TIMER_FREQ     1193180 	/* 时钟的频率 */
 #define COUNTER0_VALUE  (TIMER_FREQ / HZ)	    /* pit count0 数值 */
 
-void pit_clock_init()
+/* 一次性模式下16位计数器最多能计数的ticks */
+#define PIT_ONESHOT_MAX_TICKS   (0xffff / COUNTER0_VALUE)
+
+static unsigned int pit_oneshot_count = 0;     /* 一次性模式设置的计数值 */
+static unsigned int pit_count_remainder = 0;   /* 不足1个tick的计数，累积起来避免时间丢失 */
+
+/* 周期模式（模式2），每个tick产生一次中断 */
+void pit_clock_periodic()
 {
 	ioport_out8(PIT_CTRL, PIT_MODE_2 | PIT_MODE_MSB_LSB | 
             PIT_MODE_COUNTER_0 | PIT_MODE_BINARY);
 	ioport_out8(PIT_COUNTER0, (unsigned char) (COUNTER0_VALUE & 0xff));
 	ioport_out8(PIT_COUNTER0, (unsigned char) (COUNTER0_VALUE >> 8) & 0xff);   
 }
+
+/**
+ * pit_clock_oneshot - 一次性模式（模式0），计数到0时产生一次中断
+ * @ticks: 多少个tick后产生中断
+ * 
+ * 返回实际设置的ticks，受16位计数器限制
+ */
+clock_t pit_clock_oneshot(clock_t ticks)
+{
+	if (ticks > PIT_ONESHOT_MAX_TICKS)
+		ticks = PIT_ONESHOT_MAX_TICKS;
+	pit_oneshot_count = ticks * COUNTER0_VALUE;
+	ioport_out8(PIT_CTRL, PIT_MODE_0 | PIT_MODE_MSB_LSB | 
+            PIT_MODE_COUNTER_0 | PIT_MODE_BINARY);
+	ioport_out8(PIT_COUNTER0, (unsigned char) (pit_oneshot_count & 0xff));
+	ioport_out8(PIT_COUNTER0, (unsigned char) (pit_oneshot_count >> 8) & 0xff);
+	return ticks;
+}
+
+/**
+ * pit_clock_elapsed - 一次性模式启动后经过的ticks
+ * 
+ * 计数到0后计数器会从0xffff继续递减，这时按设置的计数值计算
+ */
+clock_t pit_clock_elapsed()
+{
+	ioport_out8(PIT_CTRL, PIT_MODE_COUNTER_0 | PIT_MODE_LPCV);
+	unsigned int count = ioport_in8(PIT_COUNTER0);
+	count |= ioport_in8(PIT_COUNTER0) << 8;
+	unsigned int elapsed = pit_oneshot_count;
+	if (count <= pit_oneshot_count)
+		elapsed -= count;
+	pit_count_remainder += elapsed % COUNTER0_VALUE;
+	clock_t ticks = elapsed / COUNTER0_VALUE;
+	if (pit_count_remainder >= COUNTER0_VALUE) {
+		pit_count_remainder -= COUNTER0_VALUE;
+		ticks++;
+	}
+	return ticks;
+}
+
+void pit_clock_init()
+{
+	pit_clock_periodic();
+}
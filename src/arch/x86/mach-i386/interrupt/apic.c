@@ -0,0 +1,205 @@
+#include <xbook/config.h>
+
+#ifdef CONFIG_SMP
+#include <arch/apic.h>
+#include <arch/acpi.h>
+#include <arch/interrupt.h>
+#include <arch/page.h>
+#include <arch/cpu.h>
+#include <xbook/hardirq.h>
+#include <xbook/virmem.h>
+#include <xbook/debug.h>
+#include <xbook/clock.h>
+
+/* 
+ * local apic和io apic。
+ * 开启后isa中断通过io apic投递到启动处理器，8259A被全部屏蔽，
+ * 中断号和向量号的对应关系和8259A一样，其它代码不需要改变。
+ */
+
+int apic_enabled = 0;
+
+static volatile unsigned int *lapic_base = NULL;
+static volatile unsigned int *ioapic_base = NULL;
+static int ioapic_pins;
+
+static inline unsigned int lapic_read(unsigned int reg)
+{
+    return lapic_base[reg >> 2];
+}
+
+static inline void lapic_write(unsigned int reg, unsigned int value)
+{
+    lapic_base[reg >> 2] = value;
+    (void) lapic_base[LAPIC_ID >> 2]; /* 读一次等待写入完成 */
+}
+
+static inline unsigned int ioapic_read(unsigned int reg)
+{
+    ioapic_base[IOAPIC_REGSEL >> 2] = reg;
+    return ioapic_base[IOAPIC_WINDOW >> 2];
+}
+
+static inline void ioapic_write(unsigned int reg, unsigned int value)
+{
+    ioapic_base[IOAPIC_REGSEL >> 2] = reg;
+    ioapic_base[IOAPIC_WINDOW >> 2] = value;
+}
+
+int lapic_get_id()
+{
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi()
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/* 初始化当前处理器的local apic，每个处理器都要调用 */
+void lapic_init()
+{
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    /* 清除错误状态，需要连续写两次 */
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_EOI, 0);
+    lapic_write(LAPIC_TPR, 0);
+}
+
+/**
+ * lapic_send_ipi - 发送处理器间中断
+ * @apicid: 目标处理器的local apic id
+ * @command: 中断命令
+ * 
+ * 等待中断发送完成，成功返回0，超时返回-1
+ */
+int lapic_send_ipi(int apicid, unsigned int command)
+{
+    /* ICR分两次写入，中间不能被打断 */
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    lapic_write(LAPIC_ICR_HIGH, apicid << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    int timeout = 100000;
+    while ((lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) && --timeout > 0)
+        ;
+    interrupt_restore_state(flags);
+    return timeout > 0 ? 0 : -1;
+}
+
+/**
+ * lapic_timer_calibrate - 用系统时钟校准local apic时钟
+ * 
+ * local apic时钟的频率和总线有关，需要开中断后在启动处理器上调用。
+ * 返回一个tick对应的计数值
+ */
+unsigned int lapic_timer_calibrate()
+{
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    /* 从一个tick的开始计数 */
+    clock_t start = systicks;
+    while (systicks == start)
+        cpu_pause();
+    start = systicks;
+    lapic_write(LAPIC_TIMER_INITCNT, 0xffffffff);
+    while (systicks - start < 10)
+        cpu_pause();
+    unsigned int count = 0xffffffff - lapic_read(LAPIC_TIMER_CURCNT);
+    lapic_write(LAPIC_TIMER_INITCNT, 0);
+    return count / 10;
+}
+
+/* 以周期模式启动当前处理器的local apic时钟，每个tick产生一次中断 */
+void lapic_timer_start(unsigned int count)
+{
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITCNT, count);
+}
+
+static unsigned int ioapic_irq_pin(irqno_t irq)
+{
+    return acpi_madt_info.isa_gsi[irq] - acpi_madt_info.ioapic_gsi_base;
+}
+
+static void ioapic_enable(irqno_t irq)
+{
+    if (irq >= ACPI_ISA_IRQ_NR)
+        return;
+    unsigned int reg = IOAPIC_REG_REDTBL + ioapic_irq_pin(irq) * 2;
+    ioapic_write(reg, ioapic_read(reg) & ~IOAPIC_REDTBL_MASKED);
+}
+
+static void ioapic_disable(irqno_t irq)
+{
+    if (irq >= ACPI_ISA_IRQ_NR)
+        return;
+    unsigned int reg = IOAPIC_REG_REDTBL + ioapic_irq_pin(irq) * 2;
+    ioapic_write(reg, ioapic_read(reg) | IOAPIC_REDTBL_MASKED);
+}
+
+static void ioapic_ack(irqno_t irq)
+{
+    lapic_eoi();
+}
+
+/**
+ * 把isa中断重定向到启动处理器，向量号和8259A的一样。
+ * 按照MADT中的中断源覆盖设置极性和触发方式，默认是高电平边沿触发。
+ */
+static void ioapic_route_isa_irqs(int apicid)
+{
+    int irq;
+    for (irq = 0; irq < ACPI_ISA_IRQ_NR; irq++) {
+        unsigned int pin = ioapic_irq_pin(irq);
+        if (pin >= ioapic_pins)
+            continue;
+        unsigned int low = (IRQ_OFF_IN_IDT + irq) | IOAPIC_REDTBL_MASKED;
+        word flags = acpi_madt_info.isa_flags[irq];
+        if ((flags & 0x03) == 0x03)
+            low |= IOAPIC_REDTBL_LOW;
+        if (((flags >> 2) & 0x03) == 0x03)
+            low |= IOAPIC_REDTBL_LEVEL;
+        ioapic_write(IOAPIC_REG_REDTBL + pin * 2 + 1, apicid << 24);
+        ioapic_write(IOAPIC_REG_REDTBL + pin * 2, low);
+    }
+}
+
+/**
+ * apic_init - 初始化启动处理器的local apic和io apic
+ * 
+ * 需要在注册中断之前调用，成功后中断控制器切换成io apic。
+ * 没有apic时返回-1，继续使用8259A
+ */
+int apic_init()
+{
+    if (!acpi_madt_info.lapic_addr || !acpi_madt_info.ioapic_addr) {
+        keprint(PRINT_WARING "[apic]: no apic found, use 8259A.\n");
+        return -1;
+    }
+    lapic_base = memio_remap(acpi_madt_info.lapic_addr, PAGE_SIZE);
+    ioapic_base = memio_remap(acpi_madt_info.ioapic_addr, PAGE_SIZE);
+    if (!lapic_base || !ioapic_base) {
+        keprint(PRINT_ERR "[apic]: remap apic registers failed!\n");
+        return -1;
+    }
+    lapic_init();
+    ioapic_pins = ((ioapic_read(IOAPIC_REG_VERSION) >> 16) & 0xff) + 1;
+    ioapic_route_isa_irqs(lapic_get_id());
+
+    /* 8259A在pic_init中已经全部屏蔽，之后的中断都由io apic处理 */
+    interrupt_controller.enable = ioapic_enable;
+    interrupt_controller.disable = ioapic_disable;
+    interrupt_controller.ack = ioapic_ack;
+    cpu_attach(lapic_get_id());
+    apic_enabled = 1;
+    keprint(PRINT_INFO "[apic]: lapic id %d, ioapic with %d pins\n", lapic_get_id(), ioapic_pins);
+    return 0;
+}
+#endif  /* CONFIG_SMP */
@@ -7,6 +7,12 @@ extern syscalls
 extern exception_check
 extern syscall_check
 extern syscall_dispatch
+extern sysenter_frame_fixup
+extern smp_lock_kernel
+extern smp_unlock_kernel_on_exit
+extern smp_tlb_ipi_handler
+extern smp_resched_ipi_handler
+extern smp_timer_handler
 
 [bits 32]
 [section .text]
@@ -58,6 +64,23 @@ INTERRUPT_ENTRY 0x2c,NO_ERROR_CODE	;ps/2鼠标
 INTERRUPT_ENTRY 0x2d,NO_ERROR_CODE	;fpu浮点单元异常
 INTERRUPT_ENTRY 0x2e,NO_ERROR_CODE	;硬盘
 INTERRUPT_ENTRY 0x2f,NO_ERROR_CODE	;保留
+IPI_ENTRY 0xf1,smp_resched_ipi_handler	;重新调度
+IPI_ENTRY 0xf2,smp_timer_handler	;local apic时钟
+
+;tlb刷新的处理器间中断，发出请求的处理器持有大内核锁，这里不能再获取
+global ipi_entry0xf0
+ipi_entry0xf0:
+    push ds
+    push es
+    pushad
+    mov ax, ss
+    mov ds, ax
+    mov es, ax
+    call smp_tlb_ipi_handler
+    popad
+    pop es
+    pop ds
+    iretd
 
 ;系统调用中断
 [bits 32]
@@ -81,6 +104,9 @@ syscall_handler:
     mov fs, ax
 	mov gs, ax
     pop eax
+
+    call smp_lock_kernel
+    mov eax, [esp + 7*4]    ; 恢复被调用破坏的系统调用号
     
    	push 0x40			; 此位置压入0x40也是为了保持统一的栈格式
     
@@ -109,8 +135,108 @@ syscall_handler:
     pop eax
     jmp .check_exception
 
+;快速系统调用入口，用户态通过sysenter进入
+;进入时esp指向tss.esp0，用户的ebp指向用户栈上保存的返回地址、ebp、edx、ecx
+global sysenter_handler
+sysenter_handler:
+    mov esp, [esp]          ; 切换到当前任务的内核栈
+
+    ;1 构建和中断一样的栈格式，ss、esp、eflags、cs、eip稍后填写
+    push 0                  ; ss
+    push 0                  ; esp
+    pushfd                  ; eflags
+    push 0                  ; cs
+    push 0                  ; eip
+    push 0                  ; error_code
+
+    push ds
+    push es
+    push fs
+    push gs
+    pushad
+
+    push eax
+    mov ax, ss
+	mov ds, ax
+	mov es, ax
+    mov fs, ax
+	mov gs, ax
+    pop eax
+
+    call smp_lock_kernel
+
+    push 0x40
+
+    sti
+
+    ;2 从用户栈读取返回地址和被sysenter占用的寄存器
+    push esp
+    call sysenter_frame_fixup
+    add esp, 4
+
+    ; 记录返回地址和用户栈，C函数会保留esi和edi
+    mov esi, [esp + 14*4]
+    mov edi, [esp + 17*4]
+    cmp eax, 0
+    jne .check_exception
+    mov eax, [esp + 8*4]
+
+    push eax
+    call syscall_check
+    cmp eax, 1
+    je .bad_syscall
+    pop eax
+
+    push esp
+    call syscall_dispatch
+    add esp, 4
+    mov [esp + 8*4], eax
+
+.check_exception:
+    push esp
+    call exception_check
+    add esp, 4
+    cli
+
+    ;3 返回地址或者用户栈被修改（执行新程序、进入异常处理）时，需要通过iretd返回
+    cmp esi, [esp + 14*4]
+    jne interrupt_exit
+    cmp edi, [esp + 17*4]
+    jne interrupt_exit
+
+    push esp
+    call smp_unlock_kernel_on_exit
+    add esp, 4
+
+    add esp, 4              ; 跳过中断号
+    popad
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    mov edx, [esp + 4]      ; edx = eip
+    mov ecx, [esp + 16]     ; ecx = esp
+    push dword [esp + 12]   ; 恢复eflags，暂时不开中断，并清除TF和NT
+    and dword [esp], ~0x4300
+    popfd
+    sti                     ; sti后的一条指令执行完才响应中断
+    sysexit
+
+.bad_syscall:
+    pop eax
+    jmp .check_exception
+
+; local apic的伪中断不需要处理，也不能发送EOI
+global apic_spurious_handler
+apic_spurious_handler:
+    iretd
+
 global interrupt_exit
 interrupt_exit:
+    cli                    ; 释放大内核锁后直到返回都不能被打断
+    push esp
+    call smp_unlock_kernel_on_exit
+    add esp, 4
     add esp, 4			   ; 跳过中断号
     popad
     pop gs
@@ -21,6 +21,8 @@ word SLP_EN;
 word SCI_EN;
 byte PM1_CNT_LEN;
 
+acpi_madt_info_t acpi_madt_info;
+
 // check if the given address has a valid header
 unsigned int *acpi_check_RSDPtr(unsigned int *ptr) {
     char *sig = "RSD PTR ";
@@ -161,12 +163,66 @@ int acpi_enable(void) {
 // (Pkglength bit 6-7 encode additional PkgLength bytes [shouldn't be the case here])
 //
 
+/**
+ * acpi_madt_parse - 从MADT中获取处理器和中断控制器的信息
+ * @rsdt: RSDT的地址
+ * 
+ * 在开启分页前调用，直接访问ACPI表的物理地址。
+ * 成功返回0，没有MADT返回-1，这时只能使用8259A和启动处理器
+ */
+int acpi_madt_parse(unsigned int *rsdt)
+{
+    acpi_madt_info_t *info = &acpi_madt_info;
+    memset(info, 0, sizeof(acpi_madt_info_t));
+    int i;
+    for (i = 0; i < ACPI_ISA_IRQ_NR; i++)
+        info->isa_gsi[i] = i;   /* 默认isa中断一一对应 */
+
+    int entrys = (*(rsdt + 1) - 36) / 4;
+    unsigned int *table = rsdt + 36 / 4;
+    for (; entrys > 0; entrys--, table++) {
+        if (acpi_checkHeader((unsigned int *) *table, "APIC") == 0)
+            break;
+    }
+    if (entrys <= 0)
+        return -1;
+    byte *madt = (byte *) *table;
+    byte *end = madt + *((dword *) madt + 1);
+    info->lapic_addr = *(dword *) (madt + 36);
+    byte *entry;
+    for (entry = madt + 44; entry + 2 <= end && entry[1]; entry += entry[1]) {
+        switch (entry[0]) {
+        case ACPI_MADT_LAPIC:
+            if ((*(dword *) (entry + 4) & ACPI_MADT_LAPIC_ENABLED) &&
+                info->cpu_count < CPU_NR_MAX)
+                info->lapic_ids[info->cpu_count++] = entry[3];
+            break;
+        case ACPI_MADT_IOAPIC:
+            if (!info->ioapic_addr) {   /* 只使用第一个io apic */
+                info->ioapic_addr = *(dword *) (entry + 4);
+                info->ioapic_gsi_base = *(dword *) (entry + 8);
+            }
+            break;
+        case ACPI_MADT_OVERRIDE:
+            if (entry[2] == 0 && entry[3] < ACPI_ISA_IRQ_NR) { /* 只有isa总线 */
+                info->isa_gsi[entry[3]] = *(dword *) (entry + 4);
+                info->isa_flags[entry[3]] = *(word *) (entry + 8);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
+
 int acpi_init(void) {
     unsigned int *ptr = acpi_get_RSDPtr();
 
     // check if address is correct  ( if acpi is available on this pc )
     if (ptr != NULL && acpi_checkHeader(ptr, "RSDT") == 0)
     {
+        acpi_madt_parse(ptr);
         // the RSDT contains an unknown number of pointers to acpi tables
         int entrys = *(ptr + 1);
         entrys = (entrys - 36) /4;
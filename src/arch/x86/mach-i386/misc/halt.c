@@ -2,6 +2,7 @@
 #include <arch/acpi.h>
 #include <arch/io.h>
 #include <xbook/debug.h>
+#include <xbook/bufcache.h>
 
 static void acpi_poweroff() {
     // SCI_EN is set to 1 if acpi poweroff is possible
@@ -24,6 +25,9 @@ void sys_shutdown(void) {
 
     // TODO: Check if Halt OK
 
+    /* 把还没有写回的磁盘缓存写入磁盘 */
+    sys_sync();
+
     // Halt
     halt();
 }
@@ -1,11 +1,15 @@
 #include <arch/misc.h>
 #include <xbook/debug.h>
+#include <xbook/bufcache.h>
 
 void sys_reboot(void) {
     // TODO: Send 'Exit' signal in OS
 
     // TODO: Check if Reboot OK
 
+    /* 把还没有写回的磁盘缓存写入磁盘 */
+    sys_sync();
+
     // Reboot
     reboot();
 }
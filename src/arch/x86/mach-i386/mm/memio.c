@@ -1,6 +1,7 @@
 #include <xbook/debug.h>
 #include <arch/page.h>
 #include <arch/memio.h>
+#include <arch/memory.h>
 
 /**
  * 因为memio是直接映射一个物理地址，因此不需要分配物理页，直接使用指定的页地址即可，释放同理
@@ -12,6 +13,7 @@ int hal_memio_remap(unsigned long paddr, unsigned long vaddr, size_t size)
     while (vaddr < end) {
         /* 添加页面 */
         page_link_addr(vaddr, paddr, PAGE_ATTR_WRITE | PAGE_ATTR_SYSTEM);
+        tlb_flush_one(vaddr);
         vaddr += PAGE_SIZE;
         paddr += PAGE_SIZE;
     }
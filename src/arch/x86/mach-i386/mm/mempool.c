@@ -14,6 +14,7 @@ void mem_node_init(mem_node_t *node, int ref, uint32_t size)
 {
     node->reference = ref;
     node->count = size;
+    node->flags = 0;
     node->cache = NULL;
     node->group = NULL;
     node->section = NULL;
@@ -27,16 +28,22 @@ void mem_section_init(mem_section_t *mem_section, size_t section_size)
     list_init(&mem_section->free_list_head);
 }
 
-void mem_section_setup(mem_section_t *mem_section, mem_node_t *node_base, size_t section_count)  
-{    
-    mem_section->node_count = section_count;
-    int i;
-    for (i = 0; i < section_count; i++) {
-        mem_node_t *next = node_base + i * mem_section->section_size;
-        mem_node_init(next, 0, 0);
-        list_add_tail(&next->list, &mem_section->free_list_head);
-        MEM_NODE_MARK_SECTION(next, mem_section);
-    }
+/* 把空闲块放到对应阶的节中，块的第一个节点记录节和空闲标志 */
+static void mem_section_add_free(mem_section_t *mem_section, mem_node_t *node)
+{
+    node->reference = 0;
+    node->count = mem_section->section_size;
+    MEM_NODE_MARK_SECTION(node, mem_section);
+    MEM_NODE_SET_FREE(node);
+    list_add(&node->list, &mem_section->free_list_head);
+    MEM_SECTION_INC_COUNT(mem_section);
+}
+
+static void mem_section_del_free(mem_section_t *mem_section, mem_node_t *node)
+{
+    list_del_init(&node->list);
+    MEM_NODE_CLEAR_FREE(node);
+    MEM_SECTION_DES_COUNT(mem_section);
 }
 
 mem_range_t *mem_range_get_by_mem_node(mem_node_t *node)
@@ -90,36 +97,19 @@ void mem_range_init(unsigned int idx, unsigned int start, size_t len)
     for (i = 0; i < MEM_SECTION_MAX_NR; i++) {    
         mem_section_init(&mem_range->sections[i], powi(2, i));
     }
-    
-    int section_off = MEM_SECTION_MAX_NR - 1;     
-    size_t section_size = powi(2, section_off);
-    mem_section_t *mem_section;
-    size_t big_sections;
-    size_t small_sections;
-    
-    mem_node_t *node_base = mem_range->node_table;
-    ssize_t pages = mem_range->pages;
-
-    while (pages > 0) {
-        assert(0 <= section_off && section_off < MEM_SECTION_MAX_NR);
-
-        big_sections = pages / section_size;
-        small_sections = pages % section_size;
-        mem_section = &mem_range->sections[section_off];
-        
-        if (big_sections > 0) {
-            mem_section_setup(mem_section, node_base, big_sections);
-            pages -= big_sections * section_size;
-            node_base += big_sections * section_size;
-        } else if (small_sections > 0) {
-            /* 把剩下的所有小的节都放到大小为1的节中。 */
-            mem_section = &mem_range->sections[0];
-            mem_section_setup(mem_section, node_base, small_sections);
-            break;
-        }
-        
-        section_size >>= 1;
-        --section_off;
+    size_t index;
+    for (index = 0; index < mem_range->pages; index++) {
+        mem_node_init(mem_range->node_table + index, 0, 0);
+    }
+    /* 按伙伴对齐切分成尽可能大的块：块的下标必须是块大小的整数倍 */
+    index = 0;
+    while (index < mem_range->pages) {
+        int order = MEM_SECTION_MAX_NR - 1;
+        while (order > 0 && ((index & ((1UL << order) - 1)) ||
+            index + (1UL << order) > mem_range->pages))
+            order--;
+        mem_section_add_free(&mem_range->sections[order], mem_range->node_table + index);
+        index += 1UL << order;
     }
 }
 
@@ -148,46 +138,34 @@ unsigned int mem_node_to_phy_addr(mem_node_t *node)
     return local_addr + mem_range->start; 
 }
 
-int mem_range_split_section(mem_range_t *mem_range, mem_section_t *mem_section)
+/**
+ * 从更高阶的节中拆分出一个指定阶的块，拆分剩下的一半（伙伴）放到低一阶的节中
+ */
+static mem_node_t *mem_range_split_section(mem_range_t *mem_range, int order)
 {
-    if (!mem_range || !mem_section)
-        return 0;
-    /* 已经有节有空闲的节点，成功返回！ */
-    if (!list_empty(&mem_section->free_list_head))
-        return 0;
-
-    mem_section_t *tmp_section = mem_section + 1;
-    mem_section_t *top_section = &mem_range->sections[MEM_SECTION_MAX_NR - 1];
-    while (tmp_section <= top_section) {
-        if (!list_empty(&tmp_section->free_list_head))
-            break;
-        tmp_section++;
-    }
-    
-    if (tmp_section > top_section) {
-        // TODO: 收缩内存
+    int cur_order = order;
+    while (cur_order < MEM_SECTION_MAX_NR && list_empty(&mem_range->sections[cur_order].free_list_head))
+        cur_order++;
+    if (cur_order >= MEM_SECTION_MAX_NR) {
         keprint(PRINT_ERR "mempool: no free section left!\n");
-        return -1;
+        return NULL;
     }
+    mem_section_t *mem_section = &mem_range->sections[cur_order];
+    mem_node_t *node = list_first_owner(&mem_section->free_list_head, mem_node_t, list);
+    mem_section_del_free(mem_section, node);
+    while (cur_order > order) {
+        --cur_order;    // 下降一个节高度
+        mem_section_add_free(&mem_range->sections[cur_order], node + (1UL << cur_order));
+    }
+    return node;
+}
 
-    mem_node_t *node = list_first_owner(&tmp_section->free_list_head, mem_node_t, list);
-    list_del(&node->list);
-    MEM_SECTION_DES_COUNT(tmp_section);
-
-    mem_node_init(node, 1, tmp_section->section_size / 2);
-    
-    mem_node_t *node_half = node + node->count;
-    mem_node_init(node_half, 1, node->count);
-
-    --tmp_section; // 下降一个节高度
-    list_add(&node->list, &tmp_section->free_list_head);
-    list_add(&node_half->list, &tmp_section->free_list_head);
-    MEM_NODE_MARK_SECTION(node, tmp_section);
-    MEM_NODE_MARK_SECTION(node_half, tmp_section);
-    MEM_SECTION_INC_COUNT(tmp_section);
-    MEM_SECTION_INC_COUNT(tmp_section);
-
-    return mem_range_split_section(mem_range, mem_section);
+static int mem_order_by_count(unsigned long count)
+{
+    int order = 0;
+    while ((1UL << order) < count)
+        order++;
+    return order;
 }
 
 unsigned long mem_node_alloc_pages(unsigned long count, unsigned long flags)
@@ -209,40 +187,77 @@ unsigned long mem_node_alloc_pages(unsigned long count, unsigned long flags)
     else
         panic("phymem: get range null!");
     
-    mem_section_t *mem_section;
-    int i;
-    for (i = 0; i < MEM_SECTION_MAX_NR; i++) {
-        mem_section = &mem_range->sections[i];
-        if (mem_section->section_size >= count) {
-            break;
-        }
-    }
+    int order = mem_order_by_count(count);
     unsigned long intr_flags;
     interrupt_save_and_disable(intr_flags);
-    if (list_empty(&mem_section->free_list_head)) {
-        if (mem_section->section_size == MEM_SECTION_MAX_SIZE) {    // 没有更大的节
-            // TODO: 收缩内存，合并没有使用的小节为大节
-            keprint(PRINT_ERR "mempool: no free section!\n");
-            interrupt_restore_state(flags);
-            return 0;
-        } else {
-            if (mem_range_split_section(mem_range, mem_section) < 0) {
-                keprint(PRINT_ERR "mempool: split section failed!\n");
-                interrupt_restore_state(intr_flags);
-                return 0;
-            }
-        }
+    mem_node_t *node = mem_range_split_section(mem_range, order);
+    if (node == NULL) {
+        keprint(PRINT_ERR "mempool: split section failed!\n");
+        interrupt_restore_state(intr_flags);
+        return 0;
     }
-    mem_node_t *node = list_first_owner(&mem_section->free_list_head, mem_node_t, list);
-    list_del_init(&node->list);
-    MEM_SECTION_DES_COUNT(mem_section);
-
     mem_node_init(node, 1, count);
-    MEM_NODE_MARK_SECTION(node, mem_section);
+    MEM_NODE_MARK_SECTION(node, &mem_range->sections[order]);
     interrupt_restore_state(intr_flags);
     return mem_node_to_phy_addr(node);
 }
 
+/**
+ * 批量分配单页：一次从伙伴系统拆出一个不超过count页的块，再切分成独立的单页，
+ * 每一页都可以用mem_node_free_pages单独释放，释放后仍然能和伙伴合并。
+ * 返回实际分配到的页数，物理地址保存在pages中。
+ */
+unsigned long mem_node_alloc_pages_batch(unsigned long *pages, unsigned long count, unsigned long flags)
+{
+    if (!count || !pages)
+        return 0;
+    mem_range_t *mem_range = NULL;
+
+    if (flags & MEM_NODE_TYPE_DMA)
+        mem_range = &mem_ranges[MEM_RANGE_DMA];
+    else if (flags & MEM_NODE_TYPE_NORMAL)
+        mem_range = &mem_ranges[MEM_RANGE_NORMAL];
+    else if (flags & MEM_NODE_TYPE_USER)
+        mem_range = &mem_ranges[MEM_RANGE_USER];
+    else
+        panic("phymem: get range null!");
+
+    /* 取不超过count的最大的阶，如果没有这么大的空闲块，就退到现有的最大块 */
+    int order = 0;
+    while (order < MEM_SECTION_MAX_NR - 1 && (2UL << order) <= count)
+        order++;
+    unsigned long intr_flags;
+    interrupt_save_and_disable(intr_flags);
+    int top = MEM_SECTION_MAX_NR - 1;
+    while (top >= 0 && list_empty(&mem_range->sections[top].free_list_head))
+        top--;
+    if (top < 0) {
+        interrupt_restore_state(intr_flags);
+        return 0;
+    }
+    if (order > top)
+        order = top;
+    mem_node_t *node = mem_range_split_section(mem_range, order);
+    if (node == NULL) {
+        interrupt_restore_state(intr_flags);
+        return 0;
+    }
+    unsigned long base = mem_node_to_phy_addr(node);
+    unsigned long i, nr = 1UL << order;
+    for (i = 0; i < nr; i++) {
+        mem_node_t *page = node + i;
+        mem_node_init(page, 1, 1);
+        MEM_NODE_MARK_SECTION(page, &mem_range->sections[0]);
+        pages[i] = base + i * PAGE_SIZE;
+    }
+    interrupt_restore_state(intr_flags);
+    return nr;
+}
+
+/**
+ * 释放页块，和空闲的伙伴块合并成更大的块，直到伙伴不空闲或者达到最大阶。
+ * 通过空闲标志检测重复释放，不需要遍历空闲链表。
+ */
 int mem_node_free_pages(unsigned long addr)
 {
     if (!addr)
@@ -251,7 +266,7 @@ int mem_node_free_pages(unsigned long addr)
     if (!node)
         return -1;
     
-    // 放回节点所属的节中去
+    // 只有块的第一个节点记录了所属的节
     mem_section_t *section = MEM_NODE_GET_SECTION(node);
     if (!section) {
         // keprint(PRINT_WARING "node %x addr %x no section!\n", node, addr);
@@ -259,18 +274,61 @@ int mem_node_free_pages(unsigned long addr)
     }
     unsigned long intr_flags;
     interrupt_save_and_disable(intr_flags);
-    if (list_find(&node->list, &section->free_list_head)) {
+    if (MEM_NODE_IS_FREE(node)) {
         // keprint(PRINT_WARING "addr %x don't need free again!\n", addr);
         interrupt_restore_state(intr_flags); 
         return -1;
     }
+    /* 页还被其它地方引用（例如写时复制的共享页），只减少引用计数 */
+    if (node->reference > 1) {
+        node->reference--;
+        interrupt_restore_state(intr_flags);
+        return 0;
+    }
+    mem_range_t *mem_range = mem_range_get_by_mem_node(node);
+    size_t index = node - mem_range->node_table;
+    int order = section - mem_range->sections;
     mem_node_init(node, 0, 0);
-    list_add(&node->list, &section->free_list_head);
-    MEM_SECTION_INC_COUNT(section);
+    while (order < MEM_SECTION_MAX_NR - 1) {
+        size_t buddy_index = index ^ (1UL << order);
+        if (buddy_index + (1UL << order) > mem_range->pages)
+            break;
+        mem_node_t *buddy = mem_range->node_table + buddy_index;
+        if (!MEM_NODE_IS_FREE(buddy) || MEM_NODE_GET_SECTION(buddy) != &mem_range->sections[order])
+            break;
+        mem_section_del_free(&mem_range->sections[order], buddy);
+        MEM_NODE_CLEAR_SECTION(buddy);
+        index &= ~(1UL << order);
+        order++;
+    }
+    mem_section_add_free(&mem_range->sections[order], mem_range->node_table + index);
+    interrupt_restore_state(intr_flags);
+    return 0;
+}
+
+/**
+ * 增加物理页的引用计数，页面被共享时使用，释放时引用计数为0才真正释放
+ */
+int mem_node_ref_pages(unsigned long addr)
+{
+    mem_node_t *node = phy_addr_to_mem_node(addr);
+    if (!node)
+        return -1;
+    unsigned long intr_flags;
+    interrupt_save_and_disable(intr_flags);
+    node->reference++;
     interrupt_restore_state(intr_flags);
     return 0;
 }
 
+int mem_node_get_reference(unsigned long addr)
+{
+    mem_node_t *node = phy_addr_to_mem_node(addr);
+    if (!node)
+        return -1;
+    return node->reference;
+}
+
 unsigned long mem_get_free_page_nr()
 {
     unsigned long flags;
@@ -288,6 +346,64 @@ unsigned long mem_get_free_page_nr()
     return page_count;
 }
 
+/* 物理地址是否在某个区域中，地址不属于任何区域时也不会停机 */
+int mem_range_has_phy_addr(unsigned int idx, unsigned long addr)
+{
+    if (idx >= MEM_RANGE_NR)
+        return 0;
+    return mem_ranges[idx].start <= addr && addr < mem_ranges[idx].end;
+}
+
+unsigned long mem_range_get_page_nr(unsigned int idx)
+{
+    if (idx >= MEM_RANGE_NR)
+        return 0;
+    return mem_ranges[idx].pages;
+}
+
+unsigned long mem_range_get_free_page_nr(unsigned int idx)
+{
+    if (idx >= MEM_RANGE_NR)
+        return 0;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    size_t page_count = 0;
+    int i;
+    for (i = 0; i < MEM_SECTION_MAX_NR; i++) {
+        mem_section_t *section = &mem_ranges[idx].sections[i];
+        page_count += section->node_count * section->section_size;
+    }
+    interrupt_restore_state(flags);
+    return page_count;
+}
+
+/**
+ * 获取碎片率：空闲内存中无法满足指定阶分配的比例（百分比）。
+ * 0表示所有空闲内存都在足够大的块中，100表示没有任何块能满足分配。
+ */
+unsigned long mem_get_fragmentation(int order)
+{
+    if (order < 0 || order >= MEM_SECTION_MAX_NR)
+        return 0;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    size_t free_pages = 0, usable_pages = 0;
+    int i, j;
+    for (j = 0; j < MEM_RANGE_NR; j++) {
+        mem_range_t *range = &mem_ranges[j];
+        for (i = 0; i < MEM_SECTION_MAX_NR; i++) {
+            mem_section_t *section = &range->sections[i];
+            free_pages += section->node_count * section->section_size;
+            if (i >= order)
+                usable_pages += section->node_count * section->section_size;
+        }
+    }
+    interrupt_restore_state(flags);
+    if (!free_pages)
+        return 0;
+    return (free_pages - usable_pages) * 100 / free_pages;
+}
+
 void mem_pool_test()
 {
     uint32_t addr = 64 * MB;
@@ -318,7 +434,18 @@ void mem_pool_test()
             break;
         mem_node_free_pages(addr);
     }
-    
+    /* 交错释放后伙伴应该合并回原来的大块 */
+    unsigned long free_nr = mem_get_free_page_nr();
+    unsigned long pages[16];
+    for (i = 0; i < 16; i++)
+        pages[i] = mem_node_alloc_pages(1, MEM_NODE_TYPE_NORMAL);
+    for (i = 0; i < 16; i += 2)
+        mem_node_free_pages(pages[i]);
+    for (i = 1; i < 16; i += 2)
+        mem_node_free_pages(pages[i]);
+    keprint("buddy merge: free pages %d -> %d, double free %d, frag %d%%\n",
+        free_nr, mem_get_free_page_nr(), mem_node_free_pages(pages[0]),
+        mem_get_fragmentation(MEM_FRAG_CHECK_ORDER));
     #endif
     spin("test");
 }
@@ -12,16 +12,71 @@
 #include <xbook/memspace.h>
 #include <xbook/exception.h>
 #include <xbook/vmm.h>
+#include <xbook/pagecache.h>
+#include <xbook/swap.h>
+#include <xbook/config.h>
+#include <arch/cpu.h>
+
+#if CONFIG_FAULT_AROUND_PAGES < 1 || CONFIG_FAULT_AROUND_PAGES > PAGE_TABLE_ENTRY_NR || \
+    (CONFIG_FAULT_AROUND_PAGES & (CONFIG_FAULT_AROUND_PAGES - 1))
+#error "CONFIG_FAULT_AROUND_PAGES must be a power of two within one page table"
+#endif
+
+/* cpu支持4MB大页时，内核直接映射区使用大页 */
+static int page_large_enabled = 0;
+
+/* 内核地址所在的页已经映射，大页映射的区域没有页表 */
+static bool page_kern_present(unsigned long addr)
+{
+    pde_t pde = *vir_addr_to_dir_entry(addr);
+    if (!(pde & PAGE_ATTR_PRESENT))
+        return false;
+    if (pde & PAGE_ATTR_LARGE)
+        return true;
+    return (*vir_addr_to_table_entry(addr) & PAGE_ATTR_PRESENT) != 0;
+}
+
+/**
+ * page_user_access - 检测用户地址范围都在有prot保护的空间中
+ *
+ * 程序段、匿名内存都是延迟映射的，换出的页也不在内存中，这些页在内核访问时
+ * 由页故障映射或者换入，所以只检测空间，不检测页表。
+ */
+static bool page_user_access(unsigned long vaddr, unsigned long nbytes, unsigned long prot)
+{
+    unsigned long addr = vaddr;
+    unsigned long end = vaddr + nbytes;
+    if (end < vaddr)
+        return false;
+    bool ok = true;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    while (addr < end) {
+        mem_space_t *space = mem_space_find(task_current->vmm, addr);
+        if (space == NULL || space->start > addr || !(space->page_prot & prot)) {
+            ok = false;
+            break;
+        }
+        addr = space->end;  /* 相邻的空间继续检测 */
+    }
+    interrupt_restore_state(flags);
+    return ok;
+}
+
+static inline bool page_is_user_range(unsigned long vaddr)
+{
+    return task_current->vmm && vaddr >= USER_VMM_BASE_ADDR && vaddr < USER_VMM_TOP_ADDR;
+}
 
 bool page_readable(unsigned long vaddr, unsigned long nbytes)
 {
+    if (page_is_user_range(vaddr))
+        return page_user_access(vaddr, nbytes, PROT_USER | PROT_READ | PROT_WRITE | PROT_EXEC);
     unsigned long addr = vaddr & PAGE_MASK;
     unsigned long count = PAGE_ALIGN(nbytes);
     while (count > 0) {
-        pte_t *pte = vir_addr_to_table_entry(addr);
-        if (!(*pte & PAGE_ATTR_PRESENT)) {
+        if (!page_kern_present(addr))
             return false;
-        }
         addr += PAGE_SIZE;
         count -= PAGE_SIZE;
     }
@@ -30,16 +85,17 @@ bool page_readable(unsigned long vaddr, unsigned long nbytes)
 
 bool page_writable(unsigned long vaddr, unsigned long nbytes)
 {
+    /* 写时复制的页在写入时会通过页故障复制，所以空间可写就行 */
+    if (page_is_user_range(vaddr))
+        return page_user_access(vaddr, nbytes, PROT_WRITE);
     unsigned long addr = vaddr & PAGE_MASK;
     unsigned long count = PAGE_ALIGN(nbytes);
     while (count > 0) {
-        pte_t *pte = vir_addr_to_table_entry(addr);
-        if (!(*pte & PAGE_ATTR_PRESENT)) {
+        if (!page_kern_present(addr))
             return false;
-        }
-        if (!(*pte & PAGE_ATTR_WRITE)) {
+        if (!(*vir_addr_to_dir_entry(addr) & PAGE_ATTR_LARGE) &&
+            !(*vir_addr_to_table_entry(addr) & PAGE_ATTR_WRITE))
             return false;
-        }
         addr += PAGE_SIZE;
         count -= PAGE_SIZE;
     }
@@ -69,7 +125,8 @@ void page_link_addr(unsigned long va, unsigned long pa, unsigned long prot)
         if (!page_table) {
             panic("%s: kernel no page left!\n", __func__);
         }
-        *pde = (page_table | prot | PAGE_ATTR_PRESENT);
+        /* 页目录项总是可写，由页表项控制具体的读写属性 */
+        *pde = (page_table | (prot & ~PAGE_ATTR_COW) | PAGE_ATTR_WRITE | PAGE_ATTR_PRESENT);
         memset((void *)((unsigned long)pte & PAGE_MASK), 0, PAGE_SIZE);
 
         assert(!(*pte & PAGE_ATTR_PRESENT));
@@ -92,11 +149,8 @@ void page_link_addr_unsafe(unsigned long va, unsigned long pa, unsigned long pro
 
         if ((*pte & PAGE_ATTR_PRESENT)) {
             page_free(*pte & PAGE_MASK);
-            *pte = 0;
-        }
-
-        if (!(*pte & PAGE_ATTR_PRESENT)) {
             *pte = (paddr | prot | PAGE_ATTR_PRESENT);
+            tlb_flush_one(vaddr);   /* 替换了已有的映射，需要刷新这一页的快表 */
         } else {
             *pte = (paddr | prot | PAGE_ATTR_PRESENT);
         }
@@ -106,7 +160,8 @@ void page_link_addr_unsafe(unsigned long va, unsigned long pa, unsigned long pro
             panic("%s: kernel no page left!\n", __func__);
         }
 
-        *pde = (page_table | prot | PAGE_ATTR_PRESENT);
+        /* 页目录项总是可写，由页表项控制具体的读写属性 */
+        *pde = (page_table | (prot & ~PAGE_ATTR_COW) | PAGE_ATTR_WRITE | PAGE_ATTR_PRESENT);
         memset((void *)((unsigned long)pte & PAGE_MASK), 0, PAGE_SIZE);
 
         if ((*pte & PAGE_ATTR_PRESENT)) {
@@ -209,8 +264,11 @@ int page_map_addr_fixed(unsigned long start, unsigned long addr, unsigned long l
  */
 unsigned long addr_vir2phy(unsigned long vaddr)
 {
-	pte_t* pte = vir_addr_to_table_entry(vaddr);
-	return ((*pte & 0xfffff000) + (vaddr & 0x00000fff));
+    pde_t *pde = vir_addr_to_dir_entry(vaddr);
+    if (*pde & PAGE_ATTR_LARGE)
+        return (*pde & PAGE_LARGE_MASK) + (vaddr & ~PAGE_LARGE_MASK);
+    pte_t* pte = vir_addr_to_table_entry(vaddr);
+    return ((*pte & 0xfffff000) + (vaddr & 0x00000fff));
 }
 
 /**
@@ -235,6 +293,30 @@ int page_unmap_addr(unsigned long vaddr, unsigned long len)
 	return 0;
 }
 
+/**
+ * 取消一片内核区域的映射并释放物理页，但是不刷新快表。
+ * 调用者需要在重新使用这片虚拟地址之前调用tlb_flush，这样多次释放只需要刷新一次。
+ */
+int page_unmap_addr_lazy(unsigned long vaddr, unsigned long len)
+{
+    if (!len)
+        return -1;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    unsigned long start = vaddr & PAGE_MASK;
+    unsigned long end = start + PAGE_ALIGN(len);
+    while (start < end) {
+        pte_t *pte = vir_addr_to_table_entry(start);
+        if ((*vir_addr_to_dir_entry(start) & PAGE_ATTR_PRESENT) && (*pte & PAGE_ATTR_PRESENT)) {
+            page_free(*pte & PAGE_MASK);
+            *pte &= ~PAGE_ATTR_PRESENT;
+        }
+        start += PAGE_SIZE;
+    }
+    interrupt_restore_state(flags);
+    return 0;
+}
+
 /**
  * 映射一片内存区域，如果虚拟地址对应的物理地址不存在才为其分配物理地址，已经存在就默认使用原来的物理页。
  */
@@ -263,7 +345,9 @@ int page_map_addr_safe(unsigned long start, unsigned long len, unsigned long pro
         pde_t *pde = vir_addr_to_dir_entry(vaddr);
         pte_t *pte = vir_addr_to_table_entry(vaddr);
 
-        if (!(*pde & PAGE_ATTR_PRESENT) || !(*pte & PAGE_ATTR_PRESENT)) {
+        /* 换出的页也是已经存在的页，不能覆盖 */
+        if (!(*pde & PAGE_ATTR_PRESENT) ||
+            (!(*pte & PAGE_ATTR_PRESENT) && !PAGE_IS_SWAP_ENTRY(*pte))) {
             page_addr = page_alloc_user(1);
             if (!page_addr) {
                 keprint("error: user_map_vaddr -> map pages failed!\n");
@@ -284,7 +368,7 @@ static int is_page_table_empty(pte_t *page_table)
 {
     int i;
     for (i = 0; i < PAGE_TABLE_ENTRY_NR; i++) {
-        if (page_table[i] & PAGE_ATTR_PRESENT)
+        if ((page_table[i] & PAGE_ATTR_PRESENT) || PAGE_IS_SWAP_ENTRY(page_table[i]))
             return 0;   // not empty
     }
     return 1;   // empty
@@ -319,6 +403,10 @@ int page_unmap_addr_safe(unsigned long start, unsigned long len, char fixed)
                         page_free(paddr);
                     *pte &= ~PAGE_ATTR_PRESENT;
                     tlb_flush_one(vaddr);
+                } else if (PAGE_IS_SWAP_ENTRY(*pte)) {
+                    /* 换出的页只需要释放交换槽 */
+                    swap_slot_free(PAGE_SWAP_SLOT(*pte));
+                    *pte = 0;
                 }
 
                 vaddr += PAGE_SIZE;
@@ -380,10 +468,37 @@ unsigned long *kern_page_dir_copy_to()
  * [HIGH+start, HIGH+end]
  * 并且只能通过高端地址来访问这段地址
  */
+/**
+ * 用4MB大页映射内核直接映射区，不需要页表，映射的起始地址必须4MB对齐。
+ * 末尾不足4MB的部分用一个页表映射，页表放在启动时的3个页表之后。
+ */
+static void kern_page_map_large(unsigned int *pdt, unsigned int start, unsigned int end)
+{
+    uint32_t pde_idx = KERN_PAGE_DIR_ENTRY_OFF + start / PAGE_LARGE_SIZE;
+    unsigned int *pte_addr = (unsigned int *) (KERN_PAGE_TABLE_PHY_ADDR + PAGE_SIZE * 3);
+    int i;
+    while (end - start >= PAGE_LARGE_SIZE) {
+        pdt[pde_idx++] = start | KERN_PAGE_ATTR_GLOBAL | PAGE_ATTR_LARGE;
+        start += PAGE_LARGE_SIZE;
+    }
+    if (start < end) {
+        for (i = 0; i < PAGE_TABLE_ENTRY_NR; i++) {
+            pte_addr[i] = (start < end) ? (start | KERN_PAGE_ATTR_GLOBAL) : 0;
+            start += PAGE_SIZE;
+        }
+        pdt[pde_idx] = (unsigned int)pte_addr | KERN_PAGE_ATTR;
+    }
+    dbgprint("map early: large pages end at pde %d\n", pde_idx);
+}
+
 void kern_page_map_early(unsigned int start, unsigned int end)
 {
     dbgprint("map early range: [%x,%x]\n", start, end);
 	unsigned int *pdt = (unsigned int *)KERN_PAGE_DIR_VIR_ADDR;
+    if (page_large_enabled) {
+        kern_page_map_large(pdt, start, end);
+        return;
+    }
 	unsigned int pde_nr = (end - start) / (PAGE_TABLE_ENTRY_NR * PAGE_SIZE);
 	unsigned int pte_nr = (end-start)/PAGE_SIZE;
 
@@ -421,6 +536,185 @@ static int do_handle_no_page(unsigned long addr, unsigned long prot)
 	return page_map_addr(addr, PAGE_SIZE, prot);
 }
 
+/**
+ * do_fault_around - 匿名空间缺页时，映射故障页所在的对齐页组中还没有映射的页
+ *
+ * 页组按CONFIG_FAULT_AROUND_PAGES对齐，不会跨越页表，并且限制在空间内。
+ * 物理页批量分配，通过新映射清零后再设置最终的读写属性。
+ * 故障页必须映射成功，附近的页分配不到就放弃。
+ * 返回映射的页数，失败返回-1。
+ */
+static int do_fault_around(mem_space_t *space, unsigned long addr)
+{
+    unsigned long vaddrs[CONFIG_FAULT_AROUND_PAGES];
+    unsigned long pages[CONFIG_FAULT_AROUND_PAGES];
+    unsigned long start, end, vaddr;
+    unsigned long nr = 0, got = 0, i;
+    unsigned long attr = (space->page_prot & PROT_USER) ? PAGE_ATTR_USER : PAGE_ATTR_SYSTEM;
+
+    addr &= PAGE_MASK;
+    start = addr & ~(CONFIG_FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+    end = start + CONFIG_FAULT_AROUND_PAGES * PAGE_SIZE;
+    if (start < space->start)
+        start = space->start;
+    if (end > space->end)
+        end = space->end;
+
+    /* 故障页放在第一个，优先得到物理页 */
+    vaddrs[nr++] = addr;
+    pde_t *pde = vir_addr_to_dir_entry(addr);
+    for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+        if (vaddr == addr)
+            continue;
+        if (!(*pde & PAGE_ATTR_PRESENT))
+            vaddrs[nr++] = vaddr;
+        else if (!(*vir_addr_to_table_entry(vaddr) & (PAGE_ATTR_PRESENT | PAGE_ATTR_SWAP)))
+            vaddrs[nr++] = vaddr;
+    }
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    while (got < nr) {
+        unsigned long count = page_alloc_user_batch(pages + got, nr - got);
+        if (!count)
+            break;
+        got += count;
+    }
+    if (!got) {
+        keprint(PRINT_ERR "%s: alloc user page failed!\n", __func__);
+        interrupt_restore_state(flags);
+        return -1;
+    }
+    for (i = 0; i < got; i++) {
+        page_link_addr(vaddrs[i], pages[i], attr | PAGE_ATTR_WRITE);
+        memset((void *)vaddrs[i], 0, PAGE_SIZE);
+        if (!(space->page_prot & PROT_WRITE)) {
+            *vir_addr_to_table_entry(vaddrs[i]) &= ~PAGE_ATTR_WRITE;
+            tlb_flush_one(vaddrs[i]);
+        }
+    }
+    interrupt_restore_state(flags);
+    return got;
+}
+
+/**
+ * do_swap_page - 从交换设备读回换出的页
+ * @addr: 故障地址
+ * @irq_on: 故障前是否打开了中断，关闭时不能等待磁盘，直接返回失败
+ *
+ * 读取时可能被同一进程的其它线程换入了，读完后检测页表项没有变化才映射。
+ * 没有空闲的用户页时，先换出一些页，返回后重新执行指令再次缺页。
+ */
+static int do_swap_page(unsigned long addr, int irq_on)
+{
+    unsigned long vaddr = addr & PAGE_MASK;
+    pte_t *pte = vir_addr_to_table_entry(vaddr);
+    unsigned long entry = *pte;
+    unsigned long slot = PAGE_SWAP_SLOT(entry);
+    /* 读取交换槽需要等待磁盘中断，关闭中断时不能换入 */
+    if (!irq_on)
+        return -1;
+    void *buf = mem_alloc(PAGE_SIZE);
+    if (buf == NULL)
+        return -1;
+    interrupt_enable();
+    int ret = swap_read_slot(slot, buf);
+    interrupt_disable();
+    if (ret < 0) {
+        keprint(PRINT_ERR "%s: read swap slot %d failed!\n", __func__, slot);
+        mem_free(buf);
+        return -1;
+    }
+    unsigned long page = page_alloc_user(1);
+    if (!page) {
+        mem_free(buf);
+        interrupt_enable();
+        unsigned long reclaimed = swap_reclaim(SWAP_RECLAIM_BATCH);
+        interrupt_disable();
+        return reclaimed ? 0 : -1;
+    }
+    if (*pte != entry) {
+        page_free(page);
+        mem_free(buf);
+        return 0;
+    }
+    /* 先以可写的属性映射，复制数据后恢复换出前的属性 */
+    *pte = page | PAGE_ATTR_USER | PAGE_ATTR_WRITE | PAGE_ATTR_PRESENT;
+    tlb_flush_one(vaddr);
+    memcpy((void *)vaddr, buf, PAGE_SIZE);
+    *pte = page | (entry & PAGE_SWAP_ATTR_MASK) | PAGE_ATTR_PRESENT;
+    tlb_flush_one(vaddr);
+    swap_slot_free(slot);
+    mem_free(buf);
+    return 0;
+}
+
+/**
+ * page_swap_pick - 在当前页目录中用时钟算法挑选一个要换出的页
+ * @vaddr: 开始扫描的地址，返回时更新为下次扫描的位置
+ * @end: 扫描的结束地址
+ * @buf: 选中的页的数据复制到这里
+ * @budget: 最多扫描的页表项数，每扫描一项减1
+ *
+ * 只选择用户区域中引用计数为1的页，共享的页不换出。访问过的页清除访问位，给第二次机会；
+ * 没有访问过的页清除脏位后复制数据，写到磁盘后由page_swap_out检测期间有没有被写入。
+ * 需要关闭中断调用，返回选中的页表项，没有找到返回0。
+ */
+unsigned long page_swap_pick(unsigned long *vaddr, unsigned long end, void *buf, unsigned long *budget)
+{
+    unsigned long addr = *vaddr & PAGE_MASK;
+    while (addr < end && *budget > 0) {
+        (*budget)--;
+        if (!(*vir_addr_to_dir_entry(addr) & PAGE_ATTR_PRESENT)) {
+            addr = (addr + PAGE_LARGE_SIZE) & PAGE_LARGE_MASK;
+            continue;
+        }
+        pte_t *pte = vir_addr_to_table_entry(addr);
+        unsigned long cur = addr;
+        unsigned long val = *pte;
+        addr += PAGE_SIZE;
+        if (!(val & PAGE_ATTR_PRESENT) || !page_is_user(val & PAGE_MASK) ||
+            page_ref_count(val & PAGE_MASK) != 1)
+            continue;
+        if (val & PAGE_ATTR_ACCESSED) {
+            *pte = val & ~PAGE_ATTR_ACCESSED;
+            tlb_flush_one(cur);
+            continue;
+        }
+        val &= ~PAGE_ATTR_DIRTY;
+        *pte = val;
+        tlb_flush_one(cur);
+        memcpy(buf, (void *)cur, PAGE_SIZE);
+        *vaddr = cur;
+        return val;
+    }
+    *vaddr = addr;
+    return 0;
+}
+
+/**
+ * page_swap_out - 把选中的页替换成交换项，并释放物理页
+ * @vaddr: 页的虚拟地址
+ * @pte: page_swap_pick返回的页表项
+ * @slot: 页的数据已经写入的交换槽
+ *
+ * 除了访问位，页表项没有变化才替换，说明写磁盘期间页没有被写入、取消映射或者共享。
+ * 需要关闭中断并且在选中时的页目录中调用，成功返回0。
+ */
+int page_swap_out(unsigned long vaddr, unsigned long pte, unsigned long slot)
+{
+    if (!(*vir_addr_to_dir_entry(vaddr) & PAGE_ATTR_PRESENT))
+        return -1;
+    pte_t *entry = vir_addr_to_table_entry(vaddr);
+    if ((*entry & ~PAGE_ATTR_ACCESSED) != (pte & ~PAGE_ATTR_ACCESSED))
+        return -1;
+    if (page_ref_count(pte & PAGE_MASK) != 1)
+        return -1;
+    *entry = PAGE_SWAP_ENTRY(slot, pte);
+    tlb_flush_one(vaddr);
+    page_free(pte & PAGE_MASK);
+    return 0;
+}
+
 /**
  * do_page_no_write - 让pte有写属性
  * @addr: 要设置的虚拟地址
@@ -441,6 +735,46 @@ static int do_page_no_write(unsigned long addr)
 	return 0;
 }
 
+/* 写时复制时的页数据中转缓冲区，处理时关闭中断，每个处理器一个 */
+static unsigned char cow_copy_buf[CPU_NR_MAX][PAGE_SIZE];
+
+/**
+ * do_copy_on_write - 处理写时复制
+ * @addr: 故障虚拟地址
+ *
+ * 如果物理页只被当前进程引用，就直接恢复写属性。
+ * 否则分配一个新的物理页，复制数据后替换掉原来的共享页，并减少共享页的引用计数。
+ */
+static int do_copy_on_write(unsigned long addr)
+{
+    unsigned long vaddr = addr & PAGE_MASK;
+    pte_t *pte = vir_addr_to_table_entry(vaddr);
+    unsigned long paddr = *pte & PAGE_MASK;
+    unsigned long attr = (*pte & ~(PAGE_MASK | PAGE_ATTR_COW)) | PAGE_ATTR_WRITE;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (page_ref_count(paddr) <= 1) {
+        *pte = paddr | attr;
+        tlb_flush_one(vaddr);
+        interrupt_restore_state(flags);
+        return 0;
+    }
+    unsigned long new_page = page_alloc_user(1);
+    if (!new_page) {
+        keprint(PRINT_ERR "%s: alloc user page failed!\n", __func__);
+        interrupt_restore_state(flags);
+        return -1;
+    }
+    unsigned char *copy_buf = cow_copy_buf[cpu_get_my_index()];
+    memcpy(copy_buf, (void *)vaddr, PAGE_SIZE);
+    *pte = new_page | attr;
+    tlb_flush_one(vaddr);
+    memcpy((void *)vaddr, copy_buf, PAGE_SIZE);
+    page_free(paddr);   /* 减少共享页的引用 */
+    interrupt_restore_state(flags);
+    return 0;
+}
+
 static inline void do_vir_mem_fault(unsigned long addr)
 {
     keprint("do_vir_mem_fault\n");
@@ -452,13 +786,23 @@ static inline void do_vir_mem_fault(unsigned long addr)
 static void do_expand_stack(mem_space_t *space, unsigned long addr)
 {
     addr &= PAGE_MASK;
-	space->start = addr;
+    mem_space_set_start(space->vmm, space, addr);
 }
 
 static int do_protection_fault(mem_space_t *space, unsigned long addr, int write)
 {
 	/* 没有写标志，说明该段内存不支持内存写入，就直接返回吧 */
 	if (write) {
+        pte_t *pte = vir_addr_to_table_entry(addr);
+        if ((*vir_addr_to_dir_entry(addr) & PAGE_ATTR_PRESENT) && (*pte & PAGE_ATTR_PRESENT) &&
+            (*pte & PAGE_ATTR_COW)) {
+            if (do_copy_on_write(addr) < 0) {
+                keprint(PRINT_EMERG "page: %s: copy on write failed!", __func__);
+                exception_force_self(EXP_CODE_SEGV);
+                return -1;
+            }
+            return 0;
+        }
 		keprint(PRINT_DEBUG "page: %s: addr %x have write protection.\n", __func__);
 		int ret = do_page_no_write(addr);
 		if (ret) {
@@ -528,6 +872,7 @@ int page_do_fault(trap_frame_t *frame)
     }
 
     /* 故障地址在用户空间 */
+    cur->vmm->fault_count++;
     mem_space_t *space = mem_space_find(cur->vmm, addr);
     if (space == NULL) {
         keprint(PRINT_ERR "page fauilt: user pid=%d name=%s user access user unknown space.\n", cur->pid, cur->name);
@@ -559,24 +904,77 @@ int page_do_fault(trap_frame_t *frame)
     if (frame->error_code & PAGE_ERR_PROTECT) {
         return do_protection_fault(space, addr, frame->error_code & PAGE_ERR_WRITE);
     }
-    do_handle_no_page(addr, space->page_prot);
+    if ((*vir_addr_to_dir_entry(addr) & PAGE_ATTR_PRESENT) &&
+        PAGE_IS_SWAP_ENTRY(*vir_addr_to_table_entry(addr))) {
+        if (do_swap_page(addr, frame->eflags & EFLAGS_IF_1) < 0) {
+            keprint(PRINT_ERR "page fauilt: user pid=%d name=%s swap in page failed.\n", cur->pid, cur->name);
+            exception_force_self(EXP_CODE_SEGV);
+            return -1;
+        }
+        cur->vmm->fault_pages++;
+        return 0;
+    }
+    if (space->cache) {
+        /* 文件映射需要从磁盘读取并等待磁盘中断，和换入一样，关闭中断时不能读取 */
+        if (!(frame->eflags & EFLAGS_IF_1)) {
+            keprint(PRINT_ERR "page fauilt: user pid=%d name=%s load file page with interrupt off.\n", cur->pid, cur->name);
+            exception_force_self(EXP_CODE_SEGV);
+            return -1;
+        }
+        unsigned long flags;
+        interrupt_save_and_disable(flags);
+        interrupt_enable();
+        int ret = page_cache_fault(space, addr);
+        interrupt_restore_state(flags);
+        if (ret < 0) {
+            keprint(PRINT_ERR "page fauilt: user pid=%d name=%s load file page failed.\n", cur->pid, cur->name);
+            exception_force_self(EXP_CODE_SEGV);
+            return -1;
+        }
+        cur->vmm->fault_pages++;
+        return 0;
+    }
+    int mapped = do_fault_around(space, addr);
+    if (mapped < 0 && (frame->eflags & EFLAGS_IF_1)) {
+        /* 用户页用完了，换出一些页后返回，重新执行指令时再次缺页 */
+        interrupt_enable();
+        unsigned long reclaimed = swap_reclaim(SWAP_RECLAIM_BATCH);
+        interrupt_disable();
+        if (reclaimed)
+            return 0;
+    }
+    if (mapped < 0) {
+        keprint(PRINT_ERR "page fauilt: user pid=%d name=%s map anonymous page failed.\n", cur->pid, cur->name);
+        exception_force_self(EXP_CODE_SEGV);
+        return -1;
+    }
+    cur->vmm->fault_pages += mapped;
     return 0;
 }
 
-/* 设置分页模式 */
+/**
+ * 设置分页模式
+ *
+ * 低端12MB是内核代码和数据所在的恒等映射。高端的内核映射在cpu支持时，
+ * 4MB以上的部分用大页映射，最开始的4MB包含BIOS和显存区域，仍然用页表映射。
+ * 每个页目录都会复制第一个页目录项和内核空间，所以这些映射设置成全局页，
+ * 切换页目录时不会被刷新。
+ */
 void setup_paging()
 {
     unsigned int *pgdir = (unsigned int *) KERN_PAGE_DIR_PHY_ADDR;
     unsigned int *pgtbl = (unsigned int *) KERN_PAGE_TABLE_PHY_ADDR;
+    int global = cpu_do_has_feature(CPUID_FEATURE_PGE);
+    page_large_enabled = cpu_do_has_feature(CPUID_FEATURE_PSE);
 
     /* clear page dir table */
     memset(pgdir, 0, PAGE_SIZE);
 
     unsigned int phy_addr = 0;
-    /* fill page table, 12MB memory */
+    /* fill page table, 12MB memory, only the first 4MB is shared by all page dirs */
     int i;
     for (i = 0; i < 1024 * 3; i++) {
-        pgtbl[i] = phy_addr | KERN_PAGE_ATTR;
+        pgtbl[i] = phy_addr | (i < PAGE_TABLE_ENTRY_NR ? KERN_PAGE_ATTR_GLOBAL : KERN_PAGE_ATTR);
         phy_addr += PAGE_SIZE;
     }
 
@@ -588,17 +986,29 @@ void setup_paging()
     pgtbl += 1024;
     pgdir[1] = (unsigned int) pgtbl | KERN_PAGE_ATTR;
     #if KERN_LOWMEN == 0
-    pgdir[513] = (unsigned int) pgtbl | KERN_PAGE_ATTR;
+    if (page_large_enabled)
+        pgdir[513] = (1 * PAGE_LARGE_SIZE) | KERN_PAGE_ATTR_GLOBAL | PAGE_ATTR_LARGE;
+    else
+        pgdir[513] = (unsigned int) pgtbl | KERN_PAGE_ATTR;
     #endif
     pgtbl += 1024;
     pgdir[2] = (unsigned int) pgtbl | KERN_PAGE_ATTR;
     #if KERN_LOWMEN == 0
-    pgdir[514] = (unsigned int) pgtbl | KERN_PAGE_ATTR;
+    if (page_large_enabled)
+        pgdir[514] = (2 * PAGE_LARGE_SIZE) | KERN_PAGE_ATTR_GLOBAL | PAGE_ATTR_LARGE;
+    else
+        pgdir[514] = (unsigned int) pgtbl | KERN_PAGE_ATTR;
     #endif
     pgdir[1023] = (unsigned int) pgdir |KERN_PAGE_ATTR;    /* record pgdir self */
+    /* 大页需要在打开分页前开启 */
+    if (page_large_enabled)
+        cpu_cr4_write(cpu_cr4_read() | REG_CR4_PSE);
     /* 打开分页模式 */
     cpu_cr3_write((unsigned int) pgdir);
-    cpu_cr0_write(cpu_cr0_read() | REG_CR0_PG);
+    cpu_cr0_write(cpu_cr0_read() | REG_CR0_PG | REG_CR0_WP);
+    /* 全局页必须在打开分页后开启 */
+    if (global)
+        cpu_cr4_write(cpu_cr4_read() | REG_CR4_PGE);
     /* 0-8M物理内存是内核可以直接访问的地址，即使开启分页模式后，内核也可能会访问该地址的数据，
     不过不用担心，用户不能访问，因为页权限的问题所致 */
 }
@@ -25,7 +25,7 @@ unsigned long mem_get_total_page_nr()
 int physic_memory_init()
 {
     total_pmem_size = phy_mem_get_size_from_hardware();
-    assert(total_pmem_size >= (300 * MB));
+    assert(total_pmem_size >= PHY_MEM_MIN_SIZE);
     /* 根据内存大小划分区域
     如果内存大于1GB:
         1G预留128MB给非连续内存，其余给内核和用户程序平分，内核多余的部分分给用户
@@ -36,6 +36,7 @@ int physic_memory_init()
     unsigned int user_size;
     
     unsigned int unused_size;
+    unsigned int boot_size;
     
     unused_size = KERN_BLACKHOLE_MEM_SIZE + NORMAL_MEM_ADDR;
     
@@ -48,6 +49,11 @@ int physic_memory_init()
         normal_size -= more_size;
     }
     
+    /* 引导内存只保存每个区域的物理页节点表，按照内存大小分配，小内存时不会超过normal区域 */
+    boot_size = PAGE_ALIGN((total_pmem_size / PAGE_SIZE) * SIZEOF_MEM_NODE) + (MEM_RANGE_NR + 1) * PAGE_SIZE;
+    if (boot_size > BOOT_MEM_SIZE)
+        boot_size = BOOT_MEM_SIZE;
+
     noteprint("total size:%x %d MB\n", total_pmem_size, total_pmem_size / MB);
     noteprint("normal size:%x %d MB\n", normal_size, normal_size / MB);
     noteprint("user size:%x %d MB\n", user_size, user_size / MB);
@@ -57,9 +63,9 @@ int physic_memory_init()
     kern_page_map_early(DMA_MEM_ADDR, NORMAL_MEM_ADDR + normal_size);
 
     /* normal size前面是boot mem，后面是normal mem */
-    boot_mem_init(KERN_BASE_VIR_ADDR + BOOT_MEM_ADDR, BOOT_MEM_SIZE);
+    boot_mem_init(KERN_BASE_VIR_ADDR + BOOT_MEM_ADDR, boot_size);
     mem_range_init(MEM_RANGE_DMA, DMA_MEM_ADDR, DMA_MEM_SIZE);
-    mem_range_init(MEM_RANGE_NORMAL, BOOT_MEM_ADDR + BOOT_MEM_SIZE, normal_size - BOOT_MEM_SIZE);
+    mem_range_init(MEM_RANGE_NORMAL, BOOT_MEM_ADDR + boot_size, normal_size - boot_size);
     mem_range_init(MEM_RANGE_USER, NORMAL_MEM_ADDR + normal_size, user_size - KERN_BLACKHOLE_MEM_SIZE);
 
     // mem_pool_test();
@@ -5,67 +5,86 @@
 #include <xbook/memspace.h>
 #include <xbook/vmm.h>
 #include <xbook/schedule.h>
+#include <xbook/swap.h>
 #include <arch/tss.h>
+#include <arch/memory.h>
+#include <arch/smp.h>
 #include <string.h>
 
 #define DEBUG_VMM
 
-static int do_copy_share_page(addr_t vaddr, vmm_t *child, vmm_t *parent)
+/**
+ * 获取子进程页目录中虚拟地址对应的页表项，页表不存在就分配一个。
+ * 页表从NORMAL区域分配，可以直接通过内核虚拟地址访问，不需要切换页目录。
+ */
+static pte_t *vmm_child_table_entry(vmm_t *child, addr_t vaddr)
 {
-    addr_t paddr = addr_vir2phy(vaddr);
-    dbgprint("[vmm]: copy share page at vaddr %x phy addr %x\n", vaddr, paddr);   
-    vmm_active(child);
-    page_link_addr(vaddr, paddr, PAGE_ATTR_WRITE | PAGE_ATTR_USER);
-    vmm_active(parent);
-    return 0;
+    pde_t *pde = (pde_t *)child->page_storage + PAGE_DIR_ENTRY_IDX(vaddr);
+    if (!(*pde & PAGE_ATTR_PRESENT)) {
+        addr_t page_table = page_alloc_normal(1);
+        if (!page_table) {
+            keprint(PRINT_ERR "vmm_copy_mapping: alloc page table for vaddr %x failed!\n", vaddr);
+            return NULL;
+        }
+        memset(kern_phy_addr2vir_addr(page_table), 0, PAGE_SIZE);
+        *pde = page_table | PAGE_ATTR_WRITE | PAGE_ATTR_USER | PAGE_ATTR_PRESENT;
+    }
+    pte_t *page_table = kern_phy_addr2vir_addr(*pde & PAGE_MASK);
+    return page_table + PAGE_TABLE_ENTRY_IDX(vaddr);
 }
 
-static int do_copy_normal_page(addr_t vaddr, void *buf, vmm_t *child, vmm_t *parent)
+/**
+ * 复制一个页映射到子进程。
+ * 共享内存直接复制页表项；普通内存和父进程共享同一个物理页，去掉写属性并
+ * 标记为写时复制，同时增加物理页的引用计数，等到写入时再在页故障中复制。
+ */
+static int do_copy_page_cow(addr_t vaddr, vmm_t *child, int shared)
 {
-    addr_t paddr;
-    memcpy(buf, (void *)vaddr, PAGE_SIZE);
-    vmm_active(child);
-    paddr = page_alloc_user(1);
-    if (!paddr) {
-        keprint(PRINT_ERR "vmm_copy_mapping: page_alloc_one for vaddr failed!\n");
-        vmm_active(parent);
+    pte_t *pte = vir_addr_to_table_entry(vaddr);
+    if (!(*pte & PAGE_ATTR_PRESENT) && !PAGE_IS_SWAP_ENTRY(*pte))
+        return 0;
+    pte_t *child_pte = vmm_child_table_entry(child, vaddr);
+    if (child_pte == NULL)
         return -1;
+    /* 换出的页和子进程共享交换槽，谁先访问谁先换入 */
+    if (PAGE_IS_SWAP_ENTRY(*pte)) {
+        if (swap_slot_dup(PAGE_SWAP_SLOT(*pte)) < 0)
+            return -1;
+        *child_pte = *pte;
+        return 0;
     }
-    page_link_addr(vaddr, paddr, PAGE_ATTR_WRITE | PAGE_ATTR_USER);
-    memcpy((void *)vaddr, buf, PAGE_SIZE);
-    vmm_active(parent);
+    if (!shared) {
+        /* 只刷新变成只读的页，内核是全局页，不需要重新加载整个页目录 */
+        if (*pte & PAGE_ATTR_WRITE) {
+            *pte = (*pte & ~PAGE_ATTR_WRITE) | PAGE_ATTR_COW;
+            tlb_flush_one(vaddr);
+        }
+        page_ref(*pte & PAGE_MASK);
+    }
+    *child_pte = *pte;
     return 0;
 }
 
 int vmm_copy_mapping(task_t *child, task_t *parent)
 {
-    void *buf = mem_alloc(PAGE_SIZE);
-    if (buf == NULL) {
-        keprint(PRINT_ERR "vmm_copy_mapping: mem_alloc buf for data transform failed!\n");
-        return -1;
-    }
     mem_space_t *space = parent->vmm->mem_space_head;
     addr_t prog_vaddr = 0;
     while (space != NULL) {
         prog_vaddr = space->start;
         while (prog_vaddr < space->end) {
-            /* 如果是共享内存，就只复制页映射，而不创建新的页 */
-            if (space->flags & MEM_SPACE_MAP_SHARED) {
-                if (do_copy_share_page(prog_vaddr, child->vmm, parent->vmm) < 0) {
-                    mem_free(buf);
-                    return -1;
-                }
-            } else {
-                if (do_copy_normal_page(prog_vaddr, buf, child->vmm, parent->vmm) < 0) {
-                    mem_free(buf);
-                    return -1;
-                }
+            /* 页表不存在，整个页表覆盖的范围都没有映射，直接跳过 */
+            pde_t *pde = vir_addr_to_dir_entry(prog_vaddr);
+            if (!(*pde & PAGE_ATTR_PRESENT)) {
+                prog_vaddr = (prog_vaddr + PAGE_TABLE_ENTRY_NR * PAGE_SIZE) &
+                    ~(PAGE_TABLE_ENTRY_NR * PAGE_SIZE - 1);
+                continue;
             }
+            if (do_copy_page_cow(prog_vaddr, child->vmm, space->flags & MEM_SPACE_MAP_SHARED) < 0)
+                return -1;
             prog_vaddr += PAGE_SIZE;
         }
         space = space->next;
     }
-    mem_free(buf);
     return 0; 
 }
 
@@ -73,11 +92,13 @@ void vmm_active_kernel()
 {
     unsigned long paddr = KERN_PAGE_DIR_PHY_ADDR;
     cpu_cr3_write(paddr);
+    smp_set_active_pgdir(paddr);
     tss_update_info((unsigned long )task_current);
 }
 
 void vmm_active_user(unsigned int page)
 {
     cpu_cr3_write(page);    
+    smp_set_active_pgdir(page);
     tss_update_info((unsigned long )task_current);
 }
\ No newline at end of file
@@ -1,3 +1,5 @@
+extern smp_unlock_kernel_on_exit
+
 [section .text]
 [bits 32]
 
@@ -23,6 +25,10 @@ thread_switch_to_next:
 global kernel_switch_to_user
 kernel_switch_to_user:
     mov esp, [esp + 4]
+    cli
+    push esp
+    call smp_unlock_kernel_on_exit
+    add esp, 4
     add esp, 4			   ; 跳过中断号
     popad
     pop gs
@@ -6,6 +6,7 @@
 #include <xbook/process.h>
 #include <xbook/debug.h>
 #include <xbook/schedule.h>
+#include <xbook/timepage.h>
 #include <string.h>
 
 void user_frame_init(trap_frame_t *frame)
@@ -103,6 +104,12 @@ int process_frame_init(task_t *task, trap_frame_t *frame, char **argv, char **en
         return -1;
     }
     memset((void *) vmm->stack_start, 0, vmm->stack_end - vmm->stack_start);
+
+    /* 栈顶之上映射只读的时间页 */
+    if (time_page_map() < 0) {
+        mem_space_unmmap(vmm->stack_start, vmm->stack_end - vmm->stack_start);
+        return -1;
+    }
     
     int argc = 0;
     char **new_envp = NULL;
@@ -2,27 +2,54 @@
 #include <arch/segment.h>
 #include <arch/registers.h>
 #include <arch/phymem.h>
+#include <arch/cpu.h>
 #include <string.h>
 #include <xbook/task.h>
 
-tss_t tss0;
+/* 每个处理器一个tss，下标和cpu_attached_list一致 */
+tss_t tss_table[CPU_NR_MAX];
 
 tss_t *tss_get_from_cpu0()
 {
-	return &tss0;
+	return &tss_table[0];
+}
+
+tss_t *tss_get_current()
+{
+	return &tss_table[cpu_get_my_index()];
 }
 
 void tss_update_info(unsigned long task_addr)
 {
 	// 更新tss.esp0的值为任务的内核栈顶
-	tss0.esp0 = (unsigned long)(task_addr + TASK_KERN_STACK_SIZE);
+	tss_get_current()->esp0 = (unsigned long)(task_addr + TASK_KERN_STACK_SIZE);
+}
+
+static void tss_setup(tss_t *tss, unsigned long stack_top)
+{
+	memset(tss, 0, sizeof(tss_t));
+	tss->esp0 = stack_top;
+	tss->ss0 = KERNEL_DATA_SEL;
+	tss->iobase = sizeof(tss_t);
 }
 
 void tss_init()
 {
-	memset(&tss0, 0, sizeof(tss_t));
-	tss0.esp0 = KERNEL_STATCK_TOP;
-	tss0.ss0 = KERNEL_DATA_SEL;
-	tss0.iobase = sizeof(tss_t);
+	tss_setup(&tss_table[0], KERNEL_STATCK_TOP);
 	task_register_set(KERNEL_TSS_SEL);
 }
+
+/**
+ * tss_init_ap - 应用处理器加载自己的tss
+ * @index: 处理器的下标
+ * @stack_top: 处理器启动时的栈顶
+ * 
+ * 加载任务寄存器后cpu_get_my_index才能使用
+ */
+void tss_init_ap(int index, unsigned long stack_top)
+{
+	tss_t *tss = &tss_table[index];
+	tss_setup(tss, stack_top);
+	segment_tss_descriptor_set(index, tss);
+	task_register_set(KERNEL_TSS_SEL_CPU(index));
+}
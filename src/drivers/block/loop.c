@@ -6,6 +6,8 @@
 #include <xbook/task.h>
 #include <xbook/virmem.h>
 #include <xbook/dir.h>
+#include <xbook/fs.h>
+#include <xbook/diskman.h>
 #include <arch/io.h>
 #include <arch/interrupt.h>
 #include <sys/ioctl.h>
@@ -230,6 +232,7 @@ static iostatus_t loop_devctl(device_object_t *device, io_request_t *ioreq)
     device_extension_t *extension = device->device_extension;
     unsigned long arg = ioreq->parame.devctl.arg;
     unsigned long off;
+    disk_extent_t *extent;
     switch (ioreq->parame.devctl.code)
     {    
     case DISKIO_GETSIZE:
@@ -261,6 +264,20 @@ static iostatus_t loop_devctl(device_object_t *device, io_request_t *ioreq)
         }
         *((unsigned long *) arg) = extension->rwoffset;
         break;
+    case DISKIO_GETEXTENT:
+        /* 由镜像文件所在的文件系统解析扇区，交换文件用它绕过文件系统直接读写磁盘 */
+        extent = (disk_extent_t *) arg;
+        if (!IS_LOOP_UP(extension) || extent->offset >= extension->sectors) {
+            status = IO_FAILED;
+            goto final;
+        }
+        if (kfile_ioctl(extension->gfd, DISKIO_GETEXTENT, extent) < 0) {
+            status = IO_FAILED;
+            goto final;
+        }
+        if (extent->count > extension->sectors - extent->offset)
+            extent->count = extension->sectors - extent->offset;
+        break;
     case DISKIO_SETUP:
         /* 设置启动信息 */
         if (loop_setup(device, (char *)arg) < 0) {
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include <xbook/driver.h>
+#include <xbook/mdl.h>
 #include <xbook/task.h>
 #include <xbook/virmem.h>
 #include <arch/io.h>
@@ -49,7 +50,8 @@ iostatus_t ramdisk_read(device_object_t *device, io_request_t *ioreq)
 
 	} else {
 		/* 进行磁盘读取 */
-		memcpy(ioreq->user_buffer, extension->buffer + off * SECTOR_SIZE, length);
+		void *buffer = ioreq->mdl_address ? MDL_GET_MAPPED_VADDR(ioreq->mdl_address) : ioreq->system_buffer;
+		memcpy(buffer, extension->buffer + off * SECTOR_SIZE, length);
         ioreq->io_status.infomation = length;
 #ifdef DEBUG_DRV
         keprint(PRINT_DEBUG "ramdisk_read: read disk offset=%d counts=%d ok.\n",
@@ -86,7 +88,8 @@ iostatus_t ramdisk_write(device_object_t *device, io_request_t *ioreq)
 	} else {
 
 		/* 进行磁盘写入 */
-		memcpy(extension->buffer + off * SECTOR_SIZE, ioreq->user_buffer, length);
+		void *buffer = ioreq->mdl_address ? MDL_GET_MAPPED_VADDR(ioreq->mdl_address) : ioreq->system_buffer;
+		memcpy(extension->buffer + off * SECTOR_SIZE, buffer, length);
         ioreq->io_status.infomation = length;
 #ifdef DEBUG_DRV
         keprint(PRINT_DEBUG "ramdisk_write: write disk offset=%d counts=%d ok.\n",
@@ -153,8 +156,8 @@ static iostatus_t ramdisk_enter(driver_object_t *driver)
         keprint(PRINT_ERR "ramdisk_enter: create device failed!\n");
         return status;
     }
-    /* neighter io mode */
-    devobj->flags = 0;
+    /* direct io mode，内核缓冲区直接使用，用户缓冲区不会在持有设备时缺页 */
+    devobj->flags = DO_DIRECT_IO;
     extension = (device_extension_t *)devobj->device_extension;
     extension->device_object = devobj;
     extension->sectors = RAMDISK_SECTORS;
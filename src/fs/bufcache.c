@@ -0,0 +1,427 @@
+#include <xbook/bufcache.h>
+#include <xbook/diskman.h>
+#include <xbook/memcache.h>
+#include <xbook/mutexlock.h>
+#include <xbook/debug.h>
+#include <xbook/task.h>
+#include <xbook/schedule.h>
+#include <xbook/clock.h>
+#include <string.h>
+#include <math.h>
+
+// #define DEBUG_BUF_CACHE
+
+/* 每个磁盘的访问状态，用来判断是否顺序读取 */
+typedef struct {
+    unsigned long next_sector;  /* 上次读取结束的位置 */
+    unsigned long sectors;      /* 磁盘扇区数，为0表示未知 */
+} buf_disk_t;
+
+static buf_block_t *buf_block_table;
+static list_t buf_hash_table[BUF_CACHE_HASH_NR];
+static LIST_HEAD(buf_lru_list);
+static LIST_HEAD(buf_free_list);
+static buf_disk_t buf_disks[DISK_MAN_SOLT_NR];
+static unsigned long buf_dirty_count = 0;
+/* 保护缓存的链表和块，读写磁盘时不持有 */
+DEFINE_MUTEX_LOCK(buf_cache_mutex);
+/* 同一时间只有一个写回者，保证后写入的数据不会被先前的写回覆盖。先获取写回锁再获取缓存锁 */
+DEFINE_MUTEX_LOCK(buf_flush_mutex);
+
+/* 连续扇区的读写通过这个缓冲区和磁盘交换数据 */
+#define BUF_CACHE_IO_NR     (BUF_CACHE_BYPASS_NR + BUF_CACHE_READAHEAD_NR)
+/* 写回时使用的缓冲区，由写回锁保护 */
+static unsigned char buf_flush_buffer[BUF_CACHE_IO_NR * BUF_BLOCK_SIZE];
+static buf_block_t *buf_flush_table[BUF_CACHE_BLOCK_NR];
+
+#define buf_hash(solt, sector) \
+        (&buf_hash_table[((sector) + (solt) * 31) % BUF_CACHE_HASH_NR])
+
+static buf_block_t *buf_cache_lookup(int solt, unsigned long sector)
+{
+    buf_block_t *block;
+    list_for_each_owner (block, buf_hash(solt, sector), hash_list) {
+        if (block->solt == solt && block->sector == sector)
+            return block;
+    }
+    return NULL;
+}
+
+static void buf_block_release(buf_block_t *block)
+{
+    if (block->flags & BUF_BLOCK_DIRTY)
+        buf_dirty_count--;
+    block->flags = 0;
+    block->solt = -1;
+    list_del_init(&block->hash_list);
+    list_del(&block->lru_list);
+    list_add(&block->lru_list, &buf_free_list);
+}
+
+static int buf_block_compare(buf_block_t *a, buf_block_t *b)
+{
+    if (a->solt != b->solt)
+        return a->solt - b->solt;
+    return a->sector > b->sector ? 1 : (a->sector < b->sector ? -1 : 0);
+}
+
+/**
+ * 写回脏块。按磁盘和扇区排序后把连续的扇区合并成一次写入。
+ * solt小于0时写回所有磁盘。需要持有写回锁调用，写磁盘时不持有缓存锁。
+ * 正在写回的块标记为忙，不会被回收，写回前清除脏标记，写回期间再次写入的块会重新变脏。
+ */
+static int buf_cache_do_flush(int solt)
+{
+    buf_block_t *block;
+    int count = 0, i, j, k;
+    mutex_lock(&buf_cache_mutex);
+    list_for_each_owner (block, &buf_lru_list, lru_list) {
+        if (!(block->flags & BUF_BLOCK_DIRTY))
+            continue;
+        if (solt >= 0 && block->solt != solt)
+            continue;
+        /* 插入排序，脏块数量不多 */
+        for (i = count; i > 0 && buf_block_compare(buf_flush_table[i - 1], block) > 0; i--)
+            buf_flush_table[i] = buf_flush_table[i - 1];
+        buf_flush_table[i] = block;
+        block->flags |= BUF_BLOCK_BUSY;
+        count++;
+    }
+    mutex_unlock(&buf_cache_mutex);
+    int err = 0;
+    for (i = 0; i < count; i = j) {
+        for (j = i + 1; j < count && j - i < BUF_CACHE_IO_NR; j++) {
+            if (buf_flush_table[j]->solt != buf_flush_table[i]->solt ||
+                buf_flush_table[j]->sector != buf_flush_table[i]->sector + (j - i))
+                break;
+        }
+        mutex_lock(&buf_cache_mutex);
+        for (k = i; k < j; k++) {
+            memcpy(buf_flush_buffer + (k - i) * BUF_BLOCK_SIZE, buf_flush_table[k]->data, BUF_BLOCK_SIZE);
+            buf_flush_table[k]->flags &= ~BUF_BLOCK_DIRTY;
+            buf_dirty_count--;
+        }
+        mutex_unlock(&buf_cache_mutex);
+        if (disk_manager_raw_write(buf_flush_table[i]->solt, buf_flush_table[i]->sector,
+            buf_flush_buffer, (j - i) * BUF_BLOCK_SIZE) < 0) {
+            keprint(PRINT_ERR "bufcache: write back disk %d sector %d count %d failed!\n",
+                buf_flush_table[i]->solt, buf_flush_table[i]->sector, j - i);
+            mutex_lock(&buf_cache_mutex);
+            for (k = i; k < j; k++) {
+                if (!(buf_flush_table[k]->flags & BUF_BLOCK_DIRTY)) {
+                    buf_flush_table[k]->flags |= BUF_BLOCK_DIRTY;
+                    buf_dirty_count++;
+                }
+            }
+            mutex_unlock(&buf_cache_mutex);
+            err = -1;
+        }
+    }
+    mutex_lock(&buf_cache_mutex);
+    for (i = 0; i < count; i++)
+        buf_flush_table[i]->flags &= ~BUF_BLOCK_BUSY;
+    mutex_unlock(&buf_cache_mutex);
+    #ifdef DEBUG_BUF_CACHE
+    if (count)
+        keprint(PRINT_DEBUG "bufcache: flush %d blocks\n", count);
+    #endif
+    return err;
+}
+
+/**
+ * 分配一个缓存块。没有空闲块时回收最久没有使用的干净块，脏块和正在写回的块不回收。
+ * 需要持有缓存锁调用，所有块都是脏块时返回NULL。
+ */
+static buf_block_t *buf_block_alloc(int solt, unsigned long sector)
+{
+    buf_block_t *block, *victim = NULL;
+    if (list_empty(&buf_free_list)) {
+        list_for_each_owner_reverse (block, &buf_lru_list, lru_list) {
+            if (!(block->flags & (BUF_BLOCK_DIRTY | BUF_BLOCK_BUSY))) {
+                victim = block;
+                break;
+            }
+        }
+        if (victim == NULL)
+            return NULL;
+        buf_block_release(victim);
+    }
+    block = list_first_owner(&buf_free_list, buf_block_t, lru_list);
+    list_del(&block->lru_list);
+    list_add(&block->lru_list, &buf_lru_list);
+    block->solt = solt;
+    block->sector = sector;
+    block->flags = 0;
+    list_add(&block->hash_list, buf_hash(solt, sector));
+    return block;
+}
+
+static void buf_block_touch(buf_block_t *block)
+{
+    list_del(&block->lru_list);
+    list_add(&block->lru_list, &buf_lru_list);
+}
+
+/**
+ * 读取一段连续的未缓存扇区，后面多读的扇区作为预读放入缓存。
+ * 需要持有缓存锁调用，读磁盘期间释放锁。重新加锁后如果别的任务已经缓存了某个扇区，
+ * 以缓存中的数据为准，它可能是读磁盘期间写入的新数据。
+ */
+static int buf_cache_fill(int solt, unsigned long sector, unsigned long count,
+    unsigned long readahead, unsigned char *buffer)
+{
+    unsigned long sectors = buf_disks[solt].sectors;
+    unsigned long i;
+    for (i = 0; i < readahead; i++) {
+        if ((sectors && sector + count + i >= sectors) ||
+            buf_cache_lookup(solt, sector + count + i))
+            break;
+    }
+    readahead = i;
+    unsigned char *iobuf = mem_alloc((count + readahead) * BUF_BLOCK_SIZE);
+    if (iobuf == NULL) {
+        readahead = 0;
+        iobuf = buffer;     /* 没有内存时不预读，直接读到调用者的缓冲区 */
+    }
+    mutex_unlock(&buf_cache_mutex);
+    int err = disk_manager_raw_read(solt, sector, iobuf, (count + readahead) * BUF_BLOCK_SIZE);
+    if (err < 0 && readahead) {
+        /* 预读的部分可能超出磁盘范围，只读需要的扇区 */
+        readahead = 0;
+        err = disk_manager_raw_read(solt, sector, iobuf, count * BUF_BLOCK_SIZE);
+    }
+    mutex_lock(&buf_cache_mutex);
+    if (err < 0) {
+        if (iobuf != buffer)
+            mem_free(iobuf);
+        return -1;
+    }
+    for (i = 0; i < count + readahead; i++) {
+        unsigned char *data = iobuf + i * BUF_BLOCK_SIZE;
+        buf_block_t *block = buf_cache_lookup(solt, sector + i);
+        if (block) {
+            data = block->data;
+        } else {
+            block = buf_block_alloc(solt, sector + i);
+            if (block)
+                memcpy(block->data, data, BUF_BLOCK_SIZE);
+        }
+        if (i < count && data != buffer + i * BUF_BLOCK_SIZE)
+            memcpy(buffer + i * BUF_BLOCK_SIZE, data, BUF_BLOCK_SIZE);
+    }
+    if (iobuf != buffer)
+        mem_free(iobuf);
+    return 0;
+}
+
+int buf_cache_read(int solt, unsigned long sector, void *buffer, unsigned long count)
+{
+    if (solt < 0 || solt >= DISK_MAN_SOLT_NR)
+        return -1;
+    unsigned char *buf = buffer;
+    buf_block_t *block;
+    unsigned long i, j;
+    if (count > BUF_CACHE_BYPASS_NR) {
+        if (disk_manager_raw_read(solt, sector, buffer, count * BUF_BLOCK_SIZE) < 0)
+            return -1;
+        mutex_lock(&buf_cache_mutex);
+        /* 缓存中的块可能还没有写回，以缓存为准 */
+        for (i = 0; i < count; i++) {
+            block = buf_cache_lookup(solt, sector + i);
+            if (block)
+                memcpy(buf + i * BUF_BLOCK_SIZE, block->data, BUF_BLOCK_SIZE);
+        }
+        buf_disks[solt].next_sector = sector + count;
+        mutex_unlock(&buf_cache_mutex);
+        return 0;
+    }
+    mutex_lock(&buf_cache_mutex);
+    int sequential = (sector == buf_disks[solt].next_sector);
+    for (i = 0; i < count; i = j) {
+        block = buf_cache_lookup(solt, sector + i);
+        if (block) {
+            memcpy(buf + i * BUF_BLOCK_SIZE, block->data, BUF_BLOCK_SIZE);
+            buf_block_touch(block);
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < count; j++) {
+            if (buf_cache_lookup(solt, sector + j))
+                break;
+        }
+        unsigned long readahead = (sequential && j == count) ? BUF_CACHE_READAHEAD_NR : 0;
+        if (buf_cache_fill(solt, sector + i, j - i, readahead, buf + i * BUF_BLOCK_SIZE) < 0) {
+            mutex_unlock(&buf_cache_mutex);
+            return -1;
+        }
+    }
+    buf_disks[solt].next_sector = sector + count;
+    mutex_unlock(&buf_cache_mutex);
+    return 0;
+}
+
+/* 写回所有脏块，不能持有缓存锁调用 */
+static int buf_cache_flush_all()
+{
+    mutex_lock(&buf_flush_mutex);
+    int err = buf_cache_do_flush(-1);
+    mutex_unlock(&buf_flush_mutex);
+    return err;
+}
+
+/**
+ * 写入缓存并标记为脏块，由写回线程或者同步时写入磁盘。
+ */
+int buf_cache_write(int solt, unsigned long sector, void *buffer, unsigned long count)
+{
+    if (solt < 0 || solt >= DISK_MAN_SOLT_NR)
+        return -1;
+    unsigned char *buf = buffer;
+    buf_block_t *block;
+    unsigned long i;
+    if (count > BUF_CACHE_BYPASS_NR) {
+        /* 持有写回锁，避免写回线程用旧数据覆盖直接写入的数据 */
+        mutex_lock(&buf_flush_mutex);
+        mutex_lock(&buf_cache_mutex);
+        /* 先更新缓存中的块，写入磁盘后这些块就和磁盘一致了 */
+        for (i = 0; i < count; i++) {
+            block = buf_cache_lookup(solt, sector + i);
+            if (block) {
+                memcpy(block->data, buf + i * BUF_BLOCK_SIZE, BUF_BLOCK_SIZE);
+                if (block->flags & BUF_BLOCK_DIRTY) {
+                    block->flags &= ~BUF_BLOCK_DIRTY;
+                    buf_dirty_count--;
+                }
+            }
+        }
+        mutex_unlock(&buf_cache_mutex);
+        int err = disk_manager_raw_write(solt, sector, buffer, count * BUF_BLOCK_SIZE);
+        if (err < 0) {
+            /* 没有写入磁盘，缓存中的块需要以后再写回 */
+            mutex_lock(&buf_cache_mutex);
+            for (i = 0; i < count; i++) {
+                block = buf_cache_lookup(solt, sector + i);
+                if (block && !(block->flags & BUF_BLOCK_DIRTY)) {
+                    block->flags |= BUF_BLOCK_DIRTY;
+                    buf_dirty_count++;
+                }
+            }
+            mutex_unlock(&buf_cache_mutex);
+        }
+        mutex_unlock(&buf_flush_mutex);
+        return err < 0 ? -1 : 0;
+    }
+    int flushed = 0;
+    mutex_lock(&buf_cache_mutex);
+    for (i = 0; i < count; i++) {
+        block = buf_cache_lookup(solt, sector + i);
+        if (block) {
+            buf_block_touch(block);
+        } else {
+            block = buf_block_alloc(solt, sector + i);
+            if (block == NULL) {
+                /* 所有块都是脏块，写回一次后再试 */
+                mutex_unlock(&buf_cache_mutex);
+                if (flushed++ || buf_cache_flush_all() < 0)
+                    return -1;
+                mutex_lock(&buf_cache_mutex);
+                i--;
+                continue;
+            }
+        }
+        memcpy(block->data, buf + i * BUF_BLOCK_SIZE, BUF_BLOCK_SIZE);
+        if (!(block->flags & BUF_BLOCK_DIRTY)) {
+            block->flags |= BUF_BLOCK_DIRTY;
+            buf_dirty_count++;
+        }
+    }
+    int over = buf_dirty_count > BUF_CACHE_DIRTY_MAX;
+    mutex_unlock(&buf_cache_mutex);
+    if (over)
+        return buf_cache_flush_all();
+    return 0;
+}
+
+/**
+ * 把磁盘的脏块写回，solt小于0时同步所有磁盘
+ */
+int buf_cache_sync(int solt)
+{
+    mutex_lock(&buf_flush_mutex);
+    int err = buf_cache_do_flush(solt);
+    mutex_unlock(&buf_flush_mutex);
+    /* 数据可能还在磁盘的写缓存中 */
+    disk_manager_flush(solt);
+    return err;
+}
+
+/* 丢弃磁盘的所有缓存块，磁盘关闭时调用，调用前需要先同步 */
+void buf_cache_invalidate(int solt)
+{
+    buf_block_t *block, *next;
+    /* 持有写回锁时没有正在写回的块 */
+    mutex_lock(&buf_flush_mutex);
+    mutex_lock(&buf_cache_mutex);
+    list_for_each_owner_safe (block, next, &buf_lru_list, lru_list) {
+        if (block->solt == solt)
+            buf_block_release(block);
+    }
+    buf_disks[solt].next_sector = 0;
+    mutex_unlock(&buf_cache_mutex);
+    mutex_unlock(&buf_flush_mutex);
+}
+
+void buf_cache_set_disk_size(int solt, unsigned long sectors)
+{
+    if (solt < 0 || solt >= DISK_MAN_SOLT_NR)
+        return;
+    buf_disks[solt].sectors = sectors;
+}
+
+static void buf_cache_flush_thread(void *arg)
+{
+    while (1) {
+        task_sleep_by_ticks(BUF_CACHE_FLUSH_INTERVAL * HZ);
+        if (!buf_dirty_count)
+            continue;
+        buf_cache_sync(-1);
+    }
+}
+
+int sys_sync()
+{
+    return buf_cache_sync(-1);
+}
+
+int buf_cache_init()
+{
+    buf_block_table = mem_alloc(BUF_CACHE_BLOCK_NR * sizeof(buf_block_t));
+    if (buf_block_table == NULL)
+        return -1;
+    unsigned char *data = mem_alloc(BUF_CACHE_BLOCK_NR * BUF_BLOCK_SIZE);
+    if (data == NULL) {
+        mem_free(buf_block_table);
+        return -1;
+    }
+    int i;
+    for (i = 0; i < BUF_CACHE_HASH_NR; i++)
+        list_init(&buf_hash_table[i]);
+    for (i = 0; i < BUF_CACHE_BLOCK_NR; i++) {
+        buf_block_t *block = &buf_block_table[i];
+        list_init(&block->hash_list);
+        block->solt = -1;
+        block->sector = 0;
+        block->flags = 0;
+        block->data = data + i * BUF_BLOCK_SIZE;
+        list_add_tail(&block->lru_list, &buf_free_list);
+    }
+    for (i = 0; i < DISK_MAN_SOLT_NR; i++) {
+        buf_disks[i].next_sector = 0;
+        buf_disks[i].sectors = 0;
+    }
+    if (task_create("bufflush", TASK_PRIO_LEVEL_NORMAL, buf_cache_flush_thread, NULL) == NULL) {
+        keprint(PRINT_ERR "bufcache: start flush thread failed!\n");
+        return -1;
+    }
+    return 0;
+}
@@ -2,8 +2,11 @@
 #include <xbook/diskman.h>
 #include <xbook/memalloc.h>
 #include <xbook/path.h>
+#include <xbook/bufcache.h>
+#include <sys/ioctl.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 
 LIST_HEAD(disk_list_head);
 static int next_disk_solt = 0;
@@ -112,6 +115,10 @@ static int disk_manager_open(int solt)
                     return -1;
                 }
                 disk_solt_cache[solt] = disk->handle;
+                unsigned int sectors = 0;
+                if (device_devctl(disk->handle, DISKIO_GETSIZE, (unsigned long) &sectors) < 0)
+                    sectors = 0;
+                buf_cache_set_disk_size(solt, sectors);
             }
             atomic_inc(&disk->ref);
             mutex_unlock(&disk_manager_mutex);
@@ -131,6 +138,9 @@ static int disk_manager_close(int solt)
     list_for_each_owner (disk, &disk_list_head, list) {
         if (disk->solt == solt) {
             if (atomic_get(&disk->ref) == 1) {
+                /* 最后一次关闭，写回脏块后丢弃缓存 */
+                buf_cache_sync(solt);
+                buf_cache_invalidate(solt);
                 if (device_close(disk->handle) != 0) {
                     mutex_unlock(&disk_manager_mutex);
                     return -1;
@@ -157,7 +167,8 @@ static int disk_manager_close(int solt)
     return -1;
 }
 
-static int disk_manager_read(int solt, off_t off, void *buffer, size_t size)
+/* 直接读写磁盘，不经过缓存，提供给块缓存使用 */
+int disk_manager_raw_read(int solt, off_t off, void *buffer, size_t size)
 {
     if (IS_BAD_SOLT(solt))
         return -1;
@@ -166,7 +177,7 @@ static int disk_manager_read(int solt, off_t off, void *buffer, size_t size)
     return 0;
 }
 
-static int disk_manager_write(int solt, off_t off, void *buffer, size_t size)
+int disk_manager_raw_write(int solt, off_t off, void *buffer, size_t size)
 {
     if (IS_BAD_SOLT(solt))
         return -1;
@@ -175,6 +186,38 @@ static int disk_manager_write(int solt, off_t off, void *buffer, size_t size)
     return 0;
 }
 
+/* 刷新磁盘自身的写缓存，solt为-1时刷新所有打开的磁盘，驱动不支持时忽略 */
+void disk_manager_flush(int solt)
+{
+    int i;
+    for (i = 0; i < DISK_MAN_SOLT_NR; i++) {
+        if ((solt >= 0 && i != solt) || SOLT_TO_HANDLE(i) < 0)
+            continue;
+        device_devctl(SOLT_TO_HANDLE(i), DISKIO_SYNC, 0);
+    }
+}
+
+static int disk_manager_read(int solt, off_t off, void *buffer, size_t size)
+{
+    if (IS_BAD_SOLT(solt))
+        return -1;
+    return buf_cache_read(solt, off, buffer, DIV_ROUND_UP(size, BUF_BLOCK_SIZE));
+}
+
+static int disk_manager_write(int solt, off_t off, void *buffer, size_t size)
+{
+    if (IS_BAD_SOLT(solt))
+        return -1;
+    return buf_cache_write(solt, off, buffer, DIV_ROUND_UP(size, BUF_BLOCK_SIZE));
+}
+
+static int disk_manager_sync(int solt)
+{
+    if (IS_BAD_SOLT(solt))
+        return -1;
+    return buf_cache_sync(solt);
+}
+
 static int disk_manager_ioctl(int solt, unsigned int cmd, unsigned long arg)
 {
     if (IS_BAD_SOLT(solt))
@@ -195,10 +238,13 @@ int disk_manager_init()
         disk_solt_cache[i] = -1;
 
     disk_info_print();
+    if (buf_cache_init() < 0)
+        return -1;
     diskman.open = disk_manager_open;
     diskman.close = disk_manager_close;
     diskman.read = disk_manager_read;
     diskman.write = disk_manager_write;
     diskman.ioctl = disk_manager_ioctl;
+    diskman.sync = disk_manager_sync;
     return 0;
 }
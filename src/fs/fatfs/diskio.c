@@ -15,6 +15,10 @@
 #include <sys/ioctl.h>
 #include <xbook/diskman.h>
 #include <xbook/debug.h>
+#include <xbook/memcache.h>
+
+/* 一次磁盘请求的最大扇区数，缓冲区IO的设备一次最多复制这么多 */
+#define DISKIO_MAX_SECTORS  (MAX_MEM_CACHE_SIZE / FF_MIN_SS)
 
 /* 文件系统驱动映射表 */
 extern int fatfs_drv_map[FF_VOLUMES];
@@ -74,11 +78,16 @@ DRESULT disk_read (
     if (pdrv >= FF_VOLUMES)
         return RES_PARERR;
 
-    DRESULT res = RES_OK;
-    if (diskman.read(fatfs_drv_map[pdrv], sector, (void *) buff, count * FF_MIN_SS) < 0) {
-        res = RES_ERROR;
+    /* 连续的多个簇一次读取，太大时分成多个请求 */
+    while (count > 0) {
+        UINT n = count > DISKIO_MAX_SECTORS ? DISKIO_MAX_SECTORS : count;
+        if (diskman.read(fatfs_drv_map[pdrv], sector, (void *) buff, n * FF_MIN_SS) < 0)
+            return RES_ERROR;
+        buff += n * FF_MIN_SS;
+        sector += n;
+        count -= n;
     }
-    return res;
+    return RES_OK;
 }
 
 
@@ -99,11 +108,15 @@ DRESULT disk_write (
 	if (pdrv >= FF_VOLUMES)
         return RES_PARERR;
 
-	DRESULT res = RES_OK;
-    if (diskman.write(fatfs_drv_map[pdrv], sector, (void *) buff, count * FF_MIN_SS) < 0) {
-        res = RES_ERROR;
+    while (count > 0) {
+        UINT n = count > DISKIO_MAX_SECTORS ? DISKIO_MAX_SECTORS : count;
+        if (diskman.write(fatfs_drv_map[pdrv], sector, (void *) buff, n * FF_MIN_SS) < 0)
+            return RES_ERROR;
+        buff += n * FF_MIN_SS;
+        sector += n;
+        count -= n;
     }
-    return res;
+    return RES_OK;
 }
 
 #endif
@@ -126,7 +139,7 @@ DRESULT disk_ioctl (
     switch(cmd)
     {
     case CTRL_SYNC:
-        res = RES_OK;
+        res = diskman.sync(fatfs_drv_map[pdrv]) < 0 ? RES_ERROR : RES_OK;
         break;     
     case GET_SECTOR_SIZE:
         *(WORD*)buff = 512; res = RES_OK;
@@ -3930,7 +3930,23 @@ FRESULT f_read (
 			cc = btr / SS(fs);					/* When remaining bytes >= sector size, */
 			if (cc > 0) {						/* Read maximum contiguous sectors directly */
 				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
+					UINT want = cc;
 					cc = fs->csize - csect;
+					/* xbook: extend the transfer over physically contiguous clusters */
+					while (cc < want) {
+						FSIZE_t nofs = fp->fptr + (FSIZE_t)cc * SS(fs);	/* File offset of the next cluster */
+#if FF_USE_FASTSEEK
+						if (fp->cltbl) {
+							clst = clmt_clust(fp, nofs);
+						} else
+#endif
+						{
+							clst = get_fat(&fp->obj, fp->clust);
+						}
+						if (clst != fp->clust + 1) break;	/* Fragmented or end of chain */
+						fp->clust = clst;
+						cc += (want - cc > fs->csize) ? fs->csize : want - cc;
+					}
 				}
 				if (disk_read(fs->pdrv, rbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
 #if !FF_FS_READONLY && FF_FS_MINIMIZE <= 2		/* Replace one of the read sectors with cached data if it contains a dirty sector */
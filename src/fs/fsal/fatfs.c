@@ -15,6 +15,7 @@
 #include <errno.h>
 #include <sys/dir.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 
 // #define DEBUG_FATFS
 
@@ -38,8 +39,16 @@ typedef struct {
     char path[MAX_PATH];    /* 保存文件路径 */
     char *dir_path;         /* 目录路径：只有被当做目录打开时才有效，默认为NULL */
     char *tmpdire;          /* 进行getdents操作时，会产生目录读取断层问题，才用临时缓冲区解决该问题 */
+    DWORD *cltbl;           /* 快速定位的簇映射表，只读打开的大文件才有 */
 } fatfs_file_extention_t;
 
+/* 超过这个大小的只读文件创建簇映射表，读取和定位时不需要沿着FAT链查找 */
+#define FATFS_FASTSEEK_MIN      (64 * 1024)
+/* 簇映射表初始的项数，每个连续的簇段占用2项 */
+#define FATFS_CLTBL_INIT        32
+/* 簇映射表最大的项数，碎片太多的文件不使用快速定位 */
+#define FATFS_CLTBL_MAX         1024
+
 fatfs_extention_t fatfs_extention;
 
 int fatfs_drv_map[FF_VOLUMES] = {
@@ -288,6 +297,35 @@ static int fatfs_is_director(char *path, DIR *dir)
     return 0;
 }
 
+/**
+ * 给文件创建簇映射表，表不够大时按照需要的大小重新分配一次。
+ * 快速定位模式下文件不能变大，所以只用于只读打开的文件，失败时仍然使用普通模式。
+ */
+static void fatfs_file_create_linkmap(fatfs_file_extention_t *extension)
+{
+    FIL *file = &extension->file;
+    UINT nr = FATFS_CLTBL_INIT;
+    while (nr <= FATFS_CLTBL_MAX) {
+        DWORD *cltbl = mem_alloc(nr * sizeof(DWORD));
+        if (!cltbl)
+            break;
+        cltbl[0] = nr;
+        file->cltbl = cltbl;
+        FRESULT fres = f_lseek(file, CREATE_LINKMAP);
+        if (fres == FR_OK) {
+            extension->cltbl = cltbl;
+            return;
+        }
+        file->cltbl = NULL;
+        /* 表不够大时，第一项返回需要的项数 */
+        UINT need = cltbl[0];
+        mem_free(cltbl);
+        if (fres != FR_NOT_ENOUGH_CORE || need <= nr)
+            break;
+        nr = need;
+    }
+}
+
 static int fsal_fatfs_open(void *path, int flags)
 {
     fsal_file_t *fp = fsal_file_alloc();
@@ -304,6 +342,7 @@ static int fsal_fatfs_open(void *path, int flags)
     fatfs_file_extention_t *extension = (fatfs_file_extention_t *) fp->extension;
     extension->dir_path = NULL;     /* 普通文件时为NULL，为目录时才有效 */
     extension->tmpdire = NULL;      /* 默认没有临时目录 */
+    extension->cltbl = NULL;
     memset(extension->path, 0, MAX_PATH);
     strcpy(extension->path, path);
     fp->fsal = &fatfs_fsal;
@@ -349,6 +388,8 @@ static int fsal_fatfs_open(void *path, int flags)
             } else {
                 extension->dir_path = extension->path;  /* open as director */
             }
+        } else if (!(mode & FA_WRITE) && f_size(&extension->file) >= FATFS_FASTSEEK_MIN) {
+            fatfs_file_create_linkmap(extension);
         }
     }
     return FSAL_FILE2IDX(fp);
@@ -376,6 +417,10 @@ static int fsal_fatfs_close(int idx)
             errprint("[fatfs]: close file failed!\n");
             return -1;
         }
+        if (extension->cltbl) {
+            mem_free(extension->cltbl);
+            extension->cltbl = NULL;
+        }
     }
     if (fp->extension)
         mem_free(fp->extension);
@@ -386,8 +431,8 @@ static int fsal_fatfs_close(int idx)
 }
 
 /**
- * The data of multiple sectors read once may not be read correctly. In this case,
- *  the data is read in units of 1 sector
+ * 整个请求交给f_read，整扇区的部分由FatFs直接读到调用者的缓冲区，
+ * 物理上连续的簇合并成一次磁盘读取。
  */
 static int fsal_fatfs_read(int idx, void *buf, size_t size)
 {
@@ -396,31 +441,14 @@ static int fsal_fatfs_read(int idx, void *buf, size_t size)
     fsal_file_t *fp = FSAL_IDX2FILE(idx);
     if (FSAL_BAD_FILE(fp))
         return -1;
-    
     FRESULT fr;
-    UINT br;
-    UINT readbytes = 0;
-    
-    // read 512 bytes each time
-    UINT chunk;
-    uint8_t *p = (uint8_t *) buf;
-    chunk =  size % (SECTOR_SIZE); // read mini block
-    while (size > 0) {
-        br = 0;
-        fr = f_read((FIL *)fp->extension, p, chunk, &br);
-        if (fr != FR_OK && !readbytes) { // first time read get error
-            errprint("fatfs: f_read: err code %d\n", fr);
-            return -1;
-        } else  if (fr != FR_OK ) { // next time read over
-            errprint("fatfs: f_read: err code %d, rd=%d br=%d\n", fr, readbytes, br);
-            return readbytes + br;
-        }
-        p += chunk;
-        size -= chunk;
-        chunk =  (SECTOR_SIZE ); // read 512 bytes block
-        readbytes += br;
+    UINT br = 0;
+    fr = f_read((FIL *)fp->extension, buf, size, &br);
+    if (fr != FR_OK) {
+        errprint("fatfs: f_read: err code %d, br=%d\n", fr, br);
+        return br ? br : -1;
     }
-    return readbytes;
+    return br;
 }
 
 static int fsal_fatfs_write(int idx, void *buf, size_t size)
@@ -849,9 +877,70 @@ static int fsal_fatfs_chdir(char *path)
     return 0;
 }
 
+/**
+ * 找到文件中从extent->offset扇区开始的一段连续扇区在磁盘上的位置。
+ * 交换文件用它在swapon时解析出扇区，之后直接读写磁盘，不再经过文件系统。
+ */
+static int fatfs_file_get_extent(fatfs_file_extention_t *extension, disk_extent_t *extent)
+{
+    FIL *file = &extension->file;
+    FATFS *fs = file->obj.fs;
+    unsigned long sectors = f_size(file) / FF_MIN_SS;
+    if (extent->offset >= sectors)
+        return -EINVAL;
+    /* 文件缓冲区中的数据先写回，之后不会再通过文件系统写这些扇区 */
+    if (f_sync(file) != FR_OK)
+        return -EIO;
+    DWORD *cltbl = extension->cltbl;
+    if (!cltbl) {
+        /* 可写打开的文件没有簇映射表，临时创建一个 */
+        fatfs_file_create_linkmap(extension);
+        cltbl = extension->cltbl;
+        extension->cltbl = NULL;
+        file->cltbl = NULL;
+        if (!cltbl)
+            return -ENOMEM;
+    }
+    int err = -EINVAL;
+    DWORD index = extent->offset / fs->csize;
+    DWORD *tbl = cltbl + 1;
+    while (*tbl) {
+        DWORD ncl = *tbl++;
+        DWORD clst = *tbl++;
+        if (index < ncl) {
+            unsigned long in = extent->offset % fs->csize;
+            extent->solt = fatfs_drv_map[fs->pdrv];
+            extent->sector = fs->database + (LBA_t)fs->csize * (clst + index - 2) + in;
+            extent->count = (ncl - index) * fs->csize - in;
+            if (extent->count > sectors - extent->offset)
+                extent->count = sectors - extent->offset;
+            err = 0;
+            break;
+        }
+        index -= ncl;
+    }
+    if (cltbl != extension->cltbl)
+        mem_free(cltbl);
+    return err;
+}
+
 static int fsal_fatfs_ioctl(int fd, int cmd, void *arg)
 {
-    /* NOTICE: FATFS暂时不支持 */
+    if (FSAL_BAD_FILE_IDX(fd))
+        return -EINVAL;
+    fsal_file_t *fp = FSAL_IDX2FILE(fd);
+    if (FSAL_BAD_FILE(fp))
+        return -EINVAL;
+    fatfs_file_extention_t *extension = (fatfs_file_extention_t *) fp->extension;
+    switch (cmd) {
+    case DISKIO_GETEXTENT:
+        if (extension->dir_path || !arg)
+            return -EINVAL;
+        return fatfs_file_get_extent(extension, (disk_extent_t *) arg);
+    default:
+        /* NOTICE: FATFS暂时不支持其它命令 */
+        break;
+    }
     return -ENOSYS;
 }
 
@@ -14,6 +14,7 @@
 #include <xbook/fifo.h>
 #include <xbook/pipe.h>
 #include <xbook/safety.h>
+#include <xbook/mdl.h>
 #include <xbook/account.h>
 #include <xbook/dir.h>
 #include <sys/ipc.h>
@@ -60,6 +61,28 @@ int sys_close(int fd)
     return local_fd_uninstall(fd);
 }
 
+/**
+ * fsif_rw_user - 固定用户缓冲区后调用文件系统读写
+ * @rw: 文件系统的读写函数
+ * @write: 读取文件，数据写入用户缓冲区
+ * 
+ * FatFs读写时持有卷的信号量，这时缓冲区缺页去读取同一个卷上的文件映射，
+ * 会等待同一个信号量直到超时，所以先把缓冲区调入并固定。
+ * 一次最多读写MDL_MAX_SIZE字节
+ */
+static int fsif_rw_user(int (*rw)(int, void *, size_t), int handle,
+    void *buffer, size_t nbytes, bool write)
+{
+    if (nbytes > MDL_MAX_SIZE)
+        nbytes = MDL_MAX_SIZE;
+    unsigned long *pages = mdl_pin_user(buffer, nbytes, write);
+    if (pages == NULL)
+        return -EFAULT;
+    int ret = rw(handle, buffer, nbytes);
+    mdl_unpin_user(pages, buffer, nbytes);
+    return ret;
+}
+
 int sys_read(int fd, void *buffer, size_t nbytes)
 {
     if (fd < 0 || !nbytes || !buffer)
@@ -75,7 +98,7 @@ int sys_read(int fd, void *buffer, size_t nbytes)
     }
     if (!ffd->fsal->read)
         return -ENOSYS;
-    return ffd->fsal->read(ffd->handle, buffer, nbytes);
+    return fsif_rw_user(ffd->fsal->read, ffd->handle, buffer, nbytes, true);
 }
 
 int sys_fastread(int fd, void *buffer, size_t nbytes)
@@ -93,7 +116,7 @@ int sys_fastread(int fd, void *buffer, size_t nbytes)
     }
     if (!ffd->fsal->fastread)
         return -ENOSYS;
-    return ffd->fsal->fastread(ffd->handle, buffer, nbytes);
+    return fsif_rw_user(ffd->fsal->fastread, ffd->handle, buffer, nbytes, true);
 }
 
 int sys_fastwrite(int fd, void *buffer, size_t nbytes)
@@ -111,7 +134,7 @@ int sys_fastwrite(int fd, void *buffer, size_t nbytes)
     }
     if (!ffd->fsal->fastwrite)
         return -ENOSYS;
-    return ffd->fsal->fastwrite(ffd->handle, buffer, nbytes);
+    return fsif_rw_user(ffd->fsal->fastwrite, ffd->handle, buffer, nbytes, false);
 }
 
 int sys_write(int fd, void *buffer, size_t nbytes)
@@ -130,7 +153,7 @@ int sys_write(int fd, void *buffer, size_t nbytes)
     }
     if (!ffd->fsal->write)
         return -ENOSYS;
-    return ffd->fsal->write(ffd->handle, buffer, nbytes);
+    return fsif_rw_user(ffd->fsal->write, ffd->handle, buffer, nbytes, false);
 }
 
 int sys_ioctl(int fd, int cmd, void *arg)
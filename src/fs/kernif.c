@@ -75,6 +75,13 @@ int kfile_ftell(int fd)
     return fsif.ftell(fd);
 }
 
+int kfile_ioctl(int fd, int cmd, void *arg)
+{
+    if (!fsif.ioctl)
+        return -ENOSYS;
+    return fsif.ioctl(fd, cmd, arg);
+}
+
 int kfile_mkdir(const char *path, mode_t mode)
 {
     if (!path)
@@ -31,6 +31,8 @@
 #define DISKIO_SETUP        DEVCTL_CODE('d', 5)
 #define DISKIO_SETDOWN      DEVCTL_CODE('d', 6)
 #define DISKIO_GETSECSIZE   DEVCTL_CODE('d', 7)
+#define DISKIO_SYNC         DEVCTL_CODE('d', 8)
+#define DISKIO_GETEXTENT    DEVCTL_CODE('d', 9)  /* 获取连续扇区在物理磁盘上的位置 */
 
 /* tty */
 #define TTYIO_CLEAR         CONIO_CLEAR
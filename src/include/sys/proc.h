@@ -15,6 +15,9 @@ typedef struct _tstate {
     unsigned long ts_priority;  /* 优先级 */
     unsigned long ts_timeslice; /* 时间片 */
     unsigned long ts_runticks;  /* 运行的ticks数 */
+    unsigned long ts_fpuloads;  /* 恢复fpu状态的次数 */
+    unsigned long ts_faults;    /* 缺页次数 */
+    unsigned long ts_faultpages;    /* 缺页时映射的页数 */
     char ts_name[PROC_NAME_LEN];      /* 任务名字 */
 } tstate_t;
 
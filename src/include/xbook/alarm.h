@@ -15,7 +15,10 @@ static inline void alarm_init(alarm_t *alarm)
     alarm->second = 0;
 }
 
+#include <types.h>
+
 unsigned long sys_alarm(unsigned long second);
-void alarm_update_ticks();
+void alarm_update_ticks(clock_t ticks);
+clock_t alarm_next_timeout();
 
 #endif   /* _XBOOK_ALARM_H */
@@ -0,0 +1,43 @@
+#ifndef _XBOOK_BUFCACHE_H
+#define _XBOOK_BUFCACHE_H
+
+#include <types.h>
+#include <stddef.h>
+#include <xbook/list.h>
+
+/* 缓存块大小，和扇区大小一致 */
+#define BUF_BLOCK_SIZE          512
+/* 缓存块数量，一共缓存1MB */
+#define BUF_CACHE_BLOCK_NR      2048
+#define BUF_CACHE_HASH_NR       256
+/* 超过这么多扇区的读写直接访问磁盘，避免大文件的数据冲掉元数据 */
+#define BUF_CACHE_BYPASS_NR     64
+/* 顺序读取时预读的扇区数 */
+#define BUF_CACHE_READAHEAD_NR  32
+/* 脏块超过这个数量时立即写回 */
+#define BUF_CACHE_DIRTY_MAX     (BUF_CACHE_BLOCK_NR / 4)
+/* 写回线程的写回间隔（秒） */
+#define BUF_CACHE_FLUSH_INTERVAL    3
+
+#define BUF_BLOCK_DIRTY         0x01
+#define BUF_BLOCK_BUSY          0x02    /* 正在写回，不能回收 */
+
+typedef struct buf_block {
+    list_t hash_list;           /* 哈希链表 */
+    list_t lru_list;            /* 最近使用链表，表头是最近使用的 */
+    int solt;                   /* 磁盘插槽 */
+    unsigned long sector;       /* 扇区号 */
+    int flags;
+    unsigned char *data;        /* 扇区数据 */
+} buf_block_t;
+
+int buf_cache_init();
+int buf_cache_read(int solt, unsigned long sector, void *buffer, unsigned long count);
+int buf_cache_write(int solt, unsigned long sector, void *buffer, unsigned long count);
+int buf_cache_sync(int solt);
+void buf_cache_invalidate(int solt);
+void buf_cache_set_disk_size(int solt, unsigned long sectors);
+
+int sys_sync();
+
+#endif   /* _XBOOK_BUFCACHE_H */
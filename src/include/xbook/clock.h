@@ -24,6 +24,7 @@ extern volatile clock_t timer_ticks;    // timer ticks
 #define time_before_eq(unknown, known) ((long)(unknown) - (long)(known) <= 0)
 
 void clock_init();
+void clock_idle();
 void clock_msleep(unsigned long msecond);
 
 clock_t sys_get_ticks();
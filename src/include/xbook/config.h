@@ -11,12 +11,27 @@
 /* config large alloc size in memcache */
 #define CONFIG_LARGE_ALLOCS
 
+/* stop the periodic tick when idle, wake up by one-shot timer */
+#define CONFIG_TICKLESS_IDLE
+
+/* pages mapped around an anonymous page fault, power of two, 1 maps only the faulting page */
+#define CONFIG_FAULT_AROUND_PAGES   8
+
+/* route interrupts by local apic and ioapic, start application processors */
+/* #define CONFIG_SMP */
+
 /* auto select timezone */
 /* #define CONFIG_TIMEZONE_AUTO */
 
 /* test device info */
 // #define CONFIG_DEVICE_TEST
 
+/* run the timer wheel test in a kernel thread at boot */
+// #define CONFIG_TIMER_TEST
+
+/* check the word-wise bitmap scan against the bytewise one at boot */
+// #define CONFIG_BITMAP_TEST
+
 /* net config */
 #ifdef CONFIG_NET
 
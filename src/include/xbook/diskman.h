@@ -17,12 +17,21 @@ typedef struct {
 
 #define DISK_MAN_SOLT_NR 10
 
+/* DISKIO_GETEXTENT的参数：文件或者虚拟磁盘中一段连续的扇区在物理磁盘上的位置 */
+typedef struct {
+    unsigned long offset;   /* 输入：起始扇区 */
+    int solt;               /* 输出：物理磁盘的插槽 */
+    unsigned long sector;   /* 输出：在物理磁盘上的扇区 */
+    unsigned long count;    /* 输出：从offset开始连续的扇区数 */
+} disk_extent_t;
+
 typedef struct {
     int (*open)(int);
     int (*close)(int);
     int (*read)(int , off_t , void *, size_t );
     int (*write)(int , off_t , void *, size_t );
     int (*ioctl)(int , unsigned int , unsigned long );
+    int (*sync)(int );
 } disk_manager_t;
 
 extern disk_manager_t diskman;
@@ -32,5 +41,8 @@ void disk_info_print();
 int disk_manager_init();
 int disk_info_find(char *name);
 int disk_info_find_with_path(char *pathname);
+int disk_manager_raw_read(int solt, off_t off, void *buffer, size_t size);
+int disk_manager_raw_write(int solt, off_t off, void *buffer, size_t size);
+void disk_manager_flush(int solt);
 
 #endif   /* _XBOOK_DISKMAN_H */
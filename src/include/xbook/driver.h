@@ -83,6 +83,10 @@ enum _io_request_flags {
     IOREQ_DEVCTL_OPERATION      = (1 << 4),
     IOREQ_MMAP_OPERATION        = (1 << 5),
     IOREQ_BUFFERED_IO           = (1 << 6),
+    IOREQ_ASYNC                 = (1 << 7),     /* 异步请求，完成时调用回调 */
+    IOREQ_PENDING               = (1 << 8),     /* 驱动已经接收请求，稍后再完成 */
+    IOREQ_LOCKED                = (1 << 9),     /* 请求持有设备锁 */
+    IOREQ_DETACHED              = (1 << 10),    /* 异步请求完成后由框架释放 */
     IOREQ_COMPLETION            = (1 << 31),    /* 完成请求 */
 };
 
@@ -130,6 +134,11 @@ typedef struct _io_status_block {
     unsigned long infomation;           /* io结果信息 */
 } io_status_block_t;
 
+struct _io_request;
+
+/* 异步请求完成回调，可能在中断中调用 */
+typedef void (*io_completion_t)(struct _io_request *ioreq, void *arg);
+
 /* 输入输出请求 */
 typedef struct _io_request 
 {
@@ -141,9 +150,14 @@ typedef struct _io_request
     struct _device_object *devobj;      /* 设备对象 */
     io_parame_t parame;                 /* 参数 */
     io_status_block_t io_status;        /* 状态块 */
-    
+    io_completion_t completion;         /* 完成回调 */
+    void *completion_arg;               /* 完成回调的参数 */
+    void *waiter;                       /* 等待请求完成的任务 */
 } io_request_t;
 
+/* io请求池预先分配的请求数量 */
+#define IO_REQUEST_POOL_NR  32
+
 #define DEVICE_QUEUE_ENTRY_NR 12
 
 /* 设备队列管理 */
@@ -174,6 +188,8 @@ typedef struct _device_object
     unsigned int flags;                 /* 设备标志 */
     atomic_t reference;                 /* 引用计数，管理设备打开情况 */
     io_request_t *cur_ioreq;            /* 当前正在处理的io请求 */
+    list_t pending_list;                /* 已经提交还没有完成的请求 */
+    int pending_count;                  /* 未完成的请求数量 */
     string_t name;                      /* 名字 */
     uint16_t mtime;                     /* 设备修改时的时间 */
     uint16_t mdate;                     /* 设备修改时的日期 */
@@ -241,9 +257,23 @@ int driver_object_delete(driver_object_t *driver);
 
 device_object_t *io_search_device_by_name(char *name);
 
+io_request_t *io_build_async_request(
+    unsigned long function,
+    device_object_t *devobj,
+    void *buffer,
+    unsigned long length,
+    unsigned long offset,
+    io_completion_t completion,
+    void *arg
+);
+
 io_request_t *io_request_alloc();
+void io_request_free(io_request_t *ioreq);
 
 iostatus_t io_call_dirver(device_object_t *device, io_request_t *ioreq);
+iostatus_t io_submit_request(device_object_t *device, io_request_t *ioreq);
+iostatus_t io_wait_request(io_request_t *ioreq);
+void io_mark_request_pending(io_request_t *ioreq);
 
 void io_complete_request(io_request_t *ioreq);
 
@@ -269,6 +299,10 @@ int device_close(handle_t handle);
 ssize_t device_read(handle_t handle, void *buffer, size_t length, off_t offset);
 ssize_t device_write(handle_t handle, void *buffer, size_t length, off_t offset);
 ssize_t device_devctl(handle_t handle, unsigned int code, unsigned long arg);
+int device_read_async(handle_t handle, void *buffer, size_t length, off_t offset,
+    io_completion_t completion, void *arg);
+int device_write_async(handle_t handle, void *buffer, size_t length, off_t offset,
+    io_completion_t completion, void *arg);
 int device_incref(handle_t handle);
 int device_decref(handle_t handle);
 void *device_mmap(handle_t handle, size_t length, int flags);
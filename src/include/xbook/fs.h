@@ -70,5 +70,6 @@ int kfile_mkdir(const char *path, mode_t mode);
 int kfile_rmdir(const char *path);
 int kfile_getcwd(char *buf, int bufsz);
 int kfile_ftell(int fd);
+int kfile_ioctl(int fd, int cmd, void *arg);
 
 #endif /* _XBOOK_FS_H */
\ No newline at end of file
@@ -4,8 +4,16 @@
 #include "const.h"
 #include "task.h"
 #include "driver.h"
+#include <arch/page.h>
 
 #define MDL_MAX_SIZE    (32 * MB)
+/* 小于这个长度的用户缓冲区，复制一次比固定并映射页更快 */
+#define MDL_MIN_SIZE    (2 * PAGE_SIZE)
+/* 固定一个页时，通过页故障调入的最多尝试次数 */
+#define MDL_PIN_RETRY   4
+/* 缓冲区覆盖的页数 */
+#define MDL_PIN_PAGES(vaddr, length) \
+    ((PAGE_ALIGN((unsigned long) (vaddr) + (length)) - ((unsigned long) (vaddr) & PAGE_MASK)) / PAGE_SIZE)
 
 /* memory description list(MDL) 内存描述链表 */
 typedef struct _mdl {
@@ -23,10 +31,13 @@ typedef struct _mdl {
 #define MDL_GET_MAPPED_VADDR(mdl) ((mdl)->mapped_vaddr + (mdl)->byte_offset)
 
 mdl_t *mdl_alloc(void *vaddr, unsigned long length,
-    bool later, io_request_t *ioreq);
+    bool later, bool write, io_request_t *ioreq);
 
 void mdl_free(mdl_t *mdl);
 
+unsigned long *mdl_pin_user(void *vaddr, unsigned long length, bool write);
+void mdl_unpin_user(unsigned long *pages, void *vaddr, unsigned long length);
+
 
 
 #endif /* _XBOOK_MDL_H */
@@ -7,6 +7,7 @@
 #include <xbook/bitmap.h>
 #include <xbook/list.h>
 #include <xbook/mutexlock.h>
+#include <arch/cpu.h>
 #include <const.h>
 
 /*
@@ -48,6 +49,18 @@ typedef struct mem_group {
 
 #define MEM_CACHE_NAME_LEN 24
 
+/* 每个CPU的对象弹匣最多缓存的对象数量 */
+#define MEM_MAGAZINE_SIZE   16
+
+/* 
+每个CPU有一个对象弹匣，释放的对象先压入弹匣，分配时先从弹匣弹出。
+只会被本CPU访问，关中断就可以操作，不需要获取cache的互斥锁。
+*/
+typedef struct mem_magazine {
+    unsigned long count;                    // 弹匣中的对象数量
+    void *objects[MEM_MAGAZINE_SIZE];       // 对象栈
+} mem_magazine_t;
+
 typedef struct mem_cache {
     list_t full_groups;      // group对象都被使用了，就放在这个链表
     list_t partial_groups;   // group对象一部分被使用了，就放在这个链表
@@ -57,6 +70,8 @@ typedef struct mem_cache {
     flags_t flags;              // cache的标志位
     unsigned long object_count;  // 每个group中有多少个对象
     mutexlock_t mutex;
+    unsigned long magazine_limit;   // 弹匣最多缓存的对象数量，大对象缓存得少一些
+    mem_magazine_t magazines[CPU_NR_MAX];
     char name[MEM_CACHE_NAME_LEN];     // cache的名字
 } mem_cache_t;
 
@@ -65,8 +80,11 @@ typedef struct cache_size {
     mem_cache_t *mem_cache;      // 指向对应cache的指针
 } cache_size_t;
 
+/* 大内存对象哈希表大小，用对象的页地址散列 */
+#define LARGE_MEM_HASH_NR   64
+
 typedef struct {
-    list_t list;    /* 链表 */
+    list_t list;    /* 哈希链表 */
     size_t size;    /* 内存大小 */
     void *addr;     /* 虚拟地址 */
 } large_mem_object_t;
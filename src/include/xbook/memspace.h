@@ -23,6 +23,8 @@
 
 #define MAX_MEM_SPACE_MAP_SIZE    (256 * MB)
 
+struct page_cache;
+
 typedef struct mem_space {
     unsigned long start;        /* 空间开始地址 */
     unsigned long end;          /* 空间结束地址 */
@@ -30,6 +32,14 @@ typedef struct mem_space {
     unsigned long flags;        /* 空间的标志 */
     vmm_t *vmm;                 /* 空间对应的虚拟内存管理 */
     struct mem_space *next;     /* 所有空间构成单向链表 */
+    struct page_cache *cache;   /* 文件映射的页缓存，匿名映射为NULL */
+    unsigned long file_off;     /* 空间开始地址对应的文件偏移（页对齐） */
+    unsigned long file_size;    /* 从空间开始地址算起，文件数据的长度 */
+    struct mem_space *left;     /* 平衡树左子树 */
+    struct mem_space *right;    /* 平衡树右子树 */
+    int height;                 /* 平衡树中的高度 */
+    unsigned long gap;          /* 与前一个空间结尾之间的空闲大小 */
+    unsigned long max_gap;      /* 子树中最大的空闲大小，用于快速查找未映射区域 */
 } mem_space_t;
 
 typedef struct {
@@ -42,10 +52,16 @@ typedef struct {
 } mmap_args_t;
 
 #define mem_space_alloc() mem_alloc(sizeof(mem_space_t))
-#define mem_space_free    mem_free
+void mem_space_free(mem_space_t *space);
 
 void mem_space_dump(vmm_t *vmm);
 void mem_space_insert(vmm_t *vmm, mem_space_t *space);
+void mem_space_link(vmm_t *vmm, mem_space_t *space, mem_space_t *prev);
+void mem_space_remove(vmm_t *vmm, mem_space_t *space, mem_space_t *prev);
+void mem_space_set_start(vmm_t *vmm, mem_space_t *space, unsigned long start);
+void mem_space_set_end(vmm_t *vmm, mem_space_t *space, unsigned long end);
+mem_space_t *mem_space_find(vmm_t *vmm, unsigned long addr);
+mem_space_t *mem_space_find_prev(vmm_t *vmm, unsigned long addr, mem_space_t **prev);
 int do_mem_space_unmap(vmm_t *vmm, unsigned long addr, unsigned long len);
 int do_mem_space_map(vmm_t *vmm, unsigned long addr, unsigned long paddr, 
     unsigned long len, unsigned long prot, unsigned long flags);
@@ -54,6 +70,9 @@ void *mem_space_mmap(uint32_t addr, uint32_t paddr, uint32_t len, uint32_t prot,
 int mem_space_unmmap(uint32_t addr, uint32_t len);
 unsigned long sys_mem_space_expend_heap(unsigned long heap);
 unsigned long mem_space_get_unmaped(vmm_t *vmm, unsigned len);
+int do_mem_space_map_file(vmm_t *vmm, unsigned long addr, unsigned long len,
+    unsigned long prot, unsigned long flags, struct page_cache *cache,
+    unsigned long file_off, unsigned long file_size);
 
 void *mem_space_mmap_viraddr(uint32_t addr, uint32_t vaddr,
         uint32_t len, uint32_t prot, uint32_t flags);
@@ -69,39 +88,14 @@ static inline void mem_space_init(mem_space_t *space, unsigned long start,
     space->flags = flags;
     space->vmm = NULL;
     space->next = NULL;
-}
-
-static inline void mem_space_remove(vmm_t *vmm, mem_space_t *space, mem_space_t *prev)
-{
-    if (prev)
-        prev->next = space->next;
-    else
-        vmm->mem_space_head = space->next;    
-    mem_space_free(space);
-}
-
-static inline mem_space_t *mem_space_find(vmm_t *vmm, unsigned long addr)
-{
-    mem_space_t *space = vmm->mem_space_head;
-    while (space != NULL) {
-        if (addr < space->end)
-            return space;
-        space = space->next;
-    }
-    return NULL;
-}
-
-static inline mem_space_t *mem_space_find_prev(vmm_t *vmm, unsigned long addr, mem_space_t **prev)
-{
-    *prev = NULL;    /* prev save prev space ptr, set NULL first */
-    mem_space_t *space = vmm->mem_space_head;
-    while (space != NULL) {
-        if (addr < space->end)
-            return space;
-        *prev = space;   /* save prev */
-        space = space->next;
-    }
-    return NULL;
+    space->cache = NULL;
+    space->file_off = 0;
+    space->file_size = 0;
+    space->left = NULL;
+    space->right = NULL;
+    space->height = 0;
+    space->gap = 0;
+    space->max_gap = 0;
 }
 
 static inline mem_space_t *mem_space_find_intersection(vmm_t *vmm,
@@ -0,0 +1,40 @@
+#ifndef _XBOOK_PAGECACHE_H
+#define _XBOOK_PAGECACHE_H
+
+#include <types.h>
+#include <stddef.h>
+#include <xbook/list.h>
+#include <xbook/semaphore.h>
+#include <xbook/memspace.h>
+#include <arch/atomic.h>
+
+/* 页缓存哈希表大小 */
+#define PAGE_CACHE_HASH_NR      64
+/* 没有被映射时还保留在内存中的页缓存数量，再次执行同一个程序时可以直接使用 */
+#define PAGE_CACHE_IDLE_MAX     16
+
+#define PAGE_CACHE_STALE        0x01    /* 文件已经改变，最后一个引用释放时销毁 */
+
+/* 文件的页缓存，以文件路径区分，多个进程映射同一个文件时共享物理页 */
+typedef struct page_cache {
+    list_t hash_list;           /* 哈希链表 */
+    list_t idle_list;           /* 没有引用时放到空闲链表 */
+    char path[MAX_PATH];        /* 文件的绝对路径 */
+    off_t size;                 /* 文件大小 */
+    time_t mtime;               /* 文件修改时间，用来判断文件是否已经改变 */
+    int fd;                     /* 读取文件页使用的内核文件描述符 */
+    int flags;
+    atomic_t references;        /* 映射的引用次数 */
+    unsigned long npages;       /* 文件占用的页数 */
+    unsigned long *pages;       /* 每个文件页对应的物理页，为0表示还没有读取 */
+    semaphore_t lock;           /* 读取文件页时的互斥 */
+} page_cache_t;
+
+void page_cache_init();
+page_cache_t *page_cache_get(const char *path);
+void page_cache_hold(page_cache_t *cache);
+void page_cache_put(page_cache_t *cache);
+unsigned long page_cache_read_page(page_cache_t *cache, unsigned long index);
+int page_cache_fault(mem_space_t *space, unsigned long addr);
+
+#endif /* _XBOOK_PAGECACHE_H */
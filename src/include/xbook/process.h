@@ -4,6 +4,8 @@
 #include "task.h"
 #include "elf32.h"
 
+struct page_cache;
+
 #define PROC_CREATE_INIT    0X80000000      /* 只用于INIT进程 */
 #define PROC_CREATE_STOP    0X01            /* 创建后停止，不执行 */
 
@@ -14,7 +16,7 @@ int proc_vmm_exit(task_t *task);
 int proc_vmm_exit_when_forking(task_t *child, task_t *parent);
 int proc_build_arg(unsigned long arg_top, unsigned long *arg_bottom, char *argv[], char **dest_argv[]);
 void proc_map_space_init(task_t *task);
-int proc_load_image(vmm_t *vmm, struct Elf32_Ehdr *elf_header, int fd);
+int proc_load_image(vmm_t *vmm, struct Elf32_Ehdr *elf_header, int fd, struct page_cache *cache);
 void proc_trap_frame_init(task_t *task);
 int proc_release(task_t *task);
 int proc_pthread_init(task_t *task);
@@ -17,12 +17,28 @@ enum sched_priority_level {
     TASK_PRIO_LEVEL_MAX
 };
 
-#define TASK_PRIORITY_LOW       0
-#define TASK_PRIORITY_HIGH      2
-#define TASK_PRIORITY_REALTIME  3
-#define TASK_PRIORITY_MAX       TASK_PRIORITY_REALTIME
+/*
+ * 优先级数值越大越优先，一共32个优先级，刚好用一个32位的位图表示哪些队列有任务。
+ * 非实时任务的动态优先级在静态优先级上下浮动，实时任务和idle的优先级固定。
+ */
+#define TASK_PRIORITY_IDLE      0
+#define TASK_PRIORITY_LOW       4
+#define TASK_PRIORITY_NORMAL    12
+#define TASK_PRIORITY_HIGH      20
+#define TASK_PRIORITY_REALTIME  28
+#define TASK_PRIORITY_MAX       31
 #define TASK_PRIORITY_MAX_NR    (TASK_PRIORITY_MAX + 1)
 
+/* 动态优先级最多在静态优先级上增减的值 */
+#define SCHED_MAX_BONUS         4
+/* 睡眠平均值的上限，睡眠平均值越大，任务越倾向于交互 */
+#define SCHED_MAX_SLEEP_AVG     HZ
+/* 过期队列的任务等待超过这个时间，交互任务也要放到过期队列，避免饿死 */
+#define SCHED_STARVATION_LIMIT  HZ
+
+/* 调度单元标志 */
+#define SCHED_NEED_RESCHED      0x01    /* 唤醒了更高优先级的任务，需要尽快调度 */
+
 typedef struct {
     spinlock_t lock;
     list_t list;
@@ -30,15 +46,25 @@ typedef struct {
     unsigned int priority;  /* 队列优先级 */
 } sched_queue_t;
 
+/* 优先级数组，位图中置位的位表示对应优先级的队列中有任务 */
+typedef struct sched_array {
+    uint32_t bitmap;
+    uint32_t tasknr;
+    sched_queue_t queue[TASK_PRIORITY_MAX_NR];
+} sched_array_t;
+
 typedef struct {
     spinlock_t lock;
     cpuid_t cpuid;          /* 调度单元的cpuid */
     uint32_t flags;
-    uint32_t tasknr;
-    uint32_t dynamic_priority;      /* 当前调度单元的动态优先级 */
+    uint32_t tasknr;        /* 就绪任务数量，不包括idle */
     task_t *idle;           /* 当前调度单元的idle任务 */
     task_t *cur;            /* 当前调度单元的执行中的任务 */
-    sched_queue_t priority_queue[TASK_PRIORITY_MAX_NR];  /* 优先级队列 */
+    /* 时间片用完的任务放到过期数组，活动数组为空时交换两个数组 */
+    sched_array_t *active;
+    sched_array_t *expired;
+    sched_array_t arrays[2];
+    clock_t expired_timestamp;  /* 过期数组中第一个任务放入的时间 */
 } sched_unit_t;
 
 typedef struct _scheduler {
@@ -54,55 +80,29 @@ void schedule();
 void schedule_init();
 
 uint8_t sched_calc_base_priority(uint32_t level);
-uint8_t sched_calc_new_priority(task_t *task, char adjustment);
+uint8_t sched_calc_dynamic_priority(task_t *task);
+unsigned long sched_calc_timeslice(task_t *task);
 
+/* 调度单元和cpu_attached_list的下标一致，每个处理器只访问自己的调度单元 */
 static inline sched_unit_t *sched_get_cur_unit()
 {
-    sched_unit_t *su = NULL;
-    cpuid_t cpuid = cpu_get_my_id();
-    int i;
-    for (i = 0; i < scheduler.cpunr; i++) {
-        su = &scheduler.sched_unit_table[i];
-        if (su->cpuid == cpuid) {
-            return su;
-        }
-    }
-    if (unlikely(su == NULL))
-        panic("[schdule]: get unit null!");
-    return NULL;
+    return &scheduler.sched_unit_table[cpu_get_my_index()];
 }
 
+sched_unit_t *sched_pick_unit();
+sched_unit_t *sched_get_task_unit(task_t *task);
+
 static inline int sched_queue_has_task(sched_unit_t *su, task_t *task)
 {
-    sched_queue_t *queue = &su->priority_queue[su->dynamic_priority];
-    return list_find(&task->list, &queue->list);
-}
-
-static inline void sched_queue_add_tail(sched_unit_t *su, task_t *task)
-{    
-    sched_queue_t *queue = su->priority_queue + task->priority;
-    assert(!list_find(&task->list, &queue->list));
-    list_add_tail(&task->list, &queue->list);
-    queue->length++;
-    su->tasknr++;
-    scheduler.tasknr++;
-    if (task->priority > su->dynamic_priority) {
-        su->dynamic_priority = task->priority;
-    }
+    return task->sched_array != NULL;
 }
 
-static inline void sched_queue_add_head(sched_unit_t *su, task_t *task)
-{
-    sched_queue_t *queue = su->priority_queue + task->priority;
-    assert(!list_find(&task->list, &queue->list));
-    list_add_tail(&task->list, &queue->list);
-    queue->length++;
-    su->tasknr++;
-    scheduler.tasknr++;    
-    if (task->priority > su->dynamic_priority) {
-        su->dynamic_priority = task->priority;
-    }
-}
+/* 新任务加入就绪队列 */
+void sched_queue_add_tail(sched_unit_t *su, task_t *task);
+/* 唤醒的任务加入就绪队列 */
+void sched_queue_add_head(sched_unit_t *su, task_t *task);
+void sched_queue_remove(sched_unit_t *su, task_t *task);
+void sched_tick(sched_unit_t *su, task_t *task);
 
 void sched_print_queue(sched_unit_t *su);
 
@@ -0,0 +1,38 @@
+#ifndef _XBOOK_SWAP_H
+#define _XBOOK_SWAP_H
+
+#include <types.h>
+#include <stddef.h>
+#include <const.h>
+#include <arch/page.h>
+
+/* 一个交换槽保存一页，占用的扇区数 */
+#define SWAP_SLOT_SECTORS       (PAGE_SIZE / SECTOR_SIZE)
+/* 交换槽的最大数量，一共1GB */
+#define SWAP_SLOT_MAX           (256 * 1024)
+/* 交换槽的最大引用计数，fork后父子进程共享同一个槽 */
+#define SWAP_SLOT_COUNT_MAX     255
+/* 空闲用户页少于这么多时，换页线程开始换出 */
+#define SWAP_FREE_LOW           1024
+/* 换页线程换出到空闲用户页达到这么多为止 */
+#define SWAP_FREE_HIGH          2048
+/* 每次换出的页数 */
+#define SWAP_RECLAIM_BATCH      32
+/* 每换出一页最多扫描的页表项数，两遍就能给每个页第二次机会 */
+#define SWAP_SCAN_RATIO         64
+/* 交换文件最多的扇区段数量，碎片太多的文件不能交换 */
+#define SWAP_EXTENT_MAX         4096
+/* 换页线程检测空闲页的间隔（毫秒） */
+#define SWAP_DAEMON_INTERVAL    100
+
+int swap_init();
+int swap_enabled();
+int swap_slot_dup(unsigned long slot);
+void swap_slot_free(unsigned long slot);
+int swap_read_slot(unsigned long slot, void *buf);
+unsigned long swap_reclaim(unsigned long nr);
+
+int sys_swapon(char *path, int flags);
+int sys_swapoff(char *path);
+
+#endif   /* _XBOOK_SWAP_H */
@@ -30,6 +30,9 @@ typedef enum {
 } task_state_t;
 
 #define MAX_TASK_NAMELEN 32
+
+/* pid哈希表大小，必须是2的幂 */
+#define TASK_PID_HASH_NR    256
 #define TASK_STACK_MAGIC 0X19980325
 #define MAX_TASK_STACK_ARG_NR 16
 #define TASK_KERN_STACK_SIZE    8192
@@ -38,7 +41,7 @@ typedef enum {
 
 #define TASK_TIMESLICE_MIN  1
 #define TASK_TIMESLICE_MAX  100
-#define TASK_TIMESLICE_BASE  1
+#define TASK_TIMESLICE_BASE  5
 
 typedef void (*exit_hook_t)(void *);
 
@@ -75,6 +78,9 @@ typedef struct {
     char static_priority;      /* 任务的静态优先级 */
     unsigned long ticks;                /* 运行的ticks，当前剩余的timeslice */
     unsigned long timeslice;            /* 时间片，可以动态调整 */
+    unsigned long sleep_avg;            /* 睡眠平均值，睡眠时增加，运行时减少 */
+    clock_t sleep_timestamp;            /* 开始睡眠的时间 */
+    struct sched_array *sched_array;    /* 所在的就绪优先级数组，不在就绪队列时为NULL */
     unsigned long elapsed_ticks;        /* 任务执行总共占用的时间片数 */
     unsigned long syscall_ticks;        /* 执行系统调用总共占用的时间片数 */
     clock_t syscall_ticks_delta;  /* 执行单个系统调用占用的时间片数 */
@@ -83,6 +89,9 @@ typedef struct {
     struct vmm *vmm;                    
     list_t list;                        /* 处于所在队列的链表，就绪队列，阻塞队列等 */
     list_t global_list;                 /* 全局任务队列，用来查找所有存在的任务 */
+    list_t pid_hash_list;               /* pid哈希链表，通过pid查找任务 */
+    list_t children;                    /* 子任务链表，parent_pid是自己的任务 */
+    list_t child_list;                  /* 在父任务的子任务链表中的节点 */
     exception_manager_t exception_manager;         
     timer_t sleep_timer;               
     fpu_t fpu;
@@ -148,6 +157,7 @@ void task_exit(int status);
 
 task_t *task_find_by_pid(pid_t pid);
 void task_add_to_global_list(task_t *task);
+void task_set_parent(task_t *task, pid_t parent_pid);
 void task_activate_when_sched(task_t *task);
 
 void task_block(task_state_t state);
@@ -182,6 +192,7 @@ pid_t task_take_pid();
 void task_rollback_pid();
 void tasks_print();
 void task_start_user();
+void kern_do_idle(void *arg);
 unsigned long task_sleep_by_ticks(clock_t ticks);
 int task_count_children(task_t *parent);
 int task_do_cancel(task_t *task);
@@ -0,0 +1,18 @@
+#ifndef _XBOOK_TIMEPAGE_H
+#define _XBOOK_TIMEPAGE_H
+
+#include <sys/timepage.h>
+#include <xbook/vmm.h>
+
+/* 时间页位于用户栈顶之上，用户空间的最后一页 */
+#define TIME_PAGE_VADDR     USER_STACK_TOP
+
+/* 每隔这么多ticks校准一次TSC，间隔内的TSC差值不能超过32位 */
+#define TIME_PAGE_CALIB_TICKS   64
+
+void time_page_init();
+void time_page_update_ticks();
+void time_page_update_walltime();
+int time_page_map();
+
+#endif   /* _XBOOK_TIMEPAGE_H */
@@ -13,7 +13,8 @@ typedef void (*timer_callback_t) (struct timer_struct *, void *);
 
 /* 定时器 */
 typedef struct timer_struct {
-    list_t list;                /* 定时器链表 */
+    list_t list;                /* 时间轮槽链表 */
+    list_t hash_list;           /* id哈希链表 */
     clock_t timeout;            /* 超时点，以ticks为单位 */
     clock_t timeval;            /* 超时值 */
     void *arg;                  /* 参数 */
@@ -24,6 +25,7 @@ typedef struct timer_struct {
 
 #define TIMER_INIT(timer, _timeout, _timeval, _arg, _callback) \
     { .list = LIST_HEAD_INIT((timer).list) \
+    , .hash_list = LIST_HEAD_INIT((timer).hash_list) \
     , .timeout = (_timeout) \
     , .timeval = (_timeval) \
     , .arg = (_arg) \
@@ -58,6 +60,8 @@ void timer_del_period(timer_t *timer);
 timer_t *timer_find(unsigned long id);
 
 void timer_update_ticks();
+clock_t timer_next_timeout();
+void timer_test(void *arg);
 long sys_usleep(struct timeval *inv, struct timeval *outv);
 
 int timers_init();
@@ -10,9 +10,17 @@
 #define VIR_MEM_BASE     DYNAMIC_MAP_MEM_ADDR
 #define VIR_MEM_END      DYNAMIC_MAP_MEM_END
 
-typedef struct {
+/* 延迟刷新快表的页数上限，超过后统一刷新一次，再把区域放回空闲树 */
+#define VIR_MEM_LAZY_MAX_PAGES	2048
+
+/* 虚拟地址区域，同时作为空闲树、使用树的节点和延迟释放链表的成员 */
+typedef struct vir_mem {
 	unsigned long addr;
 	unsigned long size;
+	struct vir_mem *left;
+	struct vir_mem *right;
+	int height;
+	unsigned long max_size;		/* 子树中最大的区域大小，用于在空闲树中查找 */
 	list_t list;
 } vir_mem_t;
 
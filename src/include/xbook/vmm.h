@@ -12,6 +12,8 @@
 typedef struct vmm {
     void *page_storage;                     /* 虚拟内存管理的结构 */                   
     void *mem_space_head;                     /* 虚拟空间头,设置成空类型，使用时转换类型 */
+    void *mem_space_root;                     /* 空间平衡树（AVL）的根，按开始地址排序 */
+    void *mem_space_cache;                    /* 最近一次查找命中的空间 */
     char **envp;    /* 环境变量指针 */     
     char **argv;    /* 参数变量 */
     char *argbuf;   /* 参数的缓冲区首地址 */
@@ -20,6 +22,8 @@ typedef struct vmm {
     unsigned long heap_start, heap_end;     /* 堆空间范围 */
     unsigned long map_start, map_end;       /* 映射空间范围 */
     unsigned long stack_start, stack_end;   /* 栈空间范围 */
+    unsigned long fault_count;              /* 用户空间缺页次数 */
+    unsigned long fault_pages;              /* 缺页时映射的页数 */
 } vmm_t;
 
 /* 物理内存信息 */
@@ -27,6 +31,7 @@ typedef struct {
     unsigned long ms_total;    /* 物理内存总大小 */
     unsigned long ms_free;     /* 物理内存空闲大小 */
     unsigned long ms_used;     /* 物理内存已使用大小 */
+    unsigned long ms_frag;     /* 空闲内存碎片率（百分比） */
 } mstate_t;
 
 void vmm_init(vmm_t *vmm);
@@ -7,6 +7,7 @@
 #include <xbook/task.h>
 #include <xbook/schedule.h>
 #include <xbook/sharemem.h>
+#include <xbook/pagecache.h>
 #include <xbook/msgqueue.h>
 #include <xbook/sem.h>
 #include <xbook/syscall.h>
@@ -20,10 +21,16 @@
 #include <xbook/account.h>
 #include <xbook/portcomm.h>
 #include <xbook/disk.h>
+#include <xbook/swap.h>
+#include <xbook/bitmap.h>
 #ifdef CONFIG_NET
 #include <xbook/net.h>
 #endif
 
+#ifdef CONFIG_SMP
+#include <arch/smp.h>
+#endif
+
 #ifdef CONFIG_DWIN
 #include <dwin/dwin.h>
 #endif
@@ -34,9 +41,13 @@ int kernel_main(void)
     mem_caches_init();
     vir_mem_init();
     irq_description_init();
+#ifdef CONFIG_SMP
+    smp_init();
+#endif
     softirq_init();
     syscall_init();
     share_mem_init();
+    page_cache_init();
     msg_queue_init();
     sem_init();
     fifo_init();
@@ -47,6 +58,9 @@ int kernel_main(void)
     timers_init();
     walltime_init();
     interrupt_enable();
+#ifdef CONFIG_BITMAP_TEST
+    bitmap_test();
+#endif
     driver_framewrok_init();
     disk_init();
     initcalls_exec();
@@ -55,6 +69,7 @@ int kernel_main(void)
     while (1);
 #endif
     file_system_init();
+    swap_init();
 #ifdef CONFIG_NET
     network_init();
 #endif
@@ -62,6 +77,9 @@ int kernel_main(void)
     port_comm_init();
 #ifdef CONFIG_DWIN
     dwin_init();
+#endif
+#ifdef CONFIG_SMP
+    smp_start();
 #endif
     task_start_user();
     return 0;    
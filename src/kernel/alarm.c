@@ -17,23 +17,40 @@ unsigned long sys_alarm(unsigned long second)
     return old_second;
 }
 
-void alarm_update_ticks()
+/* 经过了ticks个时钟，空闲时停止了周期时钟，一次可能经过多个ticks */
+void alarm_update_ticks(clock_t ticks)
 {
     task_t *task;
     unsigned long flags;
     interrupt_save_and_disable(flags);
     list_for_each_owner (task, &task_global_list, global_list) {
-        if (task->alarm.flags) {
-            task->alarm.ticks--;
-            if (!task->alarm.ticks) {
-                task->alarm.second--;
-                task->alarm.ticks = HZ;
-                if (!task->alarm.second) {
-                    exception_send(task->pid, EXP_CODE_ALRM);
-                    task->alarm.flags = 0;
-                }
+        clock_t left = ticks;
+        while (task->alarm.flags && left >= task->alarm.ticks) {
+            left -= task->alarm.ticks;
+            task->alarm.second--;
+            task->alarm.ticks = HZ;
+            if (!task->alarm.second) {
+                exception_send(task->pid, EXP_CODE_ALRM);
+                task->alarm.flags = 0;
             }
         }
+        if (task->alarm.flags)
+            task->alarm.ticks -= left;
     }
     interrupt_restore_state(flags);
+}
+
+/* 最近的闹钟还有多少ticks到期，需要关中断调用 */
+clock_t alarm_next_timeout()
+{
+    clock_t next = ~0UL;
+    task_t *task;
+    list_for_each_owner (task, &task_global_list, global_list) {
+        if (task->alarm.flags) {
+            clock_t left = (task->alarm.second - 1) * HZ + task->alarm.ticks;
+            if (left < next)
+                next = left;
+        }
+    }
+    return next;
 }
\ No newline at end of file
@@ -9,17 +9,33 @@
 #include <xbook/timer.h>
 #include <xbook/hardirq.h>
 #include <xbook/walltime.h>
+#include <xbook/timepage.h>
+#include <xbook/alarm.h>
+#include <xbook/config.h>
+#include <arch/interrupt.h>
+#include <arch/cpu.h>
+#include <arch/smp.h>
 
 volatile clock_t systicks;
 volatile clock_t timer_ticks;
 
+static clock_t timer_softirq_ticks;    /* 上次处理定时器软中断时的systicks */
+
+#ifdef CONFIG_TICKLESS_IDLE
+static volatile int clock_oneshot = 0;  /* 空闲时时钟处于一次性模式 */
+#endif
+
 static void timer_softirq_handler(softirq_action_t *action)
 {
-    if (systicks % HZ == 0) {  /* 1s更新一次 */
+    /* 空闲时停止了周期时钟，一次可能经过了多个ticks */
+    clock_t now = systicks;
+    clock_t seconds = now / HZ - timer_softirq_ticks / HZ;
+    while (seconds-- > 0) {  /* 1s更新一次 */
         walltime_update_second();
     }
     timer_update_ticks();
-    alarm_update_ticks();
+    alarm_update_ticks(now - timer_softirq_ticks);
+    timer_softirq_ticks = now;
 }
 
 static void sched_softirq_handler(softirq_action_t *action)
@@ -27,17 +43,73 @@ static void sched_softirq_handler(softirq_action_t *action)
     task_t *current = task_current;
     assert(current->stack_magic == TASK_STACK_MAGIC);
     current->elapsed_ticks++;
-	if (current->ticks <= 0) {
-		schedule();
-	} else {
-		current->ticks--;
-	}
+    sched_tick(sched_get_cur_unit(), current);
+}
+
+#ifdef CONFIG_TICKLESS_IDLE
+/* 退出一次性模式，补上停止周期时钟期间经过的ticks，需要关中断调用 */
+static void clock_oneshot_exit()
+{
+    clock_t ticks = clock_hardware_elapsed();
+    clock_hardware_periodic();
+    clock_oneshot = 0;
+    systicks += ticks;
+    timer_ticks += ticks;
+}
+
+/**
+ * clock_idle - 空闲时停止周期时钟
+ * 
+ * 没有就绪任务时，把时钟设置成在最近的定时器到期时才产生中断，然后停机。
+ * 被其它中断唤醒时，从时钟计数器中计算已经经过的ticks。
+ * 其它处理器上的任务也依赖systicks，有多个处理器在线时只停机，不停止周期时钟。
+ */
+void clock_idle()
+{
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (sched_get_cur_unit()->tasknr > 0) {
+        interrupt_restore_state(flags);
+        return;
+    }
+    clock_t next = timer_next_timeout();
+    clock_t alarm_next = alarm_next_timeout();
+    if (alarm_next < next)
+        next = alarm_next;
+    if (next > 1 && smp_get_online_count() == 1) {
+        clock_oneshot = 1;
+        clock_hardware_oneshot(next);
+    }
+    smp_idle_halt();
+    interrupt_disable();
+    if (clock_oneshot) {
+        clock_oneshot_exit();
+        time_page_update_ticks();
+        softirq_active(TIMER_SOFTIRQ);
+    }
+    interrupt_restore_state(flags);
 }
+#else
+void clock_idle()
+{
+    cpu_idle();
+}
+#endif
 
 static int clock_handler(irqno_t irq, void *data)
 {
+#ifdef CONFIG_TICKLESS_IDLE
+    if (clock_oneshot) {
+        clock_oneshot_exit();
+    } else {
+        systicks++;
+        timer_ticks++;
+    }
+#else
 	systicks++;
     timer_ticks++;
+#endif
+    time_page_update_ticks();
 	softirq_active(TIMER_SOFTIRQ);
 	softirq_active(SCHED_SOFTIRQ);
     return 0;
@@ -63,6 +135,8 @@ void mdelay(time_t msec)
         ticks = 1;
     clock_t start = systicks;
     while (sys_get_ticks() - start < ticks) {
+        /* systicks只在启动处理器上增加，不能一直占着大内核锁 */
+        smp_relax_kernel();
         cpu_pause();
     }
 }
@@ -70,6 +144,8 @@ void mdelay(time_t msec)
 void clock_init()
 {
     timer_ticks = systicks = 0;
+    timer_softirq_ticks = 0;
+    time_page_init();
     clock_hardware_init();
 	softirq_build(TIMER_SOFTIRQ, timer_softirq_handler);
 	softirq_build(SCHED_SOFTIRQ, sched_softirq_handler);
@@ -13,6 +13,8 @@
 #include <xbook/config.h>
 #include <xbook/virmem.h>
 #include <xbook/schedule.h>
+#include <xbook/task.h>
+#include <xbook/memcache.h>
 #include <xbook/initcall.h>
 #include <xbook/fsal.h>
 #include <xbook/path.h>
@@ -41,6 +43,10 @@ LIST_HEAD(driver_list_head);
 device_object_t *device_handle_table[DEVICE_HANDLE_NR];
 DEFINE_SPIN_LOCK_UNLOCKED(driver_lock);
 
+/* io请求的对象缓存，释放的请求先放到空闲链表中，在中断中也可以分配和释放 */
+static mem_cache_t io_request_cache;
+static LIST_HEAD(io_request_pool);
+
 /* 设备文件系统创建时间和日期 */
 static uint16_t devfs_create_time = 0, devfs_create_date = 0;
 
@@ -345,6 +351,8 @@ iostatus_t io_create_device(
     devobj->flags = 0;
     atomic_set(&devobj->reference, 0);
     devobj->cur_ioreq = NULL;
+    list_init(&devobj->pending_list);
+    devobj->pending_count = 0;
     devobj->reserved = 0;
     if (string_new(&devobj->name, device_name, DEVICE_NAME_LEN)) {
         mem_free(devobj);
@@ -393,15 +401,78 @@ void io_delete_device(
 
 io_request_t *io_request_alloc()
 {
-    io_request_t *ioreq = mem_alloc(sizeof(io_request_t));
-    if (ioreq)
+    io_request_t *ioreq = NULL;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (!list_empty(&io_request_pool)) {
+        ioreq = list_first_owner(&io_request_pool, io_request_t, list);
+        list_del(&ioreq->list);
+    }
+    interrupt_restore_state(flags);
+    if (ioreq == NULL)
+        ioreq = mem_cache_alloc_object(&io_request_cache);
+    if (ioreq) {
         memset(ioreq, 0, sizeof(io_request_t));
+        list_init(&ioreq->list);
+    }
     return ioreq;
 }
 
+static void io_device_unlock(device_object_t *device);
+
+/**
+ * 释放io请求，同时释放请求还持有的系统缓冲区和内存描述列表。
+ * 驱动没有完成就失败的请求还挂在未决队列上、还持有设备锁，在这里一起撤销。
+ * 请求放回空闲链表，不会再还给对象缓存，空闲请求数量就是同时进行的请求数量的峰值。
+ */
 void io_request_free(io_request_t *ioreq)
 {
-    mem_free(ioreq);    
+    if (ioreq->flags & IOREQ_LOCKED) {
+        ioreq->flags &= ~IOREQ_LOCKED;
+        io_device_unlock(ioreq->devobj);
+    }
+    if (ioreq->system_buffer && (ioreq->flags & IOREQ_BUFFERED_IO)) {
+        mem_free(ioreq->system_buffer);
+        ioreq->system_buffer = NULL;
+    }
+    if (ioreq->mdl_address) {
+        mdl_free(ioreq->mdl_address);
+        ioreq->mdl_address = NULL;
+    }
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (!list_empty(&ioreq->list)) {
+        list_del_init(&ioreq->list);
+        ioreq->devobj->pending_count--;
+    }
+    list_add(&ioreq->list, &io_request_pool);
+    interrupt_restore_state(flags);
+}
+
+/* 释放io_call_dirver获取的设备锁 */
+static void io_device_unlock(device_object_t *device)
+{
+    /* 根据设备类型选择不同的锁 */
+    switch (device->type)
+    {
+    case DEVICE_TYPE_SERIAL_PORT:
+    case DEVICE_TYPE_SCREEN:
+    case DEVICE_TYPE_KEYBOARD:
+    case DEVICE_TYPE_MOUSE:
+    case DEVICE_TYPE_VIRTUAL_CHAR:
+    case DEVICE_TYPE_BEEP:
+    case DEVICE_TYPE_VIEW:
+    case DEVICE_TYPE_SOUND:
+        spin_unlock(&device->lock.spinlock);
+        break;
+    case DEVICE_TYPE_DISK:
+    case DEVICE_TYPE_NETWORK:
+    case DEVICE_TYPE_PHYSIC_NETCARD:
+        mutex_unlock(&device->lock.mutexlock);
+        break;
+    default:
+        break;
+    }
 }
 
 iostatus_t io_call_dirver(device_object_t *device, io_request_t *ioreq)
@@ -422,11 +493,13 @@ iostatus_t io_call_dirver(device_object_t *device, io_request_t *ioreq)
     case DEVICE_TYPE_VIEW:
     case DEVICE_TYPE_SOUND:
         spin_lock(&device->lock.spinlock);
+        ioreq->flags |= IOREQ_LOCKED;
         break;
     case DEVICE_TYPE_DISK:
     case DEVICE_TYPE_NETWORK:
     case DEVICE_TYPE_PHYSIC_NETCARD:
         mutex_lock(&device->lock.mutexlock);
+        ioreq->flags |= IOREQ_LOCKED;
         break;
     default:
         break;
@@ -450,6 +523,79 @@ iostatus_t io_call_dirver(device_object_t *device, io_request_t *ioreq)
     return status;
 }
 
+/**
+ * io_mark_request_pending - 驱动接收请求，稍后再完成
+ * 
+ * 在派遣函数中把请求交给硬件之前调用，然后返回IO_PENDING。
+ * 会释放设备锁，其它请求可以进入派遣函数，驱动需要自己保护设备的状态。
+ * 请求完成时（可以在中断中）调用io_complete_request。
+ */
+void io_mark_request_pending(io_request_t *ioreq)
+{
+    ioreq->flags |= IOREQ_PENDING;
+    if (ioreq->flags & IOREQ_LOCKED) {
+        ioreq->flags &= ~IOREQ_LOCKED;
+        io_device_unlock(ioreq->devobj);
+    }
+}
+
+/**
+ * io_submit_request - 提交请求
+ * 
+ * 请求先挂到设备的未决队列上，完成后才移除。
+ * 驱动在派遣函数中完成请求时直接返回结果，驱动接收请求稍后完成时返回IO_PENDING，
+ * 同步等待调用io_wait_request，异步请求在完成回调中获取结果。
+ * 驱动既没有完成也没有接收请求（派遣失败或者没有派遣函数）时，
+ * 请求从未决队列上移除并释放设备锁，避免io_device_wait_idle一直等下去。
+ */
+iostatus_t io_submit_request(device_object_t *device, io_request_t *ioreq)
+{
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    list_add_tail(&ioreq->list, &device->pending_list);
+    device->pending_count++;
+    interrupt_restore_state(flags);
+    iostatus_t status = io_call_dirver(device, ioreq);
+    int locked = 0;
+    interrupt_save_and_disable(flags);
+    if (!(ioreq->flags & (IOREQ_COMPLETION | IOREQ_PENDING))) {
+        if (!list_empty(&ioreq->list)) {
+            list_del_init(&ioreq->list);
+            device->pending_count--;
+        }
+        locked = ioreq->flags & IOREQ_LOCKED;
+        ioreq->flags &= ~IOREQ_LOCKED;
+    }
+    interrupt_restore_state(flags);
+    if (locked)
+        io_device_unlock(device);
+    return status;
+}
+
+/**
+ * io_wait_request - 等待请求完成
+ * 
+ * 返回请求的完成状态
+ */
+iostatus_t io_wait_request(io_request_t *ioreq)
+{
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    while (!(ioreq->flags & IOREQ_COMPLETION)) {
+        ioreq->waiter = task_current;
+        task_block(TASK_BLOCKED);
+    }
+    ioreq->waiter = NULL;
+    interrupt_restore_state(flags);
+    return ioreq->io_status.status;
+}
+
+/* 等待设备上所有未决的请求完成 */
+static void io_device_wait_idle(device_object_t *devobj)
+{
+    while (devobj->pending_count > 0)
+        task_sleep_by_ticks(1);
+}
 
 static iostatus_t fastio_call_dirver(device_object_t *device, int arg, void *buf, int dispatch)
 {
@@ -477,6 +623,13 @@ static iostatus_t fastio_call_dirver(device_object_t *device, int arg, void *buf
     return status;
 }
 
+/* 缓冲区在当前任务的用户空间中 */
+static int io_buffer_in_user(void *buffer)
+{
+    unsigned long addr = (unsigned long) buffer;
+    return task_current->vmm && addr >= USER_VMM_BASE_ADDR && addr < USER_VMM_TOP_ADDR;
+}
+
 io_request_t *io_build_sync_request(
     unsigned long function,
     device_object_t *devobj,
@@ -502,28 +655,32 @@ io_request_t *io_build_sync_request(
     ioreq->user_buffer = buffer;
     ioreq->mdl_address = NULL;
     if (buffer) {    
-        if (devobj->flags & DO_BUFFERED_IO) {
+        int user = io_buffer_in_user(buffer);
+        if ((devobj->flags & DO_DIRECT_IO) && user && length >= MDL_MIN_SIZE &&
+            (function == IOREQ_READ || function == IOREQ_WRITE)) {
+            /* 分配内存描述列表，驱动直接访问固定的用户页 */
+            ioreq->mdl_address = mdl_alloc(buffer, length, FALSE, function == IOREQ_READ, ioreq);
+            if (ioreq->mdl_address == NULL) {
+                io_request_free(ioreq);
+                return NULL;    
+            }
+            length = MDL_GET_BYTE_COUNT(ioreq->mdl_address);
+        } else if ((devobj->flags & DO_BUFFERED_IO) || ((devobj->flags & DO_DIRECT_IO) && user)) {
+            /* 直接IO的小用户缓冲区也复制到系统缓冲区 */
             if (length >= MAX_MEM_CACHE_SIZE) {
                 length = MAX_MEM_CACHE_SIZE;
                 keprint(PRINT_WARING "io_build_sync_request: length too big!\n");
             }
             ioreq->system_buffer = mem_alloc(length);
             if (ioreq->system_buffer == NULL) {
-                mem_free(ioreq);
+                io_request_free(ioreq);
                 return NULL;
             }
             ioreq->flags |= IOREQ_BUFFERED_IO;
         } else if (devobj->flags & DO_DIRECT_IO) {
-            ioreq->mdl_address = mdl_alloc(buffer, length, FALSE, ioreq);
-            if (ioreq->mdl_address == NULL) {
-                mem_free(ioreq);
-                return NULL;    
-            }
-            /* 分配内存描述列表 */
+            ioreq->system_buffer = buffer;  /* 内核缓冲区直接使用 */
         } /* 直接使用用户地址 */
     }
-    unsigned long flags;
-
     switch (function)
     {
     case IOREQ_OPEN:
@@ -543,11 +700,8 @@ io_request_t *io_build_sync_request(
         ioreq->flags |= IOREQ_WRITE_OPERATION;
         ioreq->parame.write.length = length;
         ioreq->parame.write.offset = offset;
-        if (devobj->flags & DO_BUFFERED_IO) {
-            interrupt_save_and_disable(flags);
+        if (ioreq->flags & IOREQ_BUFFERED_IO)
             memcpy(ioreq->system_buffer, buffer, length);
-            interrupt_restore_state(flags);
-        }
         break;
     case IOREQ_DEVCTL:
         ioreq->flags |= IOREQ_DEVCTL_OPERATION;
@@ -565,33 +719,66 @@ io_request_t *io_build_sync_request(
     return ioreq;
 }
 
+/**
+ * io_build_async_request - 创建异步请求
+ * @completion: 完成回调，可以为NULL，这时通过io_wait_request等待
+ * @arg: 回调参数
+ * 
+ * 回调可能在中断中执行，缓冲区必须是内核缓冲区，在请求完成前一直有效。
+ * 请求完成后由调用者调用io_request_free释放，设置了IOREQ_DETACHED的请求
+ * 由io_complete_request在回调返回后释放。
+ */
+io_request_t *io_build_async_request(
+    unsigned long function,
+    device_object_t *devobj,
+    void *buffer,
+    unsigned long length,
+    unsigned long offset,
+    io_completion_t completion,
+    void *arg
+){
+    io_request_t *ioreq = io_build_sync_request(function, devobj, buffer, length, offset, NULL);
+    if (ioreq == NULL)
+        return NULL;
+    ioreq->flags |= IOREQ_ASYNC;
+    ioreq->completion = completion;
+    ioreq->completion_arg = arg;
+    return ioreq;
+}
+
 void io_complete_request(io_request_t *ioreq)
 {
     if (ioreq->io_status.status == IO_FAILED)
         ioreq->io_status.infomation = -1;
     
-    ioreq->flags |= IOREQ_COMPLETION;
-    /* 根据设备类型选择不同的锁 */
-    switch (ioreq->devobj->type)
-    {
-    case DEVICE_TYPE_SERIAL_PORT:
-    case DEVICE_TYPE_SCREEN:
-    case DEVICE_TYPE_KEYBOARD:
-    case DEVICE_TYPE_MOUSE:
-    case DEVICE_TYPE_VIRTUAL_CHAR:
-    case DEVICE_TYPE_BEEP:
-    case DEVICE_TYPE_VIEW:
-    case DEVICE_TYPE_SOUND:
-        spin_unlock(&ioreq->devobj->lock.spinlock);
-        break;
-    case DEVICE_TYPE_DISK:
-    case DEVICE_TYPE_NETWORK:
-    case DEVICE_TYPE_PHYSIC_NETCARD:
-        mutex_unlock(&ioreq->devobj->lock.mutexlock);
-        break;
-    default:
-        break;
+    /* 在派遣函数中完成的请求还持有设备锁 */
+    if (ioreq->flags & IOREQ_LOCKED) {
+        ioreq->flags &= ~IOREQ_LOCKED;
+        io_device_unlock(ioreq->devobj);
     }
+    /* 异步读取的数据复制到调用者的缓冲区 */
+    if ((ioreq->flags & IOREQ_ASYNC) && (ioreq->flags & IOREQ_READ_OPERATION) &&
+        (ioreq->flags & IOREQ_BUFFERED_IO) && ioreq->io_status.status == IO_SUCCESS)
+        memcpy(ioreq->user_buffer, ioreq->system_buffer, ioreq->io_status.infomation);
+
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (!list_empty(&ioreq->list)) {
+        list_del_init(&ioreq->list);
+        ioreq->devobj->pending_count--;
+    }
+    ioreq->flags |= IOREQ_COMPLETION;
+    task_t *waiter = ioreq->waiter;
+    int detached = ioreq->flags & IOREQ_DETACHED;
+    interrupt_restore_state(flags);
+
+    /* 回调中可能会释放请求，之后不能再访问 */
+    if (ioreq->completion)
+        ioreq->completion(ioreq, ioreq->completion_arg);
+    if (waiter)
+        task_wakeup(waiter);
+    if (detached)
+        io_request_free(ioreq);
 }
 
 static int io_complete_check(io_request_t *ioreq, iostatus_t status)
@@ -757,6 +944,7 @@ int device_close(handle_t handle)
     }
     io_request_t *ioreq = NULL;
     if (!atomic_get(&devobj->reference)) { /* 最后一次关闭才关闭 */    
+        io_device_wait_idle(devobj);
         ioreq = io_build_sync_request(IOREQ_CLOSE, devobj, NULL, 0, 0, NULL);
         if (ioreq == NULL) {
             keprint(PRINT_ERR "device_close: alloc io request packet failed!\n", atomic_get(&devobj->reference));
@@ -890,20 +1078,13 @@ ssize_t device_read(handle_t handle, void *buffer, size_t length, off_t offset)
         return -1;
     }
 
-    status = io_call_dirver(devobj, ioreq);
+    status = io_submit_request(devobj, ioreq);
+    if (status == IO_PENDING)
+        status = io_wait_request(ioreq);
     if (!io_complete_check(ioreq, status)) {
         len = ioreq->io_status.infomation;
-        if (devobj->flags & DO_BUFFERED_IO) { 
-            unsigned long flags;
-            interrupt_save_and_disable(flags);
+        if (ioreq->flags & IOREQ_BUFFERED_IO)
             memcpy(ioreq->user_buffer, ioreq->system_buffer, len);
-            interrupt_restore_state(flags);
-            mem_free(ioreq->system_buffer);
-        } else if (devobj->flags & DO_DIRECT_IO) { 
-            keprint(PRINT_DEBUG "device_read: read done. free mdl.\n");
-            mdl_free(ioreq->mdl_address);
-            ioreq->mdl_address = NULL;
-        }
         io_request_free((ioreq));
         return len;
     }
@@ -945,14 +1126,11 @@ ssize_t device_write(handle_t handle, void *buffer, size_t length, off_t offset)
         keprint(PRINT_ERR "device_write: alloc io request packet failed!\n");
         return -1;
     }
-    status = io_call_dirver(devobj, ioreq);
+    status = io_submit_request(devobj, ioreq);
+    if (status == IO_PENDING)
+        status = io_wait_request(ioreq);
 
     if (!io_complete_check(ioreq, status)) {
-        if (devobj->flags & DO_DIRECT_IO) { 
-            keprint(PRINT_DEBUG "device_write: write done. free mdl.\n");
-            mdl_free(ioreq->mdl_address);
-            ioreq->mdl_address = NULL;
-        }
         unsigned int len = ioreq->io_status.infomation;
         io_request_free((ioreq));
         return len;
@@ -998,7 +1176,9 @@ ssize_t device_devctl(handle_t handle, unsigned int code, unsigned long arg)
     ioreq->parame.devctl.code = code;
     ioreq->parame.devctl.arg = arg;
     
-    status = io_call_dirver(devobj, ioreq);
+    status = io_submit_request(devobj, ioreq);
+    if (status == IO_PENDING)
+        status = io_wait_request(ioreq);
     if (!io_complete_check(ioreq, status)) {
         unsigned int infomation = ioreq->io_status.infomation;
         io_request_free((ioreq));
@@ -1021,6 +1201,61 @@ ssize_t device_devctl(handle_t handle, unsigned int code, unsigned long arg)
     return err;
 }
 
+static int device_rw_async(handle_t handle, unsigned long function,
+    void *buffer, size_t length, off_t offset, io_completion_t completion, void *arg)
+{
+    if (IS_BAD_DEVICE_HANDLE(handle) || completion == NULL)
+        return -1;
+    device_object_t *devobj = GET_DEVICE_BY_HANDLE(handle);
+    if (devobj == NULL)
+        return -1;
+    io_request_t *ioreq = io_build_async_request(function, devobj, buffer, length, offset,
+        completion, arg);
+    if (ioreq == NULL) {
+        keprint(PRINT_ERR "%s: alloc io request packet failed!\n", __func__);
+        return -1;
+    }
+    iostatus_t status = io_submit_request(devobj, ioreq);
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (ioreq->flags & IOREQ_COMPLETION) {
+        /* 在派遣函数中已经完成，回调已经执行过了 */
+        interrupt_restore_state(flags);
+        io_request_free(ioreq);
+        return 0;
+    }
+    if (status != IO_PENDING && !(ioreq->flags & IOREQ_PENDING)) {
+        /* 驱动没有接收请求，回调不会执行 */
+        interrupt_restore_state(flags);
+        io_request_free(ioreq);
+        return -1;
+    }
+    /* 请求交给驱动，完成后由io_complete_request释放，之后不能再访问 */
+    ioreq->flags |= IOREQ_DETACHED;
+    interrupt_restore_state(flags);
+    return 0;
+}
+
+/**
+ * device_read_async - 异步读取设备
+ * 
+ * 提交请求后立即返回，请求完成时调用completion，completion不能为NULL。
+ * 读取的长度在回调的ioreq->io_status.infomation中，请求由框架在回调返回后释放，
+ * 回调中不能释放或者保留请求。
+ * 成功提交返回0，失败返回-1，失败时不会调用completion
+ */
+int device_read_async(handle_t handle, void *buffer, size_t length, off_t offset,
+    io_completion_t completion, void *arg)
+{
+    return device_rw_async(handle, IOREQ_READ, buffer, length, offset, completion, arg);
+}
+
+int device_write_async(handle_t handle, void *buffer, size_t length, off_t offset,
+    io_completion_t completion, void *arg)
+{
+    return device_rw_async(handle, IOREQ_WRITE, buffer, length, offset, completion, arg);
+}
+
 int device_notify_to(char *devname, int tag, void *param)
 {
     driver_object_t *drvobj;
@@ -1516,6 +1751,15 @@ void driver_framewrok_init()
         device_handle_table[i] = NULL;
     }
 
+    if (mem_cache_init(&io_request_cache, "io_request", sizeof(io_request_t), 0) < 0)
+        panic("driver framework: init io request cache failed!\n");
+    for (i = 0; i < IO_REQUEST_POOL_NR; i++) {
+        io_request_t *ioreq = mem_cache_alloc_object(&io_request_cache);
+        if (ioreq == NULL)
+            break;
+        list_add(&ioreq->list, &io_request_pool);
+    }
+
     /* devfs */
     memset(&devfs_fsal, 0, sizeof(fsal_t));
     list_init(&devfs_fsal.list);
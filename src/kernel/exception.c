@@ -357,7 +357,7 @@ static int exception_handle(exception_manager_t *exception_manager, exception_t
     if (handler) {
         exception_frame_build(exp->code, handler, frame);
         exception_manager->in_user_mode = 1;
-        fpu_save(&task_current->fpu);
+        fpu_flush(&task_current->fpu);
     }
     return 0;
 }
@@ -427,7 +427,8 @@ int sys_expblock(uint32_t code, uint32_t state)
 int sys_excetion_return(unsigned int ebx, unsigned int ecx, unsigned int edx, 
     unsigned int esi, unsigned int edi, trap_frame_t *frame)
 {
-    fpu_restore(&task_current->fpu);
+    /* 丢弃处理函数中的fpu状态，下次使用时恢复进入处理函数前保存的状态 */
+    fpu_release(&task_current->fpu);
     return exception_return(frame);
 }
 
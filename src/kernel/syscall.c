@@ -16,6 +16,8 @@
 #include <xbook/schedule.h>
 #include <xbook/fifo.h>
 #include <xbook/sockcall.h>
+#include <xbook/bufcache.h>
+#include <xbook/swap.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <dirent.h>
@@ -153,6 +155,9 @@ void syscall_init()
     syscalls[SYS_REBOOT] = sys_reboot;
     syscalls[SYS_SHUTDOWN] = sys_shutdown;
     syscalls[SYS_SELECT] = sys_select;
+    syscalls[SYS_SYNC] = sys_sync;
+    syscalls[SYS_SWAPON] = sys_swapon;
+    syscalls[SYS_SWAPOFF] = sys_swapoff;
     
 }
 
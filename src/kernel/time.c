@@ -108,12 +108,13 @@ clock_t sys_times(struct tms *buf)
         /* 统计子进程的时间 */
         clock_t cutime = 0, cstime = 0;
         task_t *child;
-        list_for_each_owner (child, &task_global_list, list) {
-            if (child->parent_pid == cur->pid) {
-                cstime += child->syscall_ticks;
-                cutime += child->elapsed_ticks;
-            }
+        unsigned long flags;
+        interrupt_save_and_disable(flags);
+        list_for_each_owner (child, &cur->children, child_list) {
+            cstime += child->syscall_ticks;
+            cutime += child->elapsed_ticks;
         }
+        interrupt_restore_state(flags);
         buf->tms_cstime = cstime;
         buf->tms_cutime = cutime;
         keprint("%d %d %d %d\n", buf->tms_stime, buf->tms_utime, buf->tms_cstime, buf->tms_cutime);
@@ -0,0 +1,101 @@
+#include <xbook/timepage.h>
+#include <xbook/walltime.h>
+#include <xbook/clock.h>
+#include <xbook/memspace.h>
+#include <xbook/debug.h>
+#include <arch/interrupt.h>
+#include <arch/cpu.h>
+#include <arch/page.h>
+#include <arch/memory.h>
+#include <assert.h>
+#include <string.h>
+
+static time_page_t *time_page = NULL;
+static unsigned long time_page_phy_addr = 0;
+static int time_page_tsc = 0;     /* cpu是否有TSC */
+
+/* 上次校准TSC时的ticks和TSC */
+static clock_t calib_ticks;
+static unsigned long long calib_tsc;
+
+static inline void time_page_write_begin()
+{
+    time_page->seq++;
+    wmb();
+}
+
+static inline void time_page_write_end()
+{
+    wmb();
+    time_page->seq++;
+}
+
+/**
+ * 时钟中断中更新ticks，同时记录TSC。
+ * 每隔一段时间用ticks校准一次每个tick的TSC数，用户态用它计算tick内的微秒数。
+ * 需要关中断调用
+ */
+void time_page_update_ticks()
+{
+    if (!time_page)
+        return;
+    clock_t ticks = systicks;
+    unsigned long long tsc = 0;
+    unsigned long tsc_per_tick = time_page->tsc_per_tick;
+    if (time_page_tsc) {
+        tsc = cpu_rdtsc();
+        clock_t dt = ticks - calib_ticks;
+        if (dt >= TIME_PAGE_CALIB_TICKS) {
+            unsigned long long dtsc = tsc - calib_tsc;
+            /* 空闲时间隔过长，差值超出32位就放弃这次校准 */
+            if (!(dtsc >> 32))
+                tsc_per_tick = (unsigned long)dtsc / dt;
+            calib_ticks = ticks;
+            calib_tsc = tsc;
+        }
+    }
+    time_page_write_begin();
+    time_page->ticks = ticks;
+    time_page->tsc_low = (unsigned long)tsc;
+    time_page->tsc_high = (unsigned long)(tsc >> 32);
+    time_page->tsc_per_tick = tsc_per_tick;
+    time_page_write_end();
+}
+
+/* 墙上时间改变后更新时间戳 */
+void time_page_update_walltime()
+{
+    if (!time_page)
+        return;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    time_page_write_begin();
+    time_page->timestamp = walltime_make_timestamp(&walltime);
+    time_page_write_end();
+    interrupt_restore_state(flags);
+}
+
+/* 把时间页只读映射到当前进程 */
+int time_page_map()
+{
+    if (mem_space_mmap(TIME_PAGE_VADDR, time_page_phy_addr, PAGE_SIZE, PROT_USER,
+        MEM_SPACE_MAP_FIXED | MEM_SPACE_MAP_SHARED) == ((void *)-1))
+        return -1;
+    return 0;
+}
+
+void time_page_init()
+{
+    assert(TIME_PAGE_VADDR == TIME_PAGE_ADDR);
+    time_page_phy_addr = page_alloc_normal(1);
+    /* 用户态总是认为时间页存在 */
+    if (!time_page_phy_addr)
+        panic("[timepage] alloc page failed!\n");
+    time_page = kern_phy_addr2vir_addr(time_page_phy_addr);
+    memset(time_page, 0, PAGE_SIZE);
+    time_page->hz = HZ;
+    time_page_tsc = cpu_has_tsc();
+    calib_ticks = systicks;
+    if (time_page_tsc)
+        calib_tsc = cpu_rdtsc();
+}
@@ -2,34 +2,88 @@
 #include <xbook/timer.h>
 #include <sys/walltime.h>
 #include <xbook/task.h>
+#include <xbook/schedule.h>
 #include <xbook/clock.h>
 #include <xbook/safety.h>
+#include <xbook/debug.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
 #include <arch/interrupt.h>
 #include <arch/time.h>
 
-/* 10day = 10 * 60 * 60 * 24 * HZ */
-#define TIMER_IDLE_TIMEOUT  (864000 * HZ)
+/*
+ * 多级时间轮：第1级有256个槽，每个槽对应1个tick，
+ * 后面4级各有64个槽，每个槽的跨度是上一级整个轮的跨度。
+ * 添加和删除定时器只需要操作一个槽的链表，第1级转完一圈时，
+ * 把高一级当前槽中的定时器重新分散到低一级。
+ */
+#define TVR_BITS    8
+#define TVN_BITS    6
+#define TVR_SIZE    (1 << TVR_BITS)
+#define TVN_SIZE    (1 << TVN_BITS)
+#define TVR_MASK    (TVR_SIZE - 1)
+#define TVN_MASK    (TVN_SIZE - 1)
+
+#define TVN_NR      4   /* 第1级之后的级数 */
+
+/* 第n级（从0开始，不包括第1级）中当前槽的索引 */
+#define TVN_INDEX(ticks, n) (((ticks) >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+#define TIMER_HASH_NR   64
 
-LIST_HEAD(timer_list_head);
+static list_t timer_vec_root[TVR_SIZE];
+static list_t timer_vec[TVN_NR][TVN_SIZE];
+static list_t timer_hash_table[TIMER_HASH_NR];   /* 根据id查找定时器 */
+static clock_t timer_wheel_ticks;   /* 时间轮下一个要处理的tick */
 unsigned long timer_id_next = 1; /* 从1开始，0是无效的id */
-static clock_t minim_timeout_val = 0;
-static timer_t timer_idle;
 
-/* idle定时器超时
- * 重新调整所有定时器的值，所有值都减去timer_ticks（idle除外）
- */
-static void timer_idle_handler(timer_t *timer_self, void *arg)
-{
-    clock_t dt = timer_idle.timeout;
-    timer_ticks -= dt;
-    timer_t *tmp;
-    list_for_each_owner (tmp, &timer_list_head, list) {
-        if (tmp != &timer_idle)
-            tmp->timeout -= dt;
+#define timer_pending(timer) (!list_empty(&(timer)->list))
+
+/* 根据超时点放到对应的槽中，需要关中断调用 */
+static void timer_wheel_insert(timer_t *timer)
+{
+    clock_t expires = timer->timeout;
+    clock_t idx = expires - timer_wheel_ticks;
+    list_t *vec;
+    if ((long)idx < 0) {
+        /* 已经超时，放到下一个要处理的槽 */
+        vec = &timer_vec_root[timer_wheel_ticks & TVR_MASK];
+    } else if (idx < TVR_SIZE) {
+        vec = &timer_vec_root[expires & TVR_MASK];
+    } else if (idx < 1UL << (TVR_BITS + TVN_BITS)) {
+        vec = &timer_vec[0][TVN_INDEX(expires, 0)];
+    } else if (idx < 1UL << (TVR_BITS + 2 * TVN_BITS)) {
+        vec = &timer_vec[1][TVN_INDEX(expires, 1)];
+    } else if (idx < 1UL << (TVR_BITS + 3 * TVN_BITS)) {
+        vec = &timer_vec[2][TVN_INDEX(expires, 2)];
+    } else {
+        vec = &timer_vec[3][TVN_INDEX(expires, 3)];
     }
-    timer_add(&timer_idle);
+    list_add_tail(&timer->list, vec);
+}
+
+/* 从时间轮和id哈希表中移除，需要关中断调用 */
+static void timer_detach(timer_t *timer)
+{
+    list_del_init(&timer->list);
+    list_del_init(&timer->hash_list);
+}
+
+/* 把高一级槽中的定时器重新分散到低级的槽中，返回槽的索引 */
+static int timer_cascade(int n, int index)
+{
+    list_t work_list;
+    list_t *vec = &timer_vec[n][index];
+    if (!list_empty(vec)) {
+        list_replace_init(vec, &work_list);
+        while (!list_empty(&work_list)) {
+            timer_t *timer = list_first_owner(&work_list, timer_t, list);
+            list_del(&timer->list);
+            timer_wheel_insert(timer);
+        }
+    }
+    return index;
 }
 
 void timer_init(
@@ -39,6 +93,7 @@ void timer_init(
     timer_callback_t callback)
 {
     list_init(&timer->list);
+    list_init(&timer->hash_list);
     timer->timeval = timeout;
     timer->timeout = timer_ticks + timeout;
     timer->arg = arg;
@@ -53,25 +108,9 @@ void timer_add(timer_t *timer)
     interrupt_save_and_disable(flags);
     if (!timer->id)
         timer->id = timer_id_next++;
-    assert(!list_find(&timer->list, &timer_list_head));
-    if (list_empty(&timer_list_head)) {    
-        list_add_tail(&timer->list, &timer_list_head);
-        minim_timeout_val = timer->timeout;
-    } else {
-        timer_t *first = list_first_owner(&timer_list_head, timer_t, list);
-        if (timer->timeout < first->timeout) {
-            list_add(&timer->list, &timer_list_head);
-            minim_timeout_val = timer->timeout;
-        } else {
-            timer_t *tmp;
-            list_for_each_owner (tmp, &timer_list_head, list) {
-                if (timer->timeout >= tmp->timeout) {
-                    list_add_after(&timer->list, &tmp->list);
-                    break;
-                }
-            }
-        }
-    }
+    assert(!timer_pending(timer));
+    timer_wheel_insert(timer);
+    list_add(&timer->hash_list, &timer_hash_table[timer->id % TIMER_HASH_NR]);
     interrupt_restore_state(flags);
 }
 
@@ -79,8 +118,8 @@ void timer_del(timer_t *timer)
 {
     unsigned long flags;
     interrupt_save_and_disable(flags);
-    assert(list_find(&timer->list, &timer_list_head));
-    list_del(&timer->list);
+    assert(timer_pending(timer));
+    timer_detach(timer);
     interrupt_restore_state(flags);
 }
 
@@ -89,7 +128,7 @@ int timer_alive(timer_t *timer)
     int alive = 0; 
     unsigned long flags;
     interrupt_save_and_disable(flags);
-    if (list_find(&timer->list, &timer_list_head))
+    if (timer_pending(timer))
         alive = 1;
     interrupt_restore_state(flags);
     return alive;
@@ -100,6 +139,11 @@ void timer_modify(timer_t *timer, unsigned long timeout)
     unsigned long flags;
     interrupt_save_and_disable(flags);
     timer->timeout = timer_ticks + timeout;
+    /* 已经在时间轮上就移动到新的槽 */
+    if (timer_pending(timer)) {
+        list_del(&timer->list);
+        timer_wheel_insert(timer);
+    }
     interrupt_restore_state(flags);
 }
 
@@ -108,7 +152,7 @@ timer_t *timer_find(unsigned long id)
     timer_t *timer, *tmr_find = NULL;
     unsigned long flags;
     interrupt_save_and_disable(flags);
-    list_for_each_owner (timer, &timer_list_head, list) {
+    list_for_each_owner (timer, &timer_hash_table[id % TIMER_HASH_NR], hash_list) {
         if (timer->id == id) {
             tmr_find = timer;
             break;
@@ -122,9 +166,11 @@ int timer_cancel(timer_t *timer)
 {
     int retval = -1;
     if (timer) {
-        if (timer_alive(timer)) {
-            timer_del(timer);
-        }
+        unsigned long flags;
+        interrupt_save_and_disable(flags);
+        if (timer_pending(timer))
+            timer_detach(timer);
+        interrupt_restore_state(flags);
         retval = 0;
     }
     return retval;
@@ -145,40 +191,63 @@ static void timer_do_action(timer_t *timer)
     if (!(timer->flags & TIMER_PERIOD))
     {
         /* 不是周期定时才删除定时器 */
-        list_del(&timer->list);
+        timer_detach(timer);
     }
     else
     {
         /* 不删除定时器，并更新定时器超时值 */
+        list_del(&timer->list);
         timer->timeout = timer_ticks + timer->timeval;
+        timer_wheel_insert(timer);
     }
+    /* 回调中可能释放定时器，之后不能再访问 */
     timer->callback(timer, timer->arg);
 }
 
 void timer_update_ticks()
 {
-    timer_t *timer, *next;
+    list_t work_list;
     unsigned long flags;
     interrupt_save_and_disable(flags);
-    if (timer_ticks < minim_timeout_val) { // no timer timeout
-        interrupt_restore_state(flags);
-        return;
-    }
-    list_for_each_owner_safe (timer, next, &timer_list_head, list) {
-        if (timer->timeout > timer_ticks) {
-            break;
+    /* 空闲时可能一次经过多个ticks，逐个tick转动时间轮 */
+    while (time_after_eq(timer_ticks, timer_wheel_ticks)) {
+        int index = timer_wheel_ticks & TVR_MASK;
+        if (!index &&
+            !timer_cascade(0, TVN_INDEX(timer_wheel_ticks, 0)) &&
+            !timer_cascade(1, TVN_INDEX(timer_wheel_ticks, 1)) &&
+            !timer_cascade(2, TVN_INDEX(timer_wheel_ticks, 2)))
+            timer_cascade(3, TVN_INDEX(timer_wheel_ticks, 3));
+        timer_wheel_ticks++;
+        if (list_empty(&timer_vec_root[index]))
+            continue;
+        list_replace_init(&timer_vec_root[index], &work_list);
+        while (!list_empty(&work_list)) {
+            timer_t *timer = list_first_owner(&work_list, timer_t, list);
+            timer_do_action(timer); // time out
         }
-        timer_do_action(timer); // time out
     }
+    interrupt_restore_state(flags);
+}
 
-    /* 寻找超时最小的定时器超时值 */
-    list_for_each_owner (timer, &timer_list_head, list) {
-        if (timer->timeout > timer_ticks) {
+/**
+ * timer_next_timeout - 最近的定时器还有多少ticks到期
+ * 
+ * 只查找第1级时间轮，遇到需要把高一级的定时器分散下来的位置就停止，
+ * 返回的值可能比实际的到期时间早，但不会晚。需要关中断调用
+ */
+clock_t timer_next_timeout()
+{
+    clock_t ticks = timer_wheel_ticks;
+    int i;
+    for (i = 0; i < TVR_SIZE; i++, ticks++) {
+        if (i > 0 && !(ticks & TVR_MASK))
+            break;
+        if (!list_empty(&timer_vec_root[ticks & TVR_MASK]))
             break;
-        }
     }
-    minim_timeout_val = timer->timeout;
-    interrupt_restore_state(flags);
+    if (time_before_eq(ticks, timer_ticks))
+        return 0;
+    return ticks - timer_ticks;
 }
 
 long sys_usleep(struct timeval *inv, struct timeval *outv)
@@ -209,9 +278,76 @@ long sys_usleep(struct timeval *inv, struct timeval *outv)
     return 0;
 }
 
+#define TIMER_TEST_NR       4096
+#define TIMER_TEST_MAX      (70 * HZ)  /* 覆盖前3级时间轮 */
+
+static volatile int timer_test_fired;
+static volatile int timer_test_errors;
+static volatile clock_t timer_test_late;
+
+static void timer_test_handler(timer_t *timer_self, void *arg)
+{
+    clock_t late = timer_ticks - timer_self->timeout;
+    if (time_before(timer_ticks, timer_self->timeout) || arg != (void *)timer_self->id)
+        timer_test_errors++;
+    if ((long)late > (long)timer_test_late)
+        timer_test_late = late;
+    timer_test_fired++;
+}
+
+/**
+ * 时间轮压力测试，添加大量定时器，取消和修改其中一部分，
+ * 检查剩下的定时器都按时到期。需要在内核线程中调用
+ */
+void timer_test(void *arg)
+{
+    timer_t *timers = mem_alloc(sizeof(timer_t) * TIMER_TEST_NR);
+    if (!timers)
+        return;
+    timer_test_fired = timer_test_errors = 0;
+    timer_test_late = 0;
+    int i, expect = 0;
+    clock_t start = systicks;
+    for (i = 0; i < TIMER_TEST_NR; i++) {
+        timer_init(&timers[i], 1 + rand() % TIMER_TEST_MAX, NULL, timer_test_handler);
+        timer_set_arg(&timers[i], timers[i].id);
+        timer_add(&timers[i]);
+    }
+    for (i = 0; i < TIMER_TEST_NR; i++) {
+        if (i % 3 == 0) {
+            timer_cancel(&timers[i]);
+        } else {
+            if (i % 3 == 1)
+                timer_modify(&timers[i], 1 + rand() % TIMER_TEST_MAX);
+            expect++;
+        }
+    }
+    for (i = 0; i < TIMER_TEST_NR; i += 7) {
+        if (timer_find(timers[i].id) != (timer_alive(&timers[i]) ? &timers[i] : NULL))
+            timer_test_errors++;
+    }
+    while (timer_test_fired < expect && systicks - start < 2 * TIMER_TEST_MAX)
+        task_sleep_by_ticks(HZ);
+    for (i = 0; i < TIMER_TEST_NR; i++)
+        timer_cancel(&timers[i]);
+    mem_free(timers);
+    keprint(PRINT_INFO "timer test: %d timers, %d fired (expect %d), %d errors, max late %d ticks\n",
+        TIMER_TEST_NR, timer_test_fired, expect, timer_test_errors, timer_test_late);
+}
+
 int timers_init()
 {
-    timer_init(&timer_idle, TIMER_IDLE_TIMEOUT, NULL, timer_idle_handler);
-    timer_add(&timer_idle);
+    int i, j;
+    for (i = 0; i < TVR_SIZE; i++)
+        list_init(&timer_vec_root[i]);
+    for (i = 0; i < TVN_NR; i++)
+        for (j = 0; j < TVN_SIZE; j++)
+            list_init(&timer_vec[i][j]);
+    for (i = 0; i < TIMER_HASH_NR; i++)
+        list_init(&timer_hash_table[i]);
+    timer_wheel_ticks = timer_ticks;
+#ifdef CONFIG_TIMER_TEST
+    task_create("timertest", TASK_PRIO_LEVEL_NORMAL, timer_test, NULL);
+#endif
     return 0;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <xbook/schedule.h>
 #include <xbook/debug.h>
 #include <xbook/safety.h>
+#include <xbook/timepage.h>
 
 walltime_t walltime;
 const char month_day[] = {0,31,28,31,30,31,30,31,31,30,31,30,31};
@@ -90,6 +91,7 @@ void walltime_update_second()
 			}
 		}
 	}
+    time_page_update_walltime();
 }
 
 int sys_get_walltime(walltime_t *wt)
@@ -176,6 +178,7 @@ void walltime_sync(void)
         walltime.hour += 8;
     }
 #endif /* CONFIG_TIMEZONE_AUTO */
+    time_page_update_walltime();
 }
 
 static void sync_timer_handler(struct timer_struct *tmr, void *arg)
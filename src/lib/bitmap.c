@@ -1,29 +1,86 @@
 #include <string.h>
 #include <xbook/bitmap.h>
-#include <string.h>
+#include <xbook/debug.h>
+#include <xbook/clock.h>
+#include <assert.h>
+
+/* 位图按32位的字扫描，一个字里面的位和字节里面的位顺序一致（小端） */
+#define BITMAP_WORD_BITS   32
+#define BITMAP_WORD_FULL   0xffffffffUL
+
+/*
+ * bitmap_word - 读取位图的第w个字
+ *
+ * 最后不足一个字的部分逐字节拼接，超出位图的位当作已经使用，扫描时就不会越界
+ */
+static inline unsigned long bitmap_word(bitmap_t *btmp, unsigned long w)
+{
+   unsigned long off = w * 4;
+   if (off + 4 <= btmp->byte_length) {
+      return *(unsigned long *)(btmp->bits + off);
+   }
+   unsigned long word = BITMAP_WORD_FULL;
+   int i;
+   for (i = 0; off + i < btmp->byte_length; i++) {
+      word &= ~(0xffUL << (i * 8));
+      word |= (unsigned long)btmp->bits[off + i] << (i * 8);
+   }
+   return word;
+}
+
+/* 字里面第一个为1的位，bsf指令 */
+static inline unsigned long bitmap_first_set(unsigned long word)
+{
+   return __builtin_ctz(word);
+}
+
+/*
+ * bitmap_find_next - 从from位开始查找第一个值为value的位
+ * @limit: 查找到limit位为止
+ *
+ * 整个字都不匹配时直接跳过，找不到返回limit
+ */
+static unsigned long bitmap_find_next(bitmap_t *btmp, unsigned long from,
+   unsigned long limit, int value)
+{
+   unsigned long w = from / BITMAP_WORD_BITS;
+   unsigned long end_w = (limit + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+   /* 查找0位时取反，这样都变成查找1位 */
+   unsigned long invert = value ? 0 : BITMAP_WORD_FULL;
+   /* 屏蔽第一个字里from之前的位 */
+   unsigned long word = (bitmap_word(btmp, w) ^ invert) & (BITMAP_WORD_FULL << (from % BITMAP_WORD_BITS));
+   while (!word) {
+      if (++w >= end_w)
+         return limit;
+      word = bitmap_word(btmp, w) ^ invert;
+   }
+   unsigned long idx = w * BITMAP_WORD_BITS + bitmap_first_set(word);
+   return idx < limit ? idx : limit;
+}
 
 /*
  * bitmap_init - 初始化位图
  * btmp: 要初始化的位图结构的地址
- * 
+ *
  * 初始化一个位图结构，其实就是把位图数据指针指向的地址清0
  */
-void bitmap_init(bitmap_t *btmp) 
+void bitmap_init(bitmap_t *btmp)
 {
-   memset(btmp->bits, 0, btmp->byte_length);   
+   memset(btmp->bits, 0, btmp->byte_length);
+   btmp->next_free = 0;
 }
 
 /*
  * bitmap_scan_test - 检测位图某位是否为1
  * @btmp: 要检测的位图
  * @idx: 要检测哪一位
- * 
+ *
  * 可以通过检测寻找哪些是已经使用的，哪些还没有使用
  */
-bool bitmap_scan_test(bitmap_t *btmp, unsigned long  idx) 
+bool bitmap_scan_test(bitmap_t *btmp, unsigned long  idx)
 {
-   unsigned long byte_idx = idx / 8;   
-   unsigned long bit_odd  = idx % 8;  
+   unsigned long byte_idx = idx / 8;
+   unsigned long bit_odd  = idx % 8;
    return (btmp->bits[byte_idx] & (BITMAP_MASK << bit_odd));
 }
 
@@ -31,50 +88,27 @@ bool bitmap_scan_test(bitmap_t *btmp, unsigned long  idx)
  * bitmap_scan - 扫描n个位
  * @btmp: 要检测的位图
  * @cnt: 要扫描多少位
- * 
- * 可以通过检测寻找哪些是已经使用的，哪些还没有使用
+ *
+ * 查找连续cnt个为0的位，返回第一个位的位置，没找到返回-1。
+ * 从next_free提示的位置开始，按字跳过全部使用和全部空闲的区域。
  */
-long bitmap_scan(bitmap_t *btmp, unsigned long cnt) {
-   unsigned long idx_byte = 0;
-
-   while (( 0xff == btmp->bits[idx_byte]) && (idx_byte < btmp->byte_length)) {
-      idx_byte++;
-   }
-
-   
-   if (idx_byte == btmp->byte_length) {  
+long bitmap_scan(bitmap_t *btmp, unsigned long cnt)
+{
+   unsigned long total = btmp->byte_length * 8;
+   if (!cnt || cnt > total)
       return -1;
+   unsigned long start = bitmap_find_next(btmp, btmp->next_free, total, 0);
+   /* next_free之前的位都已经使用，找到的第一个0位就是新的提示 */
+   btmp->next_free = start;
+   while (start + cnt <= total) {
+      if (cnt == 1)
+         return start;
+      unsigned long end = bitmap_find_next(btmp, start + 1, start + cnt, 1);
+      if (end == start + cnt)
+         return start;
+      start = bitmap_find_next(btmp, end + 1, total, 0);
    }
-
-   long idx_bit = 0;
-
-   while ((unsigned char)(BITMAP_MASK << idx_bit) & btmp->bits[idx_byte]) { 
-	 idx_bit++;
-   }
-	 
-   long idx_start = idx_byte * 8 + idx_bit;  
-   if (cnt == 1) {
-      return idx_start;
-   }
-
-   unsigned long bit_left = (btmp->byte_length * 8 - idx_start);
-   unsigned long next_bit = idx_start + 1;
-   unsigned long count = 1;
-
-   idx_start = -1;
-   while (bit_left-- > 0) {
-      if (!(bitmap_scan_test(btmp, next_bit))) {
-	 count++;
-      } else {
-	 count = 0;
-      }
-      if (count == cnt) {
-	 idx_start = next_bit - cnt + 1;
-	 break;
-      }
-      next_bit++;          
-   }
-   return idx_start;
+   return -1;
 }
 
 /*
@@ -82,7 +116,7 @@ long bitmap_scan(bitmap_t *btmp, unsigned long cnt) {
  * @btmp: 要检测的位图
  * @idx: 哪个地址
  * @value: 要设置的值（0或1）
- * 
+ *
  * 可以通过设置位图某位的值来表达某一个事物是否使用
  */
 void bitmap_set(bitmap_t *btmp, unsigned long idx, char value)
@@ -92,8 +126,39 @@ void bitmap_set(bitmap_t *btmp, unsigned long idx, char value)
 
    if (value) {
       btmp->bits[byte_idx] |= (BITMAP_MASK << bit_odd);
+      if (idx == btmp->next_free)
+         btmp->next_free++;
    } else {
       btmp->bits[byte_idx] &= ~(BITMAP_MASK << bit_odd);
+      if (idx < btmp->next_free)
+         btmp->next_free = idx;
+   }
+}
+
+/*
+ * bitmap_set_range - 把从idx开始的cnt个位设置成value值
+ *
+ * 中间整字节的部分直接填充
+ */
+void bitmap_set_range(bitmap_t *btmp, unsigned long idx, unsigned long cnt, char value)
+{
+   unsigned long end = idx + cnt;
+   while (idx < end && (idx % 8)) {
+      bitmap_set(btmp, idx, value);
+      idx++;
+   }
+   if (end - idx >= 8) {
+      unsigned long bytes = (end - idx) / 8;
+      memset(btmp->bits + idx / 8, value ? 0xff : 0, bytes);
+      if (!value && idx < btmp->next_free)
+         btmp->next_free = idx;
+      else if (value && idx == btmp->next_free)
+         btmp->next_free = idx + bytes * 8;
+      idx += bytes * 8;
+   }
+   while (idx < end) {
+      bitmap_set(btmp, idx, value);
+      idx++;
    }
 }
 
@@ -108,6 +173,8 @@ long bitmap_change(bitmap_t *btmp, unsigned long idx)
    unsigned long bit_odd  = idx % 8;
    //进行异或
    btmp->bits[byte_idx] ^= (BITMAP_MASK << bit_odd);
+   if (!(btmp->bits[byte_idx] & (BITMAP_MASK << bit_odd)) && idx < btmp->next_free)
+      btmp->next_free = idx;
    //返回该位
    return (btmp->bits[byte_idx] & (BITMAP_MASK << bit_odd));
 }
@@ -116,7 +183,7 @@ long bitmap_change(bitmap_t *btmp, unsigned long idx)
  * bitmap_test_and_change - 测试并改变该位
  * @btmp: 要检测的位图
  * @idx: 哪个地址
- * 
+ *
  * 返回之前的状态
  */
 long bitmap_test_and_change(bitmap_t *btmp, unsigned long idx)
@@ -129,6 +196,89 @@ long bitmap_test_and_change(bitmap_t *btmp, unsigned long idx)
 
    //进行异或取反
    btmp->bits[byte_idx] ^= (BITMAP_MASK << bit_odd);
+   if (ret && idx < btmp->next_free)
+      btmp->next_free = idx;
    //返回之前的状态
    return ret;
 }
+
+/* 原来逐字节、逐位扫描的实现，只用来在测试中对比结果和速度 */
+static long bitmap_scan_bytewise(bitmap_t *btmp, unsigned long cnt)
+{
+   unsigned long idx_byte = 0;
+   while (idx_byte < btmp->byte_length && 0xff == btmp->bits[idx_byte])
+      idx_byte++;
+   if (idx_byte == btmp->byte_length)
+      return -1;
+   long idx_bit = 0;
+   while ((unsigned char)(BITMAP_MASK << idx_bit) & btmp->bits[idx_byte])
+      idx_bit++;
+   unsigned long next_bit = idx_byte * 8 + idx_bit;
+   unsigned long count = 0;
+   while (next_bit < btmp->byte_length * 8) {
+      if (!bitmap_scan_test(btmp, next_bit))
+         count++;
+      else
+         count = 0;
+      if (count == cnt)
+         return next_bit - cnt + 1;
+      next_bit++;
+   }
+   return -1;
+}
+
+#define BITMAP_TEST_BYTES  1024
+
+/*
+ * bitmap_test - 检测按字扫描的结果和逐位扫描一致，并比较两者的速度
+ */
+void bitmap_test(void)
+{
+   static unsigned char bits[BITMAP_TEST_BYTES + 3];
+   bitmap_t btmp;
+   unsigned long i, seed = 1;
+   int round;
+   /* 不是4的倍数的长度和不对齐的地址，检测末尾和不对齐的处理 */
+   btmp.bits = bits + 1;
+   btmp.byte_length = BITMAP_TEST_BYTES + 1;
+   for (round = 0; round < 64; round++) {
+      bitmap_init(&btmp);
+      for (i = 0; i < btmp.byte_length * 8; i++) {
+         seed = seed * 1103515245 + 12345;
+         /* 越往后越空闲，模拟前面已经分配了很多的情况 */
+         if ((seed >> 16) % btmp.byte_length > i / 8 / (round % 4 + 1))
+            bitmap_set(&btmp, i, 1);
+      }
+      unsigned long cnt;
+      for (cnt = 1; cnt <= 40; cnt++)
+         assert(bitmap_scan(&btmp, cnt) == bitmap_scan_bytewise(&btmp, cnt));
+      /* 分配后释放，检测提示的维护 */
+      long idx = bitmap_scan(&btmp, 3);
+      if (idx >= 0) {
+         bitmap_set_range(&btmp, idx, 3, 1);
+         assert(bitmap_scan(&btmp, 1) == bitmap_scan_bytewise(&btmp, 1));
+         bitmap_set_range(&btmp, idx, 3, 0);
+         assert(bitmap_scan(&btmp, 3) == idx);
+      }
+   }
+   /* 前面都已经使用的情况下比较速度 */
+   bitmap_init(&btmp);
+   bitmap_set_range(&btmp, 0, btmp.byte_length * 8 - 64, 1);
+   volatile long sink = 0;
+   clock_t ticks = sys_get_ticks();
+   for (i = 0; i < 10000; i++) {
+      sink += bitmap_scan_bytewise(&btmp, 1);
+      sink += bitmap_scan_bytewise(&btmp, 16);
+   }
+   clock_t old_ticks = sys_get_ticks() - ticks;
+   ticks = sys_get_ticks();
+   for (i = 0; i < 10000; i++) {
+      btmp.next_free = 0;  /* 不使用提示，只比较按字扫描 */
+      sink -= bitmap_scan(&btmp, 1);
+      sink -= bitmap_scan(&btmp, 16);
+   }
+   clock_t new_ticks = sys_get_ticks() - ticks;
+   assert(sink == 0);
+   keprint(PRINT_INFO "bitmap test: pass, %d bits scan 20000 times: bytewise %d ticks, wordwise %d ticks\n",
+      btmp.byte_length * 8, old_ticks, new_ticks);
+}
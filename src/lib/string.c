@@ -400,43 +400,90 @@ char *strndup(const char *s, size_t n)
     return p;
 }
 
-void *memset(void* src, uint8_t value, uint32_t size) 
+/*
+ * 先以4字节为单位用rep movsl复制，再用rep movsb复制剩余的字节。
+ * 方向标志在调用约定中保证为0，这里不会修改它。
+ */
+static inline void __memcpy_forward(void *dst, const void *src, uint32_t size)
 {
-	uint8_t* s = (uint8_t*)src;
-	while (size > 0){
-		*s++ = value;
-		--size;
-	}
-	return src;
+    int d0, d1, d2;
+    __asm__ __volatile__ (
+        "rep movsl\n\t"
+        "movl %4, %%ecx\n\t"
+        "andl $3, %%ecx\n\t"
+        "jz 1f\n\t"
+        "rep movsb\n\t"
+        "1:"
+        : "=&c" (d0), "=&D" (d1), "=&S" (d2)
+        : "0" (size >> 2), "g" (size), "1" (dst), "2" (src)
+        : "memory");
 }
 
-void *memset16(void* src, uint16_t value, uint32_t size) 
+static inline void __memset_forward(void *dst, uint32_t value, uint32_t size)
 {
-	uint16_t* s = (uint16_t*)src;
-	while (size-- > 0){
-		*s++ = value;
-	}
-	return src;
+    int d0, d1;
+    __asm__ __volatile__ (
+        "rep stosl\n\t"
+        "movl %3, %%ecx\n\t"
+        "andl $3, %%ecx\n\t"
+        "jz 1f\n\t"
+        "rep stosb\n\t"
+        "1:"
+        : "=&c" (d0), "=&D" (d1)
+        : "a" (value), "g" (size), "0" (size >> 2), "1" (dst)
+        : "memory");
 }
 
-void *memset32(void* src, uint32_t value, uint32_t size) 
+void *memset(void* src, uint8_t value, uint32_t size)
 {
-	uint32_t* s = (uint32_t*)src;
-	while (size-- > 0){
-		*s++ = value;
-	}
-	return src;
+    uint8_t *s = (uint8_t *)src;
+    /* 大块填充时先把目的地址对齐到4字节 */
+    if (size >= 16) {
+        uint32_t head = (-(unsigned long)s) & 3;
+        size -= head;
+        while (head--)
+            *s++ = value;
+    }
+    __memset_forward(s, value * 0x01010101U, size);
+    return src;
+}
+
+void *memset16(void* src, uint16_t value, uint32_t size)
+{
+    uint16_t* s = (uint16_t*)src;
+    int d0, d1;
+    __asm__ __volatile__ (
+        "rep stosw"
+        : "=&c" (d0), "=&D" (d1)
+        : "a" (value), "0" (size), "1" (s)
+        : "memory");
+    return src;
+}
+
+void *memset32(void* src, uint32_t value, uint32_t size)
+{
+    uint32_t* s = (uint32_t*)src;
+    int d0, d1;
+    __asm__ __volatile__ (
+        "rep stosl"
+        : "=&c" (d0), "=&D" (d1)
+        : "a" (value), "0" (size), "1" (s)
+        : "memory");
+    return src;
 }
 
 void *memcpy(const void* dst, const void* src, uint32_t size)
 {
-    uint8_t *_dst = (uint8_t *)dst;
-    uint8_t *_src = (uint8_t *)src;
-    while (size-- > 0)
-    {
-        *_dst++ = *_src++;
+    uint8_t *__dst = (uint8_t *)dst;
+    const uint8_t *__src = (const uint8_t *)src;
+    /* 大块复制时先把目的地址对齐到4字节 */
+    if (size >= 16) {
+        uint32_t head = (-(unsigned long)__dst) & 3;
+        size -= head;
+        while (head--)
+            *__dst++ = *__src++;
     }
-
+    __memcpy_forward(__dst, __src, size);
     return (void *)dst;
 }
 
@@ -459,25 +506,28 @@ int memcmp(const void * s1, const void *s2, int n)
 
 void* memmove(void* dst,const void* src,uint32_t count)
 {
-    char* tmpdst = (char*)dst;
-    char* tmpsrc = (char*)src;
+    uint8_t *tmpdst = (uint8_t *)dst;
+    const uint8_t *tmpsrc = (const uint8_t *)src;
 
-    if (tmpdst <= tmpsrc || tmpdst >= tmpsrc + count)
-    {
-        while(count--)
-        {
-            *tmpdst++ = *tmpsrc++; 
-        }
+    if (tmpdst <= tmpsrc || tmpdst >= tmpsrc + count) {
+        memcpy(dst, src, count);
+        return dst;
     }
-    else
-    {
-        tmpdst = tmpdst + count - 1;
-        tmpsrc = tmpsrc + count - 1;
-        while(count--)
-        {
-            *tmpdst-- = *tmpsrc--;
-        }
+    /* 
+     * 目的地址在源地址后面并且有重叠，需要从后往前复制。
+     * 没有使用std，避免在方向标志置位时进入中断处理。
+     */
+    tmpdst += count;
+    tmpsrc += count;
+    while (count & 3) {
+        *--tmpdst = *--tmpsrc;
+        count--;
+    }
+    while (count) {
+        tmpdst -= 4;
+        tmpsrc -= 4;
+        *(uint32_t *)tmpdst = *(const uint32_t *)tmpsrc;
+        count -= 4;
     }
-
     return dst; 
 }
@@ -12,6 +12,7 @@
 #include <xbook/dir.h>
 #include <xbook/fsal.h>
 #include <xbook/fd.h>
+#include <xbook/pagecache.h>
 
 
 
@@ -89,12 +90,20 @@ static int do_execute(const char *pathname, char *name, const char *argv[], cons
 
     char tmp_name[MAX_TASK_NAMELEN] = {0};
     strcpy(tmp_name, name);
-    vmm_unmap_the_mapping_space(cur->vmm);
+    /* 镜像通过页缓存按需加载，获取不到缓存时就直接读取整个段 */
+    page_cache_t *cache = page_cache_get(pathname);
+    /* 按需加载时旧镜像的页映射不能保留，否则不会产生缺页 */
+    vmm_unmap_space(cur->vmm);
     vmm_release_space(cur->vmm);
-    if (proc_load_image(cur->vmm, &elf_header, fd) < 0) {
+    if (proc_load_image(cur->vmm, &elf_header, fd, cache) < 0) {
         keprint(PRINT_ERR "sys_exec_file: load_image failed!\n");
+        if (cache)
+            page_cache_put(cache);
         goto free_tmp_arg;
     }
+    /* 映射空间已经持有缓存的引用 */
+    if (cache)
+        page_cache_put(cache);
     trap_frame_t *frame = (trap_frame_t *)\
         ((unsigned long)cur + TASK_KERN_STACK_SIZE - sizeof(trap_frame_t));
     proc_trap_frame_init(cur);
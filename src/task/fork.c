@@ -21,7 +21,9 @@ static pid_t task_fork_pid()
  */
 static int copy_struct_and_kstack(task_t *child, task_t *parent)
 {
+    fpu_flush(&parent->fpu);    /* 寄存器中的fpu状态写回后才能复制 */
     memcpy(child, parent, TASK_KERN_STACK_SIZE);
+    child->fpu.loads = 0;
     child->pid = task_fork_pid();
     child->tgid = child->pid;
     child->state = TASK_READY;
@@ -29,6 +31,9 @@ static int copy_struct_and_kstack(task_t *child, task_t *parent)
     child->pgid = parent->pgid;     /* 和父进程在同一个组 */
     list_init(&child->list);
     list_init(&child->global_list);
+    list_init(&child->pid_hash_list);
+    list_init(&child->children);
+    list_init(&child->child_list);
     child->kstack = (unsigned char *)((unsigned char *)child + TASK_KERN_STACK_SIZE - sizeof(trap_frame_t));
     child->port_comm = NULL;
     return 0;
@@ -134,7 +139,7 @@ int sys_fork()
         return -1;
     }
     task_add_to_global_list(child);
-    sched_queue_add_tail(sched_get_cur_unit(), child);
+    sched_queue_add_tail(sched_pick_unit(), child);
     interrupt_restore_state(flags);
     return child->pid;  /* 父进程返回子进程pid */
 }
\ No newline at end of file
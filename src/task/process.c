@@ -6,6 +6,7 @@
 #include <math.h>
 #include <xbook/memspace.h>
 #include <xbook/vmm.h>
+#include <xbook/pagecache.h>
 #include <string.h>
 #include <xbook/pthread.h>
 #include <xbook/schedule.h>
@@ -20,6 +21,23 @@
 
 #define DEBUG_PROCESS 0
 
+/**
+ * 通过页缓存映射段，只建立文件映射空间，执行时在缺页中才读取文件。
+ * 文件偏移和虚拟地址在页内的偏移必须一致，否则不能按页映射。
+ */
+static int proc_map_segment(page_cache_t *cache, unsigned long offset, unsigned long file_sz,
+    unsigned long mem_sz, unsigned long vaddr)
+{
+    unsigned long vaddr_page = vaddr & PAGE_MASK;
+    unsigned long len = PAGE_ALIGN(vaddr + mem_sz) - vaddr_page;
+    if (do_mem_space_map_file(task_current->vmm, vaddr_page, len, PROT_USER | PROT_WRITE,
+        MEM_SPACE_MAP_FIXED, cache, offset & PAGE_MASK, file_sz + (vaddr & PAGE_LIMIT)) == -1) {
+        keprint(PRINT_ERR "proc_map_segment: map file space failed!\n");
+        return -1;
+    }
+    return 0;
+}
+
 static int proc_load_segment(int fd, unsigned long offset, unsigned long file_sz,
     unsigned long mem_sz, unsigned long vaddr)
 {
@@ -46,7 +64,7 @@ static int proc_load_segment(int fd, unsigned long offset, unsigned long file_sz
     return 0;
 }
 
-int proc_load_image(vmm_t *vmm, struct Elf32_Ehdr *elf_header, int fd)
+int proc_load_image(vmm_t *vmm, struct Elf32_Ehdr *elf_header, int fd, page_cache_t *cache)
 {
     struct Elf32_Phdr prog_header;
     Elf32_Off prog_header_off = elf_header->e_phoff;
@@ -64,12 +82,17 @@ int proc_load_image(vmm_t *vmm, struct Elf32_Ehdr *elf_header, int fd)
             keprint("elf segment: paddr:%x vaddr:%x file size:%x mem size: %x\n", 
                 prog_header.p_paddr, prog_header.p_vaddr, prog_header.p_filesz, prog_header.p_memsz);
             #endif
-            if (proc_load_segment(fd, prog_header.p_offset, 
+            if (cache && (prog_header.p_offset & PAGE_LIMIT) == (prog_header.p_vaddr & PAGE_LIMIT)) {
+                /* 按需加载，bss部分在缺页时清0 */
+                if (proc_map_segment(cache, prog_header.p_offset, 
+                        prog_header.p_filesz, prog_header.p_memsz, prog_header.p_vaddr)) {
+                    return -1;
+                }
+            } else if (proc_load_segment(fd, prog_header.p_offset, 
                     prog_header.p_filesz, prog_header.p_memsz, prog_header.p_vaddr)) {
                 return -1;
-            }
-            /* 如果内存大小比文件大小大，就要清0 */
-            if (prog_header.p_memsz > prog_header.p_filesz) {
+            } else if (prog_header.p_memsz > prog_header.p_filesz) {
+                /* 如果内存大小比文件大小大，就要清0 */
                 memset((void *)(prog_header.p_vaddr + prog_header.p_filesz), 0,
                     prog_header.p_memsz - prog_header.p_filesz);    
             }
@@ -260,19 +283,17 @@ int proc_deal_zombie_child(task_t *parent)
     int zombies = 0;
     int zombie = -1;
     task_t *child, *next;
-    list_for_each_owner_safe (child, next, &task_global_list, global_list) {
-        if (child->parent_pid == parent->pid) {
-            if (child->state == TASK_ZOMBIE) {
-                if (zombie == -1) {
-                    zombie = child->pid;
-                }
-                if (TASK_IS_SINGAL_THREAD(child)) {
-                    proc_destroy(child, 0);
-                } else {
-                    proc_destroy(child, 1);
-                }
-                zombies++;
+    list_for_each_owner_safe (child, next, &parent->children, child_list) {
+        if (child->state == TASK_ZOMBIE) {
+            if (zombie == -1) {
+                zombie = child->pid;
+            }
+            if (TASK_IS_SINGAL_THREAD(child)) {
+                proc_destroy(child, 0);
+            } else {
+                proc_destroy(child, 1);
             }
+            zombies++;
         }
     }
     return zombie; /* 如果没有僵尸进程就返回-1，有则返回第一个僵尸进程的pid */
@@ -281,7 +302,7 @@ int proc_deal_zombie_child(task_t *parent)
 void proc_close_one_thread(task_t *thread)
 {
     if (thread->state == TASK_READY) {
-        list_del_init(&thread->list);
+        sched_queue_remove(sched_get_task_unit(thread), thread);
     }
     if (thread->state != TASK_HANGING && thread->state != TASK_ZOMBIE) {
         task_do_cancel(thread);
@@ -374,7 +395,7 @@ task_t *process_create(char **argv, char **envp, uint32_t flags)
     if (flags & PROC_CREATE_STOP) {    /* 阻塞，需要等待唤醒 */
         task->state = TASK_STOPPED;
     } else {    /* 进入就绪队列执行 */
-        sched_queue_add_tail(sched_get_cur_unit(), task);
+        sched_queue_add_tail(sched_pick_unit(), task);
     }
     interrupt_restore_state(irqflags);  
     return task;
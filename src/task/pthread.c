@@ -27,16 +27,12 @@ void pthread_entry(void *arg)
 
 int wait_one_hangging_thread(task_t *parent, pid_t pid, int *status)
 {
-    task_t *child, *next;
-    list_for_each_owner_safe (child, next, &task_global_list, global_list) {
-        if (child->pid == pid) {
-            if (child->state == TASK_HANGING) {
-                if (status != NULL)
-                    *status = child->exit_status;
-                proc_destroy(child, 1);
-                return pid;
-            }
-        }
+    task_t *child = task_find_by_pid(pid);
+    if (child && child->state == TASK_HANGING) {
+        if (status != NULL)
+            *status = child->exit_status;
+        proc_destroy(child, 1);
+        return pid;
     }
     return -1;
 }
@@ -133,7 +129,7 @@ void pthread_exit(void *status)
                 }
             }
         }
-        cur->parent_pid = USER_INIT_PROC_ID;
+        task_set_parent(cur, USER_INIT_PROC_ID);
     }
     task_t *parent = task_find_by_pid(cur->parent_pid); 
     if (parent) {
@@ -183,14 +179,8 @@ int pthread_join(pthread_t thread, void **thread_return)
     task_t *waiter = task_current;
     unsigned long flags;
     interrupt_save_and_disable(flags);
-    task_t *task, *find = NULL;
-    list_for_each_owner (task, &task_global_list, global_list) {
-        if (task->pid == thread && task->state != TASK_ZOMBIE) {
-            find = task;
-            break;
-        }
-    }
-    if (find == NULL) {
+    task_t *find = task_find_by_pid(thread);
+    if (find == NULL || find->state == TASK_ZOMBIE) {
         interrupt_restore_state(flags);
         return -1;
     }
@@ -204,7 +194,7 @@ int pthread_join(pthread_t thread, void **thread_return)
     }
 
     find->flags |= THREAD_FLAG_JOINED;
-    find->parent_pid = waiter->pid;
+    task_set_parent(find, waiter->pid);
     waiter->flags |= THREAD_FLAG_JOINING;
     int status;
     pid_t pid;
@@ -5,18 +5,20 @@
 #include <xbook/debug.h>
 #include <arch/interrupt.h>
 #include <arch/task.h>
+#include <arch/smp.h>
 
 #define DEBUG_SCHED 0
 
 scheduler_t scheduler;
 
-const uint8_t sched_priority_levels[TASK_PRIO_LEVEL_MAX] = {1, 0, 1, 2, 3};
+const uint8_t sched_priority_levels[TASK_PRIO_LEVEL_MAX] = {
+    TASK_PRIORITY_NORMAL,
+    TASK_PRIORITY_LOW,
+    TASK_PRIORITY_NORMAL,
+    TASK_PRIORITY_HIGH,
+    TASK_PRIORITY_REALTIME
+};
 
-/*
-TODO：优化动态优先级：当一个优先级高的线程长期获得优运行时，可以适当调低优先级。
-当一个低先级高的线程长期没获得运行时，可以适当调提高优先级。
-当前采取的是高优先级执行固定时间后就降低，不太好，没体现优先级的优势。
-*/
 uint8_t sched_calc_base_priority(uint32_t level)
 {
     if (level >= TASK_PRIO_LEVEL_MAX)
@@ -24,65 +26,293 @@ uint8_t sched_calc_base_priority(uint32_t level)
     return sched_priority_levels[level];
 }
 
-uint8_t sched_calc_new_priority(task_t *task, char adjustment)
+/* 实时任务和idle不参与动态优先级调整 */
+static inline int sched_priority_fixed(task_t *task)
 {
-    char priority = task->priority;
-    assert((priority <= TASK_PRIORITY_REALTIME));
-    if ((priority < TASK_PRIORITY_REALTIME)) {
-        priority = priority + adjustment;
-        if (priority >= TASK_PRIORITY_REALTIME)
-            priority = TASK_PRIORITY_REALTIME - 1;
-        if (priority < task->static_priority)
-            priority = task->static_priority;
-    }
+    return task->static_priority >= TASK_PRIORITY_REALTIME ||
+        task->static_priority == TASK_PRIORITY_IDLE;
+}
+
+/*
+ * idle在task_start_user降到空闲优先级之后才是真正的idle：不进入就绪队列，
+ * 没有其它任务时才运行。在这之前它是启动内核的主线程，和普通任务一样排队。
+ */
+static inline int sched_task_is_idle(sched_unit_t *su, task_t *task)
+{
+    return task == su->idle && task->static_priority == TASK_PRIORITY_IDLE;
+}
+
+static inline int sched_task_bonus(task_t *task)
+{
+    return task->sleep_avg * (SCHED_MAX_BONUS * 2 + 1) / (SCHED_MAX_SLEEP_AVG + 1) -
+        SCHED_MAX_BONUS;
+}
+
+/* 经常睡眠的任务（等待输入的界面程序）是交互任务 */
+static inline int sched_task_interactive(task_t *task)
+{
+    return sched_task_bonus(task) >= SCHED_MAX_BONUS / 2;
+}
+
+/**
+ * sched_calc_dynamic_priority - 根据睡眠平均值计算动态优先级
+ * 
+ * 经常睡眠的任务优先级提高，一直占用cpu的任务优先级降低，
+ * 最多在静态优先级上下浮动SCHED_MAX_BONUS，并且不会进入实时优先级。
+ */
+uint8_t sched_calc_dynamic_priority(task_t *task)
+{
+    if (sched_priority_fixed(task))
+        return task->static_priority;
+    int priority = task->static_priority + sched_task_bonus(task);
+    if (priority < TASK_PRIORITY_IDLE + 1)
+        priority = TASK_PRIORITY_IDLE + 1;
+    if (priority > TASK_PRIORITY_REALTIME - 1)
+        priority = TASK_PRIORITY_REALTIME - 1;
     return (uint8_t) priority;
 }
 
-static task_t *sched_queue_fetch_first(sched_unit_t *su)
+/* 时间片随优先级增大，从TASK_TIMESLICE_BASE到TASK_TIMESLICE_MAX */
+unsigned long sched_calc_timeslice(task_t *task)
 {
+    return TASK_TIMESLICE_BASE + task->priority *
+        (TASK_TIMESLICE_MAX - TASK_TIMESLICE_BASE) / TASK_PRIORITY_MAX;
+}
+
+static void sched_array_enqueue(sched_unit_t *su, sched_array_t *array, task_t *task, int head)
+{
+    sched_queue_t *queue = &array->queue[(int)task->priority];
+    assert(task->sched_array == NULL);
+    if (head)
+        list_add(&task->list, &queue->list);
+    else
+        list_add_tail(&task->list, &queue->list);
+    queue->length++;
+    array->bitmap |= 1 << task->priority;
+    array->tasknr++;
+    task->sched_array = array;
+    task->cpuid = su->cpuid;
+    su->tasknr++;
+}
+
+static void sched_array_dequeue(sched_unit_t *su, task_t *task)
+{
+    sched_array_t *array = task->sched_array;
+    sched_queue_t *queue = &array->queue[(int)task->priority];
+    list_del_init(&task->list);
+    if (!--queue->length)
+        array->bitmap &= ~(1 << task->priority);
+    array->tasknr--;
+    task->sched_array = NULL;
+    su->tasknr--;
+}
+
+/* 其它处理器的调度单元需要重新调度时，发送处理器间中断通知它 */
+static void sched_unit_kick(sched_unit_t *su)
+{
+#ifdef CONFIG_SMP
+    if (su != sched_get_cur_unit() && (su->flags & SCHED_NEED_RESCHED))
+        smp_send_reschedule(su->cpuid);
+#endif
+}
+
+/* 新任务放到空闲的调度单元时，不用等到idle的下一个tick */
+void sched_queue_add_tail(sched_unit_t *su, task_t *task)
+{
+    task->priority = sched_calc_dynamic_priority(task);
+    sched_array_enqueue(su, su->active, task, 0);
+    scheduler.tasknr++;
+    if (su->cur && sched_task_is_idle(su, su->cur))
+        su->flags |= SCHED_NEED_RESCHED;
+    sched_unit_kick(su);
+}
+
+/**
+ * 唤醒的任务根据睡眠的时间增加睡眠平均值，重新计算优先级后放到队列头，
+ * 优先级比当前任务高时，在下一次调度软中断中抢占当前任务。
+ */
+void sched_queue_add_head(sched_unit_t *su, task_t *task)
+{
+    clock_t slept = systicks - task->sleep_timestamp;
+    task->sleep_avg += slept;
+    if (task->sleep_avg > SCHED_MAX_SLEEP_AVG)
+        task->sleep_avg = SCHED_MAX_SLEEP_AVG;
+    task->priority = sched_calc_dynamic_priority(task);
+    sched_array_enqueue(su, su->active, task, 1);
+    scheduler.tasknr++;
+    if (su->cur && task->priority > su->cur->priority)
+        su->flags |= SCHED_NEED_RESCHED;
+    sched_unit_kick(su);
+}
+
+/* 从就绪队列中移除任务，需要关闭中断调用 */
+void sched_queue_remove(sched_unit_t *su, task_t *task)
+{
+    if (!task->sched_array)
+        return;
+    sched_array_dequeue(su, task);
+    scheduler.tasknr--;
+}
+
+/**
+ * 时钟调度软中断中调用，运行时减少睡眠平均值，
+ * 时间片用完或者需要抢占时进行调度
+ */
+void sched_tick(sched_unit_t *su, task_t *task)
+{
+    /* idle不消耗时间片，只有其它任务唤醒时才被抢占 */
+    if (sched_task_is_idle(su, task)) {
+        if (su->flags & SCHED_NEED_RESCHED)
+            schedule();
+        return;
+    }
+    if (task->sleep_avg)
+        task->sleep_avg--;
+    if (task->ticks)
+        task->ticks--;
+    if (!task->ticks || (su->flags & SCHED_NEED_RESCHED))
+        schedule();
+}
+
+/* 过期数组中的任务等待太久，不能再让交互任务留在活动数组中 */
+static inline int sched_expired_starving(sched_unit_t *su)
+{
+    return su->expired->tasknr &&
+        systicks - su->expired_timestamp > SCHED_STARVATION_LIMIT;
+}
+
+/**
+ * 时间片用完的任务重新计算优先级和时间片，放到过期数组。
+ * 实时任务和交互任务放回活动数组，可以继续得到运行
+ */
+static void sched_task_expire(sched_unit_t *su, task_t *task)
+{
+    task->priority = sched_calc_dynamic_priority(task);
+    task->timeslice = sched_calc_timeslice(task);
+    task->ticks = task->timeslice;
+    if (sched_priority_fixed(task) ||
+        (sched_task_interactive(task) && !sched_expired_starving(su))) {
+        sched_array_enqueue(su, su->active, task, 0);
+    } else {
+        if (!su->expired->tasknr)
+            su->expired_timestamp = systicks;
+        sched_array_enqueue(su, su->expired, task, 0);
+    }
+}
+
+#ifdef CONFIG_SMP
+/* 
+ * 线程共享地址空间和进程的线程链表，只在创建它的处理器上运行，
+ * fpu状态还在原来处理器寄存器中的任务也不能迁移
+ */
+static inline int sched_task_can_migrate(sched_unit_t *from, task_t *task)
+{
+    return task != from->idle && task->pthread == NULL &&
+        !fpu_live_elsewhere(&task->fpu);
+}
+
+/**
+ * sched_steal_task - 从最忙的调度单元上拿一个任务
+ * 
+ * 当前调度单元没有就绪任务时调用，先从活动数组中找，优先级高的先拿
+ */
+static task_t *sched_steal_task(sched_unit_t *su)
+{
+    sched_unit_t *busiest = NULL;
+    int i;
+    for (i = 0; i < scheduler.cpunr; i++) {
+        sched_unit_t *other = &scheduler.sched_unit_table[i];
+        if (other == su || !other->idle || !other->tasknr)
+            continue;
+        if (!busiest || other->tasknr > busiest->tasknr)
+            busiest = other;
+    }
+    if (!busiest)
+        return NULL;
+    sched_array_t *arrays[2] = {busiest->active, busiest->expired};
     task_t *task;
-    /* 总是选择优先级比较高的队列 */
-    while (!su->priority_queue[su->dynamic_priority].length) {
-        --su->dynamic_priority;
+    int j, priority;
+    for (j = 0; j < 2; j++) {
+        for (priority = TASK_PRIORITY_MAX; priority >= 0; priority--) {
+            if (!(arrays[j]->bitmap & (1 << priority)))
+                continue;
+            list_for_each_owner (task, &arrays[j]->queue[priority].list, list) {
+                if (sched_task_can_migrate(busiest, task)) {
+                    sched_array_dequeue(busiest, task);
+                    return task;
+                }
+            }
+        }
     }
-    sched_queue_t *queue = &su->priority_queue[su->dynamic_priority];
-    task = list_first_owner(&queue->list, task_t, list);
-    --queue->length;
-    --su->tasknr;
-    list_del_init(&task->list);
+    return NULL;
+}
+#endif
+
+static task_t *sched_queue_fetch_first(sched_unit_t *su)
+{
+    sched_array_t *array = su->active;
+    if (!array->tasknr) {
+        /* 活动数组为空，交换活动数组和过期数组 */
+        su->active = su->expired;
+        su->expired = array;
+        array = su->active;
+        su->expired_timestamp = 0;
+    }
+    if (!array->tasknr) {
+#ifdef CONFIG_SMP
+        task_t *task = sched_steal_task(su);
+        if (task)
+            return task;
+#endif
+        return su->idle;
+    }
+    /* 总是选择优先级最高的队列 */
+    int priority = 31 - __builtin_clz(array->bitmap);
+    task_t *task = list_first_owner(&array->queue[priority].list, task_t, list);
+    sched_array_dequeue(su, task);
     return task;
 }
 
 task_t *get_next_task(sched_unit_t *su)
 {
     task_t *task = su->cur;
+    su->flags &= ~SCHED_NEED_RESCHED;
     switch (task->state) {
     case TASK_RUNNING:
-        task->ticks = task->timeslice;
         task->state = TASK_READY;
+        if (sched_task_is_idle(su, task))
+            break;
+        if (!task->ticks) {
+            sched_task_expire(su, task);
+        } else {
+            /* 被抢占的任务保留剩余的时间片 */
+            sched_array_enqueue(su, su->active, task, 0);
+        }
+        break;
     case TASK_READY:
-        // Non-real-time tasks are dynamically prioritized    
-        if (task->priority < TASK_PRIORITY_REALTIME && task->priority > TASK_PRIORITY_LOW) {
-            task->priority--;
-            if ((task->priority <= TASK_PRIORITY_LOW)) {
-                task->priority = task->static_priority;
-            }
+        /* 主动让出cpu */
+        if (sched_task_is_idle(su, task))
+            break;
+        if (!task->ticks) {
+            sched_task_expire(su, task);
+        } else {
+            sched_array_enqueue(su, su->active, task, 0);
         }
-        sched_queue_add_tail(su, task);
+        break;
     default:
+        /* 进入睡眠，记录时间，唤醒时计算睡眠平均值 */
+        task->sleep_timestamp = systicks;
         break;
     }
-    task_t *next;
-    next = sched_queue_fetch_first(su);
-    return next;
+    return sched_queue_fetch_first(su);
 }
 
 static void sched_set_next_task(sched_unit_t *su, task_t *next)
 {
-    fpu_save(&su->cur->fpu);
     su->cur = next;
+    next->cpuid = su->cpuid;
     task_activate_when_sched(su->cur);
-    fpu_restore(&next->fpu);
+    fpu_switch_to(&next->fpu);
 }
 
 void schedule()
@@ -97,9 +327,53 @@ void schedule()
     #endif
     sched_set_next_task(su, next);
     thread_switch_to_next(cur, next);
+    /* 回到这个任务后，给等待大内核锁的处理器一个机会 */
+    smp_relax_kernel();
     interrupt_restore_state(flags);
 }
 
+/* 调度单元的负载：就绪任务加上正在运行的非idle任务 */
+static inline unsigned long sched_unit_load(sched_unit_t *su)
+{
+    return su->tasknr + (su->cur && !sched_task_is_idle(su, su->cur));
+}
+
+/**
+ * sched_pick_unit - 为新任务选择调度单元
+ * 
+ * 选择负载最小的已经开始调度的单元，负载相同时留在当前单元，需要关中断调用
+ */
+sched_unit_t *sched_pick_unit()
+{
+    sched_unit_t *best = sched_get_cur_unit();
+#ifdef CONFIG_SMP
+    unsigned long load = sched_unit_load(best);
+    int i;
+    for (i = 0; i < scheduler.cpunr; i++) {
+        sched_unit_t *su = &scheduler.sched_unit_table[i];
+        if (su->idle && sched_unit_load(su) < load) {
+            best = su;
+            load = sched_unit_load(su);
+        }
+    }
+#endif
+    return best;
+}
+
+/* 任务上一次所在的调度单元，唤醒的任务回到原来的处理器上 */
+sched_unit_t *sched_get_task_unit(task_t *task)
+{
+#ifdef CONFIG_SMP
+    int i;
+    for (i = 0; i < scheduler.cpunr; i++) {
+        sched_unit_t *su = &scheduler.sched_unit_table[i];
+        if (su->idle && su->cpuid == task->cpuid)
+            return su;
+    }
+#endif
+    return sched_get_cur_unit();
+}
+
 void sched_print_queue(sched_unit_t *su)
 {
     if (su == NULL) {
@@ -109,35 +383,34 @@ void sched_print_queue(sched_unit_t *su)
     keprint(PRINT_INFO "[sched]: queue list:\n");
     sched_queue_t *queue;
     task_t *task;
-    int i; 
+    int i, j; 
     unsigned long flags;
     spin_lock_irqsave(&scheduler.lock, flags);
-    for (i = 0; i < TASK_PRIORITY_MAX_NR; i++) {
-        queue = &su->priority_queue[i];
-        if (queue->length > 0) {
-            keprint(PRINT_NOTICE "qeuue prio: %d\n", queue->priority);
-            list_for_each_owner (task, &queue->list, list) {
-                keprint(PRINT_INFO "task=%s pid=%d prio=%d ->", task->name, task->pid, task->priority);
+    for (j = 0; j < 2; j++) {
+        sched_array_t *array = &su->arrays[j];
+        keprint(PRINT_NOTICE "%s array:\n", array == su->active ? "active" : "expired");
+        for (i = TASK_PRIORITY_MAX; i >= 0; i--) {
+            queue = &array->queue[i];
+            if (queue->length > 0) {
+                keprint(PRINT_NOTICE "qeuue prio: %d\n", queue->priority);
+                list_for_each_owner (task, &queue->list, list) {
+                    keprint(PRINT_INFO "task=%s pid=%d prio=%d ->", task->name, task->pid, task->priority);
+                }
+                keprint(PRINT_NOTICE "\n");
             }
-            keprint(PRINT_NOTICE "\n");
         }
     }
     spin_unlock_irqrestore(&scheduler.lock, flags);
 }
 
-void init_sched_unit(sched_unit_t *su, cpuid_t cpuid, unsigned long flags)
+static void init_sched_array(sched_array_t *array)
 {
-    su->cpuid = cpuid;
-    su->flags = flags;
-    su->cur = NULL;
-    su->idle = NULL;
-    spinlock_init(&su->lock);
-    su->tasknr = 0;
-    su->dynamic_priority = 0;
     sched_queue_t *queue;
     int i;
+    array->bitmap = 0;
+    array->tasknr = 0;
     for (i = 0; i < TASK_PRIORITY_MAX_NR; i++) {
-        queue = &su->priority_queue[i];
+        queue = &array->queue[i];
         queue->priority = i;
         queue->length = 0;
         list_init(&queue->list);
@@ -145,6 +418,21 @@ void init_sched_unit(sched_unit_t *su, cpuid_t cpuid, unsigned long flags)
     }
 }
 
+void init_sched_unit(sched_unit_t *su, cpuid_t cpuid, unsigned long flags)
+{
+    su->cpuid = cpuid;
+    su->flags = flags;
+    su->cur = NULL;
+    su->idle = NULL;
+    spinlock_init(&su->lock);
+    su->tasknr = 0;
+    init_sched_array(&su->arrays[0]);
+    init_sched_array(&su->arrays[1]);
+    su->active = &su->arrays[0];
+    su->expired = &su->arrays[1];
+    su->expired_timestamp = 0;
+}
+
 void schedule_init()
 {
     scheduler.tasknr = 0;
@@ -155,4 +443,4 @@ void schedule_init()
     for (i = 0; i < scheduler.cpunr; i++) {
         init_sched_unit(&scheduler.sched_unit_table[i], cpu_list[i], 0);
     }
-}
+}
\ No newline at end of file
@@ -35,7 +35,7 @@ void __semaphore_up(semaphore_t *sema)
         list_del(&waiter->list);
         TASK_LEAVE_WAITLIST(waiter);
         waiter->state = TASK_READY;
-        sched_queue_add_head(sched_get_cur_unit(), waiter);
+        sched_queue_add_head(sched_get_task_unit(waiter), waiter);
     }
     mutex_unlock(&sema->lock);
 }
@@ -24,7 +24,7 @@ unsigned long task_sleep_by_ticks(clock_t ticks)
     unsigned long flags;
     interrupt_save_and_disable(flags);
     long delta_ticks = 0;
-    if (timer->timeout > timer_ticks) {
+    if (time_after(timer->timeout, timer_ticks)) {
         delta_ticks = timer->timeout - timer_ticks;
         timer_del(timer);
         //keprint("sleep intrrupted!\n");
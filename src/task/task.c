@@ -28,6 +28,7 @@
 
 static pid_t task_next_pid;
 LIST_HEAD(task_global_list);
+static list_t task_pid_hash_table[TASK_PID_HASH_NR];
 /* task init done flags, for early interrupt. */
 volatile int task_init_done = 0;
 
@@ -49,8 +50,9 @@ void task_init(task_t *task, char *name, uint8_t prio_level)
     spinlock_init(&task->lock);
     task->static_priority = sched_calc_base_priority(prio_level);
     task->priority = task->static_priority;
-    //task->timeslice = TASK_TIMESLICE_BASE + (task->priority / 10);
-    task->timeslice = TASK_TIMESLICE_BASE + 1;
+    task->sleep_avg = SCHED_MAX_SLEEP_AVG / 2;
+    task->sched_array = NULL;
+    task->timeslice = sched_calc_timeslice(task);
     task->ticks = task->timeslice;
     task->elapsed_ticks = 0;
     task->syscall_ticks = task->syscall_ticks_delta = 0;
@@ -59,6 +61,9 @@ void task_init(task_t *task, char *name, uint8_t prio_level)
     task->tgid = task->pid; /* 默认都是主线程，需要的时候修改 */
     task->pgid = -1;
     task->parent_pid = -1;
+    list_init(&task->pid_hash_list);
+    list_init(&task->children);
+    list_init(&task->child_list);
     task->exit_status = 0;
     // set kernel stack as the top of task mem struct
     task->kstack = (unsigned char *)(((unsigned long )task) + TASK_KERN_STACK_SIZE);
@@ -79,13 +84,41 @@ void task_init(task_t *task, char *name, uint8_t prio_level)
 void task_free(task_t *task)
 {
     list_del(&task->global_list);
+    list_del_init(&task->pid_hash_list);
+    list_del_init(&task->child_list);
+    /* 子任务已经过继给INIT，剩下的只是断开链接 */
+    task_t *child, *next;
+    list_for_each_owner_safe (child, next, &task->children, child_list) {
+        list_del_init(&child->child_list);
+    }
+    fpu_release(&task->fpu);
     mem_free(task);
 }
 
+static inline list_t *task_pid_hash(pid_t pid)
+{
+    return &task_pid_hash_table[pid & (TASK_PID_HASH_NR - 1)];
+}
+
+/* 添加到全局任务队列和pid哈希表，并链接到父任务的子任务链表，需要关闭中断调用 */
 void task_add_to_global_list(task_t *task)
 {
-    assert(!list_find(&task->global_list, &task_global_list));
+    assert(list_empty(&task->pid_hash_list));
     list_add_tail(&task->global_list, &task_global_list);
+    list_add(&task->pid_hash_list, task_pid_hash(task->pid));
+    task_t *parent = task_find_by_pid(task->parent_pid);
+    if (parent)
+        list_add_tail(&task->child_list, &parent->children);
+}
+
+/* 修改任务的父任务，移动到新的父任务的子任务链表，需要关闭中断调用 */
+void task_set_parent(task_t *task, pid_t parent_pid)
+{
+    list_del_init(&task->child_list);
+    task->parent_pid = parent_pid;
+    task_t *parent = task_find_by_pid(parent_pid);
+    if (parent)
+        list_add_tail(&task->child_list, &parent->children);
 }
 
 void task_set_timeslice(task_t *task, uint32_t timeslice)
@@ -107,7 +140,7 @@ task_t *task_find_by_pid(pid_t pid)
     task_t *task;
     unsigned long flags;
     interrupt_save_and_disable(flags);
-    list_for_each_owner(task, &task_global_list, global_list) {
+    list_for_each_owner(task, task_pid_hash(pid), pid_hash_list) {
         if (task->pid == pid) {
             interrupt_restore_state(flags);
             return task;
@@ -149,7 +182,7 @@ task_t *task_create(char *name, uint8_t prio_level, task_func_t *func, void *arg
     unsigned long flags;
     interrupt_save_and_disable(flags);
     task_add_to_global_list(task);
-    sched_unit_t *su = sched_get_cur_unit();
+    sched_unit_t *su = sched_pick_unit();
     sched_queue_add_tail(su, task);
     interrupt_restore_state(flags);
     return task;
@@ -168,7 +201,7 @@ void task_exit(int status)
     cur->exit_status = status;
     task_do_cancel(cur);
     task_exit_hook(cur);
-    cur->parent_pid = USER_INIT_PROC_ID;
+    task_set_parent(cur, USER_INIT_PROC_ID);
     task_t *parent = task_find_by_pid(cur->parent_pid); 
     if (parent) {
         if (parent->state == TASK_WAITING) {
@@ -219,13 +252,12 @@ void task_unblock(task_t *task)
         panic("task_unblock: task name=%s pid=%d state=%d\n", task->name, task->pid, task->state);
     }
     if (task->state != TASK_READY) {
-        sched_unit_t *su = sched_get_cur_unit();
+        sched_unit_t *su = sched_get_task_unit(task);
         assert(!sched_queue_has_task(su, task));
         if (sched_queue_has_task(su, task)) {
             panic("task_unblock: task has already in ready list!\n");
         }
         task->state = TASK_READY;
-        task->priority = sched_calc_new_priority(task, 1);
         sched_queue_add_head(su, task);
     }
     interrupt_restore_state(flags);
@@ -244,8 +276,8 @@ int task_count_children(task_t *parent)
 {
     int children = 0;
     task_t *child;
-    list_for_each_owner (child, &task_global_list, global_list) {
-        if (child->parent_pid == parent->pid && TASK_IS_SINGAL_THREAD(child)) {
+    list_for_each_owner (child, &parent->children, child_list) {
+        if (TASK_IS_SINGAL_THREAD(child)) {
             children++;
         }
     }
@@ -374,6 +406,9 @@ int sys_tstate(tstate_t *ts, unsigned int *idx)
             tmp_ts.ts_priority = task->priority;
             tmp_ts.ts_timeslice = task->timeslice;
             tmp_ts.ts_runticks = task->elapsed_ticks;
+            tmp_ts.ts_fpuloads = task->fpu.loads;
+            tmp_ts.ts_faults = task->vmm ? task->vmm->fault_count : 0;
+            tmp_ts.ts_faultpages = task->vmm ? task->vmm->fault_pages : 0;
             memset(tmp_ts.ts_name, 0, PROC_NAME_LEN);
             strcpy(tmp_ts.ts_name, task->name);
             ++index;
@@ -429,7 +464,7 @@ void task_dump(task_t *task)
 void kern_do_idle(void *arg)
 {
     while (1) {
-        cpu_idle();
+        clock_idle();
         schedule();
     }
 }
@@ -451,7 +486,7 @@ void task_start_user()
     sched_unit_t *su = sched_get_cur_unit();
 	unsigned long flags;
     interrupt_save_and_disable(flags);
-    su->idle->static_priority = su->idle->priority = TASK_PRIORITY_LOW;
+    su->idle->static_priority = su->idle->priority = TASK_PRIORITY_IDLE;
     interrupt_restore_state(flags);
     schedule();
     interrupt_enable();
@@ -460,6 +495,9 @@ void task_start_user()
 
 void tasks_init()
 {
+    int i;
+    for (i = 0; i < TASK_PID_HASH_NR; i++)
+        list_init(&task_pid_hash_table[i]);
     task_next_pid = 0;
     sched_unit_t *su = sched_get_cur_unit();
     task_init_boot_idle(su);
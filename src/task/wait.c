@@ -16,21 +16,19 @@
 */
 static int wait_any_hangging_child(task_t *parent, int *status)
 {
-    task_t *child, *next;
-    list_for_each_owner_safe (child, next, &task_global_list, global_list) {
-        if (child->parent_pid == parent->pid) {
-            if (child->state == TASK_HANGING) {
-                pid_t child_pid = child->pid;
-                if (status != NULL)
-                    *status = child->exit_status;
-                /* 如果是单执行流，并且不是内核线程 */
-                if (TASK_IS_SINGAL_THREAD(child)) {
-                    proc_destroy(child, 0);
-                } else {
-                    proc_destroy(child, 1);
-                }     
-                return child_pid;
-            }
+    task_t *child;
+    list_for_each_owner (child, &parent->children, child_list) {
+        if (child->state == TASK_HANGING) {
+            pid_t child_pid = child->pid;
+            if (status != NULL)
+                *status = child->exit_status;
+            /* 如果是单执行流，并且不是内核线程 */
+            if (TASK_IS_SINGAL_THREAD(child)) {
+                proc_destroy(child, 0);
+            } else {
+                proc_destroy(child, 1);
+            }     
+            return child_pid;
         }
     }
     return -1;
@@ -38,20 +36,16 @@ static int wait_any_hangging_child(task_t *parent, int *status)
 
 static int wait_one_hangging_child(task_t *parent, pid_t pid, int *status)
 {
-    task_t *child, *next;
-    list_for_each_owner_safe (child, next, &task_global_list, global_list) {
-        if (child->pid == pid) { 
-            if (child->state == TASK_HANGING) {
-                if (status != NULL)
-                    *status = child->exit_status;
-                if (TASK_IS_SINGAL_THREAD(child)) {
-                    proc_destroy(child, 0);
-                } else {
-                    proc_destroy(child, 1);
-                }
-                return pid;
-            }
+    task_t *child = task_find_by_pid(pid);
+    if (child && child->state == TASK_HANGING) {
+        if (status != NULL)
+            *status = child->exit_status;
+        if (TASK_IS_SINGAL_THREAD(child)) {
+            proc_destroy(child, 0);
+        } else {
+            proc_destroy(child, 1);
         }
+        return pid;
     }
     return -1;
 }
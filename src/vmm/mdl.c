@@ -3,25 +3,142 @@
 #include <xbook/debug.h>
 #include <xbook/virmem.h>
 #include <xbook/schedule.h>
+#include <xbook/safety.h>
+#include <arch/page.h>
+#include <arch/interrupt.h>
 
+/* 映射后的内核虚拟地址覆盖的字节数，包括第一页前面的偏移 */
+#define MDL_MAPPED_SIZE(mdl) PAGE_ALIGN((mdl)->byte_offset + (mdl)->byte_count)
+
+/**
+ * mdl_pin_page - 固定用户虚拟地址所在的物理页
+ * @addr: 页对齐的用户虚拟地址
+ * @write: 设备是否会写入这个页
+ * 
+ * 页不在内存中、已经换出或者需要写时复制时，访问一次这个地址，由页故障处理后再检测。
+ * 固定就是增加物理页的引用计数，这样取消映射时不会释放，换页线程也不会换出。
+ * 
+ * @return: 成功返回物理地址，失败返回0
+ */
+static unsigned long mdl_pin_page(unsigned long addr, bool write)
+{
+    unsigned long flags;
+    int retry;
+    for (retry = 0; retry < MDL_PIN_RETRY; retry++) {
+        interrupt_save_and_disable(flags);
+        if (*vir_addr_to_dir_entry(addr) & PAGE_ATTR_PRESENT) {
+            pte_t pte = *vir_addr_to_table_entry(addr);
+            if ((pte & PAGE_ATTR_PRESENT) && (!write || (pte & PAGE_ATTR_WRITE))) {
+                unsigned long phyaddr = pte & PAGE_MASK;
+                page_ref(phyaddr);
+                interrupt_restore_state(flags);
+                return phyaddr;
+            }
+        }
+        interrupt_restore_state(flags);
+        volatile char *p = (volatile char *) addr;
+        if (write)
+            *p = *p;
+        else
+            (void) *p;
+    }
+    return 0;
+}
+
+/**
+ * mdl_pin_user - 固定用户缓冲区的所有页，不映射到内核
+ * @vaddr: 用户虚拟地址
+ * @length: 缓冲区长度
+ * @write: 会写入缓冲区
+ * 
+ * 文件系统持有卷的锁时读写用户缓冲区，这时再缺页去读取同一个卷上的文件映射就会死锁，
+ * 所以进入文件系统前先调入并固定缓冲区，固定的页也不会被换出。
+ * 
+ * @return: 成功返回保存物理页的数组，用mdl_unpin_user释放，失败返回NULL
+ */
+unsigned long *mdl_pin_user(void *vaddr, unsigned long length, bool write)
+{
+    unsigned long start = (unsigned long) vaddr & PAGE_MASK;
+    unsigned long npages = MDL_PIN_PAGES(vaddr, length);
+    unsigned long *pages = mem_alloc(npages * sizeof(unsigned long));
+    if (pages == NULL)
+        return NULL;
+    unsigned long i;
+    for (i = 0; i < npages; i++) {
+        pages[i] = mdl_pin_page(start + i * PAGE_SIZE, write);
+        if (!pages[i]) {
+            keprint(PRINT_ERR "mdl_pin_user: pin page %x failed!\n", start + i * PAGE_SIZE);
+            unsigned long flags;
+            interrupt_save_and_disable(flags);
+            while (i-- > 0)
+                page_free(pages[i]);
+            interrupt_restore_state(flags);
+            mem_free(pages);
+            return NULL;
+        }
+    }
+    return pages;
+}
+
+/* 释放mdl_pin_user固定的页，参数和固定时一样 */
+void mdl_unpin_user(unsigned long *pages, void *vaddr, unsigned long length)
+{
+    unsigned long npages = MDL_PIN_PAGES(vaddr, length);
+    unsigned long flags;
+    unsigned long i;
+    interrupt_save_and_disable(flags);
+    for (i = 0; i < npages; i++)
+        page_free(pages[i]);
+    interrupt_restore_state(flags);
+    mem_free(pages);
+}
+
+/**
+ * mdl_unpin_pages - 取消映射并释放固定的物理页
+ * @pages: 已经映射的页数
+ */
+static void mdl_unpin_pages(mdl_t *mdl, unsigned long pages)
+{
+    unsigned long mapped_vaddr = (unsigned long) mdl->mapped_vaddr;
+    unsigned long i;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    for (i = 0; i < pages; i++)
+        page_free(addr_vir2phy(mapped_vaddr + i * PAGE_SIZE) & PAGE_MASK);
+    if (pages > 0)
+        page_unmap_addr_safe(mapped_vaddr, pages * PAGE_SIZE, 1);
+    interrupt_restore_state(flags);
+}
 
 /**
  * mdl_alloc - 分配一个内存描述列表
  * @vaddr: 用户虚拟地址
  * @length: 数据长度
  * @later: 描述列表不是第一个
+ * @write: 设备会写入缓冲区（读取请求）
  * @ioreq: 输入输出请求
  * 
- * 分配并映射内存，在内核中分配一个内核虚拟地址，映射到和用户的虚拟地址的物理页一样的物理页，
- * 相当于共享了用户虚拟地址的物理页，这样，就可以通过内核的虚拟地址来访问用户的虚拟地址。
+ * 检测用户缓冲区后，把每个用户页固定，并逐页映射到分配的内核虚拟地址，
+ * 相当于共享了用户虚拟地址的物理页，这样，在任何地址空间中（比如中断里）
+ * 都可以通过内核的虚拟地址来访问用户的缓冲区，驱动不需要再复制一次数据。
  * 
  * @return: 成功返回mdl指针，失败返回NULL
  */
 mdl_t *mdl_alloc(void *vaddr, unsigned long length,
-    bool later, io_request_t *ioreq)
+    bool later, bool write, io_request_t *ioreq)
 {
     if (!length || vaddr == NULL)
         return NULL;
+    if (length > MDL_MAX_SIZE) {
+        length = MDL_MAX_SIZE;      /* 剪切长度 */
+        keprint(PRINT_NOTICE "mdl_alloc: length=%x too long!\n", length);    
+    }
+    /* 只检测缓冲区在有相应保护的空间中，还没有映射的页由mdl_pin_page调入 */
+    if (safety_check_range(vaddr, length) < 0)
+        return NULL;
+    if (write ? !page_writable((unsigned long) vaddr, length) :
+        !page_readable((unsigned long) vaddr, length))
+        return NULL;
 
     /* 分配mdl空间 */
     mdl_t *mdl = mem_alloc(sizeof(mdl_t));
@@ -31,42 +148,36 @@ mdl_t *mdl_alloc(void *vaddr, unsigned long length,
     /* 获取虚拟地址页对齐的地址 */
     mdl->start_vaddr =  (void *) (((unsigned long) vaddr) & PAGE_MASK);
     mdl->byte_offset = (char *)vaddr - (char *)mdl->start_vaddr;
-    if (length > MDL_MAX_SIZE) {
-        length = MDL_MAX_SIZE;      /* 剪切长度 */
-        keprint(PRINT_NOTICE "mdl_alloc: length=%x too long!\n", length);    
-    }
     mdl->byte_count = length;
     mdl->task = task_current;
     mdl->next = NULL;
 
-    unsigned long flags;    /* 关闭并保存中断 */
-    interrupt_save_and_disable(flags);
-
-    unsigned long phyaddr = addr_vir2phy((unsigned long) mdl->start_vaddr);
-    keprint(PRINT_DEBUG "mdl_alloc: viraddr=%x phyaddr=%x\n", vaddr, phyaddr);
-    unsigned long pages = PAGE_ALIGN(length) / PAGE_SIZE;
-    keprint(PRINT_DEBUG "mdl_alloc: length=%d pages=%d\n", length, pages);
-    
     /* 分配一个虚拟地址 */
-    unsigned long mapped_vaddr = vir_addr_alloc(length);
+    unsigned long mapped_vaddr = vir_addr_alloc(MDL_MAPPED_SIZE(mdl));
     if (!mapped_vaddr) {
         mem_free(mdl);
-        interrupt_restore_state(flags);
         return NULL;
     }
     mdl->mapped_vaddr = (void *) mapped_vaddr;
-    
-    /* 映射固定内存页（虚拟地址和物理地址都指定了） */
-    page_map_addr_fixed(mapped_vaddr, phyaddr, length, PROT_KERN | PROT_WRITE);
-    
-    interrupt_restore_state(flags);
-    keprint(PRINT_DEBUG "mdl_alloc: map success!\n");
-    
+
+    /* 逐页固定并映射，用户页的物理地址不一定连续 */
+    unsigned long pages = MDL_MAPPED_SIZE(mdl) / PAGE_SIZE;
+    unsigned long i;
+    for (i = 0; i < pages; i++) {
+        unsigned long phyaddr = mdl_pin_page((unsigned long) mdl->start_vaddr + i * PAGE_SIZE, write);
+        if (!phyaddr) {
+            keprint(PRINT_ERR "mdl_alloc: pin page %x failed!\n", (unsigned long) mdl->start_vaddr + i * PAGE_SIZE);
+            mdl_unpin_pages(mdl, i);
+            vir_addr_free(mapped_vaddr, MDL_MAPPED_SIZE(mdl));
+            mem_free(mdl);
+            return NULL;
+        }
+        page_map_addr_fixed(mapped_vaddr + i * PAGE_SIZE, phyaddr, PAGE_SIZE, PROT_KERN | PROT_WRITE);
+    }
+
     /* 有请求才进行关联 */
     if (ioreq) {    
         if (later) { /* 插入到末尾 */
-            keprint(PRINT_DEBUG "mdl_alloc: insert tail.\n");
-    
             mdl_t *cur = ioreq->mdl_address;
             while (cur != NULL) {
                 if (cur->next == NULL) {
@@ -76,8 +187,6 @@ mdl_t *mdl_alloc(void *vaddr, unsigned long length,
                 cur = cur->next;
             }
         } else { /* 队首 */
-            keprint(PRINT_DEBUG "mdl_alloc: insert head.\n");
-    
             mdl->next = ioreq->mdl_address;
             ioreq->mdl_address = mdl;
         }
@@ -89,20 +198,13 @@ mdl_t *mdl_alloc(void *vaddr, unsigned long length,
  * mdl_free - 释放内存描述列表
  * @mdl: 内存描述列表
  * 
+ * 取消内核映射，释放固定的用户页，用户已经取消映射的页这时才真正释放
  */
 void mdl_free(mdl_t *mdl)
 {
     if (mdl == NULL)
         return;
-    keprint(PRINT_DEBUG "mdl_free: vaddr=%x length=%d byte offset=%d mapped vaddr=%x.\n",
-        mdl->start_vaddr, mdl->byte_count, mdl->byte_offset, mdl->mapped_vaddr);
-    unsigned long flags;    /* 关闭并保存中断 */
-    interrupt_save_and_disable(flags);
-    /* 取消共享内存映射 */
-    page_unmap_addr_safe((unsigned long) mdl->mapped_vaddr, mdl->byte_count, 1);
-    vir_addr_free((unsigned long) mdl->mapped_vaddr, mdl->byte_count);  /* 释放映射后的虚拟地址 */
-    interrupt_restore_state(flags);
-
+    mdl_unpin_pages(mdl, MDL_MAPPED_SIZE(mdl) / PAGE_SIZE);
+    vir_addr_free((unsigned long) mdl->mapped_vaddr, MDL_MAPPED_SIZE(mdl));  /* 释放映射后的虚拟地址 */
     mem_free(mdl); /* 释放mdl结构 */
 }
-
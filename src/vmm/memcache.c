@@ -57,10 +57,22 @@ static cache_size_t cache_size[] = {
 	#endif
 #endif
 
+/* 小于等于该大小的分配直接查表得到cache */
+#define CACHE_SIZE_INDEX_MAX	4096
+#define CACHE_SIZE_INDEX_SHIFT	5
+#define CACHE_SIZE_INDEX_NR		(CACHE_SIZE_INDEX_MAX >> CACHE_SIZE_INDEX_SHIFT)
+
 mem_cache_t mem_caches[MAX_MEM_CACHE_NR];
-LIST_HEAD(large_mem_object_list);
+/* 以32字节为粒度的大小到cache的映射表 */
+static mem_cache_t *cache_size_index[CACHE_SIZE_INDEX_NR];
+/* 第一个大于查表范围的大小 */
+static cache_size_t *cache_size_large;
+static list_t large_mem_hash_table[LARGE_MEM_HASH_NR];
 DEFINE_MUTEX_LOCK(large_mem_mutex);
 
+#define large_mem_hash(addr) \
+	(&large_mem_hash_table[((unsigned long)(addr) >> PAGE_SHIFT) % LARGE_MEM_HASH_NR])
+
 void mem_cache_dump(mem_cache_t *cache)
 {
 	keprint("----Mem Cache----\n");
@@ -100,6 +112,16 @@ int mem_cache_init(mem_cache_t *cache, char *name, size_t size, flags_t flags)
 
 	cache->object_size = size;
 	cache->flags = flags;
+	/* 大对象占用内存多，只缓存少量对象 */
+	if (size <= 1024)
+		cache->magazine_limit = MEM_MAGAZINE_SIZE;
+	else if (size <= 16 * 1024)
+		cache->magazine_limit = MEM_MAGAZINE_SIZE / 4;
+	else
+		cache->magazine_limit = 0;
+	int i;
+	for (i = 0; i < CPU_NR_MAX; i++)
+		cache->magazines[i].count = 0;
 	memset(cache->name, 0, MEM_CACHE_NAME_LEN);
 	strcpy(cache->name, name);
     mutexlock_init(&cache->mutex);
@@ -193,9 +215,40 @@ static int mem_caches_build()
 		mem_cache++;
 		cachesz++;
 	}
+	int i;
+	for (i = 0; i < CACHE_SIZE_INDEX_NR; i++) {
+		cachesz = &cache_size[0];
+		while (cachesz->cache_size < ((i + 1) << CACHE_SIZE_INDEX_SHIFT))
+			cachesz++;
+		cache_size_index[i] = cachesz->mem_cache;
+	}
+	cachesz = &cache_size[0];
+	while (cachesz->cache_size && cachesz->cache_size <= CACHE_SIZE_INDEX_MAX)
+		cachesz++;
+	cache_size_large = cachesz;
+	for (i = 0; i < LARGE_MEM_HASH_NR; i++)
+		list_init(&large_mem_hash_table[i]);
 	return 0;
 }
 
+/* 根据大小找到对应的cache，小对象查表，大对象从查表范围之后的大小中依次查找 */
+static inline mem_cache_t *mem_cache_lookup(size_t size)
+{
+	if (!size)
+		size = 1;
+	if (size <= CACHE_SIZE_INDEX_MAX)
+		return cache_size_index[(size - 1) >> CACHE_SIZE_INDEX_SHIFT];
+	cache_size_t *cachesz = cache_size_large;
+	while (cachesz->cache_size) {
+		if (cachesz->cache_size >= size)
+			return cachesz->mem_cache;
+		cachesz++;
+	}
+	return NULL;
+}
+
+static void mem_cache_do_free(mem_cache_t *cache, void *object);
+
 static void *mem_cache_do_alloc(mem_cache_t *cache, mem_group_t *group)
 {
 	void *object;
@@ -215,7 +268,7 @@ static void *mem_cache_do_alloc(mem_cache_t *cache, mem_group_t *group)
 	return object;
 }
 
-void *mem_cache_alloc_object(mem_cache_t *cache)
+static void *mem_cache_alloc_object_slow(mem_cache_t *cache)
 {
 	void *object;
 	mem_group_t *group;
@@ -246,6 +299,49 @@ new_group:
 	return NULL;
 }
 
+/**
+ * 弹匣为空时一次从group中分配一批对象，一个返回给调用者，剩下的装入弹匣
+ */
+static void *mem_cache_refill_magazine(mem_cache_t *cache)
+{
+	void *objects[MEM_MAGAZINE_SIZE / 2];
+	unsigned long count = 0, batch = cache->magazine_limit / 2;
+	while (count < batch) {
+		objects[count] = mem_cache_alloc_object_slow(cache);
+		if (objects[count] == NULL)
+			break;
+		count++;
+	}
+	if (!count)
+		return mem_cache_alloc_object_slow(cache);
+	unsigned long flags;
+	interrupt_save_and_disable(flags);
+	mem_magazine_t *magazine = &cache->magazines[cpu_get_my_index()];
+	while (count > 1 && magazine->count < cache->magazine_limit)
+		magazine->objects[magazine->count++] = objects[--count];
+	interrupt_restore_state(flags);
+	/* 装填过程中弹匣可能被中断里的释放填满了，多余的对象还回去 */
+	while (count > 1)
+		mem_cache_do_free(cache, objects[--count]);
+	return objects[0];
+}
+
+void *mem_cache_alloc_object(mem_cache_t *cache)
+{
+	if (!cache->magazine_limit)
+		return mem_cache_alloc_object_slow(cache);
+	void *object = NULL;
+	unsigned long flags;
+	interrupt_save_and_disable(flags);
+	mem_magazine_t *magazine = &cache->magazines[cpu_get_my_index()];
+	if (magazine->count > 0)
+		object = magazine->objects[--magazine->count];
+	interrupt_restore_state(flags);
+	if (object)
+		return object;
+	return mem_cache_refill_magazine(cache);
+}
+
 void *mem_alloc(size_t size)
 {
 	if (size > MAX_MEM_CACHE_SIZE) {
@@ -262,19 +358,15 @@ void *mem_alloc(size_t size)
             return NULL;
         }
         mutex_lock(&large_mem_mutex);
-        list_add(&obj->list, &large_mem_object_list);
+        list_add(&obj->list, large_mem_hash(obj->addr));
         mutex_unlock(&large_mem_mutex);
         //keprint(PRINT_DEBUG "[memcache]: alloc large mem object %x\n", obj->addr);
 		return obj->addr;
 	}
-	cache_size_t *cachesz = &cache_size[0];
-	while (cachesz->cache_size) {
-		if (cachesz->cache_size >= size)
-			break;
-		cachesz++;
-	}
-    void *p = mem_cache_alloc_object(cachesz->mem_cache);
-    return p;
+	mem_cache_t *cache = mem_cache_lookup(size);
+	if (cache == NULL)
+		return NULL;
+    return mem_cache_alloc_object(cache);
 }
 
 void *mem_alloc_align(size_t size, int align)
@@ -315,7 +407,8 @@ void *mem_realloc(void *ptr, size_t size)
     return ret;
 }
 
-static void mem_cache_do_free(mem_cache_t *cache, void *object)
+/* 找到对象所在的group和位图中的索引，对象没有分配时说明重复释放 */
+static mem_group_t *mem_cache_object_group(mem_cache_t *cache, void *object, int *index)
 {
 	mem_group_t *group;
 	mem_node_t *node = phy_addr_to_mem_node(kern_vir_addr2phy_addr(object));
@@ -324,9 +417,18 @@ static void mem_cache_do_free(mem_cache_t *cache, void *object)
 	group = MEM_NODE_GET_GROUP(node);
 	if (group == NULL) 
 		panic(PRINT_EMERG "group get from page bad!\n");
-	int index = (((unsigned char *)object) - group->objects)/cache->object_size; 
-	if (index < 0 || index > group->map.byte_length*8)
+	*index = (((unsigned char *)object) - group->objects)/cache->object_size; 
+	if (*index < 0 || *index > group->map.byte_length*8)
 		panic(PRINT_EMERG "map index bad range!\n");
+	if (!bitmap_scan_test(&group->map, *index))
+		panic(PRINT_EMERG "mem cache %d: double free object %x!\n", cache->object_size, object);
+	return group;
+}
+
+static void mem_cache_do_free(mem_cache_t *cache, void *object)
+{
+	int index;
+	mem_group_t *group = mem_cache_object_group(cache, object, &index);
     mutex_lock(&cache->mutex);
 	bitmap_set(&group->map, index, 0);
 	int unsing = group->using_count;
@@ -343,9 +445,55 @@ static void mem_cache_do_free(mem_cache_t *cache, void *object)
     mutex_unlock(&cache->mutex);
 }
 
+/**
+ * 释放对象时先压入本CPU的弹匣，弹匣满了就把一半对象还给group
+ */
 void mem_cache_free_object(mem_cache_t *cache, void *object)
 {
-	mem_cache_do_free(cache, object);
+	if (!cache->magazine_limit) {
+		mem_cache_do_free(cache, object);
+		return;
+	}
+	/* 弹匣中的对象在位图中还是已分配的，还要检查是否已经在弹匣中 */
+	int index;
+	mem_cache_object_group(cache, object, &index);
+	void *objects[MEM_MAGAZINE_SIZE / 2];
+	unsigned long count = 0;
+	unsigned long flags;
+	interrupt_save_and_disable(flags);
+	mem_magazine_t *magazine = &cache->magazines[cpu_get_my_index()];
+	for (count = 0; count < magazine->count; count++) {
+		if (magazine->objects[count] == object)
+			panic(PRINT_EMERG "mem cache %d: double free object %x!\n", cache->object_size, object);
+	}
+	count = 0;
+	if (magazine->count >= cache->magazine_limit) {
+		while (count < cache->magazine_limit / 2)
+			objects[count++] = magazine->objects[--magazine->count];
+	}
+	magazine->objects[magazine->count++] = object;
+	interrupt_restore_state(flags);
+	while (count > 0)
+		mem_cache_do_free(cache, objects[--count]);
+}
+
+/* 把所有CPU弹匣中的对象还给group，这样空闲的group才能被回收 */
+static void mem_cache_drain_magazines(mem_cache_t *cache)
+{
+	void *objects[MEM_MAGAZINE_SIZE];
+	unsigned long count;
+	unsigned long flags;
+	int i;
+	for (i = 0; i < CPU_NR_MAX; i++) {
+		interrupt_save_and_disable(flags);
+		mem_magazine_t *magazine = &cache->magazines[i];
+		count = magazine->count;
+		memcpy(objects, magazine->objects, count * sizeof(void *));
+		magazine->count = 0;
+		interrupt_restore_state(flags);
+		while (count > 0)
+			mem_cache_do_free(cache, objects[--count]);
+	}
 }
 
 void mem_free(void *object)
@@ -357,10 +505,10 @@ void mem_free(void *object)
 	CHECK_MEM_NODE(node);
 	cache = MEM_NODE_GET_CACHE(node);
     if (cache == NULL) {
-        /* 采用首适配释放 */
+        /* 在哈希链表中查找大内存对象 */
         mutex_lock(&large_mem_mutex);
         large_mem_object_t *obj;
-        list_for_each_owner (obj, &large_mem_object_list, list) {
+        list_for_each_owner (obj, large_mem_hash(object), list) {
             if (obj->addr == object) {
                 list_del(&obj->list);
                 mem_cache_page_free(obj->addr);
@@ -407,6 +555,7 @@ static int mem_cahce_shrink(mem_cache_t *cache)
 	int ret;
 	if (!cache) 
 		return 0; 
+	mem_cache_drain_magazines(cache);
 	unsigned long flags;
     interrupt_save_and_disable(flags);
 	ret = mem_cache_do_shrink(cache);
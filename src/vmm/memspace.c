@@ -2,6 +2,7 @@
 #include <xbook/task.h>
 #include <xbook/debug.h>
 #include <xbook/schedule.h>
+#include <xbook/pagecache.h>
 
 // #define DEBUG_MEM_SPACE
 
@@ -17,62 +18,318 @@ void mem_space_dump(vmm_t *vmm)
     }
 }
 
-void mem_space_insert(vmm_t *vmm, mem_space_t *space)
+void mem_space_free(mem_space_t *space)
+{
+    if (space->cache)
+        page_cache_put(space->cache);
+    mem_free(space);
+}
+
+/*
+ * 空间除了按地址排序的单向链表外，还用一棵AVL树索引，以开始地址为键。
+ * 每个节点记录与前一个空间之间的空闲大小(gap)，以及子树中最大的空闲大小(max_gap)，
+ * 查找地址和查找未映射区域都只需要O(logn)。
+ */
+static inline int mem_space_height(mem_space_t *node)
 {
-    mem_space_t *prev = NULL;
-    mem_space_t *p = (mem_space_t *)vmm->mem_space_head;
-    while (p != NULL) {
-        if (space->end <= p->start)
-            break;
-        prev = p;
-        p = p->next;
+    return node ? node->height : 0;
+}
+
+static inline unsigned long mem_space_max_gap(mem_space_t *node)
+{
+    return node ? node->max_gap : 0;
+}
+
+static void mem_space_tree_update(mem_space_t *node)
+{
+    int lh = mem_space_height(node->left);
+    int rh = mem_space_height(node->right);
+    node->height = (lh > rh ? lh : rh) + 1;
+    unsigned long gap = node->gap;
+    if (mem_space_max_gap(node->left) > gap)
+        gap = node->left->max_gap;
+    if (mem_space_max_gap(node->right) > gap)
+        gap = node->right->max_gap;
+    node->max_gap = gap;
+}
+
+static mem_space_t *mem_space_rotate_right(mem_space_t *node)
+{
+    mem_space_t *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    mem_space_tree_update(node);
+    mem_space_tree_update(left);
+    return left;
+}
+
+static mem_space_t *mem_space_rotate_left(mem_space_t *node)
+{
+    mem_space_t *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    mem_space_tree_update(node);
+    mem_space_tree_update(right);
+    return right;
+}
+
+static mem_space_t *mem_space_tree_balance(mem_space_t *node)
+{
+    mem_space_tree_update(node);
+    int factor = mem_space_height(node->left) - mem_space_height(node->right);
+    if (factor > 1) {
+        if (mem_space_height(node->left->left) < mem_space_height(node->left->right))
+            node->left = mem_space_rotate_left(node->left);
+        return mem_space_rotate_right(node);
+    }
+    if (factor < -1) {
+        if (mem_space_height(node->right->right) < mem_space_height(node->right->left))
+            node->right = mem_space_rotate_right(node->right);
+        return mem_space_rotate_left(node);
+    }
+    return node;
+}
+
+static mem_space_t *mem_space_tree_insert(mem_space_t *node, mem_space_t *space)
+{
+    if (node == NULL) {
+        space->left = space->right = NULL;
+        mem_space_tree_update(space);
+        return space;
     }
-    space->next = p;
-    if (prev)
-        prev->next = space;
+    if (space->start < node->start)
+        node->left = mem_space_tree_insert(node->left, space);
     else
+        node->right = mem_space_tree_insert(node->right, space);
+    return mem_space_tree_balance(node);
+}
+
+static mem_space_t *mem_space_tree_remove_min(mem_space_t *node, mem_space_t **min)
+{
+    if (node->left == NULL) {
+        *min = node;
+        return node->right;
+    }
+    node->left = mem_space_tree_remove_min(node->left, min);
+    return mem_space_tree_balance(node);
+}
+
+static mem_space_t *mem_space_tree_erase(mem_space_t *node, unsigned long start)
+{
+    if (node == NULL)
+        return NULL;
+    if (start < node->start) {
+        node->left = mem_space_tree_erase(node->left, start);
+    } else if (start > node->start) {
+        node->right = mem_space_tree_erase(node->right, start);
+    } else {
+        mem_space_t *left = node->left;
+        mem_space_t *right = node->right;
+        mem_space_t *min;
+        if (right == NULL)
+            return left;
+        right = mem_space_tree_remove_min(right, &min);
+        min->left = left;
+        min->right = right;
+        return mem_space_tree_balance(min);
+    }
+    return mem_space_tree_balance(node);
+}
+
+/* 某个节点的gap变化后，沿根到该节点的路径重新计算max_gap */
+static void mem_space_tree_fixup(mem_space_t *node, unsigned long start)
+{
+    if (node == NULL)
+        return;
+    if (start < node->start)
+        mem_space_tree_fixup(node->left, start);
+    else if (start > node->start)
+        mem_space_tree_fixup(node->right, start);
+    mem_space_tree_update(node);
+}
+
+static void mem_space_update_gap(vmm_t *vmm, mem_space_t *space, unsigned long gap)
+{
+    if (space->gap == gap)
+        return;
+    space->gap = gap;
+    mem_space_tree_fixup(vmm->mem_space_root, space->start);
+}
+
+/**
+ * 查找第一个结束地址大于addr的空间，prev返回它在链表中的前一个空间。
+ * 空间互不重叠，所以结束地址和开始地址的顺序一致，可以直接在树上查找。
+ */
+static mem_space_t *mem_space_lookup(vmm_t *vmm, unsigned long addr, mem_space_t **prev)
+{
+    mem_space_t *node = vmm->mem_space_root;
+    mem_space_t *found = NULL;
+    *prev = NULL;
+    while (node != NULL) {
+        if (addr < node->end) {
+            found = node;
+            node = node->left;
+        } else {
+            *prev = node;
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+mem_space_t *mem_space_find(vmm_t *vmm, unsigned long addr)
+{
+    mem_space_t *space = vmm->mem_space_cache;
+    if (space && space->start <= addr && addr < space->end)
+        return space;
+    mem_space_t *prev;
+    space = mem_space_lookup(vmm, addr, &prev);
+    if (space)
+        vmm->mem_space_cache = space;
+    return space;
+}
+
+mem_space_t *mem_space_find_prev(vmm_t *vmm, unsigned long addr, mem_space_t **prev)
+{
+    return mem_space_lookup(vmm, addr, prev);
+}
+
+/**
+ * 把空间链接到prev之后（prev为NULL时作为第一个空间），同时插入到树中。
+ * 调用者需要保证空间不和已有空间重叠。
+ * 修改链表和树的时候关闭中断，换页线程会在其它进程中查找空间。
+ */
+void mem_space_link(vmm_t *vmm, mem_space_t *space, mem_space_t *prev)
+{
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (prev) {
+        space->next = prev->next;
+        prev->next = space;
+    } else {
+        space->next = vmm->mem_space_head;
         vmm->mem_space_head = (void *)space;
+    }
     space->vmm = vmm;
-    /* 共享内存不进行合并处理 */
-    if (space->flags & MEM_SPACE_MAP_SHARED) {
+    space->gap = space->start - (prev ? prev->end : 0);
+    vmm->mem_space_root = mem_space_tree_insert(vmm->mem_space_root, space);
+    if (space->next)
+        mem_space_update_gap(vmm, space->next, space->next->start - space->end);
+    interrupt_restore_state(flags);
+}
+
+static void mem_space_unlink(vmm_t *vmm, mem_space_t *space, mem_space_t *prev)
+{
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    mem_space_t *next = space->next;
+    if (prev)
+        prev->next = next;
+    else
+        vmm->mem_space_head = next;
+    vmm->mem_space_root = mem_space_tree_erase(vmm->mem_space_root, space->start);
+    if (next)
+        mem_space_update_gap(vmm, next, next->start - (prev ? prev->end : 0));
+    if (vmm->mem_space_cache == space)
+        vmm->mem_space_cache = NULL;
+    interrupt_restore_state(flags);
+}
+
+void mem_space_remove(vmm_t *vmm, mem_space_t *space, mem_space_t *prev)
+{
+    mem_space_unlink(vmm, space, prev);
+    mem_space_free(space);
+}
+
+/* 修改空间的开始地址，新的地址不能越过前一个空间，顺序不变，只需更新gap */
+void mem_space_set_start(vmm_t *vmm, mem_space_t *space, unsigned long start)
+{
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    space->gap += start - space->start;
+    space->start = start;
+    mem_space_tree_fixup(vmm->mem_space_root, start);
+    interrupt_restore_state(flags);
+}
+
+/* 修改空间的结束地址，新的地址不能越过后一个空间，需要更新后一个空间的gap */
+void mem_space_set_end(vmm_t *vmm, mem_space_t *space, unsigned long end)
+{
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    space->end = end;
+    if (space->next)
+        mem_space_update_gap(vmm, space->next, space->next->start - end);
+    interrupt_restore_state(flags);
+}
+
+void mem_space_insert(vmm_t *vmm, mem_space_t *space)
+{
+    mem_space_t *prev;
+    mem_space_t *p = mem_space_lookup(vmm, space->start, &prev);
+    /* 共享内存和文件映射不进行合并处理 */
+    if ((space->flags & MEM_SPACE_MAP_SHARED) || space->cache) {
+        mem_space_link(vmm, space, prev);
         return;
     }
     /* merge prev and space */
-    if (prev != NULL && prev->end == space->start) {
-        if (prev->page_prot == space->page_prot && prev->flags == space->flags) {
-            prev->end = space->end;
-            prev->next = p;
-            mem_space_free(space);
-            space = prev;
-        }
+    if (prev != NULL && prev->end == space->start && !prev->cache &&
+        prev->page_prot == space->page_prot && prev->flags == space->flags) {
+        mem_space_set_end(vmm, prev, space->end);
+        mem_space_free(space);
+        space = prev;
+    } else {
+        mem_space_link(vmm, space, prev);
     }
     /* merge space and p */
-    if (p != NULL && space->end == p->start) {
-        if (space->page_prot == p->page_prot && space->flags == p->flags) {
-            space->end = p->end;
-            space->next = p->next;
-            mem_space_free(space);    
-        }
+    if (p != NULL && space->end == p->start && !p->cache &&
+        space->page_prot == p->page_prot && space->flags == p->flags) {
+        unsigned long end = p->end;
+        mem_space_remove(vmm, p, space);
+        mem_space_set_end(vmm, space, end);
     }
 }
 
+/* 查找开始地址大于start，并且gap不小于len的第一个空间 */
+static mem_space_t *mem_space_gap_search(mem_space_t *node, unsigned long start, unsigned long len)
+{
+    if (node == NULL || node->max_gap < len)
+        return NULL;
+    if (node->start > start) {
+        mem_space_t *found = mem_space_gap_search(node->left, start, len);
+        if (found)
+            return found;
+        if (node->gap >= len)
+            return node;
+    }
+    return mem_space_gap_search(node->right, start, len);
+}
+
 unsigned long mem_space_get_unmaped(vmm_t *vmm, unsigned len)
 {
     unsigned long addr = vmm->map_start;
-    mem_space_t *space = mem_space_find(vmm, addr);
-    while (space != NULL) {
-        if (USER_VMM_SIZE - len < addr + USER_VMM_BASE_ADDR) {
-            errprint("mem_space_get_unmaped: len too big!\n");
-            return -1;
+    mem_space_t *prev;
+    mem_space_t *space = mem_space_lookup(vmm, addr, &prev);
+    if (space == NULL)
+        return addr;
+    if (addr + len > space->start) {
+        /* 第一个空间之前放不下，就在它之后的空闲区域中查找 */
+        mem_space_t *found = mem_space_gap_search(vmm->mem_space_root, space->start, len);
+        if (found) {
+            addr = found->start - found->gap;
+        } else {
+            space = vmm->mem_space_root;
+            while (space->right != NULL)
+                space = space->right;
+            addr = space->end;
         }
-        if (addr + len >= vmm->map_end)
-            return -1;
-        if (addr + len <= space->start)
-            return addr;
-    
-        addr = space->end;
-        space = space->next;
     }
+    if (USER_VMM_SIZE - len < addr + USER_VMM_BASE_ADDR) {
+        errprint("mem_space_get_unmaped: len too big!\n");
+        return -1;
+    }
+    if (addr + len >= vmm->map_end)
+        return -1;
     return addr;
 }
 
@@ -129,6 +386,43 @@ int do_mem_space_map(vmm_t *vmm, unsigned long addr, unsigned long paddr,
     return addr;
 }
 
+/**
+ * 映射文件到进程空间，只建立空间，不映射物理页。
+ * 访问时在缺页中从文件的页缓存中读取。
+ */
+int do_mem_space_map_file(vmm_t *vmm, unsigned long addr, unsigned long len,
+    unsigned long prot, unsigned long flags, page_cache_t *cache,
+    unsigned long file_off, unsigned long file_size)
+{
+    if (vmm == NULL || cache == NULL || (file_off & ~PAGE_MASK)) {
+        keprint(PRINT_ERR "do_mem_space_map_file: failed!\n");
+        return -1;
+    }
+    len = PAGE_ALIGN(len);
+    if (!len || len > USER_VMM_SIZE || addr > USER_VMM_TOP_ADDR || addr > USER_VMM_TOP_ADDR - len ||
+        addr < USER_VMM_BASE_ADDR || (addr & ~PAGE_MASK)) {
+        keprint(PRINT_ERR "do_mem_space_map_file: addr %x and len %x out of range!\n", addr, len);
+        return -1;
+    }
+    mem_space_t* p = mem_space_find(vmm, addr);
+    if (p != NULL && addr + len > p->start) {
+        keprint(PRINT_ERR "do_mem_space_map_file: this space had existed!\n");
+        return -1;
+    }
+    mem_space_t *space = mem_space_alloc();
+    if (!space) {
+        keprint(PRINT_ERR "do_mem_space_map_file: mem_alloc for space failed!\n");
+        return -1;    
+    }
+    mem_space_init(space, addr, addr + len, prot, flags);
+    page_cache_hold(cache);
+    space->cache = cache;
+    space->file_off = file_off;
+    space->file_size = file_size;
+    mem_space_insert(vmm, space);
+    return addr;
+}
+
 int do_mem_space_map_viraddr(vmm_t *vmm, unsigned long addr, unsigned long vaddr, 
     unsigned long len, unsigned long prot, unsigned long flags)
 {
@@ -213,23 +507,31 @@ int do_mem_space_unmap(vmm_t *vmm, unsigned long addr, unsigned long len)
     }
     page_unmap_addr_safe(addr, len, space->flags & MEM_SPACE_MAP_SHARED);
 
-    mem_space_t* space_new = mem_space_alloc();
-    if (!space_new) {        
-        keprint(PRINT_ERR "do_mem_space_unmap: mem_alloc for space_new failed!\n");
-        return -1;
+    /* 解除映射的区域后面还有剩余，就拆分出一个新空间，空的空间不放入树中 */
+    mem_space_t* space_new = NULL;
+    if (addr + len < space->end) {
+        space_new = mem_space_alloc();
+        if (!space_new) {        
+            keprint(PRINT_ERR "do_mem_space_unmap: mem_alloc for space_new failed!\n");
+            return -1;
+        }
+        *space_new = *space;
+        space_new->start = addr + len;
+        if (space_new->cache) {
+            unsigned long delta = space_new->start - space->start;
+            space_new->file_off += delta;
+            space_new->file_size = space_new->file_size > delta ? space_new->file_size - delta : 0;
+            page_cache_hold(space_new->cache);
+        }
     }
-    space_new->start = addr + len;
-    space_new->end = space->end;
-    space->end = addr;
-    space_new->next = space->next;
-    space->next = space_new;
-    if (space->start == space->end) {
+    if (addr > space->start) {
+        mem_space_set_end(vmm, space, addr);
+        prev = space;
+    } else {
         mem_space_remove(vmm, space, prev);
-        space = prev;
-    }
-    if (space_new->start == space_new->end) {
-        mem_space_remove(vmm, space_new, space);
     }
+    if (space_new)
+        mem_space_link(vmm, space_new, prev);
     return 0;
 }
 
@@ -265,7 +567,7 @@ static unsigned long do_mem_space_expend_heap(vmm_t *vmm, unsigned long addr, un
     if (addr) {
         space = mem_space_find(vmm, addr - 1);
         if (space && space->end == addr && space->flags == flags) {
-            space->end = addr + len;
+            mem_space_set_end(vmm, space, addr + len);
             goto the_end;
         }
     }
@@ -0,0 +1,261 @@
+#include <xbook/pagecache.h>
+#include <xbook/memcache.h>
+#include <xbook/debug.h>
+#include <xbook/dir.h>
+#include <xbook/fs.h>
+#include <arch/page.h>
+#include <arch/memory.h>
+#include <arch/interrupt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+
+// #define DEBUG_PAGE_CACHE
+
+static list_t page_cache_hash_table[PAGE_CACHE_HASH_NR];
+static LIST_HEAD(page_cache_idle_list);
+static int page_cache_idle_count = 0;
+
+static unsigned int page_cache_hash(const char *path)
+{
+    unsigned int hash = 0;
+    while (*path)
+        hash = hash * 31 + *path++;
+    return hash % PAGE_CACHE_HASH_NR;
+}
+
+static page_cache_t *page_cache_create(const char *path, struct stat *st)
+{
+    page_cache_t *cache = mem_alloc(sizeof(page_cache_t));
+    if (cache == NULL)
+        return NULL;
+    cache->npages = DIV_ROUND_UP(st->st_size, PAGE_SIZE);
+    cache->pages = mem_alloc(cache->npages * sizeof(unsigned long));
+    if (cache->pages == NULL) {
+        mem_free(cache);
+        return NULL;
+    }
+    memset(cache->pages, 0, cache->npages * sizeof(unsigned long));
+    cache->fd = kfile_open(path, O_RDONLY);
+    if (cache->fd < 0) {
+        mem_free(cache->pages);
+        mem_free(cache);
+        return NULL;
+    }
+    list_init(&cache->hash_list);
+    list_init(&cache->idle_list);
+    strcpy(cache->path, path);
+    cache->size = st->st_size;
+    cache->mtime = st->st_mtime;
+    cache->flags = 0;
+    atomic_set(&cache->references, 0);
+    semaphore_init(&cache->lock, 1);
+    return cache;
+}
+
+/**
+ * 销毁页缓存，释放缓存持有的物理页引用。
+ * 如果物理页还被进程映射，那么只是减少引用计数，等进程取消映射后才真正释放。
+ */
+static void page_cache_destroy(page_cache_t *cache)
+{
+#ifdef DEBUG_PAGE_CACHE
+    keprint(PRINT_DEBUG "page cache: destroy %s\n", cache->path);
+#endif
+    unsigned long i;
+    for (i = 0; i < cache->npages; i++) {
+        if (cache->pages[i])
+            page_free(cache->pages[i]);
+    }
+    kfile_close(cache->fd);
+    mem_free(cache->pages);
+    mem_free(cache);
+}
+
+/* 从哈希表中移除，不会再被查找到。需要关闭中断调用 */
+static void page_cache_unhash(page_cache_t *cache)
+{
+    list_del_init(&cache->hash_list);
+    cache->flags |= PAGE_CACHE_STALE;
+    if (!list_empty(&cache->idle_list)) {
+        list_del_init(&cache->idle_list);
+        page_cache_idle_count--;
+    }
+}
+
+/**
+ * 获取文件的页缓存，增加引用计数。
+ * 如果缓存已经存在并且文件没有改变，就直接使用已经读取的页。
+ */
+page_cache_t *page_cache_get(const char *path)
+{
+    if (!path)
+        return NULL;
+    char abs_path[MAX_PATH] = {0};
+    build_path(path, abs_path);
+    struct stat st;
+    if (kfile_stat(abs_path, &st) < 0 || !st.st_size)
+        return NULL;
+    page_cache_t *cache, *stale = NULL;
+    list_t *head = &page_cache_hash_table[page_cache_hash(abs_path)];
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    list_for_each_owner (cache, head, hash_list) {
+        if (strcmp(cache->path, abs_path))
+            continue;
+        if (cache->size == st.st_size && cache->mtime == st.st_mtime) {
+            if (!list_empty(&cache->idle_list)) {
+                list_del_init(&cache->idle_list);
+                page_cache_idle_count--;
+            }
+            atomic_inc(&cache->references);
+            interrupt_restore_state(flags);
+            return cache;
+        }
+        /* 文件已经改变，旧的缓存不能再被使用 */
+        page_cache_unhash(cache);
+        if (atomic_get(&cache->references) <= 0)
+            stale = cache;
+        break;
+    }
+    interrupt_restore_state(flags);
+    if (stale)
+        page_cache_destroy(stale);
+
+    cache = page_cache_create(abs_path, &st);
+    if (cache == NULL)
+        return NULL;
+    atomic_set(&cache->references, 1);
+    interrupt_save_and_disable(flags);
+    list_add(&cache->hash_list, head);
+    interrupt_restore_state(flags);
+    return cache;
+}
+
+void page_cache_hold(page_cache_t *cache)
+{
+    atomic_inc(&cache->references);
+}
+
+/**
+ * 减少页缓存的引用计数。没有引用后放到空闲链表中保留，
+ * 空闲缓存过多时销毁最久没有使用的缓存。
+ */
+void page_cache_put(page_cache_t *cache)
+{
+    page_cache_t *victim = NULL;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    atomic_dec(&cache->references);
+    if (atomic_get(&cache->references) > 0) {
+        interrupt_restore_state(flags);
+        return;
+    }
+    if (cache->flags & PAGE_CACHE_STALE) {
+        victim = cache;
+    } else {
+        list_add_tail(&cache->idle_list, &page_cache_idle_list);
+        if (++page_cache_idle_count > PAGE_CACHE_IDLE_MAX) {
+            victim = list_first_owner(&page_cache_idle_list, page_cache_t, idle_list);
+            page_cache_unhash(victim);
+        }
+    }
+    interrupt_restore_state(flags);
+    if (victim)
+        page_cache_destroy(victim);
+}
+
+/**
+ * 获取文件页对应的物理页，如果还没有读取就从文件中读取。
+ * 缓存页从NORMAL区域分配，可以直接通过内核虚拟地址访问。
+ * 成功返回物理地址，失败返回0
+ */
+unsigned long page_cache_read_page(page_cache_t *cache, unsigned long index)
+{
+    if (index >= cache->npages)
+        return 0;
+    if (cache->pages[index])
+        return cache->pages[index];
+    semaphore_down(&cache->lock);
+    /* 等待锁的时候可能已经被其它进程读取了 */
+    if (cache->pages[index]) {
+        semaphore_up(&cache->lock);
+        return cache->pages[index];
+    }
+    unsigned long page = page_alloc_normal(1);
+    if (!page) {
+        semaphore_up(&cache->lock);
+        return 0;
+    }
+    void *buf = kern_phy_addr2vir_addr(page);
+    off_t off = index * PAGE_SIZE;
+    size_t count = min(cache->size - off, PAGE_SIZE);
+    kfile_lseek(cache->fd, off, SEEK_SET);
+    if (kfile_read(cache->fd, buf, count) != count) {
+        keprint(PRINT_ERR "page cache: read %s page %d failed!\n", cache->path, index);
+        page_free(page);
+        semaphore_up(&cache->lock);
+        return 0;
+    }
+    if (count < PAGE_SIZE)
+        memset(buf + count, 0, PAGE_SIZE - count);
+    cache->pages[index] = page;
+    semaphore_up(&cache->lock);
+    return page;
+}
+
+/**
+ * page_cache_fault - 处理文件映射空间的缺页
+ * @space: 文件映射的空间
+ * @addr: 故障地址
+ *
+ * 完整位于文件中的页直接映射缓存页，只读并且标记为写时复制，多个进程共享。
+ * 和文件末尾相交的页复制文件数据后把剩余部分清0，超出文件的页（bss）映射清0的页。
+ */
+int page_cache_fault(mem_space_t *space, unsigned long addr)
+{
+    unsigned long vaddr = addr & PAGE_MASK;
+    unsigned long off = vaddr - space->start;
+    unsigned long paddr = 0;
+    unsigned long flags;
+    if (off < space->file_size) {
+        paddr = page_cache_read_page(space->cache, (space->file_off + off) >> PAGE_SHIFT);
+        if (!paddr)
+            return -1;
+    }
+    interrupt_save_and_disable(flags);
+    /* 读取文件时可能被同一进程的其它线程映射了 */
+    if ((*vir_addr_to_dir_entry(vaddr) & PAGE_ATTR_PRESENT) &&
+        (*vir_addr_to_table_entry(vaddr) & PAGE_ATTR_PRESENT)) {
+        interrupt_restore_state(flags);
+        return 0;
+    }
+    if (paddr && off + PAGE_SIZE <= space->file_size) {
+        page_ref(paddr);
+        page_link_addr(vaddr, paddr, PAGE_ATTR_USER | PAGE_ATTR_COW);
+        interrupt_restore_state(flags);
+        return 0;
+    }
+    unsigned long page = page_alloc_user(1);
+    if (!page) {
+        interrupt_restore_state(flags);
+        return -1;
+    }
+    page_link_addr(vaddr, page, PAGE_ATTR_USER | PAGE_ATTR_WRITE);
+    if (paddr) {
+        memcpy((void *)vaddr, kern_phy_addr2vir_addr(paddr), space->file_size - off);
+        memset((void *)vaddr + space->file_size - off, 0, PAGE_SIZE - (space->file_size - off));
+    } else {
+        memset((void *)vaddr, 0, PAGE_SIZE);
+    }
+    interrupt_restore_state(flags);
+    return 0;
+}
+
+void page_cache_init()
+{
+    int i;
+    for (i = 0; i < PAGE_CACHE_HASH_NR; i++)
+        list_init(&page_cache_hash_table[i]);
+}
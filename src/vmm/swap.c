@@ -0,0 +1,571 @@
+#include <xbook/swap.h>
+#include <xbook/bitmap.h>
+#include <xbook/memcache.h>
+#include <xbook/mutexlock.h>
+#include <xbook/memspace.h>
+#include <xbook/driver.h>
+#include <xbook/account.h>
+#include <xbook/safety.h>
+#include <xbook/debug.h>
+#include <xbook/task.h>
+#include <xbook/schedule.h>
+#include <xbook/clock.h>
+#include <xbook/path.h>
+#include <xbook/dir.h>
+#include <xbook/diskman.h>
+#include <xbook/bufcache.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <errno.h>
+
+// #define DEBUG_SWAP
+
+/*
+ * 交换设备可以是磁盘，也可以是绑定了交换文件的loop设备。
+ * 换入在页故障中进行，不能经过文件系统和块缓存：它们在持有锁的时候会访问用户缓冲区，
+ * 如果缓冲区的页被换出了，换入时再次获取同一个锁就会死锁。
+ * 所以swapon时通过DISKIO_GETEXTENT把交换文件解析成磁盘上的连续扇区段，之后直接读写磁盘。
+ * 交换文件打开期间不能再通过文件系统写入或者改变大小。
+ * 每个交换槽保存一页数据，槽的引用计数为0时空闲，fork后父子进程共享同一个槽。
+ * 槽的分配和释放会在页故障中调用，所以用关闭中断来保护。
+ */
+typedef struct {
+    unsigned long slot;                 /* 第一个槽 */
+    unsigned long nr;                   /* 连续的槽数量 */
+    int solt;                           /* 磁盘管理器的插槽 */
+    unsigned long sector;               /* 第一个槽在磁盘上的扇区 */
+} swap_extent_t;
+
+typedef struct {
+    handle_t handle;                    /* 设备句柄，小于0表示没有交换设备 */
+    char devname[DEVICE_NAME_LEN];
+    unsigned long slots;                /* 交换槽数量 */
+    unsigned long used;                 /* 已经使用的槽数量 */
+    bitmap_t slot_map;                  /* 槽的使用位图 */
+    unsigned char *slot_count;          /* 槽的引用计数 */
+    swap_extent_t *extents;             /* 交换文件的扇区段，按槽排序，磁盘上交换时为NULL */
+    unsigned long extent_nr;
+} swap_device_t;
+
+static swap_device_t swap_device = {.handle = -1};
+/* swapon和swapoff互斥 */
+DEFINE_MUTEX_LOCK(swap_device_mutex);
+/* 换出时只有一个缓冲区，换页线程和直接换出互斥 */
+DEFINE_MUTEX_LOCK(swap_reclaim_mutex);
+static unsigned char swap_io_buffer[PAGE_SIZE];
+
+/* 空闲用户页的水位，用户内存很小时在swap_init中缩小 */
+static unsigned long swap_free_low = SWAP_FREE_LOW;
+static unsigned long swap_free_high = SWAP_FREE_HIGH;
+
+/* 时钟算法的指针：扫描到的进程和地址 */
+static pid_t swap_hand_pid = -1;
+static unsigned long swap_hand_addr = 0;
+
+int swap_enabled()
+{
+    return swap_device.handle >= 0;
+}
+
+static long swap_slot_alloc()
+{
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (swap_device.handle < 0) {
+        interrupt_restore_state(flags);
+        return -1;
+    }
+    long slot = bitmap_scan(&swap_device.slot_map, 1);
+    if (slot >= 0) {
+        bitmap_set(&swap_device.slot_map, slot, 1);
+        swap_device.slot_count[slot] = 1;
+        swap_device.used++;
+    }
+    interrupt_restore_state(flags);
+    return slot;
+}
+
+/* 页表项被复制时增加槽的引用，引用计数已经达到最大值时失败 */
+int swap_slot_dup(unsigned long slot)
+{
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (slot >= swap_device.slots || !swap_device.slot_count[slot] ||
+        swap_device.slot_count[slot] >= SWAP_SLOT_COUNT_MAX) {
+        interrupt_restore_state(flags);
+        return -1;
+    }
+    swap_device.slot_count[slot]++;
+    interrupt_restore_state(flags);
+    return 0;
+}
+
+void swap_slot_free(unsigned long slot)
+{
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (slot < swap_device.slots && swap_device.slot_count[slot]) {
+        if (!--swap_device.slot_count[slot]) {
+            bitmap_set(&swap_device.slot_map, slot, 0);
+            swap_device.used--;
+        }
+    } else {
+        keprint(PRINT_WARING "swap: free bad slot %d\n", slot);
+    }
+    interrupt_restore_state(flags);
+}
+
+/* 二分查找槽所在的扇区段，槽跨过不连续的簇时不在任何段中 */
+static swap_extent_t *swap_extent_find(unsigned long slot)
+{
+    unsigned long low = 0, high = swap_device.extent_nr;
+    while (low < high) {
+        unsigned long mid = (low + high) / 2;
+        swap_extent_t *extent = &swap_device.extents[mid];
+        if (slot < extent->slot)
+            high = mid;
+        else if (slot >= extent->slot + extent->nr)
+            low = mid + 1;
+        else
+            return extent;
+    }
+    return NULL;
+}
+
+static int swap_rw_slot(unsigned long slot, void *buf, int write)
+{
+    if (!swap_device.extents) {
+        if (write)
+            return device_write(swap_device.handle, buf, PAGE_SIZE, slot * SWAP_SLOT_SECTORS) < 0 ? -1 : 0;
+        return device_read(swap_device.handle, buf, PAGE_SIZE, slot * SWAP_SLOT_SECTORS) < 0 ? -1 : 0;
+    }
+    swap_extent_t *extent = swap_extent_find(slot);
+    if (extent == NULL)
+        return -1;
+    unsigned long sector = extent->sector + (slot - extent->slot) * SWAP_SLOT_SECTORS;
+    if (write)
+        return disk_manager_raw_write(extent->solt, sector, buf, PAGE_SIZE);
+    return disk_manager_raw_read(extent->solt, sector, buf, PAGE_SIZE);
+}
+
+/* 读取交换槽的数据，需要打开中断调用 */
+int swap_read_slot(unsigned long slot, void *buf)
+{
+    if (swap_device.handle < 0 || slot >= swap_device.slots)
+        return -1;
+    return swap_rw_slot(slot, buf, 0);
+}
+
+static int swap_write_slot(unsigned long slot, void *buf)
+{
+    return swap_rw_slot(slot, buf, 1);
+}
+
+/* 可以换出的空间：私有的匿名页。栈在进程退出时没有取消映射，不换出 */
+static int swap_space_can_reclaim(mem_space_t *space)
+{
+    return !(space->flags & (MEM_SPACE_MAP_SHARED | MEM_SPACE_MAP_STACK));
+}
+
+/* 可以扫描的进程：用户进程的主线程，线程共享主线程的vmm */
+static int swap_task_can_reclaim(task_t *task)
+{
+    return task->vmm != NULL && task->pid == task->tgid &&
+        task->vmm->mem_space_head != NULL && task->vmm->page_storage != NULL;
+}
+
+/* 找到时钟指针指向的进程，进程已经退出了就从它的下一个进程开始 */
+static task_t *swap_hand_task()
+{
+    task_t *task = NULL;
+    if (swap_hand_pid >= 0)
+        task = task_find_by_pid(swap_hand_pid);
+    if (task == NULL) {
+        swap_hand_addr = 0;
+        if (list_empty(&task_global_list))
+            return NULL;
+        task = list_first_owner(&task_global_list, task_t, global_list);
+    }
+    return task;
+}
+
+static void swap_hand_next(task_t *task)
+{
+    if (task->global_list.next == &task_global_list)
+        task = list_first_owner(&task_global_list, task_t, global_list);
+    else
+        task = list_owner(task->global_list.next, task_t, global_list);
+    swap_hand_pid = task->pid;
+    swap_hand_addr = 0;
+}
+
+/**
+ * 从时钟指针开始扫描，选中一个页复制到swap_io_buffer中。
+ * 需要切换到被扫描进程的页目录，所以整个过程关闭中断。
+ * 返回选中的页表项，*vmm和*vaddr返回页所在的vmm和地址。
+ */
+static unsigned long swap_pick_page(unsigned long *budget, vmm_t **vmm, unsigned long *vaddr)
+{
+    unsigned long pte = 0;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    task_t *task = swap_hand_task();
+    while (task != NULL && *budget > 0 && !pte) {
+        if (!swap_task_can_reclaim(task)) {
+            (*budget)--;
+            swap_hand_next(task);
+            task = swap_hand_task();
+            continue;
+        }
+        swap_hand_pid = task->pid;
+        vmm_active(task->vmm);
+        mem_space_t *space = mem_space_find(task->vmm, swap_hand_addr);
+        while (space != NULL && *budget > 0) {
+            if (swap_space_can_reclaim(space)) {
+                unsigned long addr = max(swap_hand_addr, space->start);
+                pte = page_swap_pick(&addr, space->end, swap_io_buffer, budget);
+                swap_hand_addr = addr;
+                if (pte || addr < space->end)
+                    break;  /* 选中了页，或者扫描预算用完了 */
+            } else {
+                (*budget)--;
+                swap_hand_addr = space->end;
+            }
+            space = space->next;
+        }
+        vmm_active(task_current->vmm);
+        if (pte) {
+            *vmm = task->vmm;
+            *vaddr = swap_hand_addr;
+            swap_hand_addr += PAGE_SIZE;
+        } else if (space == NULL) {
+            swap_hand_next(task);
+            task = swap_hand_task();
+        }
+    }
+    interrupt_restore_state(flags);
+    return pte;
+}
+
+/**
+ * 数据写入交换槽后，检测进程和页表项都没有变化，就把页换出。
+ */
+static int swap_finish_page(pid_t pid, vmm_t *vmm, unsigned long vaddr, unsigned long pte, unsigned long slot)
+{
+    int ret = -1;
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    task_t *task = task_find_by_pid(pid);
+    if (task != NULL && task->vmm == vmm && swap_task_can_reclaim(task)) {
+        mem_space_t *space = mem_space_find(vmm, vaddr);
+        if (space != NULL && space->start <= vaddr && swap_space_can_reclaim(space)) {
+            vmm_active(vmm);
+            ret = page_swap_out(vaddr, pte, slot);
+            vmm_active(task_current->vmm);
+        }
+    }
+    interrupt_restore_state(flags);
+    return ret;
+}
+
+/**
+ * swap_reclaim - 按时钟算法换出最多nr个页
+ *
+ * 时钟指针记录在进程和地址上，每次从上次停下的位置继续扫描所有进程的私有页。
+ * 需要打开中断调用，写磁盘时会等待。返回换出的页数。
+ */
+unsigned long swap_reclaim(unsigned long nr)
+{
+    if (swap_device.handle < 0)
+        return 0;
+    unsigned long reclaimed = 0;
+    unsigned long budget = nr * SWAP_SCAN_RATIO;
+    mutex_lock(&swap_reclaim_mutex);
+    while (reclaimed < nr && budget > 0) {
+        vmm_t *vmm;
+        unsigned long vaddr;
+        unsigned long pte = swap_pick_page(&budget, &vmm, &vaddr);
+        if (!pte)
+            break;
+        pid_t pid = swap_hand_pid;
+        long slot = swap_slot_alloc();
+        if (slot < 0) {
+            keprint(PRINT_WARING "swap: no free slot on %s!\n", swap_device.devname);
+            break;
+        }
+        if (swap_write_slot(slot, swap_io_buffer) < 0) {
+            keprint(PRINT_ERR "swap: write slot %d to %s failed!\n", slot, swap_device.devname);
+            swap_slot_free(slot);
+            break;
+        }
+        if (swap_finish_page(pid, vmm, vaddr, pte, slot) < 0) {
+            /* 写磁盘期间页被写入或者取消映射了 */
+            swap_slot_free(slot);
+            continue;
+        }
+        reclaimed++;
+    }
+    mutex_unlock(&swap_reclaim_mutex);
+#ifdef DEBUG_SWAP
+    keprint(PRINT_DEBUG "swap: reclaim %d pages, %d slots used\n", reclaimed, swap_device.used);
+#endif
+    return reclaimed;
+}
+
+/* 换页线程：空闲的用户页少于低水位时，一直换出到高水位 */
+static void swap_daemon(void *arg)
+{
+    while (1) {
+        task_sleep_by_ticks(MSEC_TO_TICKS(SWAP_DAEMON_INTERVAL));
+        if (!swap_enabled() || page_user_free_nr() >= swap_free_low)
+            continue;
+        while (page_user_free_nr() < swap_free_high) {
+            if (!swap_reclaim(SWAP_RECLAIM_BATCH))
+                break;
+        }
+    }
+}
+
+/* 把/dev/xxx转换成设备名xxx */
+static char *swap_device_name(char *abs_path)
+{
+    if (strncmp(abs_path, DEV_DIR_PATH, strlen(DEV_DIR_PATH)) != 0)
+        return NULL;
+    char *p = abs_path + strlen(DEV_DIR_PATH);
+    while (*p == '/')
+        p++;
+    return *p ? p : NULL;
+}
+
+/**
+ * 把loop设备上的交换文件解析成磁盘上的扇区段，相邻的段合并。
+ * 一个槽的扇区在磁盘上不连续时，这个槽在位图中一直标记为已使用，不会分配。
+ * 成功返回可以使用的槽数量，失败返回-1
+ */
+static long swap_map_file(handle_t handle, unsigned long slots, bitmap_t *slot_map,
+    swap_extent_t **extents_out, unsigned long *nr_out)
+{
+    swap_extent_t *extents = NULL;
+    unsigned long nr = 0, max = 0, usable = 0;
+    unsigned long slot = 0;
+    while (slot < slots) {
+        disk_extent_t ext;
+        ext.offset = slot * SWAP_SLOT_SECTORS;
+        if (device_devctl(handle, DISKIO_GETEXTENT, (unsigned long) &ext) < 0)
+            goto failed;
+        unsigned long n = ext.count / SWAP_SLOT_SECTORS;
+        if (!n) {
+            bitmap_set(slot_map, slot, 1);
+            slot++;
+            continue;
+        }
+        if (n > slots - slot)
+            n = slots - slot;
+        swap_extent_t *last = nr ? &extents[nr - 1] : NULL;
+        if (last && last->solt == ext.solt && last->slot + last->nr == slot &&
+            last->sector + last->nr * SWAP_SLOT_SECTORS == ext.sector) {
+            last->nr += n;
+        } else {
+            if (nr == max) {
+                max = max ? max * 2 : 16;
+                if (max > SWAP_EXTENT_MAX) {
+                    keprint(PRINT_ERR "swap: swap file has too many fragments!\n");
+                    goto failed;
+                }
+                swap_extent_t *new_extents = mem_alloc(max * sizeof(swap_extent_t));
+                if (new_extents == NULL)
+                    goto failed;
+                if (extents) {
+                    memcpy(new_extents, extents, nr * sizeof(swap_extent_t));
+                    mem_free(extents);
+                }
+                extents = new_extents;
+            }
+            extents[nr].slot = slot;
+            extents[nr].nr = n;
+            extents[nr].solt = ext.solt;
+            extents[nr].sector = ext.sector;
+            nr++;
+        }
+        usable += n;
+        slot += n;
+    }
+    if (!usable)
+        goto failed;
+    *extents_out = extents;
+    *nr_out = nr;
+    return usable;
+failed:
+    if (extents)
+        mem_free(extents);
+    return -1;
+}
+
+/**
+ * sys_swapon - 在设备上打开交换
+ * @path: 设备路径，例如/dev/sdb，或者绑定了交换文件的loop设备/dev/loop0
+ * @flags: 保留
+ *
+ * 只支持一个交换设备，设备或者文件的原有数据会被覆盖。内存盘不能作为交换设备。
+ */
+int sys_swapon(char *path, int flags)
+{
+    if (!path)
+        return -EINVAL;
+    if (mem_copy_from_user(NULL, path, MAX_PATH) < 0)
+        return -EINVAL;
+    if (!account_selfcheck_permission(path, PERMISION_ATTR_DEVICE))
+        return -EPERM;
+    char abs_path[MAX_PATH] = {0};
+    build_path(path, abs_path);
+    char *name = swap_device_name(abs_path);
+    if (name == NULL)
+        return -ENODEV;
+    mutex_lock(&swap_device_mutex);
+    if (swap_device.handle >= 0) {
+        mutex_unlock(&swap_device_mutex);
+        return -EBUSY;
+    }
+    handle_t handle = device_open(name, 0);
+    if (handle < 0) {
+        mutex_unlock(&swap_device_mutex);
+        return -ENODEV;
+    }
+    device_object_t *devobj = io_search_device_by_name(name);
+    if (devobj == NULL || (devobj->type != DEVICE_TYPE_DISK && devobj->type != DEVICE_TYPE_VIRTUAL_DISK)) {
+        keprint(PRINT_ERR "swap: %s is not a disk!\n", name);
+        device_close(handle);
+        mutex_unlock(&swap_device_mutex);
+        return -EINVAL;
+    }
+    unsigned int sectors = 0;
+    if (device_devctl(handle, DISKIO_GETSIZE, (unsigned long) &sectors) < 0)
+        sectors = 0;
+    /* 不使用最后一个扇区，少用一个槽 */
+    unsigned long slots = sectors ? (sectors - 1) / SWAP_SLOT_SECTORS : 0;
+    if (slots > SWAP_SLOT_MAX)
+        slots = SWAP_SLOT_MAX;
+    slots &= ~7UL;  /* 位图按字节管理 */
+    if (!slots) {
+        device_close(handle);
+        mutex_unlock(&swap_device_mutex);
+        return -EINVAL;
+    }
+    unsigned char *slot_count = mem_alloc(slots);
+    unsigned char *bits = mem_alloc(slots / 8);
+    if (slot_count == NULL || bits == NULL) {
+        if (slot_count)
+            mem_free(slot_count);
+        if (bits)
+            mem_free(bits);
+        device_close(handle);
+        mutex_unlock(&swap_device_mutex);
+        return -ENOMEM;
+    }
+    memset(slot_count, 0, slots);
+    bitmap_t slot_map;
+    slot_map.bits = bits;
+    slot_map.byte_length = slots / 8;
+    bitmap_init(&slot_map);
+    swap_extent_t *extents = NULL;
+    unsigned long extent_nr = 0;
+    unsigned long usable = slots;
+    if (devobj->type == DEVICE_TYPE_VIRTUAL_DISK) {
+        /* 只有能解析出物理扇区的虚拟磁盘（绑定了文件的loop设备）才能交换 */
+        long ret = swap_map_file(handle, slots, &slot_map, &extents, &extent_nr);
+        if (ret < 0) {
+            keprint(PRINT_ERR "swap: %s is not backed by a file on a disk!\n", name);
+            mem_free(slot_count);
+            mem_free(bits);
+            device_close(handle);
+            mutex_unlock(&swap_device_mutex);
+            return -EINVAL;
+        }
+        usable = ret;
+        /* 块缓存中交换文件的脏数据先写回，之后写回不会覆盖换出的页 */
+        buf_cache_sync(-1);
+    }
+    unsigned long irq_flags;
+    interrupt_save_and_disable(irq_flags);
+    strncpy(swap_device.devname, name, DEVICE_NAME_LEN - 1);
+    swap_device.devname[DEVICE_NAME_LEN - 1] = '\0';
+    swap_device.slots = slots;
+    swap_device.used = 0;
+    swap_device.slot_count = slot_count;
+    swap_device.slot_map = slot_map;
+    swap_device.extents = extents;
+    swap_device.extent_nr = extent_nr;
+    swap_device.handle = handle;
+    interrupt_restore_state(irq_flags);
+    mutex_unlock(&swap_device_mutex);
+    keprint(PRINT_INFO "swap: swap on %s, %d KB, %d extents\n", name,
+        usable * (PAGE_SIZE / 1024), extent_nr);
+    return 0;
+}
+
+/**
+ * sys_swapoff - 关闭交换
+ *
+ * 不会把换出的页读回内存，还有页在交换设备上时返回-EBUSY。
+ */
+int sys_swapoff(char *path)
+{
+    mutex_lock(&swap_device_mutex);
+    if (swap_device.handle < 0) {
+        mutex_unlock(&swap_device_mutex);
+        return -EINVAL;
+    }
+    mutex_lock(&swap_reclaim_mutex);
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+    if (swap_device.used) {
+        interrupt_restore_state(flags);
+        mutex_unlock(&swap_reclaim_mutex);
+        mutex_unlock(&swap_device_mutex);
+        return -EBUSY;
+    }
+    handle_t handle = swap_device.handle;
+    unsigned char *slot_count = swap_device.slot_count;
+    unsigned char *bits = swap_device.slot_map.bits;
+    swap_extent_t *extents = swap_device.extents;
+    swap_device.handle = -1;
+    swap_device.slots = 0;
+    swap_device.slot_count = NULL;
+    swap_device.slot_map.bits = NULL;
+    swap_device.slot_map.byte_length = 0;
+    swap_device.extents = NULL;
+    swap_device.extent_nr = 0;
+    interrupt_restore_state(flags);
+    mutex_unlock(&swap_reclaim_mutex);
+    device_close(handle);
+    mem_free(slot_count);
+    mem_free(bits);
+    if (extents)
+        mem_free(extents);
+    mutex_unlock(&swap_device_mutex);
+    keprint(PRINT_INFO "swap: swap off %s\n", swap_device.devname);
+    return 0;
+}
+
+int swap_init()
+{
+    swap_device.handle = -1;
+    swap_device.slots = 0;
+    swap_device.used = 0;
+    swap_device.slot_count = NULL;
+    swap_device.slot_map.bits = NULL;
+    swap_device.slot_map.byte_length = 0;
+    swap_device.extents = NULL;
+    swap_device.extent_nr = 0;
+    /* 用户内存很小时，水位按照用户页总数缩小，不然换页线程会一直换出 */
+    unsigned long user_pages = page_user_total_nr();
+    if (swap_free_high > user_pages / 4) {
+        swap_free_high = user_pages / 4;
+        swap_free_low = swap_free_high / 2;
+    }
+    if (task_create("kswapd", TASK_PRIO_LEVEL_NORMAL, swap_daemon, NULL) == NULL) {
+        keprint(PRINT_ERR "swap: start swap daemon failed!\n");
+        return -1;
+    }
+    return 0;
+}
@@ -1,136 +1,325 @@
 #include <arch/interrupt.h>
 #include <arch/memio.h>
+#include <arch/memory.h>
 #include <xbook/virmem.h>
 #include <xbook/debug.h>
-#include <xbook/bitmap.h>
 #include <xbook/memcache.h>
-#include <xbook/mutexlock.h>
 #include <string.h>
 
-static bitmap_t vir_addr_bitmap;
-static unsigned long vir_addr_base; 
-static list_t using_vir_mem_list;
-static list_t free_vir_mem_list;
+/*
+ * 非连续内存区域的虚拟地址管理。
+ * 空闲的虚拟地址区域放在按地址排序的AVL树中，每个节点记录子树中最大的区域大小，
+ * 这样可以在O(logn)内找到能满足大小的地址最低的区域；释放时和相邻的空闲区域合并。
+ * 已经分配的区域放在另一棵按地址排序的树中，释放时按地址查找。
+ * vir_mem_free释放的区域先不刷新快表，放到延迟链表中，累计到一定页数后统一刷新，
+ * 再放回空闲树。
+ */
+static vir_mem_t *free_vir_mem_root;
+static vir_mem_t *using_vir_mem_root;
+static list_t lazy_vir_mem_list;
+static unsigned long lazy_vir_mem_pages;
+static unsigned long vir_addr_base;
 
-DEFINE_MUTEX_LOCK(vir_addr_lock);
+static inline int vir_mem_height(vir_mem_t *node)
+{
+	return node ? node->height : 0;
+}
 
-unsigned long vir_addr_alloc(size_t size)
+static inline unsigned long vir_mem_max_size(vir_mem_t *node)
 {
-	size = PAGE_ALIGN(size);
-	if (!size)
-		return 0;
-	long pages = size / PAGE_SIZE;
-    mutex_lock(&vir_addr_lock);
-	long idx = bitmap_scan(&vir_addr_bitmap, pages);
-	if (idx == -1) {
-        mutex_unlock(&vir_addr_lock);
-        return 0;
-    }	
-	int i;
-	for (i = 0; i < pages; i++) {
-		bitmap_set(&vir_addr_bitmap, idx + i, 1);
+	return node ? node->max_size : 0;
+}
+
+static void vir_mem_tree_update(vir_mem_t *node)
+{
+	int lh = vir_mem_height(node->left);
+	int rh = vir_mem_height(node->right);
+	node->height = (lh > rh ? lh : rh) + 1;
+	unsigned long size = node->size;
+	if (vir_mem_max_size(node->left) > size)
+		size = node->left->max_size;
+	if (vir_mem_max_size(node->right) > size)
+		size = node->right->max_size;
+	node->max_size = size;
+}
+
+static vir_mem_t *vir_mem_rotate_right(vir_mem_t *node)
+{
+	vir_mem_t *left = node->left;
+	node->left = left->right;
+	left->right = node;
+	vir_mem_tree_update(node);
+	vir_mem_tree_update(left);
+	return left;
+}
+
+static vir_mem_t *vir_mem_rotate_left(vir_mem_t *node)
+{
+	vir_mem_t *right = node->right;
+	node->right = right->left;
+	right->left = node;
+	vir_mem_tree_update(node);
+	vir_mem_tree_update(right);
+	return right;
+}
+
+static vir_mem_t *vir_mem_tree_balance(vir_mem_t *node)
+{
+	vir_mem_tree_update(node);
+	int factor = vir_mem_height(node->left) - vir_mem_height(node->right);
+	if (factor > 1) {
+		if (vir_mem_height(node->left->left) < vir_mem_height(node->left->right))
+			node->left = vir_mem_rotate_left(node->left);
+		return vir_mem_rotate_right(node);
 	}
-    mutex_unlock(&vir_addr_lock);
-	return vir_addr_base + idx * PAGE_SIZE; 
+	if (factor < -1) {
+		if (vir_mem_height(node->right->right) < vir_mem_height(node->right->left))
+			node->right = vir_mem_rotate_right(node->right);
+		return vir_mem_rotate_left(node);
+	}
+	return node;
 }
 
-unsigned long vir_addr_free(unsigned long vaddr, size_t size)
+static vir_mem_t *vir_mem_tree_insert(vir_mem_t *node, vir_mem_t *area)
 {
-    if (!size)
-        return -1;
-    size = PAGE_ALIGN(size);
-	long pages = size / PAGE_SIZE;
-	long idx = (vaddr - vir_addr_base) / PAGE_SIZE;
-	if (idx == -1)
-		return -1;
-    mutex_lock(&vir_addr_lock);
-    long i;
-	for (i = 0; i < pages; i++) {
-		bitmap_set(&vir_addr_bitmap, idx + i, 0);
+	if (node == NULL) {
+		area->left = area->right = NULL;
+		vir_mem_tree_update(area);
+		return area;
 	}
-    mutex_unlock(&vir_addr_lock);
-	return 0; 
+	if (area->addr < node->addr)
+		node->left = vir_mem_tree_insert(node->left, area);
+	else
+		node->right = vir_mem_tree_insert(node->right, area);
+	return vir_mem_tree_balance(node);
 }
 
-static void *vir_mem_do_alloc(size_t size)
+static vir_mem_t *vir_mem_tree_remove_min(vir_mem_t *node, vir_mem_t **min)
 {
-	unsigned long start = vir_addr_alloc(size);
-	if (!start) 
-		return NULL;
-	
-	vir_mem_t *area;
-	area = mem_alloc(sizeof(vir_mem_t));
-	if (area == NULL) {
-		vir_addr_free(start, size);
-		return NULL;
+	if (node->left == NULL) {
+		*min = node;
+		return node->right;
 	}
-	area->addr = start;
-	area->size = size;
+	node->left = vir_mem_tree_remove_min(node->left, min);
+	return vir_mem_tree_balance(node);
+}
 
-	unsigned long flags;
-    interrupt_save_and_disable(flags);
-	list_add_tail(&area->list, &using_vir_mem_list);
-	if (page_map_addr(start, size, PROT_KERN | PROT_WRITE)) {
-		vir_addr_free(start, size);
-		mem_free(area);
-		interrupt_restore_state(flags);
+static vir_mem_t *vir_mem_tree_erase(vir_mem_t *node, unsigned long addr)
+{
+	if (node == NULL)
 		return NULL;
+	if (addr < node->addr) {
+		node->left = vir_mem_tree_erase(node->left, addr);
+	} else if (addr > node->addr) {
+		node->right = vir_mem_tree_erase(node->right, addr);
+	} else {
+		vir_mem_t *left = node->left;
+		vir_mem_t *right = node->right;
+		vir_mem_t *min;
+		if (right == NULL)
+			return left;
+		right = vir_mem_tree_remove_min(right, &min);
+		min->left = left;
+		min->right = right;
+		return vir_mem_tree_balance(min);
 	}
-	interrupt_restore_state(flags);
-	return (void *)area->addr;
+	return vir_mem_tree_balance(node);
 }
 
-void *vir_mem_alloc(size_t size)
+/* 节点的大小变化后，沿根到该节点的路径重新计算max_size */
+static void vir_mem_tree_fixup(vir_mem_t *node, unsigned long addr)
 {
-	size = PAGE_ALIGN(size);
+	if (node == NULL)
+		return;
+	if (addr < node->addr)
+		vir_mem_tree_fixup(node->left, addr);
+	else if (addr > node->addr)
+		vir_mem_tree_fixup(node->right, addr);
+	vir_mem_tree_update(node);
+}
 
-	if (!size)
-		return NULL;
+static vir_mem_t *vir_mem_tree_find(vir_mem_t *node, unsigned long addr)
+{
+	while (node != NULL) {
+		if (addr < node->addr)
+			node = node->left;
+		else if (addr > node->addr)
+			node = node->right;
+		else
+			return node;
+	}
+	return NULL;
+}
+
+/* 查找地址最低的、大小不小于size的空闲区域 */
+static vir_mem_t *vir_mem_tree_search(vir_mem_t *node, unsigned long size)
+{
+	while (node != NULL) {
+		if (vir_mem_max_size(node->left) >= size)
+			node = node->left;
+		else if (node->size >= size)
+			return node;
+		else if (vir_mem_max_size(node->right) >= size)
+			node = node->right;
+		else
+			return NULL;
+	}
+	return NULL;
+}
 
-	size += PAGE_SIZE;
-	vir_mem_t *target = NULL, *area;
-	list_for_each_owner(area, &free_vir_mem_list, list) {
-		if (size >= area->size) {
-			target = area;
-			break;
+/* 查找空闲树中addr前后相邻的区域 */
+static void vir_mem_tree_neighbor(vir_mem_t *node, unsigned long addr,
+	vir_mem_t **prev, vir_mem_t **next)
+{
+	*prev = *next = NULL;
+	while (node != NULL) {
+		if (addr < node->addr) {
+			*next = node;
+			node = node->left;
+		} else {
+			*prev = node;
+			node = node->right;
 		}
 	}
-	if (target != NULL) {
-		unsigned long flags;
-        interrupt_save_and_disable(flags);
-		list_del(&target->list);
-		list_add_tail(&target->list, &using_vir_mem_list);
-		interrupt_restore_state(flags);
-		return (void *)target->addr;
+}
+
+/* 不再使用的节点用left串起来，等开中断后再释放 */
+static inline void vir_mem_push_unused(vir_mem_t **unused, vir_mem_t *node)
+{
+	node->left = *unused;
+	*unused = node;
+}
+
+static void vir_mem_free_unused(vir_mem_t *unused)
+{
+	while (unused != NULL) {
+		vir_mem_t *next = unused->left;
+		mem_free(unused);
+		unused = next;
 	}
-	return (void *)vir_mem_do_alloc(size);
 }
 
-static int vir_mem_do_free(vir_mem_t *target)
+/**
+ * 把区域放回空闲树，和前后相邻的空闲区域合并，合并掉的节点放到unused中
+ */
+static void vir_mem_insert_free(vir_mem_t *area, vir_mem_t **unused)
 {
-	vir_mem_t *area;
-	list_del(&target->list);
-	char inserted = 0;
-	if (list_empty(&free_vir_mem_list)) {
-		list_add(&target->list, &free_vir_mem_list);
+	vir_mem_t *prev, *next;
+	vir_mem_tree_neighbor(free_vir_mem_root, area->addr, &prev, &next);
+	if (prev && prev->addr + prev->size == area->addr) {
+		prev->size += area->size;
+		vir_mem_push_unused(unused, area);
+		if (next && prev->addr + prev->size == next->addr) {
+			prev->size += next->size;
+			free_vir_mem_root = vir_mem_tree_erase(free_vir_mem_root, next->addr);
+			vir_mem_push_unused(unused, next);
+		}
+		vir_mem_tree_fixup(free_vir_mem_root, prev->addr);
+	} else if (next && area->addr + area->size == next->addr) {
+		/* 向前扩展后一个区域，顺序不变，只需要更新路径 */
+		next->addr = area->addr;
+		next->size += area->size;
+		vir_mem_tree_fixup(free_vir_mem_root, next->addr);
+		vir_mem_push_unused(unused, area);
 	} else {
-		area = list_first_owner(&free_vir_mem_list, vir_mem_t, list);
-		do {
-			if (target->size > area->size) {
-				if (area->list.next == &free_vir_mem_list) {
-					list_add_tail(&target->list, &free_vir_mem_list);
-					inserted = 1;
-					break;
-				}
-				area = list_owner(area->list.next, vir_mem_t, list);
-			} else {
-				list_add_before(&target->list, &area->list);
-				inserted = 1;
-				break;
-			}
-		} while (&area->list != &free_vir_mem_list);
-	}
-	return inserted;
+		free_vir_mem_root = vir_mem_tree_insert(free_vir_mem_root, area);
+	}
+}
+
+/**
+ * 刷新快表后，把延迟释放的区域放回空闲树
+ */
+static void vir_mem_purge_lazy(vir_mem_t **unused)
+{
+	vir_mem_t *area, *next;
+	if (list_empty(&lazy_vir_mem_list))
+		return;
+	tlb_flush();
+	list_for_each_owner_safe(area, next, &lazy_vir_mem_list, list) {
+		list_del_init(&area->list);
+		vir_mem_insert_free(area, unused);
+	}
+	lazy_vir_mem_pages = 0;
+}
+
+unsigned long vir_addr_alloc(size_t size)
+{
+	size = PAGE_ALIGN(size);
+	if (!size)
+		return 0;
+	unsigned long addr = 0;
+	vir_mem_t *unused = NULL, *area;
+	unsigned long flags;
+	interrupt_save_and_disable(flags);
+	area = vir_mem_tree_search(free_vir_mem_root, size);
+	if (area == NULL && !list_empty(&lazy_vir_mem_list)) {
+		vir_mem_purge_lazy(&unused);
+		area = vir_mem_tree_search(free_vir_mem_root, size);
+	}
+	if (area != NULL) {
+		addr = area->addr;
+		if (area->size == size) {
+			free_vir_mem_root = vir_mem_tree_erase(free_vir_mem_root, area->addr);
+			vir_mem_push_unused(&unused, area);
+		} else {
+			/* 从区域开头切出，区域仍然在原来的位置 */
+			area->addr += size;
+			area->size -= size;
+			vir_mem_tree_fixup(free_vir_mem_root, area->addr);
+		}
+	}
+	interrupt_restore_state(flags);
+	vir_mem_free_unused(unused);
+	return addr;
+}
+
+unsigned long vir_addr_free(unsigned long vaddr, size_t size)
+{
+	size = PAGE_ALIGN(size);
+	if (!size || vaddr < vir_addr_base || vaddr >= VIR_MEM_END)
+		return -1;
+	vir_mem_t *area = mem_alloc(sizeof(vir_mem_t));
+	if (area == NULL)
+		return -1;
+	area->addr = vaddr;
+	area->size = size;
+	vir_mem_t *unused = NULL;
+	unsigned long flags;
+	interrupt_save_and_disable(flags);
+	vir_mem_insert_free(area, &unused);
+	interrupt_restore_state(flags);
+	vir_mem_free_unused(unused);
+	return 0;
+}
+
+void *vir_mem_alloc(size_t size)
+{
+	size = PAGE_ALIGN(size);
+	if (!size)
+		return NULL;
+	vir_mem_t *area = mem_alloc(sizeof(vir_mem_t));
+	if (area == NULL)
+		return NULL;
+	/* 多保留一页不映射的虚拟地址作为隔离页 */
+	unsigned long start = vir_addr_alloc(size + PAGE_SIZE);
+	if (!start) {
+		mem_free(area);
+		return NULL;
+	}
+	area->addr = start;
+	area->size = size;
+	list_init(&area->list);
+	if (page_map_addr(start, size, PROT_KERN | PROT_WRITE)) {
+		page_unmap_addr_safe(start, size, 0);
+		vir_addr_free(start, size + PAGE_SIZE);
+		mem_free(area);
+		return NULL;
+	}
+	unsigned long flags;
+	interrupt_save_and_disable(flags);
+	using_vir_mem_root = vir_mem_tree_insert(using_vir_mem_root, area);
+	interrupt_restore_state(flags);
+	return (void *)area->addr;
 }
 
 int vir_mem_free(void *ptr)
@@ -140,23 +329,25 @@ int vir_mem_free(void *ptr)
 	unsigned long addr = (unsigned long)ptr;
 	if (addr < vir_addr_base || addr >= VIR_MEM_END)
 		return -1;
-	vir_mem_t *target = NULL, *area;
+	vir_mem_t *unused = NULL;
 	unsigned long flags;
-    interrupt_save_and_disable(flags);
-	list_for_each_owner(area, &using_vir_mem_list, list) {
-		if (area->addr == addr) {
-			target = area;
-			break;
-		}
-	}
-	if (target != NULL) {
-		if (vir_mem_do_free(target)) {
-			interrupt_restore_state(flags);
-			return 0;
-		}
+	interrupt_save_and_disable(flags);
+	vir_mem_t *target = vir_mem_tree_find(using_vir_mem_root, addr);
+	if (target == NULL) {
+		interrupt_restore_state(flags);
+		return -1;
 	}
-    interrupt_restore_state(flags);
-	return -1;
+	using_vir_mem_root = vir_mem_tree_erase(using_vir_mem_root, addr);
+	page_unmap_addr_lazy(target->addr, target->size);
+	/* 加上隔离页，整个区域等刷新快表后再放回空闲树 */
+	target->size += PAGE_SIZE;
+	list_add_tail(&target->list, &lazy_vir_mem_list);
+	lazy_vir_mem_pages += target->size / PAGE_SIZE;
+	if (lazy_vir_mem_pages >= VIR_MEM_LAZY_MAX_PAGES)
+		vir_mem_purge_lazy(&unused);
+	interrupt_restore_state(flags);
+	vir_mem_free_unused(unused);
+	return 0;
 }
 
 void *memio_remap(unsigned long paddr, size_t size)
@@ -165,7 +356,7 @@ void *memio_remap(unsigned long paddr, size_t size)
         return NULL;
     }
     unsigned long vaddr = vir_addr_alloc(size);
-    if (vaddr == -1) {
+    if (!vaddr) {
         keprint("alloc virtual addr for IO remap failed!\n");
         return NULL;
     }
@@ -177,17 +368,17 @@ void *memio_remap(unsigned long paddr, size_t size)
 	}
 	area->addr = vaddr;
 	area->size = size;
-    unsigned long flags;
-    interrupt_save_and_disable(flags);
-	list_add_tail(&area->list, &using_vir_mem_list);
+	list_init(&area->list);
     if (hal_memio_remap(paddr, vaddr, size)) {
-        list_del(&area->list);
         mem_free(area);
         vir_addr_free(vaddr, size);
-        vaddr = 0;
+        return NULL;
     }
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
+	using_vir_mem_root = vir_mem_tree_insert(using_vir_mem_root, area);
     interrupt_restore_state(flags);
-    return (void *)vaddr;    
+    return (void *)vaddr;
 }
 
 int memio_unmap(void *vaddr)
@@ -198,34 +389,34 @@ int memio_unmap(void *vaddr)
     unsigned long addr = (unsigned long )vaddr;
 	if (addr < vir_addr_base || addr >= VIR_MEM_END)
 		return -1;
-	vir_mem_t *target = NULL, *area;
 	unsigned long flags;
     interrupt_save_and_disable(flags);
-	list_for_each_owner(area, &using_vir_mem_list, list) {
-		if (area->addr == addr) {
-			target = area;
-			break;
-		}
-	}
-	if (target != NULL) {
-        if (hal_memio_unmap(target->addr, target->size)) {
-            list_del(&target->list);
-            vir_addr_free(addr, target->size);
-            mem_free(target);
-            interrupt_restore_state(flags);
-            return 0;
-		}
+	vir_mem_t *target = vir_mem_tree_find(using_vir_mem_root, addr);
+	if (target == NULL) {
+		interrupt_restore_state(flags);
+		return -1;
 	}
+	using_vir_mem_root = vir_mem_tree_erase(using_vir_mem_root, addr);
 	interrupt_restore_state(flags);
-    return -1;
+	/* 设备内存立即取消映射，不使用延迟刷新 */
+	hal_memio_unmap(target->addr, target->size);
+	vir_addr_free(addr, target->size);
+	mem_free(target);
+    return 0;
 }
 
 void vir_mem_init()
 {
-	vir_addr_bitmap.byte_length = DYNAMIC_MAP_MEM_SIZE / (PAGE_SIZE * 8);
-	vir_addr_bitmap.bits = mem_alloc(vir_addr_bitmap.byte_length);
-	bitmap_init(&vir_addr_bitmap);
 	vir_addr_base = VIR_MEM_BASE;
-	list_init(&using_vir_mem_list);
-	list_init(&free_vir_mem_list);
+	free_vir_mem_root = NULL;
+	using_vir_mem_root = NULL;
+	list_init(&lazy_vir_mem_list);
+	lazy_vir_mem_pages = 0;
+	vir_mem_t *area = mem_alloc(sizeof(vir_mem_t));
+	if (area == NULL)
+		panic("vir_mem_init: alloc free area failed!\n");
+	area->addr = vir_addr_base;
+	area->size = VIR_MEM_END - vir_addr_base;
+	list_init(&area->list);
+	free_vir_mem_root = vir_mem_tree_insert(NULL, area);
 }
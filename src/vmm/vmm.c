@@ -6,6 +6,7 @@
 #include <xbook/sharemem.h>
 #include <xbook/safety.h>
 #include <xbook/process.h>
+#include <xbook/pagecache.h>
 #include <string.h>
 #include <errno.h>
 
@@ -16,6 +17,10 @@ void vmm_init(vmm_t *vmm)
         panic(PRINT_EMERG "task_init_vmm: mem_alloc for page_storege failed!\n");
     }
     vmm->mem_space_head = NULL;
+    vmm->mem_space_root = NULL;
+    vmm->mem_space_cache = NULL;
+    vmm->fault_count = 0;
+    vmm->fault_pages = 0;
     vmm->argv = NULL;
     vmm->envp = NULL;
     vmm->argbuf = NULL;
@@ -43,6 +48,7 @@ int sys_mstate(mstate_t *ms)
     tms.ms_used = tms.ms_total - tms.ms_free;
     if (tms.ms_used < 0)
         tms.ms_used = 0;
+    tms.ms_frag = mem_get_fragmentation(MEM_FRAG_CHECK_ORDER);
     if (mem_copy_to_user(ms, &tms, sizeof(mstate_t)) < 0) {
         return -EFAULT;
     }
@@ -98,15 +104,13 @@ int vmm_copy_mem_space(vmm_t *child_vmm, vmm_t *parent_vmm)
             return -1;
         }
         *space = *p;
-        space->next = NULL;
+        if (space->cache)
+            page_cache_hold(space->cache);
         if (space->flags & MEM_SPACE_MAP_SHARED) {
             if (vmm_inc_share_mem(space) < 0)
                 return -1;
         }
-        if (tail == NULL)
-            child_vmm->mem_space_head = space;    
-        else 
-            tail->next = space;
+        mem_space_link(child_vmm, space, tail);
         tail = space;
         p = p->next;
     }
@@ -117,7 +121,14 @@ int vmm_release_space(vmm_t *vmm)
 {
     if (vmm == NULL)
         return -1; 
+    /* 先从vmm上摘下整个链表再释放，换页线程不会访问到释放了的空间 */
+    unsigned long flags;
+    interrupt_save_and_disable(flags);
     mem_space_t *space = (mem_space_t *)vmm->mem_space_head;
+    vmm->mem_space_head = NULL;
+    vmm->mem_space_root = NULL;
+    vmm->mem_space_cache = NULL;
+    interrupt_restore_state(flags);
     mem_space_t *p;
     while (space != NULL) {
         p = space;
@@ -129,7 +140,6 @@ int vmm_release_space(vmm_t *vmm)
         mem_space_free(p);
     }
     vmm_debuild_argbuf(vmm);
-    vmm->mem_space_head = NULL;
     vmm->code_start = 0;
     vmm->code_end = 0;
     vmm->data_start = 0;